@@ -0,0 +1,474 @@
+/*
+ * Dreamroq benchmark
+ *
+ * Decodes a RoQ file as fast as possible with no-op callbacks and
+ * reports decode speed. For file sources it also reports how many
+ * read system calls the decode took (Linux only, from /proc/self/io),
+ * so the I/O pattern of the decoder can be compared between versions,
+ * and how many branches the CPU mispredicted and how many cache misses
+ * there were, where the kernel gives access to the performance counters
+ * (Linux only, perf_event_open).
+ * With --kernels it times the block kernels of roq-blocks.h instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "dreamroqlib.h"
+#include "roq-blocks.h"
+#include "roq-trace.h"
+
+static unsigned long frames = 0;
+static unsigned long audio_chunks = 0;
+
+// Number of read system calls issued by this process so far, or -1
+static long read_syscalls(void)
+{
+    FILE *fh = fopen("/proc/self/io", "r");
+    char line[128];
+    long count = -1;
+
+    if (!fh)
+        return -1;
+
+    while (fgets(line, sizeof(line), fh))
+        if (sscanf(line, "syscr: %ld", &count) == 1)
+            break;
+    fclose(fh);
+
+    return count;
+}
+
+// Starts counting a PERF_COUNT_HW_* event of this process; returns the
+// counter or -1 if there is none
+static int counter_open(int event)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = event;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd >= 0)
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+static long long counter_close(int fd)
+{
+    long long count = -1;
+
+#ifdef __linux__
+    if (fd < 0)
+        return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+        count = -1;
+    close(fd);
+#endif
+    return count;
+}
+
+static void video_cb(unsigned short *buf, int width, int height, int stride, int texture_height, void *user_data)
+{
+    frames++;
+}
+
+static void audio_cb(unsigned char *buf, int size, int channels, void *user_data)
+{
+    audio_chunks++;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned char *load_file(const char *filename, size_t *length)
+{
+    FILE *fh = fopen(filename, "rb");
+    unsigned char *bytes;
+
+    if (!fh)
+        return NULL;
+
+    fseek(fh, 0, SEEK_END);
+    *length = ftell(fh);
+    fseek(fh, 0, SEEK_SET);
+
+    bytes = malloc(*length);
+    if (bytes && fread(bytes, *length, 1, fh) != 1)
+    {
+        free(bytes);
+        bytes = NULL;
+    }
+    fclose(fh);
+
+    return bytes;
+}
+
+/*
+ * Kernel microbenchmarks: each block kernel of every kernel set built in
+ * runs over a 512x256 frame at block positions and motion vectors like
+ * the VQ decoder's. Motion compensation is timed separately for even and
+ * odd horizontal vectors, because the portable kernels only copy 32 bits
+ * at a time when the vector is even.
+ */
+#define KERNEL_STRIDE 512
+#define KERNEL_HEIGHT 256
+#define KERNEL_BLOCKS 4096
+#define KERNEL_ROUNDS 2000
+
+enum { OP_MC8_EVEN, OP_MC8_ODD, OP_MC4_EVEN, OP_MC4_ODD, OP_CCC4, OP_COUNT };
+
+static const char *op_names[OP_COUNT] = {
+    "FCC 8x8, even x", "FCC 8x8, odd x", "FCC 4x4, even x", "FCC 4x4, odd x", "CCC 2x2 x4"
+};
+
+static unsigned short *kernel_dst, *kernel_src;
+static unsigned short kernel_codebook[256][4];
+static int dst_offsets[OP_COUNT][KERNEL_BLOCKS];
+static int src_offsets[OP_COUNT][KERNEL_BLOCKS];
+
+static void setup_kernel_blocks(void)
+{
+    int op, i, size, x, y, mx, my;
+
+    kernel_dst = calloc(KERNEL_STRIDE * KERNEL_HEIGHT, sizeof(unsigned short));
+    kernel_src = malloc(KERNEL_STRIDE * KERNEL_HEIGHT * sizeof(unsigned short));
+    for (i = 0; i < KERNEL_STRIDE * KERNEL_HEIGHT; i++)
+        kernel_src[i] = rand();
+    for (i = 0; i < 256 * 4; i++)
+        kernel_codebook[i / 4][i % 4] = rand();
+
+    for (op = 0; op < OP_COUNT; op++)
+    {
+        size = op == OP_MC8_EVEN || op == OP_MC8_ODD ? 8 : 4;
+        for (i = 0; i < KERNEL_BLOCKS; i++)
+        {
+            // Keep vectors of -7..8 inside the frame
+            x = 8 + size * (rand() % ((KERNEL_STRIDE - 24) / size));
+            y = 8 + size * (rand() % ((KERNEL_HEIGHT - 24) / size));
+            mx = rand() % 16 - 7;
+            my = rand() % 16 - 7;
+            if ((op == OP_MC8_EVEN || op == OP_MC4_EVEN) && (mx & 1))
+                mx++;
+            if ((op == OP_MC8_ODD || op == OP_MC4_ODD) && !(mx & 1))
+                mx++;
+            dst_offsets[op][i] = y * KERNEL_STRIDE + x;
+            src_offsets[op][i] = op == OP_CCC4 ? rand() % 256 : (y + my) * KERNEL_STRIDE + x + mx;
+        }
+    }
+}
+
+// Inlined with a constant kernel set, like the decoder's VQ loop
+static ROQ_INLINE void run_kernel(int op, int kernels)
+{
+    const int *dst = dst_offsets[op], *src = src_offsets[op];
+    int round, i;
+
+    for (round = 0; round < KERNEL_ROUNDS; round++)
+    {
+        switch (op)
+        {
+        case OP_MC8_EVEN:
+        case OP_MC8_ODD:
+            for (i = 0; i < KERNEL_BLOCKS; i++)
+                roq_mc8(kernels, kernel_dst + dst[i], kernel_src + src[i], KERNEL_STRIDE);
+            break;
+        case OP_MC4_EVEN:
+        case OP_MC4_ODD:
+            for (i = 0; i < KERNEL_BLOCKS; i++)
+                roq_mc4(kernels, kernel_dst + dst[i], kernel_src + src[i], KERNEL_STRIDE);
+            break;
+        case OP_CCC4:
+            for (i = 0; i < KERNEL_BLOCKS; i++)
+                roq_ccc4(kernels, kernel_dst + dst[i], kernel_codebook[src[i]], kernel_codebook[(src[i] + 1) & 255],
+                    kernel_codebook[(src[i] + 2) & 255], kernel_codebook[(src[i] + 3) & 255], KERNEL_STRIDE);
+            break;
+        }
+    }
+}
+
+// Nanoseconds per block
+static double time_kernel(int op, int kernels)
+{
+    double start = now_seconds();
+
+    switch (kernels)
+    {
+#ifdef ROQ_HAVE_SSE2
+    case ROQ_KERNELS_SSE2:
+        run_kernel(op, ROQ_KERNELS_SSE2);
+        break;
+#endif
+#ifdef ROQ_HAVE_NEON
+    case ROQ_KERNELS_NEON:
+        run_kernel(op, ROQ_KERNELS_NEON);
+        break;
+#endif
+    default:
+        run_kernel(op, ROQ_KERNELS_C);
+        break;
+    }
+
+    return (now_seconds() - start) * 1e9 / ((double)KERNEL_ROUNDS * KERNEL_BLOCKS);
+}
+
+static int bench_kernels(void)
+{
+    int best = roq_blocks_select();
+    unsigned long long sum = 0;
+    double c, simd;
+    int op, i;
+
+    setup_kernel_blocks();
+    if (!kernel_dst || !kernel_src)
+    {
+        printf("out of memory\n");
+        return 1;
+    }
+
+    printf("decoder kernels: %s\n", roq_blocks_name(best));
+    printf("%-16s %10s %10s %8s\n", "ns per block", "c", roq_blocks_name(best), "speedup");
+    for (op = 0; op < OP_COUNT; op++)
+    {
+        c = time_kernel(op, ROQ_KERNELS_C);
+        simd = best == ROQ_KERNELS_C ? c : time_kernel(op, best);
+        printf("%-16s %10.2f %10.2f %7.2fx\n", op_names[op], c, simd, simd > 0 ? c / simd : 0.0);
+    }
+
+    // Uses the output so none of it is optimized away
+    for (i = 0; i < KERNEL_STRIDE * KERNEL_HEIGHT; i++)
+        sum += kernel_dst[i];
+    printf("checksum %llx\n", sum);
+
+    free(kernel_dst);
+    free(kernel_src);
+
+    return 0;
+}
+
+static int list_chunks(const char *filename)
+{
+    static const struct { unsigned short id; const char *name; } names[] = {
+        { RoQ_SIGNATURE,     "RoQ_SIGNATURE" },
+        { RoQ_INFO,          "RoQ_INFO" },
+        { RoQ_QUAD_CODEBOOK, "RoQ_QUAD_CODEBOOK" },
+        { RoQ_QUAD_VQ,       "RoQ_QUAD_VQ" },
+        { RoQ_JPEG,          "RoQ_JPEG" },
+        { RoQ_SOUND_MONO,    "RoQ_SOUND_MONO" },
+        { RoQ_SOUND_STEREO,  "RoQ_SOUND_STEREO" },
+        { RoQ_PACKET,        "RoQ_PACKET" },
+    };
+    unsigned long count[sizeof(names) / sizeof(names[0])] = { 0 };
+    unsigned long long bytes[sizeof(names) / sizeof(names[0])] = { 0 };
+    unsigned long other = 0;
+    roq_packet_t packet;
+    roq_demux_t *demux;
+    unsigned int i;
+
+    demux = roq_demux_create_with_filename(filename);
+    if (!demux)
+    {
+        printf("could not open %s (%d)\n", filename, roq_errno);
+        return 1;
+    }
+
+    while (roq_demux_next(demux, &packet))
+    {
+        for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        {
+            if (names[i].id == packet.chunk_id)
+            {
+                count[i]++;
+                bytes[i] += packet.chunk_size;
+                break;
+            }
+        }
+        if (i == sizeof(names) / sizeof(names[0]))
+            other++;
+    }
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        if (count[i])
+            printf("%-18s %6lu chunks %10llu bytes\n", names[i].name, count[i], bytes[i]);
+    if (other)
+        printf("%-18s %6lu chunks\n", "unknown", other);
+
+    roq_demux_destroy(demux);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    long syscalls = 0, before = 0;
+    const char *filename = NULL;
+    const char *trace_name = NULL;
+    int use_memory = 0;
+    int chunks = 0;
+    int iterations = 1;
+    int scale = ROQ_SCALE_FULL;
+    unsigned char *bytes = NULL;
+    size_t length = 0;
+    double start, elapsed;
+    roq_t *roq;
+    int tiled = 0;
+    int region[5] = { 0, 0, 0, 0, 0 };
+    int branch_counter, cache_counter;
+    long long branch_misses, cache_misses;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--memory"))
+            use_memory = 1;
+        else if (!strcmp(argv[i], "--chunks"))
+            chunks = 1;
+        else if (!strcmp(argv[i], "--kernels"))
+            return bench_kernels();
+        else if (!strcmp(argv[i], "--iterations") && i + 1 < argc)
+            iterations = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--scale") && i + 1 < argc)
+            scale = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--tiled"))
+            tiled = 1;
+        else if (!strcmp(argv[i], "--region") && i + 5 < argc)
+        {
+            region[0] = atoi(argv[++i]);
+            region[1] = atoi(argv[++i]);
+            region[2] = atoi(argv[++i]);
+            region[3] = atoi(argv[++i]);
+            region[4] = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+            trace_name = argv[++i];
+        else
+            filename = argv[i];
+    }
+
+    if (!filename || iterations < 1)
+    {
+        printf("USAGE: bench-dreamroq [--memory] [--chunks] [--iterations N] [--scale 1|2|4] [--tiled] [--region <x> <y> <w> <h> <margin>] [--trace <file.json>] <file.roq>\n");
+        printf("       bench-dreamroq --kernels\n");
+        return 1;
+    }
+
+    if (chunks)
+        return list_chunks(filename);
+
+    if (use_memory)
+    {
+        bytes = load_file(filename, &length);
+        if (!bytes)
+        {
+            printf("could not load %s\n", filename);
+            return 1;
+        }
+    }
+
+#ifdef __linux__
+    branch_counter = counter_open(PERF_COUNT_HW_BRANCH_MISSES);
+    cache_counter = counter_open(PERF_COUNT_HW_CACHE_MISSES);
+#else
+    branch_counter = cache_counter = -1;
+#endif
+    start = now_seconds();
+    for (i = 0; i < iterations; i++)
+    {
+        if (use_memory)
+        {
+            roq = roq_create_with_memory(bytes, length, 0);
+        }
+        else
+        {
+            before = read_syscalls();
+            roq = roq_create_with_filename(filename);
+        }
+
+        if (!roq)
+        {
+            printf("could not create decoder (%d)\n", roq_errno);
+            return 1;
+        }
+
+        if (!roq_set_decode_scale(roq, scale))
+        {
+            printf("unsupported scale %d\n", scale);
+            return 1;
+        }
+
+        if (!roq_set_decode_tiled(roq, tiled))
+        {
+            printf("could not decode tiled (%d)\n", roq_errno);
+            return 1;
+        }
+
+        if (!roq_set_decode_region(roq, region[0], region[1], region[2], region[3], region[4]))
+        {
+            printf("could not set a decode region (%d)\n", roq_errno);
+            return 1;
+        }
+
+        roq_set_video_decode_callback(roq, video_cb);
+        roq_set_audio_decode_callback(roq, audio_cb);
+
+        while (!roq_has_ended(roq))
+            roq_decode(roq);
+
+        roq_destroy(roq);
+
+        // The read of /proc/self/io itself counts once
+        if (!use_memory && before >= 0)
+            syscalls += read_syscalls() - before - 1;
+    }
+    elapsed = now_seconds() - start;
+    branch_misses = counter_close(branch_counter);
+    cache_misses = counter_close(cache_counter);
+
+    printf("%lu frames, %lu audio chunks in %.3f s (%.1f fps)\n",
+        frames, audio_chunks, elapsed, elapsed > 0 ? frames / elapsed : 0.0);
+
+    if (!use_memory && syscalls > 0)
+        printf("%ld read syscalls, %.3f per frame\n",
+            syscalls, frames ? (double)syscalls / frames : 0.0);
+
+    if (branch_misses >= 0)
+        printf("%lld branch misses, %.0f per frame\n",
+            branch_misses, frames ? (double)branch_misses / frames : 0.0);
+
+    if (cache_misses >= 0)
+        printf("%lld cache misses, %.0f per frame\n",
+            cache_misses, frames ? (double)cache_misses / frames : 0.0);
+
+    if (trace_name && !roq_trace_dump(trace_name))
+        printf("could not write %s (tracing needs a TRACE=1 build)\n", trace_name);
+
+    free(bytes);
+
+    return 0;
+}
@@ -0,0 +1,389 @@
+/*
+ * Dreamroq C++ layer
+ *
+ * Header-only C++20 wrapper over dreamroqlib.h for engine code:
+ *
+ *  - roq::decoder owns a roq_t and is move-only.
+ *  - roq::basic_frame and roq::audio are views that borrow the
+ *    decoder's frame buffers and PCM buffer; nothing is copied. They
+ *    stay valid until the next decode call on the same decoder.
+ *  - decoder::decode() takes the video and audio sinks as template
+ *    parameters. The C library still calls one trampoline per event,
+ *    but each trampoline is instantiated for its sink type, so the sink
+ *    itself is called directly and inlined into it. Passing roq::none
+ *    for a sink leaves that callback unset, which makes the library skip
+ *    decoding that stream entirely.
+ *  - decoder::frames() is a coroutine that yields frames lazily from a
+ *    pull loop.
+ *  - The pixel format of a frame view is a template parameter. rgb565
+ *    is what the decoder produces and is accessed in place; other
+ *    formats convert per pixel on access or in bulk with convert().
+ */
+
+#ifndef DREAMROQ_HPP
+#define DREAMROQ_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <iterator>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "dreamroqlib.h"
+
+namespace roq {
+
+// Thrown when a decoder can not be created; code is the roq_errno value.
+class error : public std::runtime_error {
+public:
+    error(const std::string& what, int code)
+        : std::runtime_error(what + " (roq_errno " + std::to_string(code) + ")"), code_(code) {}
+
+    int code() const noexcept { return code_; }
+
+private:
+    int code_;
+};
+
+// Pixel formats. Each one converts from the decoder's native RGB565.
+struct rgb565 {
+    using value_type = std::uint16_t;
+    static constexpr value_type convert(std::uint16_t pixel) noexcept { return pixel; }
+};
+
+struct argb1555 {
+    using value_type = std::uint16_t;
+    static constexpr value_type convert(std::uint16_t pixel) noexcept {
+        return value_type(0x8000 | ((pixel >> 1) & 0x7FE0) | (pixel & 0x1F));
+    }
+};
+
+struct argb8888 {
+    using value_type = std::uint32_t;
+    static constexpr value_type convert(std::uint16_t pixel) noexcept {
+        std::uint32_t r = (pixel >> 11) & 0x1F, g = (pixel >> 5) & 0x3F, b = pixel & 0x1F;
+        return 0xFF000000u | (((r << 3) | (r >> 2)) << 16) |
+               (((g << 2) | (g >> 4)) << 8) | ((b << 3) | (b >> 2));
+    }
+};
+
+// A decoded frame, borrowed from the decoder.
+template <class Format = rgb565>
+class basic_frame {
+public:
+    using format = Format;
+    using value_type = typename Format::value_type;
+
+    basic_frame() = default;
+    basic_frame(const std::uint16_t* pixels, int width, int height, int stride, int texture_height) noexcept
+        : pixels_(pixels, std::size_t(stride) * texture_height),
+          width_(width), height_(height), stride_(stride), texture_height_(texture_height) {}
+
+    int width() const noexcept { return width_; }
+    int height() const noexcept { return height_; }
+    int stride() const noexcept { return stride_; }
+    int texture_height() const noexcept { return texture_height_; }
+
+    // The whole RGB565 buffer, stride x texture_height, ready for a
+    // texture upload.
+    std::span<const std::uint16_t> native() const noexcept { return pixels_; }
+
+    // The visible RGB565 pixels of one row.
+    std::span<const std::uint16_t> row(int y) const noexcept {
+        return pixels_.subspan(std::size_t(y) * stride_, width_);
+    }
+
+    value_type pixel(int x, int y) const noexcept {
+        return Format::convert(pixels_[std::size_t(y) * stride_ + x]);
+    }
+
+    // Writes the visible pixels in Format to out, out_stride values per
+    // row (width when 0). out must hold out_stride * height values.
+    void convert(std::span<value_type> out, int out_stride = 0) const noexcept {
+        if (!out_stride)
+            out_stride = width_;
+        for (int y = 0; y < height_; y++) {
+            auto src = row(y);
+            auto dst = out.subspan(std::size_t(y) * out_stride, width_);
+            for (int x = 0; x < width_; x++)
+                dst[x] = Format::convert(src[x]);
+        }
+    }
+
+    // A view of the same pixels in another format.
+    template <class Other>
+    basic_frame<Other> as() const noexcept {
+        return basic_frame<Other>(pixels_.data(), width_, height_, stride_, texture_height_);
+    }
+
+private:
+    std::span<const std::uint16_t> pixels_;
+    int width_ = 0;
+    int height_ = 0;
+    int stride_ = 0;
+    int texture_height_ = 0;
+};
+
+using frame = basic_frame<>;
+
+// A chunk of decoded 16-bit little endian PCM, borrowed from the decoder.
+class audio {
+public:
+    audio(const std::uint8_t* bytes, int size, int channels) noexcept
+        : bytes_(bytes, std::size_t(size)), channels_(channels) {}
+
+    std::span<const std::uint8_t> bytes() const noexcept { return bytes_; }
+    int channels() const noexcept { return channels_; }
+
+    // Samples over all channels, interleaved.
+    std::size_t sample_count() const noexcept { return bytes_.size() / 2; }
+
+    std::int16_t sample(std::size_t i) const noexcept {
+        return std::int16_t(bytes_[i * 2] | (bytes_[i * 2 + 1] << 8));
+    }
+
+private:
+    std::span<const std::uint8_t> bytes_;
+    int channels_;
+};
+
+// Sink placeholder: the stream is not decoded at all.
+struct none {};
+
+// What decoder::decode() did; the values roq_decode() returns.
+enum class status : int {
+    ended = 0,                      // end of the stream or an error
+    decoded = 1,
+    need_data = ROQ_NEED_DATA,      // a push source needs more bytes
+    need_frame = ROQ_NEED_FRAME,    // every frame of the frame pool is held
+};
+
+// Minimal lazy generator; std::generator only arrives with C++23.
+template <class T>
+class generator {
+public:
+    struct promise_type {
+        const T* value = nullptr;
+        std::exception_ptr exception;
+
+        generator get_return_object() noexcept {
+            return generator(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(const T& v) noexcept {
+            value = std::addressof(v);
+            return {};
+        }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { exception = std::current_exception(); }
+    };
+
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+        explicit iterator(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+        const T& operator*() const { return *handle_.promise().value; }
+        const T* operator->() const { return handle_.promise().value; }
+
+        iterator& operator++() {
+            handle_.resume();
+            rethrow();
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+
+        bool operator==(std::default_sentinel_t) const { return !handle_ || handle_.done(); }
+
+    private:
+        friend class generator;
+
+        void rethrow() const {
+            if (handle_.done() && handle_.promise().exception)
+                std::rethrow_exception(handle_.promise().exception);
+        }
+
+        std::coroutine_handle<promise_type> handle_;
+    };
+
+    generator(generator&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+    generator& operator=(generator&& other) noexcept {
+        if (this != &other) {
+            if (handle_)
+                handle_.destroy();
+            handle_ = std::exchange(other.handle_, {});
+        }
+        return *this;
+    }
+    generator(const generator&) = delete;
+    generator& operator=(const generator&) = delete;
+    ~generator() {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    iterator begin() {
+        iterator it(handle_);
+        if (handle_) {
+            handle_.resume();
+            it.rethrow();
+        }
+        return it;
+    }
+    std::default_sentinel_t end() const noexcept { return {}; }
+
+private:
+    explicit generator(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+class decoder {
+public:
+    explicit decoder(const char* filename) : handle_(roq_create_with_filename(filename)) {
+        if (!handle_)
+            throw error(std::string("could not open ") + filename, roq_errno);
+    }
+
+    // Takes ownership of fh when close_when_done is true.
+    decoder(std::FILE* fh, bool close_when_done) : handle_(roq_create_with_file(fh, close_when_done)) {
+        if (!handle_)
+            throw error("could not read RoQ file", roq_errno);
+    }
+
+    // Decodes from memory the caller keeps alive for the decoder's lifetime.
+    explicit decoder(std::span<const std::uint8_t> bytes)
+        : handle_(roq_create_with_memory(const_cast<unsigned char*>(bytes.data()), bytes.size(), 0)) {
+        if (!handle_)
+            throw error("could not read RoQ data", roq_errno);
+    }
+
+    decoder(decoder&& other) noexcept
+        : handle_(std::exchange(other.handle_, nullptr)), loops_(other.loops_) {}
+
+    decoder& operator=(decoder&& other) noexcept {
+        if (this != &other) {
+            if (handle_)
+                roq_destroy(handle_);
+            handle_ = std::exchange(other.handle_, nullptr);
+            loops_ = other.loops_;
+        }
+        return *this;
+    }
+
+    decoder(const decoder&) = delete;
+    decoder& operator=(const decoder&) = delete;
+
+    ~decoder() {
+        if (handle_)
+            roq_destroy(handle_);
+    }
+
+    int width() const noexcept { return roq_get_width(handle_); }
+    int height() const noexcept { return roq_get_height(handle_); }
+    int framerate() const noexcept { return roq_get_framerate(handle_); }
+    bool ended() const noexcept { return roq_has_ended(handle_); }
+
+    void rewind() noexcept { roq_rewind(handle_); }
+
+    bool loop() const noexcept { return roq_get_loop(handle_); }
+    void set_loop(bool loop) noexcept { roq_set_loop(handle_, loop, loop ? &loop_trampoline : nullptr); }
+
+    // How many times playback wrapped around since the decoder was made.
+    unsigned loop_count() const noexcept { return loops_; }
+
+    // ROQ_SCALE_FULL, ROQ_SCALE_HALF or ROQ_SCALE_QUARTER.
+    bool set_scale(int scale) noexcept { return roq_set_decode_scale(handle_, scale); }
+
+    roq_t* native_handle() const noexcept { return handle_; }
+
+    // Decodes the next frame group, handing the frame to video (as a
+    // basic_frame<Format>) and each audio chunk to audio.
+    template <class Format = rgb565, class Video, class Audio = none>
+    status decode(Video&& video, Audio&& audio = {}) {
+        using video_type = std::remove_reference_t<Video>;
+        using audio_type = std::remove_reference_t<Audio>;
+        context<video_type, audio_type> ctx{this, std::addressof(video), std::addressof(audio)};
+
+        if constexpr (std::is_same_v<std::remove_cv_t<video_type>, none>)
+            roq_set_video_decode_callback(handle_, nullptr);
+        else
+            roq_set_video_decode_callback(handle_, &video_trampoline<Format, video_type, audio_type>);
+
+        if constexpr (std::is_same_v<std::remove_cv_t<audio_type>, none>)
+            roq_set_audio_decode_callback(handle_, nullptr);
+        else
+            roq_set_audio_decode_callback(handle_, &audio_trampoline<video_type, audio_type>);
+
+        roq_set_user_data(handle_, &ctx);
+        int result = roq_decode(handle_);
+        roq_set_user_data(handle_, nullptr);
+
+        return static_cast<status>(result);
+    }
+
+    // Yields every frame until the stream ends; with looping on it never
+    // ends. Audio decoded along the way goes to audio. Each frame is valid
+    // until the generator is advanced. It also stops when the decoder
+    // waits for push data or a pool frame, with ended() still false;
+    // frames() picks up from there once the data or frame is back.
+    template <class Format = rgb565, class Audio = none>
+    generator<basic_frame<Format>> frames(Audio audio = {}) {
+        std::optional<basic_frame<Format>> next;
+
+        while (!ended()) {
+            next.reset();
+            status result = decode<Format>([&next](const basic_frame<Format>& f) { next = f; }, audio);
+            if (next)
+                co_yield *next;
+            if (result == status::need_data || result == status::need_frame)
+                break;
+        }
+    }
+
+private:
+    template <class Video, class Audio>
+    struct context {
+        decoder* self;
+        Video* video;
+        Audio* audio;
+    };
+
+    template <class Format, class Video, class Audio>
+    static void video_trampoline(unsigned short* data, int width, int height, int stride,
+                                 int texture_height, void* user_data) {
+        auto* ctx = static_cast<context<Video, Audio>*>(user_data);
+        (*ctx->video)(basic_frame<Format>(data, width, height, stride, texture_height));
+    }
+
+    template <class Video, class Audio>
+    static void audio_trampoline(unsigned char* data, int size, int channels, void* user_data) {
+        auto* ctx = static_cast<context<Video, Audio>*>(user_data);
+        (*ctx->audio)(audio(data, size, channels));
+    }
+
+    // The loop callback fires inside roq_decode(), when user_data points
+    // at a decode context; every context starts with the decoder pointer.
+    static void loop_trampoline(void* user_data) {
+        (*static_cast<decoder**>(user_data))->loops_++;
+    }
+
+    roq_t* handle_;
+    unsigned loops_ = 0;
+};
+
+} // namespace roq
+
+#endif  /* DREAMROQ_HPP */
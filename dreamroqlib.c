@@ -11,45 +11,154 @@
 #include <string.h>
 #ifdef _arch_dreamcast
 #include <malloc.h>
+#include <arch/timer.h>
+#else
+#include <time.h>
 #endif
 
 #include "dreamroqlib.h"
+#include "roq-blocks.h"
+#include "roq-jpeg.h"
+#include "roq-trace.h"
 
 #ifndef TRUE
 #define TRUE 1
 #define FALSE 0
 #endif
 
-#define RoQ_INFO           0x1001
-#define RoQ_QUAD_CODEBOOK  0x1002
-#define RoQ_QUAD_VQ        0x1011
-#define RoQ_JPEG           0x1012
-#define RoQ_SOUND_MONO     0x1020
-#define RoQ_SOUND_STEREO   0x1021
-#define RoQ_PACKET         0x1030
-#define RoQ_SIGNATURE      0x1084
-
 #define CHUNK_HEADER_SIZE 8
 
 #define ROQ_BUFFER_DEFAULT_SIZE 1024 * 64
 
+// Largest chunk the demuxer takes. File and push windows grow to hold
+// anything up to this; a bigger size field is taken for garbage.
+#define ROQ_MAX_CHUNK_SIZE (1024 * 1024 * 16)
+
+// Read-ahead window of the demuxer for file sources. Big enough for
+// several frame groups, so most frames cost no read at all.
+#define ROQ_DEMUX_BUFFER_SIZE (4 * ROQ_BUFFER_DEFAULT_SIZE)
+#define ROQ_PACKET_QUEUE_SIZE 64
+
 #define ROQ_FPS 30
 
 #define LE_16(buf) (*buf | (*(buf+1) << 8))
 #define LE_32(buf) (*buf | (*(buf+1) << 8) | (*(buf+2) << 16) | (*(buf+3) << 24))
 
 #define ROQ_CODEBOOK_SIZE 256
+
+// The SIMD kernel sets decode VQ frames in two passes, see
+// roq_unpack_vq_batched(). A batch is this many macroblocks.
+#if defined(ROQ_HAVE_SSE2) || defined(ROQ_HAVE_NEON)
+#define ROQ_VQ_BATCHED
+#define ROQ_VQ_BATCH 16
+#endif
 #define SQR_ARRAY_SIZE 260
 #define VQR_ARRAY_SIZE 256
 
 typedef struct roq_buffer_t roq_buffer_t;
-typedef struct roq_chunk_t roq_chunk_t;
+
+#ifdef ROQ_VQ_BATCHED
+// The work a VQ mode stands for, collected per kind while parsing
+enum roq_vq_op {
+    ROQ_VQ_MOT8,
+    ROQ_VQ_FCC8,
+    ROQ_VQ_SLD8,
+    ROQ_VQ_MOT4,
+    ROQ_VQ_FCC4,
+    ROQ_VQ_SLD4,
+    ROQ_VQ_CCC4,
+    ROQ_VQ_NONE,    // an 8x8 CCC block; its subblocks do the work
+    ROQ_VQ_OP_COUNT
+};
+
+typedef struct {
+    int offset;     // of the block in the frame
+    int index;      // of its argument bytes in the chunk
+} roq_vq_op_t;
+
+// Parser states: block * 5 for the mode of one of the four 8x8 blocks
+// of a macroblock, block * 5 + 1 + subblock for one of its 4x4 blocks
+#define ROQ_VQ_STATES 20
+
+// A state table entry: what to record, how many argument bytes follow,
+// whether the macroblock is done and the state for the next mode
+#define ROQ_VQ_ENTRY(op, bytes, next_mb, next) \
+    ((op) | ((bytes) << 4) | ((next_mb) << 8) | ((next) << 16))
+#define ROQ_VQ_ENTRY_OP(entry)      ((entry) & 0xF)
+#define ROQ_VQ_ENTRY_BYTES(entry)   (((entry) >> 4) & 0xF)
+#define ROQ_VQ_ENTRY_NEXT_MB(entry) (((entry) >> 8) & 1)
+#define ROQ_VQ_ENTRY_NEXT(entry)    ((entry) >> 16)
+#endif
+
+// A caller-owned frame of roq_set_frame_pool() and how many times the
+// consumer has acquired it
+typedef struct {
+    unsigned short *data;
+    int refs;
+} roq_pool_frame_t;
+
+// Everything roq_decode() carries from one frame group to the next.
+// pixels holds the last picture, then the macroblocks of the picture
+// before it that differ from it, in order, flagged in changed.
+struct roq_snapshot_t {
+    int width;
+    int height;
+    int scale_shift;
+
+    long offset;
+    long keyframe_offset;
+    unsigned int frame_index;
+    int group_video_decoded;
+    int group_audio_decoded;
+
+    unsigned short cb2x2_rgb565[ROQ_CODEBOOK_SIZE][4];
+    unsigned short cb4x4_rgb565[ROQ_CODEBOOK_SIZE][16];
+
+    size_t size;
+    unsigned char *changed;
+    unsigned short *pixels;
+};
+
+// Where the bitstream of a macroblock in the decode region starts
+typedef struct {
+    int mb;
+    int index;
+    int mode_set;
+    int mode_count;
+} roq_region_start_t;
+
+// A callback recorded by the loop cache. A frame keeps a bit per
+// macroblock in changed, set for the ones stored in data, in order; an
+// audio chunk keeps its payload in data.
+typedef struct roq_cache_event_t {
+    struct roq_cache_event_t* next;
+    long position;            // where the roq_decode() call that made it started
+    long offset;              // of its chunk
+    unsigned short chunk_id;
+    unsigned short chunk_arg;
+    unsigned int size;        // bytes of audio
+    int ends_call;            // the last callback of its roq_decode() call
+    unsigned char* changed;
+    unsigned char* data;
+} roq_cache_event_t;
+
+enum roq_cache_state {
+    ROQ_CACHE_EMPTY,
+    ROQ_CACHE_RECORDING,
+    ROQ_CACHE_COMPLETE,
+    ROQ_CACHE_VERIFYING,  // decoding the start of a pass to compare
+    ROQ_CACHE_REPLAYING,
+    ROQ_CACHE_OFF         // given up on until the next roq_set_loop_cache()
+};
 
 int roq_errno = 0;
 
 struct roq_t {
     int width;
     int height;
+    int frame_width;      // size of the decoded frames
+    int frame_height;
+    int scale_shift;      // log2 of the decode scale divisor
     int mb_width;
     int mb_height;
     int mb_count;
@@ -57,22 +166,124 @@ struct roq_t {
     unsigned short *frame[2];
     unsigned int frame_index;
 
+    // With a frame pool, frame[] point into it and the next frame may be
+    // decoded into a free pool frame instead of frame[frame_index]; the
+    // skipped blocks are then copied from mot_frame, the frame replaced
+    unsigned short *mot_frame;
+    roq_pool_frame_t *pool;
+    int pool_size;
+    size_t pool_frame_size;
+
+    // With tiled decoding the VQ decoder works on tiles[], which hold
+    // the same pictures as frame[] with every macroblock in 256
+    // consecutive pixels, and copies the macroblocks it changes out to
+    // frame[]. NULL when not decoding tiled.
+    int tiled;
+    unsigned short *tiles[2];
+
     int loop;
     int has_ended;
 
+    // Loop points: at loop_out, or at the end with loop_out -1, decoding
+    // goes back to loop_in. loop_pending is set when the end came with no
+    // two free pool frames to restore into; the next roq_decode() tries
+    // again.
+    const roq_snapshot_t *loop_in;
+    long loop_out;
+    int loop_pending;
+
+    // Offset of the last RoQ_JPEG keyframe, -1 if none yet
+    long keyframe_offset;
+
+    // Progress of a frame group interrupted by ROQ_NEED_DATA
+    int group_video_decoded;
+    int group_audio_decoded;
+
+    // roq_find_segments() runs roq_decode() with scanning set, which
+    // walks the chunks without decoding them. scan_position is where
+    // the current call started, scan_candidate the position of a
+    // self-contained frame waiting for the next frame to qualify it.
+    int scanning;
+    long scan_position;
+    long scan_candidate;
+    int scan_full_codebook;
+    long *scan_offsets;
+    int scan_max;
+    int scan_count;
+
+    // With change tracking, changed has a flag per macroblock, set where
+    // the last frame differs from the one two frames before it. The next
+    // changes_pending frames count as changed everywhere, because the
+    // frame two back is not what the decoder works from (blank frames,
+    // a keyframe, a restored snapshot).
+    int track_changes;
+    unsigned char *changed;
+    int changes_pending;
+
+    // Decode region, see roq_set_decode_region(), in video pixels. With
+    // one set, region has a flag per macroblock for the ones decoded, and
+    // stale[] one per macroblock of each of frame[] for the ones that may
+    // not hold what decoding everything would have. NULL without one.
+    // The VQ decoders list the region_started macroblocks they decode in
+    // region_starts.
+    int region_x;
+    int region_y;
+    int region_width;
+    int region_height;
+    int region_margin;
+    unsigned char *region;
+    unsigned char *stale[2];
+    roq_region_start_t *region_starts;
+    int region_started;
+
+    // Loop cache, see roq_set_loop_cache(). The callbacks of a pass are
+    // listed from cache_head; cache_next is the next one to replay.
+    // While recording, cache_changed holds a flag per macroblock where
+    // the last frame differs from the one before it, then room for the
+    // same flags of the frame being recorded.
+    enum roq_cache_state cache_state;
+    size_t cache_budget;
+    size_t cache_bytes;
+    roq_cache_event_t *cache_head;
+    roq_cache_event_t *cache_last;
+    roq_cache_event_t *cache_next;
+    unsigned char *cache_changed;
+    long cache_position;      // where the roq_decode() call being recorded started
+    long cache_end;           // the position after the recorded pass
+    unsigned int cache_frames;
+    unsigned int cache_passes;
+    unsigned int cache_frames_replayed;
+    int cache_overflowed;
+    int cache_unsupported;
+    int cache_full_codebook;  // a codebook setting every vector came
+    unsigned int cache_verified; // frames decoded the same as recorded
+    unsigned int cache_calls;    // roq_decode() calls while verifying
+    unsigned long long cache_decode_us;
+    unsigned long long cache_replay_us;
+
     int stride;
     int framerate;
     int texture_height;
 
-    roq_buffer_t *buffer;
+    // ROQ_KERNELS_* set the full resolution VQ decoder runs
+    int kernels;
 
+    roq_demux_t *demux;
+
+    void* user_data;
     roq_loop_callback loop_callback;
     roq_video_decode_callback video_decode_callback;
 	roq_audio_decode_callback audio_decode_callback;
+    roq_audio_buffer_callback audio_buffer_callback;
 
     unsigned short cb2x2_rgb565[ROQ_CODEBOOK_SIZE][4];
     unsigned short cb4x4_rgb565[ROQ_CODEBOOK_SIZE][16];
 
+    // Downsampled codebooks for reduced resolution decoding
+    unsigned short cb2x2_avg[ROQ_CODEBOOK_SIZE];
+    unsigned short cb4x4_half[ROQ_CODEBOOK_SIZE][4];
+    unsigned short cb4x4_avg[ROQ_CODEBOOK_SIZE];
+
     int channels;
     int pcm_samples;
     unsigned char pcm_sample[ROQ_BUFFER_DEFAULT_SIZE];
@@ -92,74 +303,174 @@ struct roq_t {
     int block_offset_lut[4];
     int subblock_offset_lut[4];
     int upsample_offset_lut[16];
+
+#ifdef ROQ_VQ_BATCHED
+    unsigned int vq_state_lut[ROQ_VQ_STATES][4];
+    int vq_offset_lut[ROQ_VQ_STATES];
+    roq_vq_op_t vq_ops[ROQ_VQ_OP_COUNT][ROQ_VQ_BATCH * 16];
+#endif
+
+    roq_jpeg_t jpeg;
 };
 
 enum roq_buffer_mode {
 	ROQ_BUFFER_MODE_FILE,
 	ROQ_BUFFER_MODE_FIXED_MEM,
-	ROQ_BUFFER_MODE_DYNAMIC_MEM
+	ROQ_BUFFER_MODE_PUSH,
+	ROQ_BUFFER_MODE_PACKED
 };
 
+// Bytes of the stream. In memory mode the whole file is in bytes; in
+// file, push and packed mode bytes holds a window of the stream starting
+// at offset, refilled by reads, by roq_push_data() or by decompressing
+// the blocks of a roq-pack file. A push source only reaches eof once
+// roq_push_end() is called.
 struct roq_buffer_t {
 	FILE* fh;
-    size_t start_index;
-    size_t end_index;
+    long offset;
+    size_t start_index;   // first byte not parsed into a packet yet
+    size_t end_index;     // end of the valid bytes
     size_t capacity;
+    size_t wanted;        // window the next chunk needs when it is larger
 	unsigned char* bytes;
 
     int free_when_done;
 	int close_when_done;
+    int eof;
+
+    // Group index of a roq-repack file
+    unsigned short* group_sectors;
+    unsigned int group_count;
+    unsigned int sector_size;
+    long first_group_offset;
+    unsigned int next_group;
+    long next_group_offset;
+
+    // Packed file, see ROQ_PACK_MAGIC. The window always ends on a block
+    // boundary, next_block is the block that follows it.
+    unsigned char* packed;
+    int free_packed_when_done;
+    size_t length;        // of the stream
+    unsigned int block_size;
+    unsigned int block_count;
+    unsigned int next_block;
 
     enum roq_buffer_mode mode;
 };
 
-struct roq_chunk_t {
-    short chunk_id;
-    int chunk_size;
-    short chunk_arg;
+struct roq_demux_t {
+    roq_buffer_t* buffer;
+    roq_packet_t queue[ROQ_PACKET_QUEUE_SIZE];
+    int queue_head;
+    int queue_count;
 };
 
-static roq_t* roq_create_with_buffer(roq_buffer_t* buffer);
-static roq_buffer_t* roq_buffer_create_with_filename(const char* filename);
+static roq_t* roq_create_with_demux(roq_demux_t* demux);
+static int roq_init_info(roq_t* roq, roq_packet_t* header);
+static int roq_push_header(roq_t* roq);
+static roq_demux_t* roq_demux_create_with_buffer(roq_buffer_t* buffer);
 static roq_buffer_t* roq_buffer_create_with_file(FILE* fh, int close_when_done);
 static roq_buffer_t* roq_buffer_create_with_memory(unsigned char* bytes, size_t capacity, int free_when_done);
-static roq_buffer_t* roq_buffer_create_with_capacity(size_t capacity);
-
-static int roq_buffer_read(roq_buffer_t* self, size_t count);
-static int roq_buffer_has(roq_buffer_t* self, size_t count);
-static unsigned char* roq_buffer_get_data(roq_buffer_t* self);
-static void roq_buffer_set_offset(roq_buffer_t* self, off_t offset, int whence);
+static roq_buffer_t* roq_buffer_create_with_push(size_t capacity);
+static roq_buffer_t* roq_buffer_create_with_packed(unsigned char* packed, size_t length, int free_when_done);
+
+static int roq_buffer_fill(roq_buffer_t* buffer);
+static int roq_buffer_grow(roq_buffer_t* buffer);
+static int roq_buffer_unpack(roq_buffer_t* buffer);
+static int roq_lz4_decompress(const unsigned char* src, size_t src_size, unsigned char* dst, size_t dst_size);
+static size_t roq_buffer_layout_read_size(roq_buffer_t* buffer);
+static void roq_buffer_set_layout(roq_buffer_t* buffer, unsigned char* index, size_t size);
+static void roq_buffer_set_offset(roq_buffer_t* buffer, long offset);
 static void roq_buffer_destroy(roq_buffer_t* buffer);
 
-static int roq_read_header_chunk(roq_buffer_t* self, roq_chunk_t* header);
-static int roq_eof(roq_buffer_t* self);
-static void roq_handle_end(roq_t* roq);
+static int roq_demux_parse(roq_demux_t* demux);
+static int roq_demux_peek(roq_demux_t* demux, roq_packet_t** packet);
+static void roq_demux_consume(roq_demux_t* demux);
+static size_t roq_demux_push(roq_demux_t* demux, const unsigned char* bytes, size_t length);
+static int roq_handle_end(roq_t* roq);
+
+static int roq_setup_frames(roq_t* roq);
+#ifdef ROQ_VQ_BATCHED
+static void roq_setup_vq_states(roq_t* roq);
+#endif
+static roq_pool_frame_t* roq_pool_find(roq_t* roq, unsigned short* frame);
+static int roq_claim_frame(roq_t* roq);
+static int roq_pool_pick(roq_t* roq);
+static void roq_tile_frame(roq_t* roq, unsigned short* tiles, unsigned short* frame);
+static void roq_downsample_codebook(roq_t* roq);
 
 static int roq_unpack_quad_codebook(roq_t* roq, unsigned char* buf, int size, int arg);
 static unsigned short* roq_unpack_vq(roq_t* roq, unsigned char* buf, int size, unsigned int arg);
+static unsigned short* roq_unpack_vq_scaled(roq_t* roq, unsigned char* buf, int size, unsigned int arg);
+static unsigned short* roq_unpack_jpeg(roq_t* roq, unsigned char* buf, int size);
+static void roq_decode_audio(roq_t* roq, roq_packet_t* packet);
+static void roq_scan_vq(roq_t* roq, unsigned char* buf, int size);
+static void roq_track_vq(roq_t* roq, unsigned char* buf, int size);
+static int roq_setup_region(roq_t* roq);
+static void roq_region_track(roq_t* roq, unsigned char* buf, int size, unsigned int arg,
+                             unsigned char* this_stale, int replaced);
+
+static unsigned long long roq_clock_us(void);
+static unsigned long long roq_cache_clock(roq_t* roq);
+static void roq_cache_charge(roq_t* roq, unsigned long long start);
+static void roq_cache_free(roq_t* roq);
+static void roq_cache_interrupt(roq_t* roq);
+static int roq_cache_begin(roq_t* roq);
+static void roq_cache_record_frame(roq_t* roq, unsigned short* frame, roq_packet_t* packet);
+static void roq_cache_record_audio(roq_t* roq, roq_packet_t* packet);
+static void roq_cache_unsupported(roq_t* roq);
+static void roq_cache_verify_frame(roq_t* roq, unsigned short* frame);
+static void roq_cache_verified_call(roq_t* roq);
+static int roq_cache_replay(roq_t* roq);
 
 roq_t* roq_create_with_filename(const char* filename) {
-	roq_buffer_t *buffer = roq_buffer_create_with_filename(filename);
-	if (!buffer)
+	roq_demux_t *demux = roq_demux_create_with_filename(filename);
+	if (!demux)
 		return NULL;
         
-	return roq_create_with_buffer(buffer);
+	return roq_create_with_demux(demux);
 }
 
 roq_t* roq_create_with_file(FILE* fh, int close_when_done) {
-	roq_buffer_t *buffer = roq_buffer_create_with_file(fh, close_when_done);
-    if (!buffer)
+	roq_demux_t *demux = roq_demux_create_with_file(fh, close_when_done);
+    if (!demux)
 		return NULL;
     
-	return roq_create_with_buffer(buffer);
+	return roq_create_with_demux(demux);
 }
 
 roq_t* roq_create_with_memory(unsigned char* bytes, size_t capacity, int free_when_done) {
-	roq_buffer_t *buffer = roq_buffer_create_with_memory(bytes, capacity, free_when_done);
-    if (!buffer)
+	roq_demux_t *demux = roq_demux_create_with_memory(bytes, capacity, free_when_done);
+    if (!demux)
+		return NULL;
+
+	return roq_create_with_demux(demux);
+}
+
+roq_t* roq_create_with_push(size_t capacity) {
+	roq_buffer_t *buffer;
+	roq_demux_t *demux;
+
+	buffer = roq_buffer_create_with_push(capacity);
+	if (!buffer)
+		return NULL;
+
+	demux = roq_demux_create_with_buffer(buffer);
+	if (!demux)
 		return NULL;
 
-	return roq_create_with_buffer(buffer);
+	return roq_create_with_demux(demux);
+}
+
+size_t roq_push_data(roq_t* roq, const unsigned char* bytes, size_t length) {
+	if (roq->demux->buffer->mode != ROQ_BUFFER_MODE_PUSH)
+		return 0;
+
+	return roq_demux_push(roq->demux, bytes, length);
+}
+
+void roq_push_end(roq_t* roq) {
+	roq->demux->buffer->eof = TRUE;
 }
 
 void roq_set_video_decode_callback(roq_t* roq, roq_video_decode_callback cb) {
@@ -170,8 +481,178 @@ void roq_set_audio_decode_callback(roq_t* roq, roq_audio_decode_callback cb) {
 	roq->audio_decode_callback = cb;
 }
 
+void roq_set_audio_buffer_callback(roq_t* roq, roq_audio_buffer_callback cb) {
+	roq->audio_buffer_callback = cb;
+}
+
 void roq_rewind(roq_t* roq) {
-    roq_buffer_set_offset(roq->buffer, CHUNK_HEADER_SIZE, SEEK_SET);
+    roq_cache_interrupt(roq);
+    roq_demux_seek(roq->demux, CHUNK_HEADER_SIZE);
+    roq->loop_pending = FALSE;
+}
+
+int roq_set_decode_scale(roq_t* roq, int scale) {
+    int shift;
+
+    switch(scale) {
+        case ROQ_SCALE_FULL:    shift = 0; break;
+        case ROQ_SCALE_HALF:    shift = 1; break;
+        case ROQ_SCALE_QUARTER: shift = 2; break;
+        default:
+            roq_errno = ROQ_INVALID_SCALE;
+            return FALSE;
+    }
+
+    if(shift == roq->scale_shift)
+        return TRUE;
+
+    roq->scale_shift = shift;
+
+    // A push source without its header yet sets up from RoQ_INFO later
+    if(!roq->width)
+        return TRUE;
+
+    if(!roq_setup_frames(roq))
+        return FALSE;
+
+    if(shift)
+        roq_downsample_codebook(roq);
+
+    return TRUE;
+}
+
+int roq_get_decode_scale(roq_t* roq) {
+    return 1 << roq->scale_shift;
+}
+
+int roq_set_decode_tiled(roq_t* roq, int tiled) {
+    tiled = tiled ? TRUE : FALSE;
+    if(tiled == roq->tiled)
+        return TRUE;
+
+    roq->tiled = tiled;
+
+    // A push source without its header yet sets up from RoQ_INFO later
+    if(!roq->width)
+        return TRUE;
+
+    return roq_setup_frames(roq);
+}
+
+int roq_set_track_changes(roq_t* roq, int track) {
+    roq->track_changes = track ? TRUE : FALSE;
+    roq->changes_pending = 2;
+
+    if(!roq->track_changes) {
+        free(roq->changed);
+        roq->changed = NULL;
+    }
+    else if(roq->width && !roq->changed) {
+        roq->changed = malloc(roq->mb_count);
+        if(!roq->changed) {
+            roq_errno = ROQ_NO_MEMORY;
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+const unsigned char* roq_get_changed_macroblocks(roq_t* roq) {
+    return roq->changed;
+}
+
+int roq_set_decode_region(roq_t* roq, int x, int y, int width, int height, int margin) {
+    if(x < 0 || y < 0 || width < 0 || height < 0 || margin < 0) {
+        roq_errno = ROQ_CLIENT_PROBLEM;
+        return FALSE;
+    }
+
+    roq->region_x = x;
+    roq->region_y = y;
+    roq->region_width = height ? width : 0;
+    roq->region_height = width ? height : 0;
+    roq->region_margin = margin;
+
+    // A replay would hand out whole frames
+    if(roq->region_width && roq->cache_state != ROQ_CACHE_OFF) {
+        roq_cache_interrupt(roq);
+        roq_cache_free(roq);
+    }
+
+    // A push source without its header yet sets up from RoQ_INFO later
+    if(!roq->width)
+        return TRUE;
+
+    return roq_setup_region(roq);
+}
+
+const unsigned char* roq_get_stale_macroblocks(roq_t* roq) {
+    return roq->stale[0] ? roq->stale[roq->frame_index ^ 1] : NULL;
+}
+
+int roq_set_frame_pool(roq_t* roq, unsigned short** frames, int count, size_t frame_size) {
+    roq_pool_frame_t* pool = NULL;
+    int i;
+
+    if(count < 0 || count == 1 || (count && !frames)) {
+        roq_errno = ROQ_BAD_FRAME_POOL;
+        return FALSE;
+    }
+
+    if(count) {
+        pool = malloc(count * sizeof(roq_pool_frame_t));
+        if(!pool) {
+            roq_errno = ROQ_NO_MEMORY;
+            return FALSE;
+        }
+        for(i = 0; i < count; i++) {
+            pool[i].data = frames[i];
+            pool[i].refs = 0;
+        }
+    }
+
+    // Internal frames are ours to free, pool frames are not
+    if(!roq->pool_size) {
+        free(roq->frame[0]);
+        free(roq->frame[1]);
+    }
+    free(roq->pool);
+
+    roq->frame[0] = NULL;
+    roq->frame[1] = NULL;
+    roq->mot_frame = NULL;
+    roq->pool = pool;
+    roq->pool_size = count;
+    roq->pool_frame_size = frame_size;
+
+    // A push source without its header yet sets up from RoQ_INFO later
+    if(!roq->width)
+        return TRUE;
+
+    return roq_setup_frames(roq);
+}
+
+void roq_acquire_frame(roq_t* roq, unsigned short* frame) {
+    roq_pool_frame_t* pool_frame = roq_pool_find(roq, frame);
+
+    if(pool_frame)
+        pool_frame->refs++;
+}
+
+void roq_release_frame(roq_t* roq, unsigned short* frame) {
+    roq_pool_frame_t* pool_frame = roq_pool_find(roq, frame);
+
+    if(pool_frame && pool_frame->refs > 0)
+        pool_frame->refs--;
+}
+
+size_t roq_get_frame_size(roq_t* roq) {
+    return roq->texture_height * roq->stride * sizeof(unsigned short);
+}
+
+void roq_set_user_data(roq_t* roq, void* user_data) {
+	roq->user_data = user_data;
 }
 
 int roq_get_loop(roq_t* roq) {
@@ -190,164 +671,243 @@ int roq_decode(roq_t* roq) {
 	if (!decode_video && !decode_audio)
 		return FALSE;
 
-    if(roq_eof(roq->buffer))
-        roq_handle_end(roq);
-
     if(roq->has_ended)
         return FALSE;
 
-    roq_chunk_t header;
+    // Push sources start without a header
+    if(!roq->width) {
+        int status = roq_push_header(roq);
+        if(status != TRUE) {
+            if(status == FALSE)
+                roq->has_ended = TRUE;
+            return status;
+        }
+    }
+
+    // At the out point, or at the end if there were no frames to restore
+    // into then, carry on from the in point instead
+    if(roq->loop_in && (roq->loop_pending || (roq->loop_out >= 0 && !roq->group_video_decoded &&
+       !roq->group_audio_decoded && roq_get_position(roq) >= roq->loop_out))) {
+        int status = roq_restore(roq, roq->loop_in);
+        if(status != TRUE) {
+            if(status == FALSE && roq->loop_pending) {
+                roq->loop_pending = FALSE;
+                roq->has_ended = TRUE;
+            }
+            return status;
+        }
+        if(roq->loop_callback)
+            roq->loop_callback(roq->user_data);
+    }
+
+    // A pass from the start is recorded. The next one decodes its first
+    // two frames to check they come out the same, then replays the rest.
+    if(roq->cache_state == ROQ_CACHE_REPLAYING)
+        return roq_cache_replay(roq);
+    if(roq->cache_budget && decode_video && !roq->scanning && !roq->region && !roq->group_video_decoded &&
+       !roq->group_audio_decoded && roq_get_position(roq) == CHUNK_HEADER_SIZE) {
+        if(roq->cache_state == ROQ_CACHE_COMPLETE) {
+            roq->cache_state = ROQ_CACHE_VERIFYING;
+            roq->cache_next = roq->cache_head;
+            roq->cache_verified = 0;
+            roq->cache_calls = 0;
+        }
+        else if(roq->cache_state == ROQ_CACHE_EMPTY)
+            roq_cache_begin(roq);
+    }
+    if(roq->cache_state == ROQ_CACHE_RECORDING)
+        roq->cache_position = roq_get_position(roq);
+
+    if(roq->scanning)
+        roq->scan_position = roq_get_position(roq);
+
+    roq_packet_t* packet;
     int video_ended = FALSE;
     int audio_ended = FALSE;
+    int stream_ended = FALSE;
     
-	int video_decoded = FALSE;
-	int audio_decoded = FALSE;
+	int video_decoded = roq->group_video_decoded;
+	int audio_decoded = roq->group_audio_decoded;
     
+    roq->group_video_decoded = FALSE;
+    roq->group_audio_decoded = FALSE;
+
     do {
-        if(!roq_eof(roq->buffer))
-        {
-            // Read the header
-            if(!roq_read_header_chunk(roq->buffer, &header)) {
-                roq_errno = ROQ_FILE_READ_FAILURE;
-                return FALSE;
+        if(!roq_demux_peek(roq->demux, &packet)) {
+            // A push source that is not finished just has to wait
+            if(roq->demux->buffer->mode == ROQ_BUFFER_MODE_PUSH &&
+               !roq->demux->buffer->eof && roq_errno != ROQ_CHUNK_TOO_LARGE) {
+                roq->group_video_decoded = video_decoded;
+                roq->group_audio_decoded = audio_decoded;
+                return ROQ_NEED_DATA;
             }
+            stream_ended = TRUE;
+            break;
+        }
 
-            // Process chunk depending on ID
-            switch(header.chunk_id) {
-                case RoQ_INFO:
-                    roq_buffer_set_offset(roq->buffer, header.chunk_size, SEEK_CUR);
-                    break;
-                case RoQ_PACKET:
-                    printf("RoQ_PACKET\n\n");
-                    roq_buffer_set_offset(roq->buffer, header.chunk_size, SEEK_CUR);
-                    break;
-                case RoQ_JPEG:
-                    printf("RoQ_JPEG\n\n");
-                    roq_buffer_set_offset(roq->buffer, header.chunk_size, SEEK_CUR);
-                    break;
-                case RoQ_QUAD_CODEBOOK:
-                    if(!decode_video) {
-                        roq_buffer_set_offset(roq->buffer, header.chunk_size, SEEK_CUR);
+        // Process chunk depending on ID
+        switch(packet->chunk_id) {
+            case RoQ_INFO:
+                break;
+            case RoQ_PACKET:
+                printf("RoQ_PACKET\n\n");
+                break;
+            case RoQ_JPEG:
+                if(decode_video) {
+                    // Same frame boundary rule as RoQ_QUAD_VQ
+                    if(video_decoded) {
+                        audio_decoded = TRUE;
+                        continue;
                     }
-                    else {
-                        if(decode_audio && !audio_decoded && (video_decoded || video_ended)) {
-                            audio_decoded = TRUE;
-                            roq_buffer_set_offset(roq->buffer, -CHUNK_HEADER_SIZE, SEEK_CUR);
-                            continue;
-                        }
 
-                        // Read the chunk
-                        if(roq_buffer_read(roq->buffer, header.chunk_size) != header.chunk_size) {
-                            roq_errno = ROQ_FILE_READ_FAILURE;
-                            return FALSE;
-                        }
+                    if(roq->scanning) {
+                        roq->scan_candidate = -1;
+                        roq->scan_full_codebook = FALSE;
+                        video_decoded = TRUE;
+                        break;
+                    }
 
-                        unsigned char* read_buffer = roq_buffer_get_data(roq->buffer);
+                    if(!roq_claim_frame(roq)) {
+                        roq->group_audio_decoded = audio_decoded;
+                        return ROQ_NEED_FRAME;
+                    }
 
-                        // Decode codebook
-                        if(!roq_unpack_quad_codebook(roq, read_buffer, header.chunk_size, header.chunk_arg)) {
-                            roq_errno = ROQ_BAD_CODEBOOK;
-                            return FALSE;
+                    // An unusable keyframe is skipped; the VQ frames
+                    // after it still decode against the old picture
+                    ROQ_TRACE_BEGIN("jpeg");
+                    unsigned long long start = roq_cache_clock(roq);
+                    unsigned short* frame = roq_unpack_jpeg(roq, packet->data, packet->chunk_size);
+                    roq_cache_charge(roq, start);
+                    ROQ_TRACE_END("jpeg");
+                    if(frame) {
+                        video_decoded = TRUE;
+                        roq->keyframe_offset = packet->offset;
+                        // The frame after it skips to the keyframe too
+                        if(roq->changed) {
+                            memset(roq->changed, TRUE, roq->mb_count);
+                            roq->changes_pending = 1;
                         }
-                    }
-                    
-                    break;
-                case RoQ_QUAD_VQ:
-                    if(!decode_video) {
-                        roq_buffer_set_offset(roq->buffer, header.chunk_size, SEEK_CUR);
+                        // and it is decoded whole into both frames
+                        if(roq->stale[0]) {
+                            memset(roq->stale[0], FALSE, roq->mb_count);
+                            memset(roq->stale[1], FALSE, roq->mb_count);
+                        }
+                        if(roq->cache_state == ROQ_CACHE_RECORDING)
+                            roq_cache_record_frame(roq, frame, packet);
+                        else if(roq->cache_state == ROQ_CACHE_VERIFYING)
+                            roq_cache_verify_frame(roq, frame);
+                        ROQ_TRACE_BEGIN("video callback");
+                        roq->video_decode_callback(frame, roq->frame_width, roq->frame_height, roq->stride, roq->texture_height, roq->user_data);
+                        ROQ_TRACE_END("video callback");
                     }
                     else {
-                        // Read the chunk
-                        if(roq_buffer_read(roq->buffer, header.chunk_size) != header.chunk_size) {
-                            roq_errno = ROQ_FILE_READ_FAILURE;
-                            return FALSE;
-                        }
+                        roq_errno = ROQ_BAD_JPEG;
+                    }
+                }
+                break;
+            case RoQ_QUAD_CODEBOOK:
+                if(decode_video) {
+                    // The codebook starts the next frame group. Leave it
+                    // queued for the next call.
+                    if(decode_audio && !audio_decoded && (video_decoded || video_ended)) {
+                        audio_decoded = TRUE;
+                        continue;
+                    }
 
-                        unsigned char* read_buffer = roq_buffer_get_data(roq->buffer);
+                    // 0 counts mean 256 vectors, see roq_unpack_quad_codebook()
+                    if(roq->scanning) {
+                        roq->scan_full_codebook = packet->chunk_arg == 0 &&
+                            packet->chunk_size >= ROQ_CODEBOOK_SIZE * (6 + 4);
+                        break;
+                    }
 
-                        // Decode video
-                        unsigned short* frame = roq_unpack_vq(roq, read_buffer, header.chunk_size, header.chunk_arg);
-                        if(frame) {
-                            video_decoded = TRUE;
-                            roq->video_decode_callback(frame, roq->width, roq->height, roq->stride, roq->texture_height, NULL);
-                        }
-                        else {
-                            roq_errno = ROQ_BAD_VQ_STREAM;
-                            video_ended = TRUE;
-                        }
+                    if(roq->cache_state == ROQ_CACHE_RECORDING && packet->chunk_arg == 0 &&
+                       packet->chunk_size >= ROQ_CODEBOOK_SIZE * (6 + 4))
+                        roq->cache_full_codebook = TRUE;
+
+                    // Decode codebook
+                    ROQ_TRACE_BEGIN("codebook");
+                    unsigned long long start = roq_cache_clock(roq);
+                    int codebook_ok = roq_unpack_quad_codebook(roq, packet->data, packet->chunk_size, packet->chunk_arg);
+                    roq_cache_charge(roq, start);
+                    ROQ_TRACE_END("codebook");
+                    if(!codebook_ok) {
+                        roq_errno = ROQ_BAD_CODEBOOK;
+                        return FALSE;
                     }
-                    break;
-                case RoQ_SOUND_MONO:
-                    if(!decode_audio) {
-                        roq_buffer_set_offset(roq->buffer, header.chunk_size, SEEK_CUR);
+                }
+                break;
+            case RoQ_QUAD_VQ:
+                if(decode_video) {
+                    // A second frame in one call means the audio has run
+                    // out. Leave it queued so every call returns at most
+                    // one frame.
+                    if(video_decoded) {
+                        audio_decoded = TRUE;
+                        continue;
                     }
-                    else {
-                        int i, snd_left;
-                        // Read the chunk
-                        if(roq_buffer_read(roq->buffer, header.chunk_size) != header.chunk_size) {
-                            roq_errno = ROQ_FILE_READ_FAILURE;
-                            return FALSE;
-                        }
 
-                        unsigned char* read_buffer = roq_buffer_get_data(roq->buffer);
+                    if(roq->scanning) {
+                        roq_scan_vq(roq, packet->data, packet->chunk_size);
+                        video_decoded = TRUE;
+                        break;
+                    }
 
-                        // Decode audio
-                        roq->channels = 1;
-                        roq->pcm_samples = header.chunk_size*2;
-                        snd_left = header.chunk_arg;
-                        for(i = 0; i < header.chunk_size; i++) {
-                            snd_left += roq->snd_sqr_array[read_buffer[i]];
-                            roq->pcm_sample[i * 2] = snd_left & 0xff;
-                            roq->pcm_sample[i * 2 + 1] = (snd_left & 0xff00) >> 8;
-                        }
-                        audio_decoded = TRUE;
-                        roq->audio_decode_callback(roq->pcm_sample, roq->pcm_samples, roq->channels, NULL);
+                    if(!roq_claim_frame(roq)) {
+                        roq->group_audio_decoded = audio_decoded;
+                        return ROQ_NEED_FRAME;
                     }
-                    break;
-                case RoQ_SOUND_STEREO:
-                    if(!decode_audio) {
-                        roq_buffer_set_offset(roq->buffer, header.chunk_size, SEEK_CUR);
+
+                    // Decode video
+                    ROQ_TRACE_BEGIN("vq");
+                    unsigned long long start = roq_cache_clock(roq);
+                    unsigned short* frame = roq_unpack_vq(roq, packet->data, packet->chunk_size, packet->chunk_arg);
+                    roq_cache_charge(roq, start);
+                    ROQ_TRACE_END("vq");
+                    if(frame) {
+                        video_decoded = TRUE;
+                        if(roq->changed)
+                            roq_track_vq(roq, packet->data, packet->chunk_size);
+                        if(roq->cache_state == ROQ_CACHE_RECORDING)
+                            roq_cache_record_frame(roq, frame, packet);
+                        else if(roq->cache_state == ROQ_CACHE_VERIFYING)
+                            roq_cache_verify_frame(roq, frame);
+                        ROQ_TRACE_BEGIN("video callback");
+                        roq->video_decode_callback(frame, roq->frame_width, roq->frame_height, roq->stride, roq->texture_height, roq->user_data);
+                        ROQ_TRACE_END("video callback");
                     }
                     else {
-                        int i, snd_left, snd_right;
-
-                        // Read the chunk
-                        if(roq_buffer_read(roq->buffer, header.chunk_size) != header.chunk_size) {
-                            roq_errno = ROQ_FILE_READ_FAILURE;
-                            return FALSE;
-                        }
-                        
-                        unsigned char* read_buffer = roq_buffer_get_data(roq->buffer);
-
-                        // Decode audio
-                        roq->channels = 2;
-                        roq->pcm_samples = header.chunk_size*2;
-                        snd_left = (header.chunk_arg & 0xFF00);
-                        snd_right = (header.chunk_arg & 0xFF) << 8;
-                        for(i = 0; i < header.chunk_size; i += 2) {
-                            snd_left  += roq->snd_sqr_array[read_buffer[i]];
-                            snd_right += roq->snd_sqr_array[read_buffer[i+1]];
-                            roq->pcm_sample[i * 2] = snd_left & 0xff;
-                            roq->pcm_sample[i * 2 + 1] = (snd_left & 0xff00) >> 8;
-                            roq->pcm_sample[i * 2 + 2] =  snd_right & 0xff;
-                            roq->pcm_sample[i * 2 + 3] = (snd_right & 0xff00) >> 8;
-                        }
-                        audio_decoded = TRUE;
-                        roq->audio_decode_callback(roq->pcm_sample, roq->pcm_samples, roq->channels, NULL);
+                        roq_errno = ROQ_BAD_VQ_STREAM;
+                        video_ended = TRUE;
                     }
-                    break;
-                default:
-                    break;
-            }
+                }
+                break;
+            case RoQ_SOUND_MONO:
+            case RoQ_SOUND_STEREO:
+                if(decode_audio) {
+                    if(roq->cache_state == ROQ_CACHE_RECORDING)
+                        roq_cache_record_audio(roq, packet);
+                    if(!roq->scanning)
+                        roq_decode_audio(roq, packet);
+                    audio_decoded = TRUE;
+                }
+                break;
+            default:
+                break;
         }
+
+        roq_demux_consume(roq->demux);
     } while ((decode_video && !video_decoded && !video_ended) || 
              (decode_audio && !audio_decoded && !audio_ended));
                 
     // We wanted to decode something but failed -> the source must have ended
-    if (video_ended || audio_ended) {
-        roq_handle_end(roq);
-        return FALSE;
-    }
+    if (video_ended || audio_ended || (stream_ended && !video_decoded && !audio_decoded))
+        return roq_handle_end(roq);
+
+    if(roq->cache_state == ROQ_CACHE_RECORDING && roq->cache_last)
+        roq->cache_last->ends_call = TRUE;
+    else if(roq->cache_state == ROQ_CACHE_VERIFYING)
+        roq_cache_verified_call(roq);
     
     return TRUE;
 }
@@ -356,405 +916,2850 @@ int roq_get_framerate(roq_t* roq) {
 	return roq->framerate;
 }
 
-int roq_has_ended(roq_t* roq) {
-	return roq->has_ended;
+long roq_get_keyframe_offset(roq_t* roq) {
+    return roq->keyframe_offset;
 }
 
-int roq_get_width(roq_t* roq) {
-    return roq->width;
-}
+int roq_seek_keyframe(roq_t* roq, long offset) {
+    roq_packet_t* packet;
 
-int roq_get_height(roq_t* roq) {
-    return roq->height;
-}
+    roq_cache_interrupt(roq);
+    roq_demux_seek(roq->demux, offset);
+    roq->group_video_decoded = FALSE;
+    roq->group_audio_decoded = FALSE;
 
-void roq_destroy(roq_t* roq) {
-    if(!roq)
-        return;
-    
-    if(roq->buffer) {
-        roq_buffer_destroy(roq->buffer);
-    }
-	
-    if(roq->frame[0]) {
-        free(roq->frame[0]);
-    }
-    
-    if(roq->frame[1]) {
-        free(roq->frame[1]);
+    if(!roq_demux_peek(roq->demux, &packet) ||
+       packet->offset != offset || packet->chunk_id != RoQ_JPEG) {
+        roq_errno = ROQ_FILE_READ_FAILURE;
+        return FALSE;
     }
 
-	free(roq);
-    roq = NULL;
+    roq->has_ended = FALSE;
+    roq->loop_pending = FALSE;
+
+    return TRUE;
 }
 
-static void roq_handle_end(roq_t* roq) {
-	if (roq->loop) {
-		roq->frame_index = 0;
-        roq_buffer_set_offset(roq->buffer, CHUNK_HEADER_SIZE, SEEK_SET);
-        roq->has_ended = FALSE;
+long roq_get_position(roq_t* roq) {
+    roq_demux_t* demux = roq->demux;
 
-        if(roq->loop_callback)
-            roq->loop_callback(NULL);
-	}
-	else {
-		roq->has_ended = TRUE;
-	}
+    if(roq->cache_state == ROQ_CACHE_REPLAYING)
+        return roq->cache_next ? roq->cache_next->position : roq->cache_end;
+
+    if(demux->queue_count)
+        return demux->queue[demux->queue_head].offset;
+
+    return demux->buffer->offset + demux->buffer->start_index;
 }
 
-static roq_t* roq_create_with_buffer(roq_buffer_t* buffer) {
-    int i;
-    roq_chunk_t header;
-    unsigned char* read_buffer;
-    roq_t* roq = malloc(sizeof(roq_t));
-    memset(roq, 0, sizeof(roq_t));
+static void roq_scan_record(roq_t* roq, long offset) {
+    // The start of the stream is recorded up front
+    if(roq->scan_count && offset == CHUNK_HEADER_SIZE)
+        return;
+    if(roq->scan_count < roq->scan_max)
+        roq->scan_offsets[roq->scan_count] = offset;
+    roq->scan_count++;
+}
 
-    roq->loop = FALSE;
-    roq->buffer = buffer;
-    roq->frame_index = 0;
+int roq_find_segments(roq_t* roq, long* offsets, int max) {
+    const roq_snapshot_t* loop_in = roq->loop_in;
+    int loop = roq->loop;
+    int count;
 
-    // Check if it has the ROQ signature header
-    if(!roq_read_header_chunk(roq->buffer, &header)) {
-        roq_destroy(roq);
+    if(roq->demux->buffer->mode == ROQ_BUFFER_MODE_PUSH) {
         roq_errno = ROQ_FILE_READ_FAILURE;
-        return NULL;
+        return 0;
     }
-    
-    if(header.chunk_id != RoQ_SIGNATURE || header.chunk_size != 0xFFFFFFFF) {
-        roq_destroy(roq);
-        roq_errno = ROQ_FILE_READ_FAILURE;
-        return NULL;
+    if(!roq->video_decode_callback && !roq->audio_decode_callback) {
+        roq_errno = ROQ_CLIENT_PROBLEM;
+        return 0;
     }
-    roq->framerate = header.chunk_arg;
 
-    // Get RoQ_INFO
-    do {
-        if(!roq_read_header_chunk(roq->buffer, &header)) {
-            roq_destroy(roq);
-            roq_errno = ROQ_FILE_READ_FAILURE;
-            return NULL;
-        }
-        
-        if(header.chunk_id == RoQ_INFO) {
-            if(roq_buffer_read(roq->buffer, header.chunk_size) != header.chunk_size) {
-                roq_destroy(roq);
-                roq_errno = ROQ_FILE_READ_FAILURE;
-                return NULL;
-            }
+    // Once through, without looping
+    roq->loop = FALSE;
+    roq->loop_in = NULL;
+    roq->scanning = TRUE;
+    roq->scan_offsets = offsets;
+    roq->scan_max = max;
+    roq->scan_count = 0;
+    roq->scan_candidate = -1;
+    roq->scan_full_codebook = FALSE;
+
+    if(roq_seek_segment(roq, CHUNK_HEADER_SIZE)) {
+        roq_scan_record(roq, CHUNK_HEADER_SIZE);
+        while(roq_decode(roq) == TRUE)
+            ;
+    }
 
-            read_buffer = roq_buffer_get_data(roq->buffer);
-            roq->width = LE_16(&read_buffer[0]);
-            roq->height = LE_16(&read_buffer[2]); 
+    count = roq->scan_count;
+    roq->scanning = FALSE;
+    roq->scan_offsets = NULL;
+    roq->loop = loop;
+    roq->loop_in = loop_in;
 
-            /* width and height each need to be divisible by 16 */
-            if ((roq->width & 0xF) || (roq->height & 0xF)) {
-                roq_destroy(roq);
-                roq_errno = ROQ_INVALID_PIC_SIZE;
-                return NULL;
-            }
+    if(!roq_seek_segment(roq, CHUNK_HEADER_SIZE))
+        return 0;
 
-            if (roq->width < 8 || roq->width > 1024 ||
-                roq->height < 8 || roq->height > 1024) {
-                roq_destroy(roq);
-                roq_errno = ROQ_INVALID_DIMENSION;
-                return NULL;
-            }
+    return count;
+}
 
-            roq->mb_width = roq->width >> 4;
-            roq->mb_height = roq->height >> 4;
-            roq->mb_count = roq->mb_width * roq->mb_height;
-            
-            roq->stride = 8;
-            while (roq->stride < roq->width)
-                roq->stride <<= 1;
-
-            // Initialize Audio SQRT Look-Up Table
-            for(i = 0; i < 128; i++) {
-                roq->snd_sqr_array[i] = i * i;
-                roq->snd_sqr_array[i + 128] = -(roq->snd_sqr_array[i]);
-            }
+int roq_seek_segment(roq_t* roq, long offset) {
+    roq_packet_t* packet;
 
-            // Initialize YUV420 -> RGB Math Look-Up Table helpers
-            for(i = 0; i < 256; i++) {
-                roq->yy_lut[i] = 1.164 * (i - 16);
-                roq->cr_r_lut[i] = 1.596 * (i - 128);
-                roq->cb_b_lut[i] = 2.017 * (i - 128);
-                roq->cr_g_lut[i] = -0.813 * (i - 128);
-                roq->cb_g_lut[i] = -0.392 * (i - 128);
-            }
+    if(roq->demux->buffer->mode == ROQ_BUFFER_MODE_PUSH) {
+        roq_errno = ROQ_FILE_READ_FAILURE;
+        return FALSE;
+    }
 
-            for(i = 0; i < 4; i++) {
-                roq->block_offset_lut[i] = (i / 2 * 8 * roq->stride) + (i % 2 * 8);
-            }
+    roq_cache_interrupt(roq);
+    roq_demux_seek(roq->demux, offset);
+    roq->group_video_decoded = FALSE;
+    roq->group_audio_decoded = FALSE;
 
-            for(i = 0; i < 4; i++) {
-                roq->subblock_offset_lut[i] = (i / 2 * 4 * roq->stride) + (i % 2 * 4);
-            }
+    if(!roq_demux_peek(roq->demux, &packet) || packet->offset != offset) {
+        roq_errno = ROQ_FILE_READ_FAILURE;
+        return FALSE;
+    }
 
-            for(i = 0; i < 4; i++) {
-                roq->unpack_4x4_lut[i] = (i / 2) * 8 + (i % 2) * 2;
-            }
+    roq->has_ended = FALSE;
+    roq->loop_pending = FALSE;
 
-            for(i = 0; i < 16; i++) {
-                roq->upsample_offset_lut[i] = (i / 4 * 2 * roq->stride) + (i % 4 * 2);
-            }
+    return TRUE;
+}
 
-            roq->texture_height = 8;
-            while (roq->texture_height < roq->height)
-                roq->texture_height <<= 1;
-
-            printf(
-                "\tRoQ_INFO: dimensions = %dx%d,\n"
-                "\t%dx%d; %d mbs,\n"
-                "\ttexture = %dx%d,\n"
-                "\tframerate= %d fps\n\n", 
-                roq->width, roq->height, roq->mb_width, roq->mb_height,
-                roq->mb_count, roq->stride, roq->texture_height, roq->framerate);
-            fflush(stdout);
+// Compares macroblock index of two frames
+static int roq_macroblock_equal(roq_t* roq, unsigned short* a, unsigned short* b, int index) {
+    int mb_size = 16 >> roq->scale_shift;
+    size_t offset = (index / roq->mb_width) * mb_size * roq->stride + (index % roq->mb_width) * mb_size;
+    int y;
+
+    for(y = 0; y < mb_size; y++, offset += roq->stride)
+        if(memcmp(a + offset, b + offset, mb_size * sizeof(unsigned short)))
+            return FALSE;
+
+    return TRUE;
+}
+
+// Copies macroblock index between a frame and a run of pixels
+static void roq_macroblock_copy(roq_t* roq, unsigned short* frame, unsigned short* pixels, int index, int to_frame) {
+    int mb_size = 16 >> roq->scale_shift;
+    unsigned short* line = frame + (index / roq->mb_width) * mb_size * roq->stride + (index % roq->mb_width) * mb_size;
+    int y;
+
+    for(y = 0; y < mb_size; y++, line += roq->stride, pixels += mb_size) {
+        if(to_frame)
+            memcpy(line, pixels, mb_size * sizeof(unsigned short));
+        else
+            memcpy(pixels, line, mb_size * sizeof(unsigned short));
+    }
+}
+
+roq_snapshot_t* roq_snapshot(roq_t* roq) {
+    roq_snapshot_t* snapshot;
+    unsigned short* last_frame;
+    unsigned short* older_frame;
+    unsigned short* pixels;
+    int mb_size = 16 >> roq->scale_shift;
+    size_t bitmap_size = (roq->mb_count + 7) / 8;
+    size_t size;
+    int changed = 0;
+    int i, y;
+
+    // A replay does not keep the codebooks up to date
+    if(!roq->width || roq->cache_state == ROQ_CACHE_REPLAYING) {
+        roq_errno = ROQ_BAD_SNAPSHOT;
+        return NULL;
+    }
+
+    // The picture before last is in the frame the next one goes to,
+    // unless a pool frame has just replaced that
+    last_frame = roq->frame[roq->frame_index ^ 1];
+    older_frame = roq->mot_frame ? roq->mot_frame : roq->frame[roq->frame_index];
+
+    for(i = 0; i < roq->mb_count; i++)
+        if(!roq_macroblock_equal(roq, last_frame, older_frame, i))
+            changed++;
+
+    size = sizeof(roq_snapshot_t) + bitmap_size +
+        (roq->frame_width * roq->frame_height + changed * mb_size * mb_size) * sizeof(unsigned short);
+    snapshot = malloc(size);
+    if(!snapshot) {
+        roq_errno = ROQ_NO_MEMORY;
+        return NULL;
+    }
+
+    snapshot->width = roq->width;
+    snapshot->height = roq->height;
+    snapshot->scale_shift = roq->scale_shift;
+    snapshot->offset = roq_get_position(roq);
+    snapshot->keyframe_offset = roq->keyframe_offset;
+    snapshot->frame_index = roq->frame_index;
+    snapshot->group_video_decoded = roq->group_video_decoded;
+    snapshot->group_audio_decoded = roq->group_audio_decoded;
+    memcpy(snapshot->cb2x2_rgb565, roq->cb2x2_rgb565, sizeof(roq->cb2x2_rgb565));
+    memcpy(snapshot->cb4x4_rgb565, roq->cb4x4_rgb565, sizeof(roq->cb4x4_rgb565));
+    snapshot->size = size;
+
+    // The pixels go first to keep them aligned
+    snapshot->pixels = (unsigned short*)(snapshot + 1);
+    pixels = snapshot->pixels;
+    for(y = 0; y < roq->frame_height; y++, pixels += roq->frame_width)
+        memcpy(pixels, last_frame + y * roq->stride, roq->frame_width * sizeof(unsigned short));
+
+    snapshot->changed = (unsigned char*)(snapshot->pixels + roq->frame_width * roq->frame_height +
+        changed * mb_size * mb_size);
+    memset(snapshot->changed, 0, bitmap_size);
+    for(i = 0; i < roq->mb_count; i++) {
+        if(roq_macroblock_equal(roq, last_frame, older_frame, i))
+            continue;
+        snapshot->changed[i / 8] |= 1 << (i % 8);
+        roq_macroblock_copy(roq, older_frame, pixels, i, FALSE);
+        pixels += mb_size * mb_size;
+    }
+
+    return snapshot;
+}
+
+int roq_restore(roq_t* roq, const roq_snapshot_t* snapshot) {
+    unsigned short* last_frame;
+    unsigned short* older_frame;
+    unsigned short* pixels = snapshot->pixels;
+    roq_packet_t* packet;
+    int mb_size = 16 >> roq->scale_shift;
+    int i, y;
+
+    if(snapshot->width != roq->width || snapshot->height != roq->height ||
+       snapshot->scale_shift != roq->scale_shift) {
+        roq_errno = ROQ_BAD_SNAPSHOT;
+        return FALSE;
+    }
+
+    // Held pool frames must not change; wait for two to be free
+    if(roq->pool_size && !roq_pool_pick(roq))
+        return ROQ_NEED_FRAME;
+
+    roq_cache_interrupt(roq);
+    roq_demux_seek(roq->demux, snapshot->offset);
+    if(!roq_demux_peek(roq->demux, &packet) || packet->offset != snapshot->offset) {
+        roq_errno = ROQ_FILE_READ_FAILURE;
+        return FALSE;
+    }
+
+    roq->frame_index = snapshot->frame_index;
+    roq->mot_frame = NULL;
+    last_frame = roq->frame[roq->frame_index ^ 1];
+    older_frame = roq->frame[roq->frame_index];
+
+    for(y = 0; y < roq->frame_height; y++, pixels += roq->frame_width) {
+        memcpy(last_frame + y * roq->stride, pixels, roq->frame_width * sizeof(unsigned short));
+        memcpy(older_frame + y * roq->stride, pixels, roq->frame_width * sizeof(unsigned short));
+    }
+    for(i = 0; i < roq->mb_count; i++) {
+        if(!(snapshot->changed[i / 8] & (1 << (i % 8))))
+            continue;
+        roq_macroblock_copy(roq, older_frame, pixels, i, TRUE);
+        pixels += mb_size * mb_size;
+    }
+
+    if(roq->tiles[0]) {
+        roq_tile_frame(roq, roq->tiles[0], roq->frame[0]);
+        roq_tile_frame(roq, roq->tiles[1], roq->frame[1]);
+    }
+
+    memcpy(roq->cb2x2_rgb565, snapshot->cb2x2_rgb565, sizeof(roq->cb2x2_rgb565));
+    memcpy(roq->cb4x4_rgb565, snapshot->cb4x4_rgb565, sizeof(roq->cb4x4_rgb565));
+    if(roq->scale_shift)
+        roq_downsample_codebook(roq);
+
+    roq->keyframe_offset = snapshot->keyframe_offset;
+    roq->changes_pending = 2;
+    if(roq->stale[0]) {
+        memset(roq->stale[0], FALSE, roq->mb_count);
+        memset(roq->stale[1], FALSE, roq->mb_count);
+    }
+    roq->group_video_decoded = snapshot->group_video_decoded;
+    roq->group_audio_decoded = snapshot->group_audio_decoded;
+    roq->has_ended = FALSE;
+    roq->loop_pending = FALSE;
+
+    return TRUE;
+}
+
+size_t roq_snapshot_get_size(const roq_snapshot_t* snapshot) {
+    return snapshot->size;
+}
+
+void roq_snapshot_destroy(roq_snapshot_t* snapshot) {
+    free(snapshot);
+}
+
+int roq_set_loop_cache(roq_t* roq, size_t budget) {
+    if(roq->demux->buffer->mode == ROQ_BUFFER_MODE_PUSH) {
+        roq_errno = ROQ_CLIENT_PROBLEM;
+        return FALSE;
+    }
+
+    roq->cache_budget = budget;
+    if(roq->cache_state == ROQ_CACHE_OFF)
+        roq->cache_state = ROQ_CACHE_EMPTY;
+
+    // A replay finishes its pass first, see roq_handle_end()
+    if(roq->cache_state != ROQ_CACHE_REPLAYING && (!budget || roq->cache_bytes > budget))
+        roq_cache_free(roq);
+
+    return TRUE;
+}
+
+void roq_get_loop_cache_stats(roq_t* roq, roq_loop_cache_stats_t* stats) {
+    int complete = roq->cache_state == ROQ_CACHE_COMPLETE || roq->cache_state == ROQ_CACHE_VERIFYING ||
+                   roq->cache_state == ROQ_CACHE_REPLAYING;
+
+    stats->frames = complete ? roq->cache_frames : 0;
+    stats->bytes = roq->cache_bytes;
+    stats->passes = roq->cache_passes;
+    stats->frames_replayed = roq->cache_frames_replayed;
+    stats->overflowed = roq->cache_overflowed;
+    stats->unsupported = roq->cache_unsupported;
+    stats->decode_us = roq->cache_decode_us;
+    stats->replay_us = roq->cache_replay_us;
+    stats->saved_us = 0;
+    if(stats->frames)
+        stats->saved_us = (long long)(roq->cache_decode_us * roq->cache_frames_replayed / stats->frames) -
+                          (long long)roq->cache_replay_us;
+}
+
+static unsigned long long roq_clock_us(void) {
 #ifdef _arch_dreamcast
-            roq->frame[0] = memalign(32, roq->texture_height * roq->stride * sizeof(unsigned short));
-            roq->frame[1] = memalign(32, roq->texture_height * roq->stride * sizeof(unsigned short));
+    return timer_us_gettime64();
 #else
-            roq->frame[0] = malloc(roq->texture_height * roq->stride * sizeof(unsigned short));
-            roq->frame[1] = malloc(roq->texture_height * roq->stride * sizeof(unsigned short));
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
 #endif
-            
-            if (!roq->frame[0] || !roq->frame[1]) {
+}
+
+// Only the pass being recorded is timed
+static unsigned long long roq_cache_clock(roq_t* roq) {
+    return roq->cache_state == ROQ_CACHE_RECORDING ? roq_clock_us() : 0;
+}
+
+static void roq_cache_charge(roq_t* roq, unsigned long long start) {
+    if(roq->cache_state == ROQ_CACHE_RECORDING)
+        roq->cache_decode_us += roq_clock_us() - start;
+}
+
+static void roq_cache_free(roq_t* roq) {
+    roq_cache_event_t* event;
+
+    while((event = roq->cache_head)) {
+        roq->cache_head = event->next;
+        free(event);
+    }
+    free(roq->cache_changed);
+
+    roq->cache_changed = NULL;
+    roq->cache_last = NULL;
+    roq->cache_next = NULL;
+    roq->cache_bytes = 0;
+    roq->cache_frames = 0;
+    roq->cache_state = ROQ_CACHE_EMPTY;
+}
+
+// Drops a pass being recorded, or stops the one being replayed where it
+// is, before the decoder moves elsewhere in the stream
+static void roq_cache_interrupt(roq_t* roq) {
+    if(roq->cache_state == ROQ_CACHE_RECORDING) {
+        roq_cache_free(roq);
+    }
+    else if(roq->cache_state == ROQ_CACHE_VERIFYING) {
+        roq->cache_state = ROQ_CACHE_COMPLETE;
+        roq->cache_next = NULL;
+    }
+    else if(roq->cache_state == ROQ_CACHE_REPLAYING) {
+        roq->cache_state = ROQ_CACHE_COMPLETE;
+        roq->cache_next = NULL;
+
+        // The tiles missed the frames replayed
+        if(roq->tiles[0]) {
+            roq_tile_frame(roq, roq->tiles[0], roq->frame[0]);
+            roq_tile_frame(roq, roq->tiles[1], roq->frame[1]);
+        }
+    }
+}
+
+static int roq_cache_begin(roq_t* roq) {
+    roq->cache_changed = malloc(roq->mb_count * 2);
+    if(!roq->cache_changed) {
+        roq->cache_state = ROQ_CACHE_OFF;
+        roq->cache_overflowed = TRUE;
+        return FALSE;
+    }
+
+    roq->cache_state = ROQ_CACHE_RECORDING;
+    roq->cache_overflowed = FALSE;
+    roq->cache_unsupported = FALSE;
+    roq->cache_full_codebook = FALSE;
+    roq->cache_passes = 0;
+    roq->cache_frames_replayed = 0;
+    roq->cache_decode_us = 0;
+    roq->cache_replay_us = 0;
+
+    return TRUE;
+}
+
+// Takes size more bytes for the cache, or gives up on the pass when the
+// budget or the memory runs out
+static roq_cache_event_t* roq_cache_new_event(roq_t* roq, size_t size) {
+    roq_cache_event_t* event = NULL;
+
+    size += sizeof(roq_cache_event_t);
+    if(roq->cache_bytes + size <= roq->cache_budget)
+        event = malloc(size);
+
+    if(!event) {
+        roq_cache_free(roq);
+        roq->cache_state = ROQ_CACHE_OFF;
+        roq->cache_overflowed = TRUE;
+        return NULL;
+    }
+
+    memset(event, 0, sizeof(roq_cache_event_t));
+    event->position = roq->cache_position;
+    if(roq->cache_last)
+        roq->cache_last->next = event;
+    else
+        roq->cache_head = event;
+    roq->cache_last = event;
+    roq->cache_bytes += size;
+
+    return event;
+}
+
+// Gives up on a stream whose passes do not all decode the same
+static void roq_cache_unsupported(roq_t* roq) {
+    roq_cache_free(roq);
+    roq->cache_state = ROQ_CACHE_OFF;
+    roq->cache_unsupported = TRUE;
+}
+
+// Records the macroblocks of frame that differ from the one before it or
+// that the one before it changed, which covers everything that differs
+// from the frame two back, the one a replay writes over
+static void roq_cache_record_frame(roq_t* roq, unsigned short* frame, roq_packet_t* packet) {
+    roq_cache_event_t* event;
+    unsigned short* last_frame = roq->frame[roq->frame_index];
+    unsigned short* pixels;
+    unsigned char* last_changed = roq->cache_changed;
+    unsigned char* changed = roq->cache_changed + roq->mb_count;
+    int whole = roq->cache_frames < 2 || packet->chunk_id == RoQ_JPEG;
+    int mb_size = 16 >> roq->scale_shift;
+    int count = 0;
+    int i;
+
+    // Vectors left from before the pass would make the next one decode
+    // differently
+    if(packet->chunk_id == RoQ_QUAD_VQ && !roq->cache_full_codebook) {
+        roq_cache_unsupported(roq);
+        return;
+    }
+
+    for(i = 0; i < roq->mb_count; i++) {
+        changed[i] = !roq_macroblock_equal(roq, frame, last_frame, i);
+        if(whole || changed[i] || last_changed[i])
+            count++;
+    }
+
+    event = roq_cache_new_event(roq, count * mb_size * mb_size * sizeof(unsigned short) + (roq->mb_count + 7) / 8);
+    if(!event)
+        return;
+
+    // The pixels go first to keep them aligned
+    event->offset = packet->offset;
+    event->chunk_id = packet->chunk_id;
+    event->data = (unsigned char*)(event + 1);
+    event->changed = event->data + count * mb_size * mb_size * sizeof(unsigned short);
+    memset(event->changed, 0, (roq->mb_count + 7) / 8);
+
+    pixels = (unsigned short*)event->data;
+    for(i = 0; i < roq->mb_count; i++) {
+        if(!whole && !changed[i] && !last_changed[i])
+            continue;
+        event->changed[i / 8] |= 1 << (i % 8);
+        roq_macroblock_copy(roq, frame, pixels, i, FALSE);
+        pixels += mb_size * mb_size;
+    }
+
+    memcpy(last_changed, changed, roq->mb_count);
+    roq->cache_frames++;
+}
+
+static void roq_cache_record_audio(roq_t* roq, roq_packet_t* packet) {
+    roq_cache_event_t* event = roq_cache_new_event(roq, packet->chunk_size);
+
+    if(!event)
+        return;
+
+    event->offset = packet->offset;
+    event->chunk_id = packet->chunk_id;
+    event->chunk_arg = packet->chunk_arg;
+    event->size = packet->chunk_size;
+    event->data = (unsigned char*)(event + 1);
+    memcpy(event->data, packet->data, packet->chunk_size);
+}
+
+// Compares a frame decoded at the start of a pass with the recorded one,
+// which is whole. Two frames the same mean every later one will be too,
+// as each only takes from the two before it and the codebook.
+static void roq_cache_verify_frame(roq_t* roq, unsigned short* frame) {
+    roq_cache_event_t* event = roq->cache_next;
+    unsigned short* pixels;
+    unsigned short* line;
+    int mb_size = 16 >> roq->scale_shift;
+    int i, y;
+
+    while(event && event->chunk_id != RoQ_QUAD_VQ && event->chunk_id != RoQ_JPEG)
+        event = event->next;
+    if(!event) {
+        roq_cache_unsupported(roq);
+        return;
+    }
+
+    pixels = (unsigned short*)event->data;
+    for(i = 0; i < roq->mb_count; i++) {
+        line = frame + (i / roq->mb_width) * mb_size * roq->stride + (i % roq->mb_width) * mb_size;
+        for(y = 0; y < mb_size; y++, line += roq->stride, pixels += mb_size) {
+            if(memcmp(line, pixels, mb_size * sizeof(unsigned short))) {
+                roq_cache_unsupported(roq);
+                return;
+            }
+        }
+    }
+
+    roq->cache_next = event->next;
+    roq->cache_verified++;
+}
+
+// Once the frames compared, the replay picks up after the recorded call
+// that matches the one just made
+static void roq_cache_verified_call(roq_t* roq) {
+    roq_cache_event_t* event = roq->cache_head;
+    unsigned int calls = 0;
+
+    roq->cache_calls++;
+    if(roq->cache_verified < 2 && roq->cache_verified < roq->cache_frames)
+        return;
+
+    while(event && calls < roq->cache_calls) {
+        if(event->ends_call)
+            calls++;
+        event = event->next;
+    }
+
+    roq->cache_state = ROQ_CACHE_REPLAYING;
+    roq->cache_next = event;
+    roq->cache_passes++;
+}
+
+// Writes a recorded frame over the frame from two frames back, like the
+// decoder would, and keeps the references and the change flags the way
+// decoding it would have left them
+static unsigned short* roq_cache_replay_frame(roq_t* roq, roq_cache_event_t* event) {
+    unsigned short* this_frame = roq->frame[roq->frame_index];
+    unsigned short* pixels = (unsigned short*)event->data;
+    size_t frame_size = roq->frame_height * roq->stride * sizeof(unsigned short);
+    int mb_size = 16 >> roq->scale_shift;
+    int i;
+
+    if(roq->mot_frame) {
+        memcpy(this_frame, roq->mot_frame, frame_size);
+        roq->mot_frame = NULL;
+    }
+
+    for(i = 0; i < roq->mb_count; i++) {
+        if(!(event->changed[i / 8] & (1 << (i % 8))))
+            continue;
+        roq_macroblock_copy(roq, this_frame, pixels, i, TRUE);
+        pixels += mb_size * mb_size;
+    }
+
+    roq->frame_index ^= 1;
+
+    if(event->chunk_id == RoQ_JPEG) {
+        if(roq->pool_size)
+            roq->frame[roq->frame_index] = this_frame;
+        else
+            memcpy(roq->frame[roq->frame_index], this_frame, frame_size);
+        roq->keyframe_offset = event->offset;
+        if(roq->changed) {
+            memset(roq->changed, TRUE, roq->mb_count);
+            roq->changes_pending = 1;
+        }
+    }
+    else if(roq->changed) {
+        if(roq->changes_pending) {
+            memset(roq->changed, TRUE, roq->mb_count);
+            roq->changes_pending--;
+        }
+        else {
+            for(i = 0; i < roq->mb_count; i++)
+                roq->changed[i] = (event->changed[i / 8] >> (i % 8)) & 1;
+        }
+    }
+
+    return this_frame;
+}
+
+// roq_decode() from the cache: the callbacks of one recorded call
+static int roq_cache_replay(roq_t* roq) {
+    roq_cache_event_t* event;
+    roq_packet_t packet;
+    unsigned short* frame;
+    unsigned long long start;
+    int ends_call;
+
+    while((event = roq->cache_next)) {
+        if((event->chunk_id == RoQ_QUAD_VQ || event->chunk_id == RoQ_JPEG) && !roq_claim_frame(roq))
+            return ROQ_NEED_FRAME;
+
+        // A callback may seek or drop the cache
+        roq->cache_next = event->next;
+        ends_call = event->ends_call;
+
+        if(event->chunk_id == RoQ_QUAD_VQ || event->chunk_id == RoQ_JPEG) {
+            start = roq_clock_us();
+            frame = roq_cache_replay_frame(roq, event);
+            roq->cache_replay_us += roq_clock_us() - start;
+            roq->cache_frames_replayed++;
+            if(roq->video_decode_callback)
+                roq->video_decode_callback(frame, roq->frame_width, roq->frame_height, roq->stride, roq->texture_height, roq->user_data);
+        }
+        else if(roq->audio_decode_callback) {
+            packet.chunk_id = event->chunk_id;
+            packet.chunk_size = event->size;
+            packet.chunk_arg = event->chunk_arg;
+            packet.offset = event->offset;
+            packet.data = event->data;
+            roq_decode_audio(roq, &packet);
+        }
+
+        if(ends_call || roq->cache_state != ROQ_CACHE_REPLAYING)
+            return TRUE;
+    }
+
+    return roq_handle_end(roq);
+}
+
+int roq_set_loop_points(roq_t* roq, const roq_snapshot_t* in, long out) {
+    if(in && (in->width != roq->width || in->height != roq->height ||
+       in->scale_shift != roq->scale_shift || (out >= 0 && out <= in->offset))) {
+        roq_errno = ROQ_BAD_SNAPSHOT;
+        return FALSE;
+    }
+
+    roq->loop_in = in;
+    roq->loop_out = in ? out : -1;
+    roq->loop_pending = FALSE;
+
+    return TRUE;
+}
+
+int roq_has_ended(roq_t* roq) {
+	return roq->has_ended;
+}
+
+int roq_get_width(roq_t* roq) {
+    return roq->frame_width;
+}
+
+int roq_get_height(roq_t* roq) {
+    return roq->frame_height;
+}
+
+void roq_destroy(roq_t* roq) {
+    if(!roq)
+        return;
+    
+    if(roq->demux) {
+        roq_demux_destroy(roq->demux);
+    }
+	
+    if(!roq->pool_size) {
+        free(roq->frame[0]);
+        free(roq->frame[1]);
+    }
+    free(roq->pool);
+    free(roq->tiles[0]);
+    free(roq->tiles[1]);
+    free(roq->changed);
+    free(roq->region);
+    free(roq->stale[0]);
+    free(roq->stale[1]);
+    free(roq->region_starts);
+    roq_cache_free(roq);
+
+	free(roq);
+    roq = NULL;
+}
+
+roq_demux_t* roq_demux_create_with_filename(const char* filename) {
+	FILE* fh = fopen(filename, "rb");
+	if (!fh) {
+        roq_errno = ROQ_FILE_OPEN_FAILURE;
+		return NULL;
+	}
+	return roq_demux_create_with_file(fh, TRUE);
+}
+
+roq_demux_t* roq_demux_create_with_file(FILE* fh, int close_when_done) {
+	roq_buffer_t *buffer = roq_buffer_create_with_file(fh, close_when_done);
+    if (!buffer)
+		return NULL;
+
+	return roq_demux_create_with_buffer(buffer);
+}
+
+roq_demux_t* roq_demux_create_with_memory(unsigned char* bytes, size_t length, int free_when_done) {
+	roq_buffer_t *buffer = roq_buffer_create_with_memory(bytes, length, free_when_done);
+    if (!buffer)
+		return NULL;
+
+	return roq_demux_create_with_buffer(buffer);
+}
+
+int roq_demux_next(roq_demux_t* demux, roq_packet_t* packet) {
+    roq_packet_t* next;
+
+    if(!roq_demux_peek(demux, &next))
+        return FALSE;
+
+    *packet = *next;
+    roq_demux_consume(demux);
+
+    return TRUE;
+}
+
+void roq_demux_seek(roq_demux_t* demux, long offset) {
+    demux->queue_head = 0;
+    demux->queue_count = 0;
+    roq_buffer_set_offset(demux->buffer, offset);
+}
+
+void roq_demux_destroy(roq_demux_t* demux) {
+    if(demux == NULL)
+        return;
+
+    roq_buffer_destroy(demux->buffer);
+    free(demux);
+}
+
+// Returns FALSE, or ROQ_NEED_FRAME when looping back to the in point
+// has to wait for a pool frame
+static int roq_handle_end(roq_t* roq) {
+    // A pass recorded to the end is complete. One replayed to the end is
+    // replayed again next time, unless the budget has shrunk below it.
+    if (roq->cache_state == ROQ_CACHE_RECORDING) {
+        roq->cache_state = ROQ_CACHE_COMPLETE;
+        roq->cache_end = roq_get_position(roq);
+    }
+    else if (roq->cache_state == ROQ_CACHE_VERIFYING || roq->cache_state == ROQ_CACHE_REPLAYING) {
+        roq_cache_interrupt(roq);
+        if (roq->cache_bytes > roq->cache_budget)
+            roq_cache_free(roq);
+    }
+
+    if (roq->loop_in) {
+        int status = roq_restore(roq, roq->loop_in);
+        if (status == ROQ_NEED_FRAME) {
+            roq->loop_pending = TRUE;
+            return ROQ_NEED_FRAME;
+        }
+        roq->has_ended = status != TRUE;
+        if (!roq->has_ended && roq->loop_callback)
+            roq->loop_callback(roq->user_data);
+    }
+	else if (roq->loop) {
+		roq->frame_index = 0;
+        roq_demux_seek(roq->demux, CHUNK_HEADER_SIZE);
+        roq->has_ended = FALSE;
+
+        if(roq->loop_callback)
+            roq->loop_callback(roq->user_data);
+	}
+	else {
+		roq->has_ended = TRUE;
+	}
+
+    return FALSE;
+}
+
+static roq_t* roq_create_with_demux(roq_demux_t* demux) {
+    int i;
+    roq_packet_t* header;
+    roq_t* roq = malloc(sizeof(roq_t));
+    if(!roq) {
+        roq_demux_destroy(demux);
+        roq_errno = ROQ_NO_MEMORY;
+        return NULL;
+    }
+    memset(roq, 0, sizeof(roq_t));
+
+    roq->loop = FALSE;
+    roq->demux = demux;
+    roq->frame_index = 0;
+    roq->keyframe_offset = -1;
+    roq->kernels = roq_blocks_select();
+    roq_jpeg_init(&roq->jpeg);
+
+    // Push sources parse the header once it has arrived, in roq_decode()
+    if(demux->buffer->mode == ROQ_BUFFER_MODE_PUSH)
+        return roq;
+
+    // Check if it has the ROQ signature header
+    if(!roq_demux_peek(roq->demux, &header)) {
+        roq_destroy(roq);
+        roq_errno = ROQ_FILE_READ_FAILURE;
+        return NULL;
+    }
+    
+    if(header->chunk_id != RoQ_SIGNATURE || header->offset != 0) {
+        roq_destroy(roq);
+        roq_errno = ROQ_FILE_READ_FAILURE;
+        return NULL;
+    }
+    roq->framerate = header->chunk_arg;
+    roq_demux_consume(roq->demux);
+
+    // Get RoQ_INFO
+    do {
+        if(!roq_demux_peek(roq->demux, &header)) {
+            roq_destroy(roq);
+            roq_errno = ROQ_FILE_READ_FAILURE;
+            return NULL;
+        }
+        
+        if(header->chunk_id == RoQ_INFO) {
+            if(!roq_init_info(roq, header)) {
                 roq_destroy(roq);
-                roq_errno = ROQ_NO_MEMORY;
                 return NULL;
             }
+        }
+
+        i = header->chunk_id;
+        roq_demux_consume(roq->demux);
+    } while(i != RoQ_INFO);
+
+    // Reset
+    roq_demux_seek(roq->demux, CHUNK_HEADER_SIZE);
+
+	return roq;
+}
+
+// Sets the decoder up from the RoQ_INFO chunk: dimensions, look-up
+// tables and frame buffers. Returns FALSE with roq_errno set if the
+// chunk is unusable.
+static int roq_init_info(roq_t* roq, roq_packet_t* header) {
+    unsigned char* read_buffer;
+    int i;
+
+    if(header->chunk_size < 4) {
+        roq_errno = ROQ_FILE_READ_FAILURE;
+        return FALSE;
+    }
+
+    read_buffer = header->data;
+    roq->width = LE_16(&read_buffer[0]);
+    roq->height = LE_16(&read_buffer[2]); 
+
+    /* width and height each need to be divisible by 16 */
+    if ((roq->width & 0xF) || (roq->height & 0xF)) {
+        roq_errno = ROQ_INVALID_PIC_SIZE;
+        return FALSE;
+    }
+
+    if (roq->width < 8 || roq->width > ROQ_MAX_DIMENSION ||
+        roq->height < 8 || roq->height > ROQ_MAX_DIMENSION) {
+        roq_errno = ROQ_INVALID_DIMENSION;
+        return FALSE;
+    }
+
+    roq->mb_width = roq->width >> 4;
+    roq->mb_height = roq->height >> 4;
+    roq->mb_count = roq->mb_width * roq->mb_height;
+
+    // Initialize Audio SQRT Look-Up Table
+    for(i = 0; i < 128; i++) {
+        roq->snd_sqr_array[i] = i * i;
+        roq->snd_sqr_array[i + 128] = -(roq->snd_sqr_array[i]);
+    }
+
+    // Initialize YUV420 -> RGB Math Look-Up Table helpers
+    for(i = 0; i < 256; i++) {
+        roq->yy_lut[i] = 1.164 * (i - 16);
+        roq->cr_r_lut[i] = 1.596 * (i - 128);
+        roq->cb_b_lut[i] = 2.017 * (i - 128);
+        roq->cr_g_lut[i] = -0.813 * (i - 128);
+        roq->cb_g_lut[i] = -0.392 * (i - 128);
+    }
+
+    if(!roq_setup_frames(roq))
+        return FALSE;
+
+    printf(
+        "\tRoQ_INFO: dimensions = %dx%d,\n"
+        "\t%dx%d; %d mbs,\n"
+        "\ttexture = %dx%d,\n"
+        "\tframerate= %d fps\n\n", 
+        roq->width, roq->height, roq->mb_width, roq->mb_height,
+        roq->mb_count, roq->stride, roq->texture_height, roq->framerate);
+    fflush(stdout);
+
+    return TRUE;
+}
+
+// Push sources: takes the signature once it is queued and sets up from
+// RoQ_INFO as soon as that is queued too. The chunks in between stay in
+// the queue for roq_decode(). Returns ROQ_NEED_DATA until the header
+// is complete.
+static int roq_push_header(roq_t* roq) {
+    roq_demux_t* demux = roq->demux;
+    roq_packet_t* header;
+    int i;
+
+    if(!roq->framerate) {
+        if(!roq_demux_peek(demux, &header))
+            return demux->buffer->eof ? FALSE : ROQ_NEED_DATA;
+
+        if(header->chunk_id != RoQ_SIGNATURE || header->offset != 0) {
+            roq_errno = ROQ_FILE_READ_FAILURE;
+            return FALSE;
+        }
+        roq->framerate = header->chunk_arg;
+        roq_demux_consume(demux);
+    }
+
+    roq_demux_parse(demux);
+    for(i = 0; i < demux->queue_count; i++) {
+        header = &demux->queue[(demux->queue_head + i) % ROQ_PACKET_QUEUE_SIZE];
+        if(header->chunk_id == RoQ_INFO)
+            return roq_init_info(roq, header);
+    }
+
+    if(demux->buffer->eof || demux->queue_count == ROQ_PACKET_QUEUE_SIZE) {
+        roq_errno = ROQ_FILE_READ_FAILURE;
+        return FALSE;
+    }
+
+    return ROQ_NEED_DATA;
+}
+
+static int roq_setup_frames(roq_t* roq) {
+    int block_size = 8 >> roq->scale_shift;
+    int subblock_size = 4 >> roq->scale_shift;
+    size_t frame_size;
+    int i;
+
+    roq->frame_width = roq->width >> roq->scale_shift;
+    roq->frame_height = roq->height >> roq->scale_shift;
+
+    roq->stride = 8;
+    while (roq->stride < roq->frame_width)
+        roq->stride <<= 1;
+
+    roq->texture_height = 8;
+    while (roq->texture_height < roq->frame_height)
+        roq->texture_height <<= 1;
+
+    for(i = 0; i < 4; i++) {
+        roq->block_offset_lut[i] = (i / 2 * block_size * roq->stride) + (i % 2 * block_size);
+    }
+
+    for(i = 0; i < 4; i++) {
+        roq->subblock_offset_lut[i] = (i / 2 * subblock_size * roq->stride) + (i % 2 * subblock_size);
+    }
+
+    for(i = 0; i < 4; i++) {
+        roq->unpack_4x4_lut[i] = (i / 2) * 8 + (i % 2) * 2;
+    }
+
+    for(i = 0; i < 16; i++) {
+        roq->upsample_offset_lut[i] = (i / 4 * 2 * roq->stride) + (i % 4 * 2);
+    }
+
+#ifdef ROQ_VQ_BATCHED
+    roq_setup_vq_states(roq);
+#endif
+
+    frame_size = roq->texture_height * roq->stride * sizeof(unsigned short);
+    roq->mot_frame = NULL;
+
+    // Recorded frames have the old size
+    roq_cache_free(roq);
+
+    if (roq->pool_size) {
+        // Start from two frames the consumer does not hold
+        if (frame_size > roq->pool_frame_size) {
+            roq_errno = ROQ_BAD_FRAME_POOL;
+            return FALSE;
+        }
+
+        if (!roq_pool_pick(roq)) {
+            roq_errno = ROQ_BAD_FRAME_POOL;
+            return FALSE;
+        }
+    }
+    else {
+        free(roq->frame[0]);
+        free(roq->frame[1]);
+
+#ifdef _arch_dreamcast
+        roq->frame[0] = memalign(32, frame_size);
+        roq->frame[1] = memalign(32, frame_size);
+#else
+        roq->frame[0] = malloc(frame_size);
+        roq->frame[1] = malloc(frame_size);
+#endif
+
+        if (!roq->frame[0] || !roq->frame[1]) {
+            roq_errno = ROQ_NO_MEMORY;
+            return FALSE;
+        }
+    }
+
+    memset(roq->frame[0], 0, frame_size);
+    memset(roq->frame[1], 0, frame_size);
+    roq->changes_pending = 2;
+
+    if (roq->track_changes && !roq->changed) {
+        roq->changed = malloc(roq->mb_count);
+        if (!roq->changed) {
+            roq_errno = ROQ_NO_MEMORY;
+            return FALSE;
+        }
+    }
+
+    // Blank frames are what a decoder without a region starts from too
+    if (!roq_setup_region(roq))
+        return FALSE;
+    if (roq->stale[0]) {
+        memset(roq->stale[0], FALSE, roq->mb_count);
+        memset(roq->stale[1], FALSE, roq->mb_count);
+    }
+
+    free(roq->tiles[0]);
+    free(roq->tiles[1]);
+    roq->tiles[0] = NULL;
+    roq->tiles[1] = NULL;
+
+    // The scaled decoders work on frame[] directly
+    if (roq->tiled && !roq->scale_shift) {
+        frame_size = roq->mb_count * 16 * 16 * sizeof(unsigned short);
+
+#ifdef _arch_dreamcast
+        roq->tiles[0] = memalign(32, frame_size);
+        roq->tiles[1] = memalign(32, frame_size);
+#else
+        roq->tiles[0] = malloc(frame_size);
+        roq->tiles[1] = malloc(frame_size);
+#endif
+
+        if (!roq->tiles[0] || !roq->tiles[1]) {
+            free(roq->tiles[0]);
+            free(roq->tiles[1]);
+            roq->tiles[0] = NULL;
+            roq->tiles[1] = NULL;
+            roq_errno = ROQ_NO_MEMORY;
+            return FALSE;
+        }
+
+        memset(roq->tiles[0], 0, frame_size);
+        memset(roq->tiles[1], 0, frame_size);
+    }
+
+    return TRUE;
+}
+
+// Flags the macroblocks within the margin of the decode region, and
+// sets up the stale flags, which start clear: the frames hold what
+// was decoded without the region so far
+static int roq_setup_region(roq_t* roq) {
+    int x0, y0, x1, y1, x, y;
+
+    if (!roq->region_width) {
+        free(roq->region);
+        free(roq->stale[0]);
+        free(roq->stale[1]);
+        free(roq->region_starts);
+        roq->region = NULL;
+        roq->stale[0] = NULL;
+        roq->stale[1] = NULL;
+        roq->region_starts = NULL;
+        return TRUE;
+    }
+
+    if (!roq->region) {
+        roq->region = malloc(roq->mb_count);
+        roq->stale[0] = calloc(roq->mb_count, 1);
+        roq->stale[1] = calloc(roq->mb_count, 1);
+        roq->region_starts = malloc(roq->mb_count * sizeof(roq_region_start_t));
+        if (!roq->region || !roq->stale[0] || !roq->stale[1] || !roq->region_starts) {
+            roq->region_width = 0;
+            roq_setup_region(roq);
+            roq_errno = ROQ_NO_MEMORY;
+            return FALSE;
+        }
+    }
+
+    x0 = (roq->region_x - roq->region_margin) >> 4;
+    y0 = (roq->region_y - roq->region_margin) >> 4;
+    x1 = (roq->region_x + roq->region_width + roq->region_margin - 1) >> 4;
+    y1 = (roq->region_y + roq->region_height + roq->region_margin - 1) >> 4;
+    for (y = 0; y < roq->mb_height; y++)
+        for (x = 0; x < roq->mb_width; x++)
+            roq->region[y * roq->mb_width + x] = x >= x0 && x <= x1 && y >= y0 && y <= y1;
+
+    return TRUE;
+}
+
+// Copies a linear frame into the tiled layout
+static void roq_tile_frame(roq_t* roq, unsigned short* tiles, unsigned short* frame) {
+    int mb_x, mb_y, y;
+
+    for (mb_y = 0; mb_y < roq->mb_height; mb_y++) {
+        for (mb_x = 0; mb_x < roq->mb_width; mb_x++) {
+            for (y = 0; y < 16; y++) {
+                memcpy(tiles + y * 16, frame + (mb_y * 16 + y) * roq->stride + mb_x * 16,
+                    16 * sizeof(unsigned short));
+            }
+            tiles += 16 * 16;
+        }
+    }
+}
+
+#ifdef ROQ_VQ_BATCHED
+// Fills the parser state table. Modes of 8x8 blocks move on to the next
+// block, except CCC, which moves on to its first subblock; the fourth
+// subblock moves on to the next block. Leaving the fourth block ends the
+// macroblock.
+static void roq_setup_vq_states(roq_t* roq) {
+    static const unsigned char block_ops[4] = { ROQ_VQ_MOT8, ROQ_VQ_FCC8, ROQ_VQ_SLD8, ROQ_VQ_NONE };
+    static const unsigned char block_bytes[4] = { 0, 1, 1, 0 };
+    static const unsigned char subblock_ops[4] = { ROQ_VQ_MOT4, ROQ_VQ_FCC4, ROQ_VQ_SLD4, ROQ_VQ_CCC4 };
+    static const unsigned char subblock_bytes[4] = { 0, 1, 1, 4 };
+    int state, block, subblock, mode, next;
+
+    for (state = 0; state < ROQ_VQ_STATES; state++) {
+        block = state / 5;
+        subblock = state % 5 - 1;
+
+        roq->vq_offset_lut[state] = roq->block_offset_lut[block];
+        if (subblock >= 0)
+            roq->vq_offset_lut[state] += roq->subblock_offset_lut[subblock];
+
+        for (mode = 0; mode < 4; mode++) {
+            if (subblock < 0 && mode == 3)
+                next = state + 1;
+            else if (subblock >= 0 && subblock < 3)
+                next = state + 1;
+            else
+                next = (block + 1) * 5;
+
+            roq->vq_state_lut[state][mode] = ROQ_VQ_ENTRY(
+                subblock < 0 ? block_ops[mode] : subblock_ops[mode],
+                subblock < 0 ? block_bytes[mode] : subblock_bytes[mode],
+                next == ROQ_VQ_STATES, next % ROQ_VQ_STATES);
+        }
+    }
+}
+#endif
+
+static roq_pool_frame_t* roq_pool_find(roq_t* roq, unsigned short* frame) {
+    int i;
+
+    for (i = 0; i < roq->pool_size; i++) {
+        if (roq->pool[i].data == frame)
+            return &roq->pool[i];
+    }
+
+    return NULL;
+}
+
+// Points frame[] at two pool frames the consumer does not hold, for a
+// picture that is written from scratch. Returns FALSE if there are none.
+static int roq_pool_pick(roq_t* roq) {
+    unsigned short* frames[2] = { NULL, NULL };
+    int i;
+
+    for (i = 0; i < roq->pool_size && !frames[1]; i++) {
+        if (roq->pool[i].refs)
+            continue;
+        if (!frames[0])
+            frames[0] = roq->pool[i].data;
+        else
+            frames[1] = roq->pool[i].data;
+    }
+
+    if (!frames[1])
+        return FALSE;
+
+    roq->frame[0] = frames[0];
+    roq->frame[1] = frames[1];
+    roq->mot_frame = NULL;
+    return TRUE;
+}
+
+// Makes frame[frame_index] a frame the next picture can be decoded into.
+// Without a pool, or when the consumer does not hold it, that is the
+// frame from two pictures ago, as always. Otherwise any pool frame that
+// is neither held nor a reference takes its place, and the one it
+// replaces is kept as mot_frame until the next picture has copied its
+// skipped blocks over. Returns FALSE when the consumer holds every
+// frame that could be used.
+static int roq_claim_frame(roq_t* roq) {
+    unsigned short* target = roq->frame[roq->frame_index];
+    roq_pool_frame_t* pool_frame;
+    int i;
+
+    if (!roq->pool_size)
+        return TRUE;
+
+    pool_frame = roq_pool_find(roq, target);
+    if (target != roq->frame[roq->frame_index ^ 1] && !pool_frame->refs)
+        return TRUE;
+
+    for (i = 0; i < roq->pool_size; i++) {
+        pool_frame = &roq->pool[i];
+        if (pool_frame->refs || pool_frame->data == roq->frame[0] ||
+            pool_frame->data == roq->frame[1] || pool_frame->data == roq->mot_frame)
+            continue;
+
+        if (!roq->mot_frame)
+            roq->mot_frame = target;
+        roq->frame[roq->frame_index] = pool_frame->data;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static roq_demux_t* roq_demux_create_with_buffer(roq_buffer_t* buffer) {
+    roq_demux_t* demux = (roq_demux_t*)malloc(sizeof(roq_demux_t));
+    if(!demux) {
+        roq_buffer_destroy(buffer);
+        roq_errno = ROQ_NO_MEMORY;
+        return NULL;
+    }
+
+    memset(demux, 0, sizeof(roq_demux_t));
+    demux->buffer = buffer;
+
+    return demux;
+}
+
+static roq_buffer_t* roq_buffer_create_with_file(FILE* fh, int close_when_done) {
+	roq_buffer_t* buffer = (roq_buffer_t*)malloc(sizeof(roq_buffer_t));
+    if(!buffer) {
+        roq_errno = ROQ_NO_MEMORY;
+        return NULL;
+    }
+	memset(buffer, 0, sizeof(roq_buffer_t));
+	buffer->capacity = ROQ_DEMUX_BUFFER_SIZE;
+#ifdef _arch_dreamcast
+	buffer->bytes = (unsigned char*)memalign(32, buffer->capacity);
+#else
+	buffer->bytes = (unsigned char*)malloc(buffer->capacity);
+#endif
+    if(!buffer->bytes) {
+        free(buffer);
+        roq_errno = ROQ_NO_MEMORY;
+        return NULL;
+    }
+	buffer->fh = fh;
+	buffer->close_when_done = close_when_done;
+    buffer->free_when_done = TRUE;
+    buffer->offset = ftell(fh);
+	buffer->mode = ROQ_BUFFER_MODE_FILE;
+	return buffer;
+}
+
+static roq_buffer_t* roq_buffer_create_with_memory(unsigned char* bytes, size_t capacity, int free_when_done) {
+	roq_buffer_t* buffer;
+
+    if(capacity >= ROQ_PACK_HEADER_SIZE && !memcmp(bytes, ROQ_PACK_MAGIC, 4))
+        return roq_buffer_create_with_packed(bytes, capacity, free_when_done);
+
+    buffer = (roq_buffer_t*)malloc(sizeof(roq_buffer_t));
+    if(!buffer) {
+        roq_errno = ROQ_NO_MEMORY;
+        return NULL;
+    }
+	memset(buffer, 0, sizeof(roq_buffer_t));
+    buffer->bytes = bytes;
+	buffer->capacity = capacity;
+	buffer->start_index = 0;
+    buffer->end_index = capacity;
+	buffer->free_when_done = free_when_done;
+	buffer->mode = ROQ_BUFFER_MODE_FIXED_MEM;
+	return buffer;
+}
+
+static roq_buffer_t* roq_buffer_create_with_push(size_t capacity) {
+	roq_buffer_t* buffer;
+
+    if(capacity == 0)
+        capacity = ROQ_DEMUX_BUFFER_SIZE;
+
+    // Must hold the largest chunk
+    if(capacity < CHUNK_HEADER_SIZE + ROQ_BUFFER_DEFAULT_SIZE) {
+        roq_errno = ROQ_CHUNK_TOO_LARGE;
+        return NULL;
+    }
+
+	buffer = (roq_buffer_t*)malloc(sizeof(roq_buffer_t));
+    if(!buffer) {
+        roq_errno = ROQ_NO_MEMORY;
+        return NULL;
+    }
+	memset(buffer, 0, sizeof(roq_buffer_t));
+	buffer->capacity = capacity;
+	buffer->bytes = (unsigned char*)malloc(buffer->capacity);
+    if(!buffer->bytes) {
+        free(buffer);
+        roq_errno = ROQ_NO_MEMORY;
+        return NULL;
+    }
+    buffer->free_when_done = TRUE;
+	buffer->mode = ROQ_BUFFER_MODE_PUSH;
+	return buffer;
+}
+
+// Checks the header and block table of a packed file. The window
+// starts out holding the largest chunk the decoder used to allow and
+// two blocks, and grows like the others.
+static roq_buffer_t* roq_buffer_create_with_packed(unsigned char* packed, size_t length, int free_when_done) {
+    roq_buffer_t* buffer;
+    unsigned int block_size, block_count, i;
+    unsigned long start, end;
+
+    block_size = LE_32(&packed[8]);
+    block_count = LE_32(&packed[16]);
+    if(LE_16(&packed[4]) != ROQ_PACK_VERSION || block_size == 0 || block_size > ROQ_MAX_CHUNK_SIZE ||
+       (size_t)block_count + 1 > (length - ROQ_PACK_HEADER_SIZE) / 4 ||
+       LE_32(&packed[12]) > (unsigned long)block_count * block_size ||
+       LE_32(&packed[12]) + block_size <= (unsigned long)block_count * block_size) {
+        roq_errno = ROQ_FILE_READ_FAILURE;
+        return NULL;
+    }
+
+    for(i = 0; i < block_count; i++) {
+        start = LE_32(&packed[ROQ_PACK_HEADER_SIZE + i * 4]);
+        end = LE_32(&packed[ROQ_PACK_HEADER_SIZE + i * 4 + 4]);
+        if(start > end || end > length) {
+            roq_errno = ROQ_FILE_READ_FAILURE;
+            return NULL;
+        }
+    }
+
+    buffer = (roq_buffer_t*)malloc(sizeof(roq_buffer_t));
+    if(!buffer) {
+        roq_errno = ROQ_NO_MEMORY;
+        return NULL;
+    }
+    memset(buffer, 0, sizeof(roq_buffer_t));
+    buffer->capacity = ROQ_BUFFER_DEFAULT_SIZE + 2 * block_size;
+#ifdef _arch_dreamcast
+    buffer->bytes = (unsigned char*)memalign(32, buffer->capacity);
+#else
+    buffer->bytes = (unsigned char*)malloc(buffer->capacity);
+#endif
+    if(!buffer->bytes) {
+        free(buffer);
+        roq_errno = ROQ_NO_MEMORY;
+        return NULL;
+    }
+    buffer->free_when_done = TRUE;
+    buffer->packed = packed;
+    buffer->free_packed_when_done = free_when_done;
+    buffer->length = LE_32(&packed[12]);
+    buffer->block_size = block_size;
+    buffer->block_count = block_count;
+    buffer->mode = ROQ_BUFFER_MODE_PACKED;
+    return buffer;
+}
+
+// Moves the unparsed bytes to the front of the window and tops it up
+// with a single read, or with as many blocks as fit for a packed file.
+// Returns the number of bytes added.
+static int roq_buffer_fill(roq_buffer_t* buffer) {
+    size_t remaining, wanted, count;
+
+    if((buffer->mode != ROQ_BUFFER_MODE_FILE && buffer->mode != ROQ_BUFFER_MODE_PACKED) || buffer->eof)
+        return 0;
+
+    if(buffer->wanted > buffer->capacity && !roq_buffer_grow(buffer))
+        return 0;
+
+    remaining = buffer->end_index - buffer->start_index;
+    if(buffer->start_index > 0) {
+        memmove(buffer->bytes, buffer->bytes + buffer->start_index, remaining);
+        buffer->offset += buffer->start_index;
+        buffer->start_index = 0;
+        buffer->end_index = remaining;
+    }
+
+    if(buffer->mode == ROQ_BUFFER_MODE_PACKED)
+        return roq_buffer_unpack(buffer);
+
+    wanted = buffer->capacity - buffer->end_index;
+    if(buffer->group_sectors) {
+        count = roq_buffer_layout_read_size(buffer);
+        if(count)
+            wanted = count;
+    }
+
+    ROQ_TRACE_BEGIN("read");
+    count = fread(buffer->bytes + buffer->end_index, 1, wanted, buffer->fh);
+    ROQ_TRACE_END("read");
+    if(count < wanted)
+        buffer->eof = TRUE;
+
+    buffer->end_index += count;
+
+    return count;
+}
+
+// Swaps the window for one twice the size of a chunk that does not fit
+// in it, keeping the unparsed bytes; it stays that large. Queued
+// packets point into the old window, so this only runs with none.
+static int roq_buffer_grow(roq_buffer_t* buffer) {
+    size_t remaining = buffer->end_index - buffer->start_index;
+    size_t capacity = buffer->wanted * 2;
+    unsigned char* bytes;
+
+#ifdef _arch_dreamcast
+    bytes = (unsigned char*)memalign(32, capacity);
+#else
+    bytes = (unsigned char*)malloc(capacity);
+#endif
+    if(!bytes) {
+        roq_errno = ROQ_NO_MEMORY;
+        return FALSE;
+    }
+
+    memcpy(bytes, buffer->bytes + buffer->start_index, remaining);
+    free(buffer->bytes);
+    buffer->bytes = bytes;
+    buffer->capacity = capacity;
+    buffer->offset += buffer->start_index;
+    buffer->start_index = 0;
+    buffer->end_index = remaining;
+
+    return TRUE;
+}
+
+// Decompresses the blocks that fit after the end of the window, at
+// least one; a window too full for that grows. Returns the number of
+// bytes added.
+static int roq_buffer_unpack(roq_buffer_t* buffer) {
+    unsigned char* block;
+    size_t count = 0;
+    size_t size, packed_size;
+
+    if(buffer->next_block < buffer->block_count && buffer->capacity - buffer->end_index < buffer->block_size) {
+        buffer->wanted = buffer->end_index + buffer->block_size;
+        if(!roq_buffer_grow(buffer))
+            return 0;
+    }
+
+    ROQ_TRACE_BEGIN("unpack");
+    while(buffer->next_block < buffer->block_count) {
+        size = buffer->length - (size_t)buffer->next_block * buffer->block_size;
+        if(size > buffer->block_size)
+            size = buffer->block_size;
+        if(size > buffer->capacity - buffer->end_index)
+            break;
+
+        // A block that did not get smaller is stored as it is
+        block = buffer->packed + LE_32(&buffer->packed[ROQ_PACK_HEADER_SIZE + buffer->next_block * 4]);
+        packed_size = LE_32(&buffer->packed[ROQ_PACK_HEADER_SIZE + buffer->next_block * 4 + 4]) -
+                      LE_32(&buffer->packed[ROQ_PACK_HEADER_SIZE + buffer->next_block * 4]);
+        if(packed_size == size)
+            memcpy(buffer->bytes + buffer->end_index, block, size);
+        else if(!roq_lz4_decompress(block, packed_size, buffer->bytes + buffer->end_index, size)) {
+            roq_errno = ROQ_FILE_READ_FAILURE;
+            buffer->next_block = buffer->block_count;
+            break;
+        }
+
+        buffer->end_index += size;
+        buffer->next_block++;
+        count += size;
+    }
+    ROQ_TRACE_END("unpack");
+
+    if(buffer->next_block == buffer->block_count)
+        buffer->eof = TRUE;
+
+    return count;
+}
+
+// Decodes an LZ4 block (the raw block format, without frame headers)
+// that holds exactly dst_size bytes. Returns FALSE on a block that is
+// broken or of another size.
+static int roq_lz4_decompress(const unsigned char* src, size_t src_size, unsigned char* dst, size_t dst_size) {
+    const unsigned char* src_end = src + src_size;
+    unsigned char* out = dst;
+    unsigned char* out_end = dst + dst_size;
+    const unsigned char* match;
+    size_t length, offset;
+    unsigned int token;
+
+    while(src < src_end) {
+        token = *src++;
+
+        length = token >> 4;
+        if(length == 15) {
+            do {
+                if(src == src_end)
+                    return FALSE;
+                length += *src;
+            } while(*src++ == 255);
+        }
+        if(length > (size_t)(src_end - src) || length > (size_t)(out_end - out))
+            return FALSE;
+        memcpy(out, src, length);
+        out += length;
+        src += length;
+
+        // The last sequence is literals only
+        if(src == src_end)
+            break;
+
+        if(src_end - src < 2)
+            return FALSE;
+        offset = src[0] | (src[1] << 8);
+        src += 2;
+        if(offset == 0 || offset > (size_t)(out - dst))
+            return FALSE;
+
+        length = token & 15;
+        if(length == 15) {
+            do {
+                if(src == src_end)
+                    return FALSE;
+                length += *src;
+            } while(*src++ == 255);
+        }
+        length += 4;
+        if(length > (size_t)(out_end - out))
+            return FALSE;
+
+        // A match may overlap what it writes, repeating a short run
+        match = out - offset;
+        if(offset >= length) {
+            memcpy(out, match, length);
+            out += length;
+        }
+        else {
+            while(length--)
+                *out++ = *match++;
+        }
+    }
+
+    return out == out_end;
+}
+
+// Fast path for roq-repack files: read up to the next frame group
+// boundary and then as many whole groups as fit in the window, so every
+// read covers whole sectors and ends on a chunk boundary. Returns 0 to
+// fall back to a plain read.
+static size_t roq_buffer_layout_read_size(roq_buffer_t* buffer) {
+    long position = buffer->offset + buffer->end_index;
+    size_t room = buffer->capacity - buffer->end_index;
+    size_t group_size, count;
+
+    // Find the next group after a seek or an unaligned read
+    if(position != buffer->next_group_offset) {
+        buffer->next_group = 0;
+        buffer->next_group_offset = buffer->first_group_offset;
+        while(buffer->next_group < buffer->group_count && buffer->next_group_offset < position) {
+            buffer->next_group_offset += (long)buffer->group_sectors[buffer->next_group] * buffer->sector_size;
+            buffer->next_group++;
+        }
+
+        if(buffer->next_group_offset < position)
+            return 0;
+    }
+
+    count = buffer->next_group_offset - position;
+    if(count > room)
+        return 0;
+
+    while(buffer->next_group < buffer->group_count) {
+        group_size = (size_t)buffer->group_sectors[buffer->next_group] * buffer->sector_size;
+        if(count + group_size > room)
+            break;
+        count += group_size;
+        buffer->next_group_offset += group_size;
+        buffer->next_group++;
+    }
+
+    return count;
+}
+
+// Loads the group index of a roq-repack file from an RoQ_INFO payload.
+// Anything else, or a memory source, leaves the buffer untouched.
+static void roq_buffer_set_layout(roq_buffer_t* buffer, unsigned char* index, size_t size) {
+    unsigned int i, count;
+
+    if(buffer->mode != ROQ_BUFFER_MODE_FILE || buffer->group_sectors)
+        return;
+
+    if(size < ROQ_REPACK_INDEX_HEADER_SIZE || memcmp(index, ROQ_REPACK_MAGIC, 4) ||
+       LE_16(&index[4]) != ROQ_REPACK_VERSION)
+        return;
+
+    count = LE_32(&index[8]);
+    if(count == 0 || count > (size - ROQ_REPACK_INDEX_HEADER_SIZE) / 2)
+        return;
+
+    buffer->group_sectors = (unsigned short*)malloc(count * sizeof(unsigned short));
+    if(!buffer->group_sectors)
+        return;
+
+    for(i = 0; i < count; i++)
+        buffer->group_sectors[i] = LE_16(&index[ROQ_REPACK_INDEX_HEADER_SIZE + i * 2]);
+
+    buffer->group_count = count;
+    buffer->sector_size = LE_16(&index[6]);
+    buffer->first_group_offset = LE_32(&index[12]);
+    buffer->next_group = 0;
+    buffer->next_group_offset = buffer->first_group_offset;
+}
+
+static void roq_buffer_set_offset(roq_buffer_t* buffer, long offset) {
+    if(buffer->mode == ROQ_BUFFER_MODE_FILE) {
+        // Stay inside the window if we can
+        if(offset >= buffer->offset && offset <= buffer->offset + (long)buffer->end_index) {
+            buffer->start_index = offset - buffer->offset;
+            return;
+        }
+
+        fseek(buffer->fh, offset, SEEK_SET);
+        buffer->offset = offset;
+        buffer->start_index = 0;
+        buffer->end_index = 0;
+        buffer->eof = FALSE;
+    }
+    else if(buffer->mode == ROQ_BUFFER_MODE_PUSH) {
+        // Data that has been released can not be read again
+        if(offset >= buffer->offset && offset <= buffer->offset + (long)buffer->end_index)
+            buffer->start_index = offset - buffer->offset;
+    }
+    else if(buffer->mode == ROQ_BUFFER_MODE_PACKED) {
+        if(offset >= buffer->offset && offset <= buffer->offset + (long)buffer->end_index) {
+            buffer->start_index = offset - buffer->offset;
+            return;
+        }
+
+        // Start over from the block that holds it
+        buffer->next_block = offset / buffer->block_size;
+        if(buffer->next_block > buffer->block_count)
+            buffer->next_block = buffer->block_count;
+        buffer->offset = (long)buffer->next_block * buffer->block_size;
+        buffer->start_index = 0;
+        buffer->end_index = 0;
+        buffer->eof = FALSE;
+        roq_buffer_unpack(buffer);
+
+        buffer->start_index = offset - buffer->offset;
+        if(buffer->start_index > buffer->end_index)
+            buffer->start_index = buffer->end_index;
+    }
+    else {
+        buffer->start_index = offset;
+    }
+}
+
+static void roq_buffer_destroy(roq_buffer_t* buffer) {
+    if(buffer == NULL) {
+        return;
+    }
+
+	if (buffer->fh && buffer->close_when_done) {
+		fclose(buffer->fh);
+	}
+
+	if (buffer->free_when_done) {
+		free(buffer->bytes);
+	}
+
+    if (buffer->free_packed_when_done) {
+        free(buffer->packed);
+    }
+
+    free(buffer->group_sectors);
+
+	free(buffer);
+    buffer = NULL;
+}
+
+// Queues every complete chunk in the buffer window. Returns FALSE if a
+// chunk is larger than ROQ_MAX_CHUNK_SIZE.
+static int roq_demux_parse(roq_demux_t* demux) {
+    roq_buffer_t* buffer = demux->buffer;
+    roq_packet_t* packet;
+    unsigned char* read_buffer;
+    size_t remaining, chunk_size;
+
+    while(demux->queue_count < ROQ_PACKET_QUEUE_SIZE) {
+        remaining = buffer->end_index - buffer->start_index;
+        if(remaining < CHUNK_HEADER_SIZE)
+            break;
+
+        read_buffer = buffer->bytes + buffer->start_index;
+        chunk_size = LE_32(&read_buffer[2]);
+
+        // The signature chunk has no payload, its size field is 0xFFFFFFFF
+        if(LE_16(&read_buffer[0]) == RoQ_SIGNATURE)
+            chunk_size = 0;
+
+        // Check if size is too large
+        if(chunk_size > ROQ_MAX_CHUNK_SIZE) {
+            roq_errno = ROQ_CHUNK_TOO_LARGE;
+            return FALSE;
+        }
+
+        if(remaining < CHUNK_HEADER_SIZE + chunk_size) {
+            // The next fill or push makes room for it
+            if(CHUNK_HEADER_SIZE + chunk_size > buffer->capacity)
+                buffer->wanted = CHUNK_HEADER_SIZE + chunk_size;
+            break;
+        }
+
+        packet = &demux->queue[(demux->queue_head + demux->queue_count) % ROQ_PACKET_QUEUE_SIZE];
+        packet->chunk_id = LE_16(&read_buffer[0]);
+        packet->chunk_size = chunk_size;
+        packet->chunk_arg = LE_16(&read_buffer[6]);
+        packet->offset = buffer->offset + buffer->start_index;
+        packet->data = read_buffer + CHUNK_HEADER_SIZE;
+
+        // A roq-repack index switches reads to whole frame groups
+        if(packet->chunk_id == RoQ_INFO && !buffer->group_sectors)
+            roq_buffer_set_layout(buffer, packet->data, chunk_size);
+
+        buffer->start_index += CHUNK_HEADER_SIZE + chunk_size;
+        demux->queue_count++;
+    }
+
+    return TRUE;
+}
+
+// Points packet at the head of the queue without removing it. More of
+// the source is only read once the queue has been drained, so queued
+// payloads never move.
+static int roq_demux_peek(roq_demux_t* demux, roq_packet_t** packet) {
+    if(!demux->queue_count) {
+        demux->queue_head = 0;
+
+        for(;;) {
+            if(!roq_demux_parse(demux))
+                return FALSE;
+
+            if(demux->queue_count)
+                break;
+
+            if(!roq_buffer_fill(demux->buffer))
+                return FALSE;
+        }
+    }
+
+    *packet = &demux->queue[demux->queue_head];
+
+    return TRUE;
+}
+
+static void roq_demux_consume(roq_demux_t* demux) {
+    demux->queue_head = (demux->queue_head + 1) % ROQ_PACKET_QUEUE_SIZE;
+    demux->queue_count--;
+}
+
+// Appends pushed bytes to the window, first releasing everything in
+// front of the oldest queued packet. Queued payloads move with the data.
+// Returns how many bytes fitted.
+static size_t roq_demux_push(roq_demux_t* demux, const unsigned char* bytes, size_t length) {
+    roq_buffer_t* buffer = demux->buffer;
+    size_t keep_from, room;
+    int i;
+
+    if(buffer->eof)
+        return 0;
+
+    // Too large a chunk waits for the queue to drain, then gets room
+    if(buffer->wanted > buffer->capacity && !demux->queue_count && !roq_buffer_grow(buffer))
+        return 0;
+
+    if(buffer->capacity - buffer->end_index < length) {
+        if(demux->queue_count)
+            keep_from = demux->queue[demux->queue_head].data - CHUNK_HEADER_SIZE - buffer->bytes;
+        else
+            keep_from = buffer->start_index;
+
+        if(keep_from > 0) {
+            memmove(buffer->bytes, buffer->bytes + keep_from, buffer->end_index - keep_from);
+            for(i = 0; i < demux->queue_count; i++)
+                demux->queue[(demux->queue_head + i) % ROQ_PACKET_QUEUE_SIZE].data -= keep_from;
+            buffer->offset += keep_from;
+            buffer->start_index -= keep_from;
+            buffer->end_index -= keep_from;
+        }
+    }
+
+    room = buffer->capacity - buffer->end_index;
+    if(length > room)
+        length = room;
+
+    memcpy(buffer->bytes + buffer->end_index, bytes, length);
+    buffer->end_index += length;
+
+    return length;
+}
+
+// Decodes a keyframe into the next frame buffer and copies it to the
+// other one, so skip blocks and motion vectors that follow see the
+// keyframe no matter which buffer they read. Pool frames are not copied:
+// both references just point at the keyframe.
+static unsigned short* roq_unpack_jpeg(roq_t* roq, unsigned char* buf, int size) {
+    unsigned short* this_frame = roq->frame[roq->frame_index ? 1 : 0];
+    unsigned short* last_frame = roq->frame[roq->frame_index ? 0 : 1];
+    size_t frame_size = roq->frame_height * roq->stride * sizeof(unsigned short);
+
+    // Whatever the keyframe does not cover keeps the old picture
+    if(roq->mot_frame) {
+        memcpy(this_frame, roq->mot_frame, frame_size);
+        roq->mot_frame = NULL;
+    }
+
+    if(!roq_jpeg_decode(&roq->jpeg, buf, size, this_frame,
+        roq->frame_width, roq->frame_height, roq->stride, roq->scale_shift))
+        return NULL;
+
+    roq->frame_index ^= 1;
+    if(roq->pool_size)
+        roq->frame[roq->frame_index] = this_frame;
+    else
+        memcpy(last_frame, this_frame, frame_size);
+
+    if(roq->tiles[0]) {
+        roq_tile_frame(roq, roq->tiles[0], this_frame);
+        memcpy(roq->tiles[1], roq->tiles[0], roq->mb_count * 16 * 16 * sizeof(unsigned short));
+    }
+
+    return this_frame;
+}
+
+// DPCM decodes an audio chunk. The output goes into the regions the
+// audio buffer callback hands out, or into pcm_sample when there is no
+// callback or it has no room; every filled region is passed to the
+// audio decode callback.
+static void roq_decode_audio(roq_t* roq, roq_packet_t* packet) {
+    unsigned char* in = packet->data;
+    unsigned char* out;
+    int channels = packet->chunk_id == RoQ_SOUND_STEREO ? 2 : 1;
+    int frame_bytes = 2 * channels;
+    int remaining = packet->chunk_size * 2;
+    int snd_left, snd_right, granted, i;
+
+    if(channels == 2) {
+        snd_left = (packet->chunk_arg & 0xFF00);
+        snd_right = (packet->chunk_arg & 0xFF) << 8;
+    }
+    else {
+        snd_left = packet->chunk_arg;
+        snd_right = 0;
+    }
+    roq->channels = channels;
+
+    // An odd byte at the end of a stereo chunk has no partner
+    remaining -= remaining % frame_bytes;
+
+    while(remaining > 0) {
+        out = NULL;
+        granted = 0;
+        if(roq->audio_buffer_callback)
+            out = roq->audio_buffer_callback(remaining, channels, &granted, roq->user_data);
+        granted -= granted % frame_bytes;
+        if(!out || granted <= 0) {
+            out = roq->pcm_sample;
+            granted = sizeof(roq->pcm_sample) - sizeof(roq->pcm_sample) % frame_bytes;
+        }
+        if(granted > remaining)
+            granted = remaining;
+
+        ROQ_TRACE_BEGIN("audio");
+        if(channels == 2) {
+            for(i = 0; i < granted; i += 4, in += 2) {
+                snd_left  += roq->snd_sqr_array[in[0]];
+                snd_right += roq->snd_sqr_array[in[1]];
+                out[i] = snd_left & 0xff;
+                out[i + 1] = (snd_left & 0xff00) >> 8;
+                out[i + 2] = snd_right & 0xff;
+                out[i + 3] = (snd_right & 0xff00) >> 8;
+            }
+        }
+        else {
+            for(i = 0; i < granted; i += 2, in++) {
+                snd_left += roq->snd_sqr_array[*in];
+                out[i] = snd_left & 0xff;
+                out[i + 1] = (snd_left & 0xff00) >> 8;
+            }
+        }
+        ROQ_TRACE_END("audio");
+
+        roq->pcm_samples = granted;
+        remaining -= granted;
+
+        ROQ_TRACE_BEGIN("audio callback");
+        roq->audio_decode_callback(out, granted, channels, roq->user_data);
+        ROQ_TRACE_END("audio callback");
+    }
+}
+
+static int roq_unpack_quad_codebook(roq_t* roq, unsigned char *buf, int size, int arg) {
+    int y[4];
+    int yp, u, v;
+    int r, g, b;
+    int count2x2;
+    int count4x4;
+    int i, j;
+    unsigned short *v2x2;
+    unsigned short *v4x4;
+
+    count2x2 = (arg >> 8) & 0xFF;
+    count4x4 =  arg       & 0xFF;
+
+    if (!count2x2)
+        count2x2 = ROQ_CODEBOOK_SIZE;
+    /* 0x00 means 256 4x4 vectors if there is enough space in the chunk
+     * after accounting for the 2x2 vectors */
+    if (!count4x4 && count2x2 * 6 < size)
+        count4x4 = ROQ_CODEBOOK_SIZE;
+
+    /* unpack the 2x2 vectors */
+    for (i = 0; i < count2x2; i++) {
+        /* unpack the YUV components from the bytestream */
+        y[0] = *buf++;
+        y[1] = *buf++;
+        y[2] = *buf++;
+        y[3] = *buf++;
+        u  = *buf++;
+        v  = *buf++;
+        
+        /* convert to RGB565 */
+        for (j = 0; j < 4; j++) {
+            yp = roq->yy_lut[y[j]];
+            r = yp + roq->cr_r_lut[v];
+            g = yp + roq->cr_g_lut[v] + roq->cb_g_lut[u];  
+            b = yp + roq->cb_b_lut[u]; 
+
+            r = (r < 0) ? 0 : ((r > 255) ? 255 : r);
+            g = (g < 0) ? 0 : ((g > 255) ? 255 : g);
+            b = (b < 0) ? 0 : ((b > 255) ? 255 : b);
+
+            roq->cb2x2_rgb565[i][j] = ((unsigned short)r & 0xf8) << 8 | 
+                                      ((unsigned short)g & 0xfc) << 3 | 
+                                      ((unsigned short)b & 0xf8) >> 3;
+        }
+    }
+
+    /* unpack the 4x4 vectors */
+    for (i = 0; i < count4x4; i++) {
+        for (j = 0; j < 4; j++) {
+            v2x2 = roq->cb2x2_rgb565[*buf++];
+            v4x4 = roq->cb4x4_rgb565[i] + roq->unpack_4x4_lut[j];
+            v4x4[0] = v2x2[0];
+            v4x4[1] = v2x2[1];
+            v4x4[4] = v2x2[2];
+            v4x4[5] = v2x2[3];
+        }
+    }
+
+    if (roq->scale_shift)
+        roq_downsample_codebook(roq);
+
+    return TRUE;
+}
+
+/* average of four RGB565 pixels, per component */
+static unsigned short roq_average_rgb565(unsigned short a, unsigned short b,
+                                         unsigned short c, unsigned short d) {
+    int r = ((a >> 11) + (b >> 11) + (c >> 11) + (d >> 11) + 2) >> 2;
+    int g = (((a >> 5) & 0x3F) + ((b >> 5) & 0x3F) +
+             ((c >> 5) & 0x3F) + ((d >> 5) & 0x3F) + 2) >> 2;
+    int bl = ((a & 0x1F) + (b & 0x1F) + (c & 0x1F) + (d & 0x1F) + 2) >> 2;
+
+    return (unsigned short)((r << 11) | (g << 5) | bl);
+}
+
+/* Builds the reduced codebooks once per codebook chunk: every 2x2
+ * vector as one pixel, every 4x4 vector as 2x2 and as one pixel. */
+static void roq_downsample_codebook(roq_t* roq) {
+    unsigned short *v;
+    int i, j;
+
+    for (i = 0; i < ROQ_CODEBOOK_SIZE; i++) {
+        v = roq->cb2x2_rgb565[i];
+        roq->cb2x2_avg[i] = roq_average_rgb565(v[0], v[1], v[2], v[3]);
+
+        v = roq->cb4x4_rgb565[i];
+        for (j = 0; j < 4; j++) {
+            unsigned short *p = v + roq->unpack_4x4_lut[j];
+            roq->cb4x4_half[i][j] = roq_average_rgb565(p[0], p[1], p[4], p[5]);
+        }
+        roq->cb4x4_avg[i] = roq_average_rgb565(roq->cb4x4_half[i][0], roq->cb4x4_half[i][1],
+                                               roq->cb4x4_half[i][2], roq->cb4x4_half[i][3]);
+    }
+}
+
+#define GET_BYTE(x) x = buf[index++];
+
+#define GET_MODE() \
+    if (!mode_count) { \
+        GET_BYTE(mode_lo); \
+        GET_BYTE(mode_hi); \
+        mode_set = (mode_hi << 8) | mode_lo; \
+        mode_count = 16; \
+    } \
+    mode_count -= 2; \
+    mode = (mode_set >> mode_count) & 0x03;
+
+/* Walks past the modes and arguments of a macroblock left out of the
+ * decode region, flagging it stale unless it is all skipped, and notes
+ * where the bitstream of one in the region starts for
+ * roq_region_track() */
+#define REGION_MACROBLOCK() \
+    if (!region[mb_y * roq->mb_width + mb_x]) { \
+        mb_modes = 0; \
+        for (block = 0; block < 4; block++) { \
+            GET_MODE(); \
+            mb_modes |= mode; \
+            if (mode != 3) { \
+                index += mode ? 1 : 0; \
+                continue; \
+            } \
+            for (subblock = 0; subblock < 4; subblock++) { \
+                GET_MODE(); \
+                index += mode == 3 ? 4 : mode ? 1 : 0; \
+            } \
+        } \
+        if (mb_modes) \
+            stale[mb_y * roq->mb_width + mb_x] = TRUE; \
+        continue; \
+    } \
+    region_start->mb = mb_y * roq->mb_width + mb_x; \
+    region_start->index = index; \
+    region_start->mode_set = mode_set; \
+    region_start->mode_count = mode_count; \
+    region_start++;
+
+// What a VQ frame takes from the pictures before it: a skipped (MOT)
+// block shows the picture from two frames back, a motion compensated
+// (FCC) one copies from the last. The modes are walked like
+// roq_unpack_vq() does; a frame too short for its blocks counts as
+// taking both, and as truncated. With changed, every macroblock with
+// a block that is not skipped is flagged there and the walk goes
+// through the whole frame.
+#define ROQ_REFS_MOT       1
+#define ROQ_REFS_FCC       2
+#define ROQ_REFS_TRUNCATED 4
+
+static int roq_vq_references(roq_t* roq, unsigned char* buf, int size, unsigned char* changed) {
+    int refs = 0;
+    int index = 0;
+    int mode_set = 0;
+    int mode, mode_lo, mode_hi;
+    int mode_count = 0;
+    int block, subblock;
+
+    for(block = 0; block < roq->mb_count * 4; block++) {
+        if(!mode_count && index + 2 > size)
+            return ROQ_REFS_MOT | ROQ_REFS_FCC | ROQ_REFS_TRUNCATED;
+        GET_MODE();
+        if(changed)
+            changed[block / 4] = (block % 4 && changed[block / 4]) || mode;
+        switch(mode) {
+            case 0:
+                refs |= ROQ_REFS_MOT;
+                break;
+            case 1:
+                refs |= ROQ_REFS_FCC;
+                index++;
+                break;
+            case 2:
+                index++;
+                break;
+            case 3:
+                for(subblock = 0; subblock < 4; subblock++) {
+                    if(!mode_count && index + 2 > size)
+                        return ROQ_REFS_MOT | ROQ_REFS_FCC | ROQ_REFS_TRUNCATED;
+                    GET_MODE();
+                    if(mode == 0)
+                        refs |= ROQ_REFS_MOT;
+                    else if(mode == 1)
+                        refs |= ROQ_REFS_FCC;
+                    index += mode == 3 ? 4 : mode ? 1 : 0;
+                }
+                break;
+        }
+        if(!changed && refs == (ROQ_REFS_MOT | ROQ_REFS_FCC))
+            break;
+    }
+
+    return index > size ? ROQ_REFS_MOT | ROQ_REFS_FCC | ROQ_REFS_TRUNCATED : refs;
+}
+
+// A frame with neither kind of block after a full codebook in its own
+// group is self-contained, and the decoding can start there when the
+// frame after it has no MOT blocks either; only those two need a look.
+static void roq_scan_vq(roq_t* roq, unsigned char* buf, int size) {
+    int refs = ROQ_REFS_MOT | ROQ_REFS_FCC;
+
+    if(roq->scan_full_codebook || roq->scan_candidate >= 0)
+        refs = roq_vq_references(roq, buf, size, NULL);
+
+    if(roq->scan_candidate >= 0 && !(refs & ROQ_REFS_MOT))
+        roq_scan_record(roq, roq->scan_candidate);
+
+    roq->scan_candidate = roq->scan_full_codebook && !refs ? roq->scan_position : -1;
+    roq->scan_full_codebook = FALSE;
+}
+
+// Flags the macroblocks of a decoded VQ frame that are not all skipped
+static void roq_track_vq(roq_t* roq, unsigned char* buf, int size) {
+    if(roq->changes_pending) {
+        memset(roq->changed, TRUE, roq->mb_count);
+        roq->changes_pending--;
+        return;
+    }
+
+    ROQ_TRACE_BEGIN("track changes");
+    if(roq_vq_references(roq, buf, size, roq->changed) & ROQ_REFS_TRUNCATED)
+        memset(roq->changed, TRUE, roq->mb_count);
+    ROQ_TRACE_END("track changes");
+}
+
+// Whether a motion compensated block of size video pixels from x, y
+// reads a stale macroblock. At a decode scale, a fraction of a pixel
+// left over blends in the next pixel too.
+static ROQ_INLINE int roq_region_source_stale(roq_t* roq, const unsigned char* stale, int x, int y, int size) {
+    int shift = roq->scale_shift;
+    int fraction = (1 << shift) - 1;
+    int mb_shift = 4 - shift;
+    int x0 = (x >> shift) >> mb_shift;
+    int y0 = (y >> shift) >> mb_shift;
+    int x1 = ((x >> shift) + (size >> shift) - 1 + ((x & fraction) != 0)) >> mb_shift;
+    int y1 = ((y >> shift) + (size >> shift) - 1 + ((y & fraction) != 0)) >> mb_shift;
+    int mb_x, mb_y;
+
+    x0 = x0 < 0 ? 0 : x0;
+    y0 = y0 < 0 ? 0 : y0;
+    x1 = x1 >= roq->mb_width ? roq->mb_width - 1 : x1;
+    y1 = y1 >= roq->mb_height ? roq->mb_height - 1 : y1;
+
+    for(mb_y = y0; mb_y <= y1; mb_y++)
+        for(mb_x = x0; mb_x <= x1; mb_x++)
+            if(stale[mb_y * roq->mb_width + mb_x])
+                return TRUE;
+
+    return FALSE;
+}
+
+// Works out which macroblocks of a VQ frame just decoded may not be
+// what decoding everything would have given. The decoder flagged the
+// ones it left out that are not all skipped; left out ones the decoder
+// would have copied from a replaced pool frame are stale too, and so
+// are the decoded ones with a block that skips to or moves from a stale
+// macroblock. Only the decoded ones are walked, from where the decoder
+// listed them.
+static void roq_region_track(roq_t* roq, unsigned char* buf, int size, unsigned int arg,
+                             unsigned char* this_stale, int replaced) {
+    unsigned char* last_stale = this_stale == roq->stale[0] ? roq->stale[1] : roq->stale[0];
+    roq_region_start_t* start = roq->region_starts;
+    int mx = (signed char)(arg >> 8);
+    int my = (signed char)arg;
+    int index;
+    int mode_set;
+    int mode, mode_lo, mode_hi;
+    int mode_count;
+    int n, mb, block, subblock, x, y;
+    int stale;
+    int truncated = FALSE;
+
+    if(replaced) {
+        for(mb = 0; mb < roq->mb_count; mb++)
+            this_stale[mb] = this_stale[mb] || !roq->region[mb];
+    }
+    // Nothing stale to take from, the usual case with a region that
+    // holds most of the picture
+    else if(!memchr(this_stale, TRUE, roq->mb_count) && !memchr(last_stale, TRUE, roq->mb_count))
+        return;
+
+    ROQ_TRACE_BEGIN("track region");
+
+    for(n = 0; n < roq->region_started && !truncated; n++, start++) {
+        mb = start->mb;
+        index = start->index;
+        mode_set = start->mode_set;
+        mode_count = start->mode_count;
+        stale = FALSE;
+        for(block = 0; block < 4 && !truncated; block++) {
+            truncated = !mode_count && index + 2 > size;
+            if(truncated)
+                break;
+            GET_MODE();
+            x = (mb % roq->mb_width) * 16 + (block & 1) * 8 + 8 - mx;
+            y = (mb / roq->mb_width) * 16 + (block >> 1) * 8 + 8 - my;
+            switch(mode) {
+                case 0:
+                    stale = stale || this_stale[mb];
+                    break;
+                case 1:
+                    stale = stale || (index < size && roq_region_source_stale(roq, last_stale,
+                        x - (buf[index] >> 4), y - (buf[index] & 0xF), 8));
+                    index++;
+                    break;
+                case 2:
+                    index++;
+                    break;
+                case 3:
+                    for(subblock = 0; subblock < 4 && !truncated; subblock++) {
+                        truncated = !mode_count && index + 2 > size;
+                        if(truncated)
+                            break;
+                        GET_MODE();
+                        if(mode == 0)
+                            stale = stale || this_stale[mb];
+                        else if(mode == 1)
+                            stale = stale || (index < size && roq_region_source_stale(roq, last_stale,
+                                x + (subblock & 1) * 4 - (buf[index] >> 4),
+                                y + (subblock >> 1) * 4 - (buf[index] & 0xF), 4));
+                        index += mode == 3 ? 4 : mode ? 1 : 0;
+                    }
+                    break;
+            }
+        }
+        truncated = truncated || index > size;
+        this_stale[mb] = stale;
+    }
+
+    // Too short for its blocks
+    if(truncated)
+        memset(this_stale, TRUE, roq->mb_count);
+    ROQ_TRACE_END("track region");
+}
+
+/* A skipped block keeps the picture of two frames ago, which is already
+ * in the frame unless a pool frame took its place; then it is copied
+ * from the frame that was replaced. */
+static ROQ_INLINE void roq_copy_block(unsigned short* this_frame, unsigned short* mot_frame,
+                                      int offset, int stride, int size) {
+    int i;
+
+    for (i = 0; i < size; i++, offset += stride)
+        memcpy(this_frame + offset, mot_frame + offset, size * sizeof(unsigned short));
+}
+
+/* Offsets of the 8x8 blocks in a macroblock, of the 4x4 blocks in a
+ * block and of the 2x2 pixel groups an upsampled block is written in.
+ * With a stride known at compile time they fold to constants; the
+ * generic instance reads the tables roq_setup_frames() fills. */
+#define ROQ_BLOCK_OFFSET(i) (fixed_stride ? \
+    ((i) / 2 * 8 * stride) + ((i) % 2 * 8) : roq->block_offset_lut[i])
+#define ROQ_SUBBLOCK_OFFSET(i) (fixed_stride ? \
+    ((i) / 2 * 4 * stride) + ((i) % 2 * 4) : roq->subblock_offset_lut[i])
+#define ROQ_UPSAMPLE_OFFSET(i) (fixed_stride ? \
+    ((i) / 4 * 2 * stride) + ((i) % 4 * 2) : roq->upsample_offset_lut[i])
+
+/* Instantiates a VQ decoder for the strides of 256, 512 and 1024 pixel
+ * wide videos, which is nearly all of them, and once for any other */
+#define ROQ_UNPACK_VQ_STRIDES(unpack, kernels) \
+    switch (roq->stride) { \
+    case 256:  return unpack(roq, buf, size, arg, kernels, 256); \
+    case 512:  return unpack(roq, buf, size, arg, kernels, 512); \
+    case 1024: return unpack(roq, buf, size, arg, kernels, 1024); \
+    default:   return unpack(roq, buf, size, arg, kernels, 0); \
+    }
+
+/* fixed_stride of the tiled decoder: a macroblock is 16 pixels wide */
+#define ROQ_TILED_STRIDE 16
+
+/* Copies a w x h part of a block between two tiled buffers */
+static ROQ_INLINE void roq_tiled_copy(unsigned short* dst, const unsigned short* src, int w, int h) {
+    int i;
+
+    for (; h > 0; h--, dst += ROQ_TILED_STRIDE, src += ROQ_TILED_STRIDE)
+        for (i = 0; i < w; i++)
+            dst[i] = src[i];
+}
+
+/* Finds the size x size block at pixel x, y of a tiled frame for
+ * motion compensation into dst. A block within one macroblock is
+ * returned to be copied by the kernels, with rows ROQ_TILED_STRIDE
+ * apart; one that straddles two or four is gathered into dst right
+ * away, a macroblock at a time, and NULL returned. The rare block that
+ * reaches out of the frame is gathered a pixel at a time, clamped. */
+static const unsigned short* roq_tiled_block(roq_t* roq, const unsigned short* tiles,
+                                             int x, int y, int size, unsigned short* dst) {
+    int width = roq->mb_width * 16;
+    int height = roq->mb_height * 16;
+    int left = 16 - (x & 15);
+    int top = 16 - (y & 15);
+    const unsigned short* src;
+    int row, i, py, px;
+
+    if (x >= 0 && y >= 0 && x + size <= width && y + size <= height) {
+        src = tiles + ((y >> 4) * roq->mb_width + (x >> 4)) * 256 + (y & 15) * 16 + (x & 15);
+        if (left >= size && top >= size)
+            return src;
+
+        if (left > size)
+            left = size;
+        if (top > size)
+            top = size;
+
+        roq_tiled_copy(dst, src, left, top);
+        if (left < size)
+            roq_tiled_copy(dst + left, src + 256 - (x & 15), size - left, top);
+        if (top < size) {
+            src += roq->mb_width * 256 - (y & 15) * 16;
+            roq_tiled_copy(dst + top * ROQ_TILED_STRIDE, src, left, size - top);
+            if (left < size)
+                roq_tiled_copy(dst + top * ROQ_TILED_STRIDE + left, src + 256 - (x & 15),
+                    size - left, size - top);
+        }
+        return NULL;
+    }
+
+    for (row = 0; row < size; row++, dst += ROQ_TILED_STRIDE) {
+        py = y + row < 0 ? 0 : y + row >= height ? height - 1 : y + row;
+        for (i = 0; i < size; i++) {
+            px = x + i < 0 ? 0 : x + i >= width ? width - 1 : x + i;
+            dst[i] = tiles[((py >> 4) * roq->mb_width + (px >> 4)) * 256 + (py & 15) * 16 + (px & 15)];
+        }
+    }
+
+    return NULL;
+}
+
+/* Copies a decoded macroblock out of the tiled frame */
+static ROQ_INLINE void roq_untile_macroblock(unsigned short* frame, const unsigned short* tile, int stride) {
+    int y;
+
+    for (y = 0; y < 16; y++, frame += stride, tile += 16)
+        memcpy(frame, tile, 16 * sizeof(unsigned short));
+}
+
+/* The VQ decoder at full resolution, with motion compensation and 2x2
+ * vectors done by one set of kernels from roq-blocks.h. kernels is a
+ * constant in each instance, and so is fixed_stride: the stride of the
+ * frames, 0 to use roq->stride, or ROQ_TILED_STRIDE to decode into
+ * tiles[] and copy each changed macroblock to frame[]. A skipped
+ * macroblock is left alone in both, as they hold the same picture,
+ * unless a pool frame replaced the frame; then all are copied. */
+static ROQ_INLINE unsigned short* roq_unpack_vq_kernels(roq_t* roq, unsigned char* buf, int size,
+                                                        unsigned int arg, int kernels, int fixed_stride) {
+    int mb_x, mb_y;
+    int block;     /* 8x8 blocks */
+    int subblock;  /* 4x4 blocks */
+    int stride = fixed_stride ? fixed_stride : roq->stride;
+    int tiled = fixed_stride == ROQ_TILED_STRIDE;
+    int i;
+
+    /* frame and pixel management */
+    unsigned short *this_frame;
+    unsigned short *last_frame;
+    unsigned short *out_frame;
+    unsigned short *mot_frame = tiled ? NULL : roq->mot_frame;
+    int untile_all = tiled && roq->mot_frame;
+    int mb_changed = FALSE;
+
+    /* decode region, see REGION_MACROBLOCK() */
+    const unsigned char *region = roq->region;
+    unsigned char *stale = roq->stale[roq->frame_index ? 1 : 0];
+    roq_region_start_t *region_start = roq->region_starts;
+    int mb_modes;
+
+    int line_offset;
+    int mb_offset;
+    int block_offset;
+    int subblock_offset;
+
+    unsigned short *this_ptr;
+    unsigned int *this_ptr32;
+    const unsigned short *last_ptr;
+    unsigned short *vector16, *vector16b, *vector16c;
+    unsigned int *vector32;
+    int stride32m2 = stride / 2 - 2;
+
+    /* bytestream management */
+    int index = 0;
+    int mode_set = 0;
+    int mode, mode_lo, mode_hi;
+    int mode_count = 0;
+
+    /* vectors */
+    int mx, my;
+    int motion_x, motion_y;
+    unsigned char data_byte;
+
+    mx = (signed char)(arg >> 8);
+    my = (signed char)arg;
+
+    out_frame = roq->frame[roq->frame_index ? 1 : 0];
+    if (roq->frame_index) {
+        roq->frame_index = 0;
+        this_frame = tiled ? roq->tiles[1] : (unsigned short*)roq->frame[1];
+        last_frame = tiled ? roq->tiles[0] : (unsigned short*)roq->frame[0];
+    }
+    else {
+        roq->frame_index = 1;
+        this_frame = tiled ? roq->tiles[0] : (unsigned short*)roq->frame[0];
+        last_frame = tiled ? roq->tiles[1] : (unsigned short*)roq->frame[1];
+    }
+    roq->mot_frame = NULL;
+
+    for (mb_y = 0; mb_y < roq->mb_height; mb_y++) {
+        line_offset = mb_y * 16 * (tiled ? roq->mb_width * 16 : stride);
+        for (mb_x = 0; mb_x < roq->mb_width; mb_x++) {
+            if (region) {
+                REGION_MACROBLOCK();
+            }
+            mb_offset = line_offset + mb_x * (tiled ? 16 * 16 : 16);
+            for (block = 0; block < 4; block++) {
+                block_offset = mb_offset + ROQ_BLOCK_OFFSET(block);
+                /* each 8x8 block gets a mode */
+                GET_MODE();
+                if (tiled && mode)
+                    mb_changed = TRUE;
+                switch (mode) {
+                case 0:  /* MOT: skip */
+                    if (mot_frame)
+                        roq_copy_block(this_frame, mot_frame, block_offset, stride, 8);
+                    break;
+
+                case 1:  /* FCC: motion compensation */
+                    GET_BYTE(data_byte);
+                    motion_x = 8 - (data_byte >>  4) - mx;
+                    motion_y = 8 - (data_byte & 0xF) - my;
+                    if (tiled)
+                        last_ptr = roq_tiled_block(roq, last_frame, mb_x * 16 + (block & 1) * 8 + motion_x,
+                            mb_y * 16 + (block >> 1) * 8 + motion_y, 8, this_frame + block_offset);
+                    else
+                        last_ptr = last_frame + block_offset +
+                            (motion_y * stride) + motion_x;
+                    if (last_ptr)
+                        roq_mc8(kernels, this_frame + block_offset, last_ptr, stride);
+                    break;
+
+                case 2:  /* SLD: upsample 4x4 vector */
+                    GET_BYTE(data_byte);
+                    vector16 = roq->cb4x4_rgb565[data_byte];
+                    for (i = 0; i < 4*4; i++) {
+                        this_ptr = this_frame + block_offset +
+                            ROQ_UPSAMPLE_OFFSET(i);
+                        this_ptr[0] = *vector16;
+                        this_ptr[1] = *vector16;
+                        this_ptr[stride+0] = *vector16;
+                        this_ptr[stride+1] = *vector16;
+                        vector16++;
+                    }
+                    break;
+
+                case 3:  /* CCC: subdivide into 4 subblocks */
+                    for (subblock = 0; subblock < 4; subblock++) {
+                        subblock_offset = block_offset + ROQ_SUBBLOCK_OFFSET(subblock);
+
+                        GET_MODE();
+                        switch (mode)
+                        {
+                        case 0:  /* MOT: skip */
+                            if (mot_frame)
+                                roq_copy_block(this_frame, mot_frame, subblock_offset, stride, 4);
+                            break;
+
+                        case 1:  /* FCC: motion compensation */
+                            GET_BYTE(data_byte);
+                            motion_x = 8 - (data_byte >>  4) - mx;
+                            motion_y = 8 - (data_byte & 0xF) - my;
+                            if (tiled)
+                                last_ptr = roq_tiled_block(roq, last_frame,
+                                    mb_x * 16 + (block & 1) * 8 + (subblock & 1) * 4 + motion_x,
+                                    mb_y * 16 + (block >> 1) * 8 + (subblock >> 1) * 4 + motion_y, 4,
+                                    this_frame + subblock_offset);
+                            else
+                                last_ptr = last_frame + subblock_offset +
+                                    (motion_y * stride) + motion_x;
+                            if (last_ptr)
+                                roq_mc4(kernels, this_frame + subblock_offset, last_ptr, stride);
+                            break;
+
+                        case 2:  /* SLD: use 4x4 vector from codebook */
+                            GET_BYTE(data_byte);
+                            vector32 = (unsigned int*)roq->cb4x4_rgb565[data_byte];
+                            this_ptr32 = (unsigned int*)this_frame;
+                            this_ptr32 += subblock_offset / 2;
+                            for (i = 0; i < 4; i++) {
+                                *this_ptr32++ = *vector32++;
+                                *this_ptr32++ = *vector32++;
+
+                                this_ptr32 += stride32m2;
+                            }
+                            break;
+
+                        case 3:  /* CCC: four 2x2 vectors */
+                            GET_BYTE(data_byte);
+                            vector16 = roq->cb2x2_rgb565[data_byte];
+                            GET_BYTE(data_byte);
+                            vector16b = roq->cb2x2_rgb565[data_byte];
+                            GET_BYTE(data_byte);
+                            vector16c = roq->cb2x2_rgb565[data_byte];
+                            GET_BYTE(data_byte);
+                            roq_ccc4(kernels, this_frame + subblock_offset, vector16, vector16b,
+                                vector16c, roq->cb2x2_rgb565[data_byte], stride);
+                            break;
+                        }
+                    }
+                    break;
+                }
+            }
 
-            memset(roq->frame[0], 0, roq->texture_height * roq->stride * sizeof(unsigned short));
-            memset(roq->frame[1], 0, roq->texture_height * roq->stride * sizeof(unsigned short));
-        }
-        else {
-            roq_buffer_set_offset(roq->buffer, header.chunk_size, SEEK_CUR);
+            if (tiled && (mb_changed || untile_all)) {
+                roq_untile_macroblock(out_frame + mb_y * 16 * roq->stride + mb_x * 16,
+                    this_frame + mb_offset, roq->stride);
+                mb_changed = FALSE;
+            }
         }
-    } while(header.chunk_id != RoQ_INFO);
-
-    // Reset
-    roq_buffer_set_offset(roq->buffer, CHUNK_HEADER_SIZE, SEEK_SET);
+    }
+    roq->region_started = region_start - roq->region_starts;
 
-	return roq;
+    return tiled ? out_frame : this_frame;
 }
 
-static roq_buffer_t* roq_buffer_create_with_filename(const char* filename) {
-	FILE* fh = fopen(filename, "rb");
-	if (!fh) {
-        roq_errno = ROQ_FILE_OPEN_FAILURE;
-		return NULL;
-	}
-	return roq_buffer_create_with_file(fh, TRUE);
-}
+#ifdef ROQ_VQ_BATCHED
+/* The same decode in two passes over every batch of macroblocks. The
+ * first walks the modes through vq_state_lut without branching on them
+ * and only records each block and where its arguments are, sorted by
+ * what has to be done. The second does it one kind at a time, so the
+ * kernels run in loops whose branches the CPU predicts, instead of
+ * behind a mispredicted jump for most modes. The order blocks are
+ * written in does not matter: they never overlap and all reads are
+ * from the previous frames. */
+static ROQ_INLINE unsigned short* roq_unpack_vq_batched(roq_t* roq, unsigned char* buf, int size,
+                                                        unsigned int arg, int kernels, int fixed_stride) {
+    int stride = fixed_stride ? fixed_stride : roq->stride;
+    int i, k;
 
-static roq_buffer_t* roq_buffer_create_with_file(FILE* fh, int close_when_done) {
-	roq_buffer_t* buffer = roq_buffer_create_with_capacity(ROQ_BUFFER_DEFAULT_SIZE);
-	buffer->fh = fh;
-	buffer->close_when_done = close_when_done;
-    buffer->free_when_done = TRUE;
-	buffer->mode = ROQ_BUFFER_MODE_FILE;
-	return buffer;
-}
+    /* frame and pixel management */
+    unsigned short *this_frame;
+    unsigned short *last_frame;
+    unsigned short *mot_frame = roq->mot_frame;
 
-static roq_buffer_t* roq_buffer_create_with_memory(unsigned char* bytes, size_t capacity, int free_when_done) {
-	roq_buffer_t* buffer = (roq_buffer_t*)malloc(sizeof(roq_buffer_t));
-	memset(buffer, 0, sizeof(roq_buffer_t));
-    buffer->bytes = bytes;
-	buffer->capacity = capacity;
-	buffer->start_index = 0;
-    buffer->end_index = 0;
-	buffer->free_when_done = free_when_done;
-	buffer->mode = ROQ_BUFFER_MODE_FIXED_MEM;
-	return buffer;
-}
+    int line_offset = 0;
+    int mb_offset = 0;
+    int mb_x = 0;
+    int mb = 0;
+    int batch_end;
 
-static roq_buffer_t* roq_buffer_create_with_capacity(size_t capacity) {
-	roq_buffer_t* buffer = (roq_buffer_t*)malloc(sizeof(roq_buffer_t));
-	memset(buffer, 0, sizeof(roq_buffer_t));
-	buffer->capacity = capacity;
-	buffer->free_when_done = TRUE;
-	buffer->bytes = (unsigned char*)malloc(capacity);
-	buffer->mode = ROQ_BUFFER_MODE_DYNAMIC_MEM;
-	return buffer;
-}
+    unsigned short *this_ptr;
+    unsigned int *this_ptr32;
+    unsigned short *vector16;
+    unsigned int *vector32;
+    unsigned char *args;
+    int stride32m2 = stride / 2 - 2;
 
-static int roq_eof(roq_buffer_t* buffer) {
-    if(buffer->mode == ROQ_BUFFER_MODE_FILE) {
-        return feof(buffer->fh);
-    } 
-    else {
-        return buffer->capacity == buffer->end_index;
-    }
-}
+    /* bytestream management */
+    int index = 0;
+    int mode_set = 0;
+    int mode, mode_lo, mode_hi;
+    int mode_count = 0;
 
-static void roq_buffer_set_offset(roq_buffer_t* buffer, off_t offset, int whence) {
-    if(buffer->mode == ROQ_BUFFER_MODE_FILE) {
-        fseek(buffer->fh, offset, whence);
+    /* parser */
+    int state = 0;
+    unsigned int entry;
+    roq_vq_op_t *op;
+    int count[ROQ_VQ_OP_COUNT];
+
+    /* vectors */
+    int mx, my;
+    int motion_x, motion_y;
+
+    mx = (signed char)(arg >> 8);
+    my = (signed char)arg;
+
+    if (roq->frame_index) {
+        roq->frame_index = 0;
+        this_frame = (unsigned short*)roq->frame[1];
+        last_frame = (unsigned short*)roq->frame[0];
     }
     else {
-        if(whence == SEEK_SET) {
-            buffer->end_index = offset;
-            buffer->start_index = buffer->end_index;
+        roq->frame_index = 1;
+        this_frame = (unsigned short*)roq->frame[0];
+        last_frame = (unsigned short*)roq->frame[1];
+    }
+    roq->mot_frame = NULL;
+
+    while (mb < roq->mb_count) {
+        batch_end = mb + ROQ_VQ_BATCH < roq->mb_count ? mb + ROQ_VQ_BATCH : roq->mb_count;
+        memset(count, 0, sizeof(count));
+
+        /* parse */
+        while (mb < batch_end) {
+            GET_MODE();
+            entry = roq->vq_state_lut[state][mode];
+            op = &roq->vq_ops[ROQ_VQ_ENTRY_OP(entry)][count[ROQ_VQ_ENTRY_OP(entry)]++];
+            op->offset = mb_offset + roq->vq_offset_lut[state];
+            op->index = index;
+            index += ROQ_VQ_ENTRY_BYTES(entry);
+            state = ROQ_VQ_ENTRY_NEXT(entry);
+
+            if (ROQ_VQ_ENTRY_NEXT_MB(entry)) {
+                mb++;
+                mb_offset += 16;
+                if (++mb_x == roq->mb_width) {
+                    mb_x = 0;
+                    line_offset += 16 * stride;
+                    mb_offset = line_offset;
+                }
+            }
         }
-        else if(whence == SEEK_CUR) {
-            buffer->end_index = buffer->start_index + offset;
-            buffer->start_index = buffer->end_index;
+
+        /* MOT: skip */
+        if (mot_frame) {
+            for (k = 0, op = roq->vq_ops[ROQ_VQ_MOT8]; k < count[ROQ_VQ_MOT8]; k++, op++)
+                roq_copy_block(this_frame, mot_frame, op->offset, stride, 8);
+            for (k = 0, op = roq->vq_ops[ROQ_VQ_MOT4]; k < count[ROQ_VQ_MOT4]; k++, op++)
+                roq_copy_block(this_frame, mot_frame, op->offset, stride, 4);
         }
-    }
-}
 
-static int roq_buffer_read(roq_buffer_t* buffer, size_t count) {
-    if(buffer->mode == ROQ_BUFFER_MODE_FILE) {
-        if(feof(buffer->fh) || fread(buffer->bytes, count, 1, buffer->fh) != 1) {
-            return 0; 
+        /* FCC: motion compensation */
+        for (k = 0, op = roq->vq_ops[ROQ_VQ_FCC8]; k < count[ROQ_VQ_FCC8]; k++, op++) {
+            motion_x = 8 - (buf[op->index] >>  4) - mx;
+            motion_y = 8 - (buf[op->index] & 0xF) - my;
+            roq_mc8(kernels, this_frame + op->offset,
+                last_frame + op->offset + (motion_y * stride) + motion_x, stride);
         }
-        return count;
-    }
-    else {
-        if (!roq_buffer_has(buffer, count)) {
-            return 0;
+        for (k = 0, op = roq->vq_ops[ROQ_VQ_FCC4]; k < count[ROQ_VQ_FCC4]; k++, op++) {
+            motion_x = 8 - (buf[op->index] >>  4) - mx;
+            motion_y = 8 - (buf[op->index] & 0xF) - my;
+            roq_mc4(kernels, this_frame + op->offset,
+                last_frame + op->offset + (motion_y * stride) + motion_x, stride);
         }
-        buffer->start_index = buffer->end_index;
-        buffer->end_index += count;
-        return count;
-    }
-}
-
-static int roq_buffer_has(roq_buffer_t* buffer, size_t count) {
-	size_t remaining = buffer->capacity - buffer->end_index;
-	if (remaining >= count) {
-		return TRUE;
-	}
-    return FALSE;
-}
 
-static unsigned char* roq_buffer_get_data(roq_buffer_t* buffer) {
-    return buffer->bytes + buffer->start_index;
-}
+        /* SLD: upsample 4x4 vector */
+        for (k = 0, op = roq->vq_ops[ROQ_VQ_SLD8]; k < count[ROQ_VQ_SLD8]; k++, op++) {
+            vector16 = roq->cb4x4_rgb565[buf[op->index]];
+            for (i = 0; i < 4*4; i++) {
+                this_ptr = this_frame + op->offset + ROQ_UPSAMPLE_OFFSET(i);
+                this_ptr[0] = *vector16;
+                this_ptr[1] = *vector16;
+                this_ptr[stride+0] = *vector16;
+                this_ptr[stride+1] = *vector16;
+                vector16++;
+            }
+        }
 
-static void roq_buffer_destroy(roq_buffer_t* buffer) {
-    if(buffer == NULL) {
-        return;
-    }
+        /* SLD: use 4x4 vector from codebook */
+        for (k = 0, op = roq->vq_ops[ROQ_VQ_SLD4]; k < count[ROQ_VQ_SLD4]; k++, op++) {
+            vector32 = (unsigned int*)roq->cb4x4_rgb565[buf[op->index]];
+            this_ptr32 = (unsigned int*)this_frame + op->offset / 2;
+            for (i = 0; i < 4; i++) {
+                *this_ptr32++ = *vector32++;
+                *this_ptr32++ = *vector32++;
 
-	if (buffer->fh && buffer->close_when_done) {
-		fclose(buffer->fh);
-	}
+                this_ptr32 += stride32m2;
+            }
+        }
 
-	if (buffer->free_when_done) {
-		free(buffer->bytes);
-	}
+        /* CCC: four 2x2 vectors */
+        for (k = 0, op = roq->vq_ops[ROQ_VQ_CCC4]; k < count[ROQ_VQ_CCC4]; k++, op++) {
+            args = buf + op->index;
+            roq_ccc4(kernels, this_frame + op->offset, roq->cb2x2_rgb565[args[0]], roq->cb2x2_rgb565[args[1]],
+                roq->cb2x2_rgb565[args[2]], roq->cb2x2_rgb565[args[3]], stride);
+        }
+    }
 
-	free(buffer);
-    buffer = NULL;
+    return this_frame;
 }
+#endif
 
-static int roq_read_header_chunk(roq_buffer_t* buffer, roq_chunk_t* header) {
-    // Read the header section
-    if(roq_buffer_read(buffer, CHUNK_HEADER_SIZE) != CHUNK_HEADER_SIZE) {
-        roq_errno = ROQ_FILE_READ_FAILURE;
-        return FALSE;
+/* The portable kernels keep the single pass: they are what the SH-4
+ * runs, where a branch costs a couple of cycles whichever way it goes
+ * and the 16 KB data cache has no room to spare for the batches. */
+static unsigned short* roq_unpack_vq_frame(roq_t* roq, unsigned char* buf, int size, unsigned int arg) {
+    if (roq->scale_shift)
+        return roq_unpack_vq_scaled(roq, buf, size, arg);
+
+    if (roq->tiles[0]) {
+        switch (roq->kernels) {
+#ifdef ROQ_HAVE_SSE2
+        case ROQ_KERNELS_SSE2:
+            return roq_unpack_vq_kernels(roq, buf, size, arg, ROQ_KERNELS_SSE2, ROQ_TILED_STRIDE);
+#endif
+#ifdef ROQ_HAVE_NEON
+        case ROQ_KERNELS_NEON:
+            return roq_unpack_vq_kernels(roq, buf, size, arg, ROQ_KERNELS_NEON, ROQ_TILED_STRIDE);
+#endif
+        default:
+            return roq_unpack_vq_kernels(roq, buf, size, arg, ROQ_KERNELS_C, ROQ_TILED_STRIDE);
+        }
     }
 
-    unsigned char* read_buffer = roq_buffer_get_data(buffer);
-    header->chunk_id = LE_16(&read_buffer[0]);
-    header->chunk_size = LE_32(&read_buffer[2]);
-    header->chunk_arg = LE_16(&read_buffer[6]);
-
-    // Check if size is too large
-    if(header->chunk_size > ROQ_BUFFER_DEFAULT_SIZE) {
-        roq_errno = ROQ_CHUNK_TOO_LARGE;
-        return FALSE;
+    switch (roq->kernels) {
+#ifdef ROQ_HAVE_SSE2
+    case ROQ_KERNELS_SSE2:
+        /* the batches hold every block, so a region goes the single pass */
+        if (roq->region)
+            ROQ_UNPACK_VQ_STRIDES(roq_unpack_vq_kernels, ROQ_KERNELS_SSE2);
+        ROQ_UNPACK_VQ_STRIDES(roq_unpack_vq_batched, ROQ_KERNELS_SSE2);
+#endif
+#ifdef ROQ_HAVE_NEON
+    case ROQ_KERNELS_NEON:
+        if (roq->region)
+            ROQ_UNPACK_VQ_STRIDES(roq_unpack_vq_kernels, ROQ_KERNELS_NEON);
+        ROQ_UNPACK_VQ_STRIDES(roq_unpack_vq_batched, ROQ_KERNELS_NEON);
+#endif
+    default:
+        ROQ_UNPACK_VQ_STRIDES(roq_unpack_vq_kernels, ROQ_KERNELS_C);
     }
-
-    return TRUE;
 }
 
-static int roq_unpack_quad_codebook(roq_t* roq, unsigned char *buf, int size, int arg) {
-    int y[4];
-    int yp, u, v;
-    int r, g, b;
-    int count2x2;
-    int count4x4;
-    int i, j;
-    unsigned short *v2x2;
-    unsigned short *v4x4;
-
-    count2x2 = (arg >> 8) & 0xFF;
-    count4x4 =  arg       & 0xFF;
+static unsigned short* roq_unpack_vq(roq_t* roq, unsigned char* buf, int size, unsigned int arg) {
+    unsigned char* this_stale = roq->stale[roq->frame_index ? 1 : 0];
+    int replaced = roq->mot_frame != NULL;
+    unsigned short* frame = roq_unpack_vq_frame(roq, buf, size, arg);
 
-    if (!count2x2)
-        count2x2 = ROQ_CODEBOOK_SIZE;
-    /* 0x00 means 256 4x4 vectors if there is enough space in the chunk
-     * after accounting for the 2x2 vectors */
-    if (!count4x4 && count2x2 * 6 < size)
-        count4x4 = ROQ_CODEBOOK_SIZE;
+    if (roq->region)
+        roq_region_track(roq, buf, size, arg, this_stale, replaced);
 
-    /* unpack the 2x2 vectors */
-    for (i = 0; i < count2x2; i++) {
-        /* unpack the YUV components from the bytestream */
-        y[0] = *buf++;
-        y[1] = *buf++;
-        y[2] = *buf++;
-        y[3] = *buf++;
-        u  = *buf++;
-        v  = *buf++;
-        
-        /* convert to RGB565 */
-        for (j = 0; j < 4; j++) {
-            yp = roq->yy_lut[y[j]];
-            r = yp + roq->cr_r_lut[v];
-            g = yp + roq->cr_g_lut[v] + roq->cb_g_lut[u];  
-            b = yp + roq->cb_b_lut[u]; 
+    return frame;
+}
 
-            r = (r < 0) ? 0 : ((r > 255) ? 255 : r);
-            g = (g < 0) ? 0 : ((g > 255) ? 255 : g);
-            b = (b < 0) ? 0 : ((b > 255) ? 255 : b);
+/* average of two RGB565 pixels without unpacking them */
+#define AVERAGE_RGB565(a, b) (((a) & (b)) + ((((a) ^ (b)) & 0xF7DE) >> 1))
 
-            roq->cb2x2_rgb565[i][j] = ((unsigned short)r & 0xf8) << 8 | 
-                                      ((unsigned short)g & 0xfc) << 3 | 
-                                      ((unsigned short)b & 0xf8) >> 3;
+/* Motion compensates a size x size block at reduced scale. The motion
+ * vector is in full resolution pixels; whatever is left over after the
+ * scale division is applied as a bilinear blend of the neighbours, so
+ * odd vectors do not drift the picture by half a pixel every frame. */
+static ROQ_INLINE void roq_motion_block(roq_t* roq, unsigned short* dst, unsigned short* last_frame,
+                                        int offset, int motion_x, int motion_y, int size, int shift) {
+    int scale = 1 << shift;
+    int stride = roq->stride;
+    int fx = motion_x & (scale - 1);
+    int fy = motion_y & (scale - 1);
+    int w00, w01, w10, w11;
+    int r, g, b, i, j;
+    unsigned short *src = last_frame + offset +
+        (motion_y >> shift) * stride + (motion_x >> shift);
+    unsigned short p00, p01, p10, p11;
+
+    if (!fx && !fy) {
+        for (i = 0; i < size; i++) {
+            for (j = 0; j < size; j++)
+                dst[j] = src[j];
+            dst += stride;
+            src += stride;
         }
+        return;
     }
 
-    /* unpack the 4x4 vectors */
-    for (i = 0; i < count4x4; i++) {
-        for (j = 0; j < 4; j++) {
-            v2x2 = roq->cb2x2_rgb565[*buf++];
-            v4x4 = roq->cb4x4_rgb565[i] + roq->unpack_4x4_lut[j];
-            v4x4[0] = v2x2[0];
-            v4x4[1] = v2x2[1];
-            v4x4[4] = v2x2[2];
-            v4x4[5] = v2x2[3];
+    /* half scale: the blend is a plain average of 2 or 4 pixels */
+    if (shift == 1) {
+        for (i = 0; i < size; i++) {
+            if (!fy) {
+                for (j = 0; j < size; j++)
+                    dst[j] = AVERAGE_RGB565(src[j], src[j + 1]);
+            }
+            else if (!fx) {
+                for (j = 0; j < size; j++)
+                    dst[j] = AVERAGE_RGB565(src[j], src[j + stride]);
+            }
+            else {
+                for (j = 0; j < size; j++) {
+                    p00 = AVERAGE_RGB565(src[j], src[j + 1]);
+                    p10 = AVERAGE_RGB565(src[j + stride], src[j + stride + 1]);
+                    dst[j] = AVERAGE_RGB565(p00, p10);
+                }
+            }
+            dst += stride;
+            src += stride;
         }
+        return;
     }
 
-    return TRUE;
+    w00 = (scale - fx) * (scale - fy);
+    w01 = fx * (scale - fy);
+    w10 = (scale - fx) * fy;
+    w11 = fx * fy;
+
+    for (i = 0; i < size; i++) {
+        for (j = 0; j < size; j++) {
+            p00 = src[j];
+            p01 = fx ? src[j + 1] : p00;
+            p10 = fy ? src[j + stride] : p00;
+            p11 = fx && fy ? src[j + stride + 1] : p00;
+
+            r = ((p00 >> 11) * w00 + (p01 >> 11) * w01 +
+                 (p10 >> 11) * w10 + (p11 >> 11) * w11) >> (shift * 2);
+            g = (((p00 >> 5) & 0x3F) * w00 + ((p01 >> 5) & 0x3F) * w01 +
+                 ((p10 >> 5) & 0x3F) * w10 + ((p11 >> 5) & 0x3F) * w11) >> (shift * 2);
+            b = ((p00 & 0x1F) * w00 + (p01 & 0x1F) * w01 +
+                 (p10 & 0x1F) * w10 + (p11 & 0x1F) * w11) >> (shift * 2);
+
+            dst[j] = (unsigned short)((r << 11) | (g << 5) | b);
+        }
+        dst += stride;
+        src += stride;
+    }
 }
 
-#define GET_BYTE(x) x = buf[index++];
-
-#define GET_MODE() \
-    if (!mode_count) { \
-        GET_BYTE(mode_lo); \
-        GET_BYTE(mode_hi); \
-        mode_set = (mode_hi << 8) | mode_lo; \
-        mode_count = 16; \
-    } \
-    mode_count -= 2; \
-    mode = (mode_set >> mode_count) & 0x03;
+/* fill a size x size block from a codebook vector stored row by row */
+#define VECTOR_BLOCK(dst, vector, size) \
+    for (i = 0; i < size; i++) { \
+        for (j = 0; j < size; j++) \
+            dst[j] = *vector++; \
+        dst += stride; \
+    }
 
-static unsigned short* roq_unpack_vq(roq_t* roq, unsigned char* buf, int size, unsigned int arg) {
+/* Same bitstream walk as roq_unpack_vq() at 1/2 or 1/4 scale. Every
+ * block and motion vector shrinks by the scale; codebook vectors come
+ * from the tables built by roq_downsample_codebook(). */
+static ROQ_INLINE unsigned short* roq_unpack_vq_shifted(roq_t* roq, unsigned char* buf, int size,
+                                                        unsigned int arg, int shift) {
     int mb_x, mb_y;
     int block;     /* 8x8 blocks */
     int subblock;  /* 4x4 blocks */
     int stride = roq->stride;
-    int i;
+    int mb_size = 16 >> shift;
+    int block_size = 8 >> shift;
+    int subblock_size = 4 >> shift;
+    int i, j;
+
+    /* codebook vectors for an 8x8 and a 4x4 block at this scale */
+    unsigned short *block_vectors = shift == 1 ? roq->cb4x4_rgb565[0] : roq->cb4x4_half[0];
+    unsigned short *subblock_vectors = shift == 1 ? roq->cb4x4_half[0] : roq->cb4x4_avg;
 
     /* frame and pixel management */
     unsigned short *this_frame;
     unsigned short *last_frame;
+    unsigned short *mot_frame = roq->mot_frame;
+
+    /* decode region, see REGION_MACROBLOCK() */
+    const unsigned char *region = roq->region;
+    unsigned char *stale = roq->stale[roq->frame_index ? 1 : 0];
+    roq_region_start_t *region_start = roq->region_starts;
+    int mb_modes;
 
     int line_offset;
     int mb_offset;
@@ -762,11 +3767,8 @@ static unsigned short* roq_unpack_vq(roq_t* roq, unsigned char* buf, int size, u
     int subblock_offset;
 
     unsigned short *this_ptr;
-    unsigned int *this_ptr32;
-    unsigned short *last_ptr;
     unsigned short *vector16;
-    unsigned int *vector32;
-    int stride32m2 = stride / 2 - 2;
+    unsigned short pixel[4];
 
     /* bytestream management */
     int index = 0;
@@ -792,55 +3794,38 @@ static unsigned short* roq_unpack_vq(roq_t* roq, unsigned char* buf, int size, u
         this_frame = (unsigned short*)roq->frame[0];
         last_frame = (unsigned short*)roq->frame[1];
     }
+    roq->mot_frame = NULL;
 
     for (mb_y = 0; mb_y < roq->mb_height; mb_y++) {
-        line_offset = mb_y * 16 * stride;
+        line_offset = mb_y * mb_size * stride;
         for (mb_x = 0; mb_x < roq->mb_width; mb_x++) {
-            mb_offset = line_offset + mb_x * 16;
+            if (region) {
+                REGION_MACROBLOCK();
+            }
+            mb_offset = line_offset + mb_x * mb_size;
             for (block = 0; block < 4; block++) {
                 block_offset = mb_offset + roq->block_offset_lut[block];
                 /* each 8x8 block gets a mode */
                 GET_MODE();
                 switch (mode) {
                 case 0:  /* MOT: skip */
+                    if (mot_frame)
+                        roq_copy_block(this_frame, mot_frame, block_offset, stride, block_size);
                     break;
 
                 case 1:  /* FCC: motion compensation */
-                    /* this needs to be done 16 bits at a time due to
-                     * data alignment issues on the SH-4 */
                     GET_BYTE(data_byte);
                     motion_x = 8 - (data_byte >>  4) - mx;
                     motion_y = 8 - (data_byte & 0xF) - my;
-                    last_ptr = last_frame + block_offset + 
-                        (motion_y * stride) + motion_x;
-                    this_ptr = this_frame + block_offset;
-                    for (i = 0; i < 8; i++) {
-                        *this_ptr++ = *last_ptr++;
-                        *this_ptr++ = *last_ptr++;
-                        *this_ptr++ = *last_ptr++;
-                        *this_ptr++ = *last_ptr++;
-                        *this_ptr++ = *last_ptr++;
-                        *this_ptr++ = *last_ptr++;
-                        *this_ptr++ = *last_ptr++;
-                        *this_ptr++ = *last_ptr++;
-
-                        last_ptr += stride - 8;
-                        this_ptr += stride - 8;
-                    }
+                    roq_motion_block(roq, this_frame + block_offset, last_frame,
+                        block_offset, motion_x, motion_y, block_size, shift);
                     break;
 
-                case 2:  /* SLD: upsample 4x4 vector */
+                case 2:  /* SLD: 4x4 vector scaled to the block */
                     GET_BYTE(data_byte);
-                    vector16 = roq->cb4x4_rgb565[data_byte];
-                    for (i = 0; i < 4*4; i++) {
-                        this_ptr = this_frame + block_offset +
-                            roq->upsample_offset_lut[i];
-                        this_ptr[0] = *vector16;
-                        this_ptr[1] = *vector16;
-                        this_ptr[stride+0] = *vector16;
-                        this_ptr[stride+1] = *vector16;
-                        vector16++;
-                    }
+                    vector16 = block_vectors + data_byte * block_size * block_size;
+                    this_ptr = this_frame + block_offset;
+                    VECTOR_BLOCK(this_ptr, vector16, block_size);
                     break;
 
                 case 3:  /* CCC: subdivide into 4 subblocks */
@@ -851,72 +3836,40 @@ static unsigned short* roq_unpack_vq(roq_t* roq, unsigned char* buf, int size, u
                         switch (mode)
                         {
                         case 0:  /* MOT: skip */
+                            if (mot_frame)
+                                roq_copy_block(this_frame, mot_frame, subblock_offset, stride, subblock_size);
                             break;
 
                         case 1:  /* FCC: motion compensation */
                             GET_BYTE(data_byte);
                             motion_x = 8 - (data_byte >>  4) - mx;
                             motion_y = 8 - (data_byte & 0xF) - my;
-                            last_ptr = last_frame + subblock_offset + 
-                                (motion_y * stride) + motion_x;
-                            this_ptr = this_frame + subblock_offset;
-                            for (i = 0; i < 4; i++)
-                            {
-                                *this_ptr++ = *last_ptr++;
-                                *this_ptr++ = *last_ptr++;
-                                *this_ptr++ = *last_ptr++;
-                                *this_ptr++ = *last_ptr++;
-
-                                last_ptr += stride - 4;
-                                this_ptr += stride - 4;
-                            }
+                            roq_motion_block(roq, this_frame + subblock_offset, last_frame,
+                                subblock_offset, motion_x, motion_y, subblock_size, shift);
                             break;
 
                         case 2:  /* SLD: use 4x4 vector from codebook */
                             GET_BYTE(data_byte);
-                            vector32 = (unsigned int*)roq->cb4x4_rgb565[data_byte];
-                            this_ptr32 = (unsigned int*)this_frame;
-                            this_ptr32 += subblock_offset / 2;
-                            for (i = 0; i < 4; i++) {
-                                *this_ptr32++ = *vector32++;
-                                *this_ptr32++ = *vector32++;
-
-                                this_ptr32 += stride32m2;
-                            }
+                            vector16 = subblock_vectors + data_byte * subblock_size * subblock_size;
+                            this_ptr = this_frame + subblock_offset;
+                            VECTOR_BLOCK(this_ptr, vector16, subblock_size);
                             break;
 
-                        case 3:  /* CCC: subdivide into 4 subblocks */
-                            GET_BYTE(data_byte);
-                            vector16 = roq->cb2x2_rgb565[data_byte];
+                        case 3:  /* CCC: four 2x2 vectors */
+                            for (i = 0; i < 4; i++) {
+                                GET_BYTE(data_byte);
+                                pixel[i] = roq->cb2x2_avg[data_byte];
+                            }
                             this_ptr = this_frame + subblock_offset;
-                            this_ptr[0] = vector16[0];
-                            this_ptr[1] = vector16[1];
-                            this_ptr[stride+0] = vector16[2];
-                            this_ptr[stride+1] = vector16[3];
-
-                            GET_BYTE(data_byte);
-                            vector16 = roq->cb2x2_rgb565[data_byte];
-                            this_ptr[2] = vector16[0];
-                            this_ptr[3] = vector16[1];
-                            this_ptr[stride+2] = vector16[2];
-                            this_ptr[stride+3] = vector16[3];
-
-                            this_ptr += stride * 2;
-
-                            GET_BYTE(data_byte);
-                            vector16 = roq->cb2x2_rgb565[data_byte];
-                            this_ptr[0] = vector16[0];
-                            this_ptr[1] = vector16[1];
-                            this_ptr[stride+0] = vector16[2];
-                            this_ptr[stride+1] = vector16[3];
-
-                            GET_BYTE(data_byte);
-                            vector16 = roq->cb2x2_rgb565[data_byte];
-                            this_ptr[2] = vector16[0];
-                            this_ptr[3] = vector16[1];
-                            this_ptr[stride+2] = vector16[2];
-                            this_ptr[stride+3] = vector16[3];
-
+                            if (shift == 1) {
+                                this_ptr[0] = pixel[0];
+                                this_ptr[1] = pixel[1];
+                                this_ptr[stride+0] = pixel[2];
+                                this_ptr[stride+1] = pixel[3];
+                            }
+                            else {
+                                this_ptr[0] = roq_average_rgb565(pixel[0], pixel[1], pixel[2], pixel[3]);
+                            }
                             break;
                         }
                     }
@@ -926,5 +3879,17 @@ static unsigned short* roq_unpack_vq(roq_t* roq, unsigned char* buf, int size, u
         }
     }
 
+    roq->region_started = region_start - roq->region_starts;
+
     return this_frame;
-}
\ No newline at end of file
+}
+
+/* The shift is a constant in each instance, so the compiler unrolls the
+ * block loops for the scale instead of running them with variable trip
+ * counts. */
+static unsigned short* roq_unpack_vq_scaled(roq_t* roq, unsigned char* buf, int size, unsigned int arg) {
+    if (roq->scale_shift == 1)
+        return roq_unpack_vq_shifted(roq, buf, size, arg, 1);
+    else
+        return roq_unpack_vq_shifted(roq, buf, size, arg, 2);
+}
@@ -26,6 +26,19 @@ extern "C" {
 #define ROQ_INVALID_DIMENSION 8
 #define ROQ_RENDER_PROBLEM    9
 #define ROQ_CLIENT_PROBLEM    10
+#define ROQ_INVALID_SCALE     11
+#define ROQ_BAD_JPEG          12
+#define ROQ_BAD_FRAME_POOL    13
+#define ROQ_BAD_SNAPSHOT      14
+
+#define RoQ_INFO           0x1001
+#define RoQ_QUAD_CODEBOOK  0x1002
+#define RoQ_QUAD_VQ        0x1011
+#define RoQ_JPEG           0x1012
+#define RoQ_SOUND_MONO     0x1020
+#define RoQ_SOUND_STEREO   0x1021
+#define RoQ_PACKET         0x1030
+#define RoQ_SIGNATURE      0x1084
 
 extern int roq_errno;
 
@@ -44,10 +57,30 @@ roq_t* roq_create_with_file(FILE* fh, int close_when_done);
 
 // Create a roq_t instance with pointer to memory as source. This assumes the
 // whole file is in memory. Pass TRUE to free_when_done to let roq call
-// free() on the pointer when roq_destroy() is called.
+// free() on the pointer when roq_destroy() is called. The memory may also
+// hold a file made by roq-pack (see ROQ_PACK_MAGIC), which is decompressed
+// a block at a time as decoding reaches it.
 
 roq_t* roq_create_with_memory(unsigned char* bytes, size_t length, int free_when_done);
 
+// Create a roq_t instance that is fed by the caller: append the stream
+// as it arrives with roq_push_data() and call roq_push_end() after the
+// last byte. The decoder keeps at most capacity bytes (0 picks the
+// default of 256 KiB, the least is 64 KiB; a chunk larger than that
+// grows it to twice the chunk) and releases data once it has been
+// decoded, so playback can begin as soon as the header and the first
+// frame are in. Until RoQ_INFO has arrived the width and height read
+// 0. Released data can not be revisited, so rewinding and looping do
+// not work on a push source.
+
+roq_t* roq_create_with_push(size_t capacity);
+
+// Returns how many of the bytes were taken; the rest did not fit and
+// has to be pushed again after more has been decoded.
+size_t roq_push_data(roq_t* roq, const unsigned char* bytes, size_t length);
+
+void roq_push_end(roq_t* roq);
+
 void roq_rewind(roq_t* roq);
 
 int roq_get_loop(roq_t* roq);
@@ -56,16 +89,185 @@ typedef void(*roq_loop_callback)
 	(void* user_data);
 void roq_set_loop(roq_t* roq, int loop, roq_loop_callback cb);
 
+// Decodes the next frame group. Returns TRUE when it decoded something,
+// FALSE at the end of the stream or on an error, and for push sources
+// ROQ_NEED_DATA when the next chunk is still incomplete; push more data
+// and call again to continue where it stopped. With a frame pool it
+// returns ROQ_NEED_FRAME when every pool frame is still held; release
+// one and call again.
+#define ROQ_NEED_DATA 2
+#define ROQ_NEED_FRAME 3
 int roq_decode(roq_t* roq);
 
 int roq_get_framerate(roq_t* roq);
 
+// RoQ_JPEG chunks are intra frames: they replace the whole picture and
+// nothing before them is needed to decode what follows. This returns
+// the stream offset of the last one decoded, or -1 if there has been
+// none. Handing it to roq_seek_keyframe() later resumes decoding with
+// that picture; the audio of its frame group before the chunk is
+// skipped. The frames after it match a straight decode when the first
+// codebook after the keyframe is complete, as encoders that place
+// keyframes for seeking write it. Returns FALSE if no keyframe can be
+// read at the offset, for instance when a push source has already
+// released it.
+long roq_get_keyframe_offset(roq_t* roq);
+
+int roq_seek_keyframe(roq_t* roq, long offset);
+
+// Stream offset of the chunk the next roq_decode() starts at.
+long roq_get_position(roq_t* roq);
+
+// Snapshots of the decoder between roq_decode() calls, see the README.
+// Restoring one into a decoder of the same stream at the same decode
+// scale continues exactly as decoding went on from there. roq_restore()
+// returns FALSE and sets roq_errno for another video or a push source,
+// and ROQ_NEED_FRAME when a frame pool has no two free frames for it.
+typedef struct roq_snapshot_t roq_snapshot_t;
+
+roq_snapshot_t* roq_snapshot(roq_t* roq);
+
+int roq_restore(roq_t* roq, const roq_snapshot_t* snapshot);
+
+// Bytes the snapshot takes.
+size_t roq_snapshot_get_size(const roq_snapshot_t* snapshot);
+
+void roq_snapshot_destroy(roq_snapshot_t* snapshot);
+
+// Loops part of a video: when decoding gets to out, a position from
+// roq_get_position() after the snapshot was taken, it restores in and
+// calls the loop callback of roq_set_loop(), in the same roq_decode()
+// call, so there is no gap. An out of -1 loops at the end of the stream
+// instead. When a frame pool has no two free frames to restore into
+// there, roq_decode() returns ROQ_NEED_FRAME and loops on the next call
+// instead. The snapshot must outlive the loop points; a NULL in clears
+// them. Returns FALSE and sets roq_errno if they do not fit the video.
+int roq_set_loop_points(roq_t* roq, const roq_snapshot_t* in, long out);
+
+// Loop cache, see the README. With a budget of more than 0 bytes it
+// records a pass from the start of the stream and replays later passes
+// whose first two frames match. Going over the budget, passes that
+// decode differently and changing the scale, tiling or frame pool drop
+// it; seeks, restores and loop points stop a replay. A budget of 0
+// drops it at the end of a replay under way, or right away. Returns
+// FALSE and sets roq_errno for push sources.
+int roq_set_loop_cache(roq_t* roq, size_t budget);
+
+typedef struct {
+    unsigned int frames;        // frames in the cache, 0 until a pass is complete
+    size_t bytes;               // memory the cache takes
+    unsigned int passes;        // passes started from the cache
+    unsigned int frames_replayed;
+    int overflowed;             // the last pass recorded went over the budget
+    int unsupported;            // passes of the stream decode differently
+    // Microseconds spent decoding the video of the recorded pass and
+    // replaying frames, and an estimate of what the cache saved: the
+    // average decode time of a frame for every frame replayed, less the
+    // time replaying took
+    unsigned long long decode_us;
+    unsigned long long replay_us;
+    long long saved_us;
+} roq_loop_cache_stats_t;
+
+void roq_get_loop_cache_stats(roq_t* roq, roq_loop_cache_stats_t* stats);
+
+// Segments, for decoding one file on several threads; see the README.
+// roq_find_segments() stores up to max segment offsets, the first being
+// the start of the stream, and returns how many there are, even past
+// max, or 0 for a push source. Set the callbacks first, as they decide
+// where frame groups end; the decoder is left at the start. After
+// roq_seek_segment() a decoder makes the same callbacks as one that
+// decoded from the start; for any but the first segment it must not
+// have decoded anything yet.
+int roq_find_segments(roq_t* roq, long* offsets, int max);
+
+int roq_seek_segment(roq_t* roq, long offset);
+
+// Size of the decoded frames, which is the size of the video divided
+// by the decode scale. Videos may be up to ROQ_MAX_DIMENSION pixels
+// on each side. The frames handed to the video callback are padded to
+// powers of two, so past 1024 they are larger than a texture can be on
+// many GPUs (the Dreamcast's included); see roq-player.c for drawing
+// them as several textures.
+#define ROQ_MAX_DIMENSION 4096
 int roq_get_width(roq_t* roq);
 
 int roq_get_height(roq_t* roq);
 
+// Decode at full, half or quarter resolution, for thumbnails and
+// previews. Codebooks are downsampled as they arrive and blocks and
+// motion vectors shrink with the frame, so the frame buffers and the
+// memory traffic shrink by the square of the scale. Changing the scale
+// reallocates and clears the frames; do it before the first
+// roq_decode() or right after roq_rewind(). Returns FALSE and sets
+// roq_errno on an unsupported scale or when out of memory.
+#define ROQ_SCALE_FULL    1
+#define ROQ_SCALE_HALF    2
+#define ROQ_SCALE_QUARTER 4
+int roq_set_decode_scale(roq_t* roq, int scale);
+
+int roq_get_decode_scale(roq_t* roq);
+
+// Decode full resolution VQ frames in an internal layout in which every
+// 16x16 macroblock is 512 contiguous bytes, so that each block decoded
+// and each block motion compensation reads touches as few cache lines
+// as possible, whatever the stride. Only the macroblocks a frame
+// changes are copied to the frame handed to the video callback, which
+// keeps the usual layout. It costs two more frames of memory and pays
+// off on wide videos on CPUs with small caches; scaled decoding ignores
+// it. Same rules as roq_set_decode_scale() for when to call it.
+int roq_set_decode_tiled(roq_t* roq, int tiled);
+
+// Change tracking, for consumers that keep the last two frames, like
+// double buffered textures, and only want to update what changed. Once
+// on, roq_get_changed_macroblocks() returns during and after the video
+// callback one byte per macroblock of the video (16x16 pixels, fewer
+// at a decode scale), row by row, nonzero where the frame differs from
+// the one passed to the callback two frames before. Skipped VQ blocks
+// are what stays the same; the first two frames, the ones after a
+// keyframe and after a restore count as changed all over. It costs a
+// pass over the block modes of every VQ frame. Returns FALSE and sets
+// roq_errno when out of memory; the array is NULL while tracking is
+// off.
+int roq_set_track_changes(roq_t* roq, int track);
+
+const unsigned char* roq_get_changed_macroblocks(roq_t* roq);
+
+// Decode region, see the README. VQ frames only decode the macroblocks
+// that meet the width by height rectangle of video pixels at x, y,
+// grown by margin on every side; the rest keep what they held.
+// roq_get_stale_macroblocks() then returns, like
+// roq_get_changed_macroblocks(), nonzero where the frame may differ from
+// a full decode. A width or height of 0 decodes everything again.
+// Returns FALSE and sets roq_errno on negative values or when out of
+// memory; the array is NULL without a region.
+int roq_set_decode_region(roq_t* roq, int x, int y, int width, int height, int margin);
+
+const unsigned char* roq_get_stale_macroblocks(roq_t* roq);
+
+// Frame pool, see the README: the decoder decodes into count frames of
+// frame_size bytes, at least roq_get_frame_size() and 32 byte aligned
+// on the Dreamcast, instead of its own two. roq_acquire_frame() keeps
+// one from being reused until roq_release_frame(); acquires nest. count
+// must be at least 2, more if frames are held. Set it up where
+// roq_set_decode_scale() may be called; the frames stay the caller's,
+// and a count of 0 goes back to internal frames. Returns FALSE and sets
+// roq_errno when the frames can not hold the video.
+int roq_set_frame_pool(roq_t* roq, unsigned short** frames, int count, size_t frame_size);
+
+void roq_acquire_frame(roq_t* roq, unsigned short* frame);
+
+void roq_release_frame(roq_t* roq, unsigned short* frame);
+
+// Bytes of one frame: stride times texture height, 0 until a push
+// source has its header.
+size_t roq_get_frame_size(roq_t* roq);
+
 int roq_has_ended(roq_t* roq);
 
+// Pointer handed back as user_data to the video, audio and loop callbacks.
+void roq_set_user_data(roq_t* roq, void* user_data);
+
 void roq_destroy(roq_t* roq);
 
 // The library calls this function when it has a frame ready for display.
@@ -78,6 +280,75 @@ typedef void(*roq_audio_decode_callback)
 	(unsigned char *audio_frame_data, int size, int channels, void* user_data);
 void roq_set_audio_decode_callback(roq_t *roq, roq_audio_decode_callback cb);
 
+// Optional. Lets the decoded audio land directly in the consumer's own
+// buffer, e.g. a ring the sound hardware reads from, instead of being
+// copied out of the decoder's. Before decoding, the library asks for
+// room for size bytes of pcm: return where to write and set *granted to
+// how many contiguous bytes fit there. It asks again for the rest when
+// less was granted, as at the end of a ring, and calls the audio decode
+// callback with each region once it is filled. Returning NULL (or
+// granting less than one sample) falls back to the decoder's buffer.
+typedef unsigned char*(*roq_audio_buffer_callback)
+	(int size, int channels, int* granted, void* user_data);
+void roq_set_audio_buffer_callback(roq_t *roq, roq_audio_buffer_callback cb);
+
+// The demuxer splits a RoQ stream into chunks. It reads ahead a large
+// block of the source in a single read and queues every complete chunk
+// it contains, so the decoder never has to seek or re-read. The decoder
+// uses it internally; tools can use it directly to walk the chunks of a
+// file.
+
+typedef struct roq_demux_t roq_demux_t;
+
+typedef struct {
+	unsigned short chunk_id;
+	unsigned int chunk_size;
+	unsigned short chunk_arg;
+	long offset;              // offset of the chunk header in the stream
+	unsigned char* data;      // chunk_size bytes of payload
+} roq_packet_t;
+
+// Streaming layout written by roq-repack. Right after RoQ_INFO comes a
+// second RoQ_INFO chunk holding the index: the magic, the version, the
+// sector size, the number of frame groups, the offset of the first one
+// and then the length in sectors of every group, all little endian.
+// Each group (audio, codebook and VQ chunk of one frame) starts on a
+// sector boundary and is padded with an empty RoQ_INFO chunk, so
+// decoders that know nothing about the layout just skip the extra
+// chunks. A demuxer reading a file with this index only issues
+// sector-aligned reads of whole groups.
+#define ROQ_REPACK_MAGIC             "RQPK"
+#define ROQ_REPACK_VERSION           1
+#define ROQ_REPACK_SECTOR_SIZE       2048
+#define ROQ_REPACK_INDEX_HEADER_SIZE 16
+
+// Compressed layout written by roq-pack, for clips that are kept in
+// memory. The header holds the magic, the version (16 bits), a reserved
+// 16 bits, the block size, the length of the stream and the number of
+// blocks, followed by one offset per block and one past the last, all
+// little endian and counted from the start of the file. Every block but
+// the last holds block size bytes of the stream, compressed on its own
+// in the LZ4 block format; a block whose compressed size equals its
+// length is stored as it is. Seeking goes back to the start of a block.
+#define ROQ_PACK_MAGIC       "RQLZ"
+#define ROQ_PACK_VERSION     1
+#define ROQ_PACK_BLOCK_SIZE  (1024 * 16)
+#define ROQ_PACK_HEADER_SIZE 20
+
+roq_demux_t* roq_demux_create_with_filename(const char* filename);
+roq_demux_t* roq_demux_create_with_file(FILE* fh, int close_when_done);
+roq_demux_t* roq_demux_create_with_memory(unsigned char* bytes, size_t length, int free_when_done);
+
+// Fills packet with the next chunk. The payload stays valid until the
+// next call. Returns FALSE at the end of the stream or on a broken
+// chunk (roq_errno tells which).
+int roq_demux_next(roq_demux_t* demux, roq_packet_t* packet);
+
+// Restarts at the chunk header found at offset.
+void roq_demux_seek(roq_demux_t* demux, long offset);
+
+void roq_demux_destroy(roq_demux_t* demux);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,268 @@
+/*
+ * Dreamroq block kernels
+ *
+ * The block copies and writes of the full resolution VQ decoder, one
+ * version per instruction set. dreamroqlib.c compiles its VQ loop once
+ * for every kernel set built in and picks one when a decoder is
+ * created; bench-dreamroq includes them to time each kernel on its own.
+ *
+ * Frames are at least 32-bit aligned and every block starts on a 4
+ * pixel boundary, so only motion compensation reads unaligned data.
+ * Build with -DROQ_NO_SIMD to get just the portable kernels, which is
+ * what the Dreamcast runs.
+ */
+
+#ifndef ROQ_BLOCKS_H
+#define ROQ_BLOCKS_H
+
+#include <stdint.h>
+
+#ifdef __GNUC__
+#define ROQ_INLINE inline __attribute__((always_inline))
+#else
+#define ROQ_INLINE inline
+#endif
+
+#define ROQ_KERNELS_C    0
+#define ROQ_KERNELS_SSE2 1
+#define ROQ_KERNELS_NEON 2
+
+#ifndef ROQ_NO_SIMD
+#if defined(__SSE2__)
+#define ROQ_HAVE_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#define ROQ_HAVE_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+/* The widest kernel set built in. SSE2 and NEON are part of the base
+ * x86-64 and AArch64 instruction sets, so any CPU the build runs on
+ * has them. */
+static inline int roq_blocks_select(void) {
+#ifdef ROQ_HAVE_SSE2
+    return ROQ_KERNELS_SSE2;
+#elif defined(ROQ_HAVE_NEON)
+    return ROQ_KERNELS_NEON;
+#else
+    return ROQ_KERNELS_C;
+#endif
+}
+
+static inline const char* roq_blocks_name(int kernels) {
+    switch (kernels) {
+    case ROQ_KERNELS_SSE2: return "sse2";
+    case ROQ_KERNELS_NEON: return "neon";
+    default:               return "c";
+    }
+}
+
+/* Portable kernels. A motion vector with an even x keeps the source on
+ * a 32-bit boundary like the destination, and then two pixels move per
+ * access; otherwise the copy has to go 16 bits at a time because of the
+ * data alignment rules of the SH-4. */
+static ROQ_INLINE void roq_mc8_c(unsigned short* dst, const unsigned short* src, int stride) {
+    int i;
+
+    if (!((uintptr_t)src & 3)) {
+        for (i = 0; i < 8; i++) {
+            unsigned int* dst32 = (unsigned int*)dst;
+            const unsigned int* src32 = (const unsigned int*)src;
+
+            dst32[0] = src32[0];
+            dst32[1] = src32[1];
+            dst32[2] = src32[2];
+            dst32[3] = src32[3];
+
+            dst += stride;
+            src += stride;
+        }
+        return;
+    }
+
+    for (i = 0; i < 8; i++) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = src[3];
+        dst[4] = src[4];
+        dst[5] = src[5];
+        dst[6] = src[6];
+        dst[7] = src[7];
+
+        dst += stride;
+        src += stride;
+    }
+}
+
+static ROQ_INLINE void roq_mc4_c(unsigned short* dst, const unsigned short* src, int stride) {
+    int i;
+
+    if (!((uintptr_t)src & 3)) {
+        for (i = 0; i < 4; i++) {
+            unsigned int* dst32 = (unsigned int*)dst;
+            const unsigned int* src32 = (const unsigned int*)src;
+
+            dst32[0] = src32[0];
+            dst32[1] = src32[1];
+
+            dst += stride;
+            src += stride;
+        }
+        return;
+    }
+
+    for (i = 0; i < 4; i++) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = src[3];
+
+        dst += stride;
+        src += stride;
+    }
+}
+
+/* Writes the four 2x2 vectors of a CCC subblock, each stored as top
+ * left, top right, bottom left, bottom right. A row of a vector is one
+ * 32-bit word. */
+static ROQ_INLINE void roq_ccc4_c(unsigned short* dst, const unsigned short* v0, const unsigned short* v1,
+                                  const unsigned short* v2, const unsigned short* v3, int stride) {
+    unsigned int* row = (unsigned int*)dst;
+    int stride32 = stride / 2;
+
+    row[0] = ((const unsigned int*)v0)[0];
+    row[1] = ((const unsigned int*)v1)[0];
+    row += stride32;
+    row[0] = ((const unsigned int*)v0)[1];
+    row[1] = ((const unsigned int*)v1)[1];
+    row += stride32;
+    row[0] = ((const unsigned int*)v2)[0];
+    row[1] = ((const unsigned int*)v3)[0];
+    row += stride32;
+    row[0] = ((const unsigned int*)v2)[1];
+    row[1] = ((const unsigned int*)v3)[1];
+}
+
+#ifdef ROQ_HAVE_SSE2
+/* An 8 pixel row is one register, a 4 pixel row half of one */
+static ROQ_INLINE void roq_mc8_sse2(unsigned short* dst, const unsigned short* src, int stride) {
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        _mm_storeu_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+        dst += stride;
+        src += stride;
+    }
+}
+
+static ROQ_INLINE void roq_mc4_sse2(unsigned short* dst, const unsigned short* src, int stride) {
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        _mm_storel_epi64((__m128i*)dst, _mm_loadl_epi64((const __m128i*)src));
+        dst += stride;
+        src += stride;
+    }
+}
+
+/* Interleaving the 32-bit rows of two vectors gives both pixel rows of
+ * their 4x2 half of the subblock */
+static ROQ_INLINE void roq_ccc4_sse2(unsigned short* dst, const unsigned short* v0, const unsigned short* v1,
+                                     const unsigned short* v2, const unsigned short* v3, int stride) {
+    __m128i top = _mm_unpacklo_epi32(_mm_loadl_epi64((const __m128i*)v0), _mm_loadl_epi64((const __m128i*)v1));
+    __m128i bottom = _mm_unpacklo_epi32(_mm_loadl_epi64((const __m128i*)v2), _mm_loadl_epi64((const __m128i*)v3));
+
+    _mm_storel_epi64((__m128i*)dst, top);
+    _mm_storel_epi64((__m128i*)(dst + stride), _mm_unpackhi_epi64(top, top));
+    _mm_storel_epi64((__m128i*)(dst + stride * 2), bottom);
+    _mm_storel_epi64((__m128i*)(dst + stride * 3), _mm_unpackhi_epi64(bottom, bottom));
+}
+#endif
+
+#ifdef ROQ_HAVE_NEON
+static ROQ_INLINE void roq_mc8_neon(unsigned short* dst, const unsigned short* src, int stride) {
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        vst1q_u16(dst, vld1q_u16(src));
+        dst += stride;
+        src += stride;
+    }
+}
+
+static ROQ_INLINE void roq_mc4_neon(unsigned short* dst, const unsigned short* src, int stride) {
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        vst1_u16(dst, vld1_u16(src));
+        dst += stride;
+        src += stride;
+    }
+}
+
+static ROQ_INLINE void roq_ccc4_neon(unsigned short* dst, const unsigned short* v0, const unsigned short* v1,
+                                     const unsigned short* v2, const unsigned short* v3, int stride) {
+    uint32x2x2_t top = vzip_u32(vreinterpret_u32_u16(vld1_u16(v0)), vreinterpret_u32_u16(vld1_u16(v1)));
+    uint32x2x2_t bottom = vzip_u32(vreinterpret_u32_u16(vld1_u16(v2)), vreinterpret_u32_u16(vld1_u16(v3)));
+
+    vst1_u16(dst, vreinterpret_u16_u32(top.val[0]));
+    vst1_u16(dst + stride, vreinterpret_u16_u32(top.val[1]));
+    vst1_u16(dst + stride * 2, vreinterpret_u16_u32(bottom.val[0]));
+    vst1_u16(dst + stride * 3, vreinterpret_u16_u32(bottom.val[1]));
+}
+#endif
+
+/* Dispatch on a kernel set that is a constant wherever these are
+ * inlined, so each instance of the VQ loop calls one set directly */
+static ROQ_INLINE void roq_mc8(int kernels, unsigned short* dst, const unsigned short* src, int stride) {
+#ifdef ROQ_HAVE_SSE2
+    if (kernels == ROQ_KERNELS_SSE2) {
+        roq_mc8_sse2(dst, src, stride);
+        return;
+    }
+#endif
+#ifdef ROQ_HAVE_NEON
+    if (kernels == ROQ_KERNELS_NEON) {
+        roq_mc8_neon(dst, src, stride);
+        return;
+    }
+#endif
+    roq_mc8_c(dst, src, stride);
+}
+
+static ROQ_INLINE void roq_mc4(int kernels, unsigned short* dst, const unsigned short* src, int stride) {
+#ifdef ROQ_HAVE_SSE2
+    if (kernels == ROQ_KERNELS_SSE2) {
+        roq_mc4_sse2(dst, src, stride);
+        return;
+    }
+#endif
+#ifdef ROQ_HAVE_NEON
+    if (kernels == ROQ_KERNELS_NEON) {
+        roq_mc4_neon(dst, src, stride);
+        return;
+    }
+#endif
+    roq_mc4_c(dst, src, stride);
+}
+
+static ROQ_INLINE void roq_ccc4(int kernels, unsigned short* dst, const unsigned short* v0, const unsigned short* v1,
+                                const unsigned short* v2, const unsigned short* v3, int stride) {
+#ifdef ROQ_HAVE_SSE2
+    if (kernels == ROQ_KERNELS_SSE2) {
+        roq_ccc4_sse2(dst, v0, v1, v2, v3, stride);
+        return;
+    }
+#endif
+#ifdef ROQ_HAVE_NEON
+    if (kernels == ROQ_KERNELS_NEON) {
+        roq_ccc4_neon(dst, v0, v1, v2, v3, stride);
+        return;
+    }
+#endif
+    roq_ccc4_c(dst, v0, v1, v2, v3, stride);
+}
+
+#endif
@@ -0,0 +1,619 @@
+/*
+ * Dreamroq JPEG keyframes
+ *
+ * Baseline (sequential, Huffman coded, 8-bit) JPEG decoder for RoQ_JPEG
+ * chunks. One interleaved scan with 1 or 3 components and sampling
+ * factors of 1 or 2 is supported, which covers what RoQ encoders write.
+ * Blocks are decoded an MCU at a time and converted straight into the
+ * RGB565 frame, so all state fits in roq_jpeg_t.
+ *
+ * The IDCT is the AAN scaled integer algorithm also used by libjpeg's
+ * "ifast" method: the AAN scale factors are folded into the
+ * dequantization tables, leaving 5 multiplies per 8 point pass.
+ */
+
+#include <string.h>
+
+#include "roq-jpeg.h"
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#ifdef __GNUC__
+#define ROQ_INLINE inline __attribute__((always_inline))
+#else
+#define ROQ_INLINE inline
+#endif
+
+#define BE_16(buf) ((*(buf) << 8) | *((buf)+1))
+
+#define JPEG_SOF0 0xC0
+#define JPEG_SOF1 0xC1
+#define JPEG_DHT  0xC4
+#define JPEG_RST0 0xD0
+#define JPEG_RST7 0xD7
+#define JPEG_SOI  0xD8
+#define JPEG_EOI  0xD9
+#define JPEG_SOS  0xDA
+#define JPEG_DQT  0xDB
+#define JPEG_DRI  0xDD
+
+// IDCT fixed point, as in libjpeg's jidctfst.c
+#define IDCT_CONST_BITS 8
+#define IDCT_PASS1_BITS 2
+#define IDCT_MULTIPLY(var, c) (((var) * (c)) >> IDCT_CONST_BITS)
+#define FIX_1_082392200 277
+#define FIX_1_414213562 362
+#define FIX_1_847759065 473
+#define FIX_2_613125930 669
+
+// Zigzag position -> natural position
+static const unsigned char dezigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// AAN scale factors in natural order, scaled by 1 << 14
+static const unsigned short aan_scales[64] = {
+    16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+    22725, 31521, 29692, 26722, 22725, 17855, 12299,  6270,
+    21407, 29692, 27969, 25172, 21407, 16819, 11585,  5906,
+    19266, 26722, 25172, 22654, 19266, 15137, 10426,  5315,
+    16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+    12873, 17855, 16819, 15137, 12873, 10114,  6967,  3552,
+     8867, 12299, 11585, 10426,  8867,  6967,  4799,  2446,
+     4520,  6270,  5906,  5315,  4520,  3552,  2446,  1247
+};
+
+static int roq_jpeg_build_huffman(roq_jpeg_huffman_t* huffman, const unsigned char* counts, const unsigned char* values, int total);
+static int roq_jpeg_decode_scan(roq_jpeg_t* jpeg, unsigned short* frame, int width, int height, int stride, int shift);
+
+void roq_jpeg_init(roq_jpeg_t* jpeg) {
+    int i, c;
+
+    memset(jpeg, 0, sizeof(roq_jpeg_t));
+
+    // Full range JFIF conversion with libjpeg's constants
+    for(i = 0; i < 256; i++) {
+        c = i - 128;
+        jpeg->cr_r[i] = (91881 * c + 32768) >> 16;
+        jpeg->cb_b[i] = (116130 * c + 32768) >> 16;
+        jpeg->cr_g[i] = -46802 * c;
+        jpeg->cb_g[i] = -22554 * c + 32768;
+    }
+}
+
+int roq_jpeg_decode(roq_jpeg_t* jpeg, const unsigned char* data, int size,
+    unsigned short* frame, int width, int height, int stride, int shift) {
+    const unsigned char* pos = data;
+    const unsigned char* end = data + size;
+    const unsigned char* segment;
+    int marker, length, i, j, t, total;
+
+    if(size < 4 || data[0] != 0xFF || data[1] != JPEG_SOI)
+        return FALSE;
+    pos += 2;
+
+    jpeg->components = 0;
+    jpeg->restart_interval = 0;
+
+    while(pos < end) {
+        // Markers may be preceded by any number of 0xFF fill bytes
+        if(*pos++ != 0xFF)
+            continue;
+        while(pos < end && *pos == 0xFF)
+            pos++;
+        if(pos >= end)
+            break;
+
+        marker = *pos++;
+        if(marker == JPEG_EOI)
+            break;
+        if(marker == 0x01 || (marker >= JPEG_RST0 && marker <= JPEG_RST7))
+            continue;
+
+        if(end - pos < 2)
+            return FALSE;
+        length = BE_16(pos);
+        if(length < 2 || length > end - pos)
+            return FALSE;
+        segment = pos + 2;
+        length -= 2;
+        pos += length + 2;
+
+        switch(marker) {
+            case JPEG_DQT:
+                while(length > 0) {
+                    int precision = segment[0] >> 4;
+                    t = segment[0] & 3;
+                    if(length < 1 + 64 * (precision + 1))
+                        return FALSE;
+                    segment++;
+                    for(i = 0; i < 64; i++) {
+                        int q = precision ? BE_16(&segment[i * 2]) : segment[i];
+                        j = dezigzag[i];
+                        jpeg->quant[t][j] = (q * aan_scales[j] + (1 << 11)) >> 12;
+                    }
+                    jpeg->quant_defined[t] = TRUE;
+                    segment += 64 * (precision + 1);
+                    length -= 1 + 64 * (precision + 1);
+                }
+                break;
+
+            case JPEG_DHT:
+                while(length > 17) {
+                    roq_jpeg_huffman_t* huffman;
+                    t = segment[0] & 3;
+                    huffman = (segment[0] >> 4) ? &jpeg->ac[t] : &jpeg->dc[t];
+                    total = 0;
+                    for(i = 1; i <= 16; i++)
+                        total += segment[i];
+                    if(total > 256 || length < 17 + total)
+                        return FALSE;
+                    if(!roq_jpeg_build_huffman(huffman, &segment[1], &segment[17], total))
+                        return FALSE;
+                    segment += 17 + total;
+                    length -= 17 + total;
+                }
+                break;
+
+            case JPEG_SOF0:
+            case JPEG_SOF1:
+                if(length < 6 || segment[0] != 8)
+                    return FALSE;
+                jpeg->height = BE_16(&segment[1]);
+                jpeg->width = BE_16(&segment[3]);
+                jpeg->components = segment[5];
+                if((jpeg->components != 1 && jpeg->components != 3) ||
+                   length < 6 + jpeg->components * 3 ||
+                   jpeg->width == 0 || jpeg->height == 0)
+                    return FALSE;
+                jpeg->hmax = jpeg->vmax = 1;
+                for(i = 0; i < jpeg->components; i++) {
+                    roq_jpeg_component_t* component = &jpeg->component[i];
+                    component->id = segment[6 + i * 3];
+                    component->h = segment[7 + i * 3] >> 4;
+                    component->v = segment[7 + i * 3] & 15;
+                    component->quant = segment[8 + i * 3] & 3;
+                    if(component->h < 1 || component->h > 2 || component->v < 1 || component->v > 2)
+                        return FALSE;
+                    // A single component scan is not interleaved
+                    if(jpeg->components == 1)
+                        component->h = component->v = 1;
+                    if(component->h > jpeg->hmax)
+                        jpeg->hmax = component->h;
+                    if(component->v > jpeg->vmax)
+                        jpeg->vmax = component->v;
+                }
+                // Both chroma planes share one subsampling, luma is full size
+                if(jpeg->components == 3 &&
+                   (jpeg->component[0].h != jpeg->hmax || jpeg->component[0].v != jpeg->vmax ||
+                    jpeg->component[1].h != jpeg->component[2].h ||
+                    jpeg->component[1].v != jpeg->component[2].v))
+                    return FALSE;
+                break;
+
+            case JPEG_DRI:
+                if(length < 2)
+                    return FALSE;
+                jpeg->restart_interval = BE_16(segment);
+                break;
+
+            case JPEG_SOS:
+                // Only one scan holding every component
+                if(!jpeg->components || length < 1 || segment[0] != jpeg->components ||
+                   length < 4 + segment[0] * 2)
+                    return FALSE;
+                for(i = 0; i < jpeg->components; i++) {
+                    roq_jpeg_component_t* component = NULL;
+                    for(j = 0; j < jpeg->components; j++)
+                        if(jpeg->component[j].id == segment[1 + i * 2])
+                            component = &jpeg->component[j];
+                    if(!component)
+                        return FALSE;
+                    component->dc_table = segment[2 + i * 2] >> 4 & 3;
+                    component->ac_table = segment[2 + i * 2] & 3;
+                    if(!jpeg->dc[component->dc_table].defined ||
+                       !jpeg->ac[component->ac_table].defined ||
+                       !jpeg->quant_defined[component->quant])
+                        return FALSE;
+                }
+
+                jpeg->pos = pos;
+                jpeg->end = end;
+                return roq_jpeg_decode_scan(jpeg, frame, width, height, stride, shift);
+
+            default:
+                // Progressive, lossless and arithmetic coded frames
+                if(marker >= 0xC2 && marker <= 0xCF && marker != JPEG_DHT)
+                    return FALSE;
+                // APPn, COM and the like
+                break;
+        }
+    }
+
+    return FALSE;
+}
+
+static int roq_jpeg_build_huffman(roq_jpeg_huffman_t* huffman, const unsigned char* counts, const unsigned char* values, int total) {
+    int length, i, k = 0, fill;
+    unsigned int code = 0;
+
+    huffman->defined = FALSE;
+    memset(huffman->lookup_length, 0, sizeof(huffman->lookup_length));
+    memcpy(huffman->values, values, total);
+
+    for(length = 1; length <= 16; length++) {
+        huffman->valoffset[length] = k - code;
+        for(i = 0; i < counts[length - 1]; i++, k++, code++) {
+            // Too many codes for their length, before they spill over
+            // the lookup tables
+            if(code >= (1u << length))
+                return FALSE;
+            if(length <= ROQ_JPEG_LOOKUP_BITS) {
+                fill = 1 << (ROQ_JPEG_LOOKUP_BITS - length);
+                memset(&huffman->lookup_length[code * fill], length, fill);
+                memset(&huffman->lookup_value[code * fill], values[k], fill);
+            }
+        }
+        huffman->maxcode[length] = counts[length - 1] ? (int)code - 1 : -1;
+        code <<= 1;
+    }
+    huffman->maxcode[17] = 0x7FFFFFFF;
+    huffman->defined = TRUE;
+
+    return TRUE;
+}
+
+// Keeps at least 25 bits in the bit buffer. Once a marker shows up the
+// data is over and zeros are fed instead.
+static ROQ_INLINE void roq_jpeg_fill(roq_jpeg_t* jpeg) {
+    unsigned int byte;
+
+    while(jpeg->bit_count <= 24) {
+        byte = 0;
+        if(!jpeg->marker && jpeg->pos < jpeg->end) {
+            byte = *jpeg->pos;
+            if(byte != 0xFF) {
+                jpeg->pos++;
+            }
+            else if(jpeg->pos + 1 < jpeg->end && jpeg->pos[1] == 0x00) {
+                jpeg->pos += 2;
+            }
+            else {
+                jpeg->marker = jpeg->pos + 1 < jpeg->end ? jpeg->pos[1] : JPEG_EOI;
+                byte = 0;
+            }
+        }
+        jpeg->bits |= byte << (24 - jpeg->bit_count);
+        jpeg->bit_count += 8;
+    }
+}
+
+static ROQ_INLINE int roq_jpeg_bits(roq_jpeg_t* jpeg, int count) {
+    int value;
+
+    roq_jpeg_fill(jpeg);
+    value = jpeg->bits >> (32 - count);
+    jpeg->bits <<= count;
+    jpeg->bit_count -= count;
+
+    return value;
+}
+
+// Reads a count bit magnitude and sign extends it
+static ROQ_INLINE int roq_jpeg_extend(roq_jpeg_t* jpeg, int count) {
+    int value = roq_jpeg_bits(jpeg, count);
+
+    if(value < (1 << (count - 1)))
+        value -= (1 << count) - 1;
+
+    return value;
+}
+
+static ROQ_INLINE int roq_jpeg_huffman(roq_jpeg_t* jpeg, roq_jpeg_huffman_t* huffman) {
+    int look, length, code;
+
+    roq_jpeg_fill(jpeg);
+    look = jpeg->bits >> (32 - ROQ_JPEG_LOOKUP_BITS);
+    length = huffman->lookup_length[look];
+    if(length) {
+        jpeg->bits <<= length;
+        jpeg->bit_count -= length;
+        return huffman->lookup_value[look];
+    }
+
+    for(length = ROQ_JPEG_LOOKUP_BITS + 1; length <= 16; length++) {
+        code = jpeg->bits >> (32 - length);
+        if(code <= huffman->maxcode[length]) {
+            jpeg->bits <<= length;
+            jpeg->bit_count -= length;
+            return huffman->values[(code + huffman->valoffset[length]) & 0xFF];
+        }
+    }
+
+    return -1;
+}
+
+// Decodes one block into jpeg->coef, dequantized. Returns the number of
+// the last coefficient decoded, 0 for a block with only DC, or -1.
+static int roq_jpeg_decode_block(roq_jpeg_t* jpeg, roq_jpeg_component_t* component) {
+    int* quant = jpeg->quant[component->quant];
+    roq_jpeg_huffman_t* ac = &jpeg->ac[component->ac_table];
+    int symbol, run, count, k, last = 0;
+
+    memset(jpeg->coef, 0, sizeof(jpeg->coef));
+
+    symbol = roq_jpeg_huffman(jpeg, &jpeg->dc[component->dc_table]);
+    if(symbol < 0 || symbol > 11)
+        return -1;
+    if(symbol)
+        component->dc_pred += roq_jpeg_extend(jpeg, symbol);
+    jpeg->coef[0] = component->dc_pred * quant[0];
+
+    for(k = 1; k < 64; k++) {
+        symbol = roq_jpeg_huffman(jpeg, ac);
+        if(symbol < 0)
+            return -1;
+        run = symbol >> 4;
+        count = symbol & 15;
+
+        if(!count) {
+            if(run != 15)
+                break;
+            k += 15;
+            continue;
+        }
+
+        k += run;
+        if(k > 63)
+            return -1;
+        last = dezigzag[k];
+        jpeg->coef[last] = roq_jpeg_extend(jpeg, count) * quant[last];
+    }
+
+    return last;
+}
+
+// 8x8 inverse DCT of jpeg->coef into samples with a row pitch of 16
+static void roq_jpeg_idct(roq_jpeg_t* jpeg, unsigned char* out, int dc_only) {
+    int workspace[64];
+    int tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+    int tmp10, tmp11, tmp12, tmp13;
+    int z5, z10, z11, z12, z13;
+    int* in = jpeg->coef;
+    int* ws;
+    int i, v;
+
+    if(dc_only) {
+        v = ((in[0] + (1 << (IDCT_PASS1_BITS + 2))) >> (IDCT_PASS1_BITS + 3)) + 128;
+        v = v < 0 ? 0 : v > 255 ? 255 : v;
+        for(i = 0; i < 8; i++)
+            memset(&out[i * 16], v, 8);
+        return;
+    }
+
+    // Pass 1: columns into the workspace
+    for(i = 0, ws = workspace; i < 8; i++, in++, ws++) {
+        if(!(in[8] | in[16] | in[24] | in[32] | in[40] | in[48] | in[56])) {
+            ws[0] = ws[8] = ws[16] = ws[24] = ws[32] = ws[40] = ws[48] = ws[56] = in[0];
+            continue;
+        }
+
+        tmp10 = in[0] + in[32];
+        tmp11 = in[0] - in[32];
+        tmp13 = in[16] + in[48];
+        tmp12 = IDCT_MULTIPLY(in[16] - in[48], FIX_1_414213562) - tmp13;
+
+        tmp0 = tmp10 + tmp13;
+        tmp3 = tmp10 - tmp13;
+        tmp1 = tmp11 + tmp12;
+        tmp2 = tmp11 - tmp12;
+
+        z13 = in[40] + in[24];
+        z10 = in[40] - in[24];
+        z11 = in[8] + in[56];
+        z12 = in[8] - in[56];
+
+        tmp7 = z11 + z13;
+        tmp11 = IDCT_MULTIPLY(z11 - z13, FIX_1_414213562);
+        z5 = IDCT_MULTIPLY(z10 + z12, FIX_1_847759065);
+        tmp10 = IDCT_MULTIPLY(z12, FIX_1_082392200) - z5;
+        tmp12 = IDCT_MULTIPLY(z10, -FIX_2_613125930) + z5;
+
+        tmp6 = tmp12 - tmp7;
+        tmp5 = tmp11 - tmp6;
+        tmp4 = tmp10 + tmp5;
+
+        ws[0]  = tmp0 + tmp7;
+        ws[56] = tmp0 - tmp7;
+        ws[8]  = tmp1 + tmp6;
+        ws[48] = tmp1 - tmp6;
+        ws[16] = tmp2 + tmp5;
+        ws[40] = tmp2 - tmp5;
+        ws[32] = tmp3 + tmp4;
+        ws[24] = tmp3 - tmp4;
+    }
+
+    // Pass 2: rows into the samples. The rounding and the +128 level
+    // shift ride on the DC term, which reaches every output once.
+#define IDCT_OUT(x) (v = (x) >> (IDCT_PASS1_BITS + 3), (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v))
+    for(i = 0, ws = workspace; i < 8; i++, ws += 8, out += 16) {
+        int dc = ws[0] + (1 << (IDCT_PASS1_BITS + 2)) + (128 << (IDCT_PASS1_BITS + 3));
+
+        tmp10 = dc + ws[4];
+        tmp11 = dc - ws[4];
+        tmp13 = ws[2] + ws[6];
+        tmp12 = IDCT_MULTIPLY(ws[2] - ws[6], FIX_1_414213562) - tmp13;
+
+        tmp0 = tmp10 + tmp13;
+        tmp3 = tmp10 - tmp13;
+        tmp1 = tmp11 + tmp12;
+        tmp2 = tmp11 - tmp12;
+
+        z13 = ws[5] + ws[3];
+        z10 = ws[5] - ws[3];
+        z11 = ws[1] + ws[7];
+        z12 = ws[1] - ws[7];
+
+        tmp7 = z11 + z13;
+        tmp11 = IDCT_MULTIPLY(z11 - z13, FIX_1_414213562);
+        z5 = IDCT_MULTIPLY(z10 + z12, FIX_1_847759065);
+        tmp10 = IDCT_MULTIPLY(z12, FIX_1_082392200) - z5;
+        tmp12 = IDCT_MULTIPLY(z10, -FIX_2_613125930) + z5;
+
+        tmp6 = tmp12 - tmp7;
+        tmp5 = tmp11 - tmp6;
+        tmp4 = tmp10 + tmp5;
+
+        out[0] = IDCT_OUT(tmp0 + tmp7);
+        out[7] = IDCT_OUT(tmp0 - tmp7);
+        out[1] = IDCT_OUT(tmp1 + tmp6);
+        out[6] = IDCT_OUT(tmp1 - tmp6);
+        out[2] = IDCT_OUT(tmp2 + tmp5);
+        out[5] = IDCT_OUT(tmp2 - tmp5);
+        out[4] = IDCT_OUT(tmp3 + tmp4);
+        out[3] = IDCT_OUT(tmp3 - tmp4);
+    }
+#undef IDCT_OUT
+}
+
+static ROQ_INLINE unsigned short roq_jpeg_rgb565(roq_jpeg_t* jpeg, int y, int cb, int cr) {
+    int r = y + jpeg->cr_r[cr];
+    int g = y + ((jpeg->cb_g[cb] + jpeg->cr_g[cr]) >> 16);
+    int b = y + jpeg->cb_b[cb];
+
+    r = r < 0 ? 0 : r > 255 ? 255 : r;
+    g = g < 0 ? 0 : g > 255 ? 255 : g;
+    b = b < 0 ? 0 : b > 255 ? 255 : b;
+
+    return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+}
+
+// Converts the decoded MCU at (x, y) into the frame. Only the part
+// inside limit_x x limit_y (full resolution pixels) is written.
+static void roq_jpeg_output(roq_jpeg_t* jpeg, unsigned short* frame, int stride, int shift,
+    int x, int y, int mcu_width, int mcu_height, int limit_x, int limit_y) {
+    unsigned char* luma = jpeg->samples[0];
+    unsigned char* cb_samples = jpeg->samples[1];
+    unsigned char* cr_samples = jpeg->samples[2];
+    int step = 1 << shift;
+    int cx = 0, cy = 0;
+    int width = limit_x - x < mcu_width ? limit_x - x : mcu_width;
+    int height = limit_y - y < mcu_height ? limit_y - y : mcu_height;
+    unsigned short* out;
+    int lx, ly, i, j, sum, c;
+
+    // log2 of the chroma subsampling
+    if(jpeg->components == 3) {
+        cx = jpeg->hmax / jpeg->component[1].h - 1;
+        cy = jpeg->vmax / jpeg->component[1].v - 1;
+    }
+
+    frame += (y >> shift) * stride + (x >> shift);
+
+    for(ly = 0; ly + step <= height; ly += step, frame += stride) {
+        out = frame;
+        for(lx = 0; lx + step <= width; lx += step) {
+            if(shift) {
+                sum = 0;
+                for(j = 0; j < step; j++)
+                    for(i = 0; i < step; i++)
+                        sum += luma[(ly + j) * 16 + lx + i];
+                sum >>= shift * 2;
+            }
+            else {
+                sum = luma[ly * 16 + lx];
+            }
+
+            if(jpeg->components == 1) {
+                *out++ = ((sum >> 3) << 11) | ((sum >> 2) << 5) | (sum >> 3);
+                continue;
+            }
+
+            // Chroma from the middle of the footprint
+            c = ((ly + step / 2) >> cy) * 16 + ((lx + step / 2) >> cx);
+            *out++ = roq_jpeg_rgb565(jpeg, sum, cb_samples[c], cr_samples[c]);
+        }
+    }
+}
+
+static void roq_jpeg_restart(roq_jpeg_t* jpeg) {
+    int i;
+
+    jpeg->bits = 0;
+    jpeg->bit_count = 0;
+
+    // Skip whatever is left before the RSTn marker
+    while(jpeg->pos + 1 < jpeg->end &&
+          !(jpeg->pos[0] == 0xFF && jpeg->pos[1] >= JPEG_RST0 && jpeg->pos[1] <= JPEG_RST7))
+        jpeg->pos++;
+    if(jpeg->pos + 1 < jpeg->end)
+        jpeg->pos += 2;
+    jpeg->marker = 0;
+
+    for(i = 0; i < jpeg->components; i++)
+        jpeg->component[i].dc_pred = 0;
+}
+
+static int roq_jpeg_decode_scan(roq_jpeg_t* jpeg, unsigned short* frame, int width, int height, int stride, int shift) {
+    int mcu_width = 8 * jpeg->hmax;
+    int mcu_height = 8 * jpeg->vmax;
+    int mcus_x = (jpeg->width + mcu_width - 1) / mcu_width;
+    int mcus_y = (jpeg->height + mcu_height - 1) / mcu_height;
+    int limit_x = width << shift;
+    int limit_y = height << shift;
+    int mcu_x, mcu_y, c, bx, by, last;
+    int restarts_left = jpeg->restart_interval;
+    roq_jpeg_component_t* component;
+
+    if(jpeg->width < limit_x)
+        limit_x = jpeg->width;
+    if(jpeg->height < limit_y)
+        limit_y = jpeg->height;
+
+    jpeg->bits = 0;
+    jpeg->bit_count = 0;
+    jpeg->marker = 0;
+    for(c = 0; c < jpeg->components; c++)
+        jpeg->component[c].dc_pred = 0;
+
+    for(mcu_y = 0; mcu_y < mcus_y; mcu_y++) {
+        for(mcu_x = 0; mcu_x < mcus_x; mcu_x++) {
+            if(jpeg->restart_interval) {
+                if(!restarts_left) {
+                    roq_jpeg_restart(jpeg);
+                    restarts_left = jpeg->restart_interval;
+                }
+                restarts_left--;
+            }
+
+            for(c = 0; c < jpeg->components; c++) {
+                component = &jpeg->component[c];
+                for(by = 0; by < component->v; by++) {
+                    for(bx = 0; bx < component->h; bx++) {
+                        last = roq_jpeg_decode_block(jpeg, component);
+                        // Corrupt data: keep what has been decoded
+                        if(last < 0)
+                            return TRUE;
+                        roq_jpeg_idct(jpeg, &jpeg->samples[c][by * 8 * 16 + bx * 8], last == 0);
+                    }
+                }
+            }
+
+            if(mcu_x * mcu_width < limit_x && mcu_y * mcu_height < limit_y)
+                roq_jpeg_output(jpeg, frame, stride, shift, mcu_x * mcu_width, mcu_y * mcu_height,
+                    mcu_width, mcu_height, limit_x, limit_y);
+        }
+    }
+
+    return TRUE;
+}
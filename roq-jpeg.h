@@ -0,0 +1,76 @@
+/*
+ * Dreamroq JPEG keyframes
+ *
+ * Baseline JPEG decoder for RoQ_JPEG chunks. It is internal to
+ * dreamroqlib.c; roq_t embeds one roq_jpeg_t, so decoding a keyframe
+ * never allocates.
+ */
+
+#ifndef ROQ_JPEG_H
+#define ROQ_JPEG_H
+
+#define ROQ_JPEG_LOOKUP_BITS 9
+#define ROQ_JPEG_MAX_COMPONENTS 3
+
+typedef struct {
+    // Codes up to ROQ_JPEG_LOOKUP_BITS long resolve with one lookup:
+    // lookup_length is 0 for longer codes
+    unsigned char lookup_length[1 << ROQ_JPEG_LOOKUP_BITS];
+    unsigned char lookup_value[1 << ROQ_JPEG_LOOKUP_BITS];
+
+    // Canonical decoding of the longer codes
+    int maxcode[18];
+    int valoffset[17];
+    unsigned char values[256];
+    int defined;
+} roq_jpeg_huffman_t;
+
+typedef struct {
+    int id;
+    int h, v;             // sampling factors
+    int quant;            // quantization table
+    int dc_table, ac_table;
+    int dc_pred;
+} roq_jpeg_component_t;
+
+typedef struct {
+    // Dequantization tables in natural order, pre-scaled for the IDCT
+    int quant[4][64];
+    int quant_defined[4];
+    roq_jpeg_huffman_t dc[4];
+    roq_jpeg_huffman_t ac[4];
+
+    roq_jpeg_component_t component[ROQ_JPEG_MAX_COMPONENTS];
+    int components;
+    int width, height;
+    int hmax, vmax;
+    int restart_interval;
+
+    // Entropy coded data
+    const unsigned char* pos;
+    const unsigned char* end;
+    unsigned int bits;
+    int bit_count;
+    int marker;
+
+    // One MCU of samples, 16 per row for every component
+    int coef[64];
+    unsigned char samples[ROQ_JPEG_MAX_COMPONENTS][16 * 16];
+
+    // JFIF YCbCr -> RGB in 16.16 fixed point
+    int cr_r[256];
+    int cb_b[256];
+    int cr_g[256];
+    int cb_g[256];
+} roq_jpeg_t;
+
+void roq_jpeg_init(roq_jpeg_t* jpeg);
+
+// Decodes a baseline JPEG into an RGB565 frame of width x height pixels,
+// downscaled by 1 << shift. Anything outside the image is left alone.
+// Returns FALSE if the data is not a baseline JPEG this decoder handles;
+// corrupt entropy data stops the decode early but still returns TRUE.
+int roq_jpeg_decode(roq_jpeg_t* jpeg, const unsigned char* data, int size,
+    unsigned short* frame, int width, int height, int stride, int shift);
+
+#endif
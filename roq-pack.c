@@ -0,0 +1,266 @@
+/*
+ * Dreamroq packer
+ *
+ * Compresses a RoQ file into the blocked layout described in
+ * dreamroqlib.h, for clips that are preloaded into memory and played
+ * with roq_create_with_memory(). Every block is compressed on its own
+ * with LZ4, so the decoder only ever holds a couple of blocks
+ * uncompressed and can seek back to any block.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dreamroqlib.h"
+
+// LZ4 block format limits: a match is at least 4 bytes, at most 64 KiB
+// back, the last 5 bytes are always literals and the last match starts
+// at least 12 bytes before the end of the block
+#define MIN_MATCH      4
+#define MAX_OFFSET     0xFFFF
+#define LAST_LITERALS  5
+#define MATCH_LIMIT    12
+
+#define HASH_BITS      14
+#define CHAIN_DEPTH    32
+
+static unsigned int block_size = ROQ_PACK_BLOCK_SIZE;
+
+static int hash_head[1 << HASH_BITS];
+static int *hash_prev = NULL;
+
+static void put_le16(unsigned char *buf, unsigned int value)
+{
+    buf[0] = value & 0xFF;
+    buf[1] = (value >> 8) & 0xFF;
+}
+
+static void put_le32(unsigned char *buf, unsigned int value)
+{
+    put_le16(buf, value & 0xFFFF);
+    put_le16(buf + 2, value >> 16);
+}
+
+static unsigned int hash4(const unsigned char *p)
+{
+    unsigned int value = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+
+    return (value * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static unsigned char *put_length(unsigned char *out, unsigned int length)
+{
+    for (; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = length;
+
+    return out;
+}
+
+static unsigned char *put_sequence(unsigned char *out, const unsigned char *literals,
+    unsigned int literal_count, unsigned int offset, unsigned int match_length)
+{
+    unsigned char *token = out++;
+    unsigned int extra;
+
+    *token = (literal_count < 15 ? literal_count : 15) << 4;
+    if (literal_count >= 15)
+        out = put_length(out, literal_count - 15);
+    memcpy(out, literals, literal_count);
+    out += literal_count;
+
+    if (match_length)
+    {
+        put_le16(out, offset);
+        out += 2;
+        extra = match_length - MIN_MATCH;
+        *token |= extra < 15 ? extra : 15;
+        if (extra >= 15)
+            out = put_length(out, extra - 15);
+    }
+
+    return out;
+}
+
+// Greedy LZ4 compression of one block, following a short hash chain
+// for the longest match. out must hold size + size / 255 + 16 bytes.
+// Returns the compressed size.
+static unsigned int compress_block(const unsigned char *in, unsigned int size, unsigned char *out)
+{
+    unsigned char *start = out;
+    unsigned int anchor = 0, pos = 0;
+    unsigned int best_length, best_offset, length, h;
+    int candidate, depth;
+
+    memset(hash_head, -1, sizeof(hash_head));
+
+    while (size >= MATCH_LIMIT && pos + MATCH_LIMIT <= size)
+    {
+        h = hash4(in + pos);
+        best_length = 0;
+        best_offset = 0;
+        for (candidate = hash_head[h], depth = 0;
+             candidate >= 0 && pos - candidate <= MAX_OFFSET && depth < CHAIN_DEPTH;
+             candidate = hash_prev[candidate], depth++)
+        {
+            length = 0;
+            while (pos + length < size - LAST_LITERALS && in[candidate + length] == in[pos + length])
+                length++;
+            if (length > best_length)
+            {
+                best_length = length;
+                best_offset = pos - candidate;
+            }
+        }
+        hash_prev[pos] = hash_head[h];
+        hash_head[h] = pos;
+
+        if (best_length < MIN_MATCH)
+        {
+            pos++;
+            continue;
+        }
+
+        out = put_sequence(out, in + anchor, pos - anchor, best_offset, best_length);
+
+        // Matches starting inside this one still go into the chains
+        for (length = 1; length < best_length && pos + length + MATCH_LIMIT <= size; length++)
+        {
+            h = hash4(in + pos + length);
+            hash_prev[pos + length] = hash_head[h];
+            hash_head[h] = pos + length;
+        }
+        pos += best_length;
+        anchor = pos;
+    }
+
+    out = put_sequence(out, in + anchor, size - anchor, 0, 0);
+
+    return out - start;
+}
+
+static unsigned char *read_file(const char *filename, unsigned long *length)
+{
+    unsigned char *bytes = NULL;
+    FILE *file;
+    long size;
+
+    file = fopen(filename, "rb");
+    if (!file)
+    {
+        printf("could not open %s\n", filename);
+        return NULL;
+    }
+
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0)
+    {
+        bytes = malloc(size);
+        if (bytes && fread(bytes, size, 1, file) != 1)
+        {
+            free(bytes);
+            bytes = NULL;
+        }
+        *length = size;
+    }
+    fclose(file);
+
+    if (!bytes)
+        printf("could not read %s\n", filename);
+
+    return bytes;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *input = NULL, *output = NULL;
+    unsigned char *bytes, *packed, *header;
+    unsigned long length, packed_length, offset;
+    unsigned int block_count, header_size, size, i;
+    FILE *out;
+    int ok = 1;
+
+    for (i = 1; i < (unsigned int)argc; i++)
+    {
+        if (!strcmp(argv[i], "--block") && i + 1 < (unsigned int)argc)
+            block_size = atoi(argv[++i]);
+        else if (!input)
+            input = argv[i];
+        else
+            output = argv[i];
+    }
+
+    if (!input || !output || block_size < 1024 || block_size > 0x100000)
+    {
+        printf("USAGE: roq-pack [--block <bytes>] <input.roq> <output.rqz>\n");
+        printf("  block size is from 1024 to 1048576 bytes (default %d)\n", ROQ_PACK_BLOCK_SIZE);
+        return 1;
+    }
+
+    bytes = read_file(input, &length);
+    if (!bytes)
+        return 1;
+    if (length < 8 || bytes[0] != (RoQ_SIGNATURE & 0xFF) || bytes[1] != (RoQ_SIGNATURE >> 8))
+    {
+        printf("%s is not a RoQ file\n", input);
+        free(bytes);
+        return 1;
+    }
+
+    block_count = (length + block_size - 1) / block_size;
+    header_size = ROQ_PACK_HEADER_SIZE + (block_count + 1) * 4;
+    header = calloc(header_size, 1);
+    packed = malloc(block_size + block_size / 255 + 16);
+    hash_prev = malloc(block_size * sizeof(int));
+    out = fopen(output, "wb");
+    if (!header || !packed || !hash_prev || !out)
+    {
+        printf(out ? "out of memory\n" : "could not create %s\n", output);
+        return 1;
+    }
+
+    memcpy(header, ROQ_PACK_MAGIC, 4);
+    put_le16(&header[4], ROQ_PACK_VERSION);
+    put_le32(&header[8], block_size);
+    put_le32(&header[12], length);
+    put_le32(&header[16], block_count);
+
+    // The block table is filled in as the blocks are written
+    ok &= fwrite(header, header_size, 1, out) == 1;
+    offset = header_size;
+    for (i = 0; i < block_count && ok; i++)
+    {
+        size = length - (unsigned long)i * block_size;
+        if (size > block_size)
+            size = block_size;
+
+        put_le32(&header[ROQ_PACK_HEADER_SIZE + i * 4], offset);
+        packed_length = compress_block(bytes + (unsigned long)i * block_size, size, packed);
+        if (packed_length < size)
+            ok &= fwrite(packed, packed_length, 1, out) == 1;
+        else
+        {
+            packed_length = size;
+            ok &= fwrite(bytes + (unsigned long)i * block_size, size, 1, out) == 1;
+        }
+        offset += packed_length;
+    }
+    put_le32(&header[ROQ_PACK_HEADER_SIZE + block_count * 4], offset);
+
+    ok &= fseek(out, 0, SEEK_SET) == 0 && fwrite(header, header_size, 1, out) == 1;
+    if (fclose(out) != 0)
+        ok = 0;
+
+    if (ok)
+        printf("%lu bytes in %u blocks of %u, packed to %lu bytes (%.2fx)\n",
+            length, block_count, block_size, offset, (double)length / offset);
+    else
+        printf("error writing %s\n", output);
+
+    free(hash_prev);
+    free(packed);
+    free(header);
+    free(bytes);
+
+    return ok ? 0 : 1;
+}
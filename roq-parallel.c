@@ -0,0 +1,409 @@
+/*
+ * Dreamroq parallel decoding
+ *
+ * The whole file is read into memory once and every segment gets a
+ * decoder of its own over it, so the workers share nothing but the
+ * list of segments. Each worker appends copies of what its decoder
+ * produces to its segment; the calling thread hands the segments out
+ * one after another and frees them as it goes. A segment holds at most
+ * its share of the budget for buffered output; its worker waits for
+ * the calling thread to take some before appending more.
+ */
+
+#include <pthread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "roq-parallel.h"
+
+#define SEGMENTS_GUESS 256
+
+#define SEGMENT_WAITING  0
+#define SEGMENT_DECODING 1
+#define SEGMENT_DONE     2
+
+typedef struct roq_parallel_item_t
+{
+    struct roq_parallel_item_t* next;
+    int channels;         // 0 for a frame
+    int width, height, stride, texture_height;
+    int size;
+    unsigned char* data;
+} roq_parallel_item_t;
+
+typedef struct
+{
+    long start;
+    long end;             // -1 for the last segment
+    int state;
+    roq_parallel_item_t* head;
+    roq_parallel_item_t** tail;
+    size_t buffered;      // bytes of data in the items
+} roq_parallel_segment_t;
+
+typedef struct
+{
+    unsigned char* bytes;
+    size_t length;
+    int scale;
+    int decode_video;
+    int decode_audio;
+
+    roq_parallel_segment_t* segments;
+    int count;
+    int next;             // next segment for a worker
+    int output;           // segment being handed to the callbacks
+    int window;
+    size_t segment_budget; // bytes of output a segment may hold
+    int full;             // workers waiting for their segment to drain
+    int error;            // roq_errno of the first failure
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} roq_parallel_t;
+
+typedef struct
+{
+    roq_parallel_t* parallel;
+    roq_parallel_segment_t* segment;
+} roq_parallel_worker_t;
+
+static void append_item(roq_parallel_worker_t* worker, roq_parallel_item_t* item)
+{
+    roq_parallel_t* parallel = worker->parallel;
+    roq_parallel_segment_t* segment = worker->segment;
+
+    pthread_mutex_lock(&parallel->lock);
+
+    // One item always fits, so the segment being handed out moves on
+    // even with a budget smaller than a frame
+    while (item && !parallel->error && segment->head &&
+           segment->buffered + item->size > parallel->segment_budget)
+    {
+        parallel->full++;
+        pthread_cond_wait(&parallel->changed, &parallel->lock);
+        parallel->full--;
+    }
+
+    if (!item)
+    {
+        if (!parallel->error)
+            parallel->error = ROQ_NO_MEMORY;
+    }
+    else
+    {
+        item->next = NULL;
+        *segment->tail = item;
+        segment->tail = &item->next;
+        segment->buffered += item->size;
+    }
+    pthread_cond_broadcast(&parallel->changed);
+    pthread_mutex_unlock(&parallel->lock);
+}
+
+static roq_parallel_item_t* new_item(int size)
+{
+    roq_parallel_item_t* item = (roq_parallel_item_t*)malloc(sizeof(roq_parallel_item_t) + size);
+
+    if (item)
+    {
+        item->size = size;
+        item->data = (unsigned char*)(item + 1);
+    }
+
+    return item;
+}
+
+static void video_callback(unsigned short* frame_data, int width, int height, int stride, int texture_height, void* user_data)
+{
+    int size = stride * texture_height * sizeof(unsigned short);
+    roq_parallel_item_t* item = new_item(size);
+
+    if (item)
+    {
+        item->channels = 0;
+        item->width = width;
+        item->height = height;
+        item->stride = stride;
+        item->texture_height = texture_height;
+        memcpy(item->data, frame_data, size);
+    }
+    append_item((roq_parallel_worker_t*)user_data, item);
+}
+
+static void audio_callback(unsigned char* audio_frame_data, int size, int channels, void* user_data)
+{
+    roq_parallel_item_t* item = new_item(size);
+
+    if (item)
+    {
+        item->channels = channels;
+        memcpy(item->data, audio_frame_data, size);
+    }
+    append_item((roq_parallel_worker_t*)user_data, item);
+}
+
+static int decode_segment(roq_parallel_t* parallel, roq_parallel_segment_t* segment)
+{
+    roq_parallel_worker_t worker;
+    roq_t* roq;
+    int ok;
+
+    roq = roq_create_with_memory(parallel->bytes, parallel->length, 0);
+    if (!roq)
+        return 0;
+
+    worker.parallel = parallel;
+    worker.segment = segment;
+    roq_set_user_data(roq, &worker);
+    if (parallel->decode_video)
+        roq_set_video_decode_callback(roq, video_callback);
+    if (parallel->decode_audio)
+        roq_set_audio_decode_callback(roq, audio_callback);
+
+    ok = roq_set_decode_scale(roq, parallel->scale) && roq_seek_segment(roq, segment->start);
+    while (ok && !roq_has_ended(roq) && (segment->end < 0 || roq_get_position(roq) < segment->end))
+        ok = roq_decode(roq) || roq_has_ended(roq);
+
+    roq_destroy(roq);
+
+    return ok;
+}
+
+static void* worker_thread(void* arg)
+{
+    roq_parallel_t* parallel = (roq_parallel_t*)arg;
+    roq_parallel_segment_t* segment;
+    int ok;
+
+    pthread_mutex_lock(&parallel->lock);
+    for (;;)
+    {
+        // Stay within the window of segments the output may hold
+        while (!parallel->error && parallel->next < parallel->count &&
+               parallel->next >= parallel->output + parallel->window)
+            pthread_cond_wait(&parallel->changed, &parallel->lock);
+        if (parallel->error || parallel->next == parallel->count)
+            break;
+
+        segment = &parallel->segments[parallel->next++];
+        segment->state = SEGMENT_DECODING;
+        pthread_mutex_unlock(&parallel->lock);
+
+        ok = decode_segment(parallel, segment);
+
+        pthread_mutex_lock(&parallel->lock);
+        segment->state = SEGMENT_DONE;
+        if (!ok && !parallel->error)
+            parallel->error = roq_errno ? roq_errno : ROQ_RENDER_PROBLEM;
+        pthread_cond_broadcast(&parallel->changed);
+    }
+    pthread_mutex_unlock(&parallel->lock);
+
+    return NULL;
+}
+
+// Hands the output of every segment to the callbacks in order, as soon
+// as it is there
+static void output_segments(roq_parallel_t* parallel, roq_video_decode_callback video_cb,
+    roq_audio_decode_callback audio_cb, void* user_data)
+{
+    roq_parallel_segment_t* segment;
+    roq_parallel_item_t* item;
+
+    pthread_mutex_lock(&parallel->lock);
+    while (parallel->output < parallel->count && !parallel->error)
+    {
+        segment = &parallel->segments[parallel->output];
+        if (!segment->head)
+        {
+            if (segment->state == SEGMENT_DONE)
+            {
+                parallel->output++;
+                pthread_cond_broadcast(&parallel->changed);
+            }
+            else
+                pthread_cond_wait(&parallel->changed, &parallel->lock);
+            continue;
+        }
+
+        item = segment->head;
+        segment->head = item->next;
+        if (!segment->head)
+            segment->tail = &segment->head;
+        segment->buffered -= item->size;
+        if (parallel->full)
+            pthread_cond_broadcast(&parallel->changed);
+        pthread_mutex_unlock(&parallel->lock);
+
+        if (item->channels)
+            audio_cb(item->data, item->size, item->channels, user_data);
+        else
+            video_cb((unsigned short*)item->data, item->width, item->height, item->stride, item->texture_height, user_data);
+        free(item);
+
+        pthread_mutex_lock(&parallel->lock);
+    }
+    pthread_mutex_unlock(&parallel->lock);
+}
+
+static void scan_video_callback(unsigned short* frame_data, int width, int height, int stride, int texture_height, void* user_data)
+{
+}
+
+static void scan_audio_callback(unsigned char* audio_frame_data, int size, int channels, void* user_data)
+{
+}
+
+// Lists the segments of the file
+static int find_segments(roq_parallel_t* parallel)
+{
+    roq_t* roq = roq_create_with_memory(parallel->bytes, parallel->length, 0);
+    long* offsets = NULL;
+    int max = SEGMENTS_GUESS;
+    int count = 0;
+    int i;
+
+    if (!roq)
+        return 0;
+    if (parallel->decode_video)
+        roq_set_video_decode_callback(roq, scan_video_callback);
+    if (parallel->decode_audio)
+        roq_set_audio_decode_callback(roq, scan_audio_callback);
+
+    // Again with room for all of them if the guess was short
+    do {
+        free(offsets);
+        max = count > max ? count : max;
+        offsets = (long*)malloc(max * sizeof(long));
+        count = offsets ? roq_find_segments(roq, offsets, max) : 0;
+    } while (count > max);
+    roq_destroy(roq);
+
+    parallel->segments = count ? (roq_parallel_segment_t*)calloc(count, sizeof(roq_parallel_segment_t)) : NULL;
+    if (!parallel->segments)
+    {
+        free(offsets);
+        return 0;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        parallel->segments[i].start = offsets[i];
+        parallel->segments[i].end = i + 1 < count ? offsets[i + 1] : -1;
+        parallel->segments[i].tail = &parallel->segments[i].head;
+    }
+    parallel->count = count;
+    free(offsets);
+
+    return count;
+}
+
+static unsigned char* read_file(const char* filename, size_t* length)
+{
+    unsigned char* bytes;
+    FILE* file;
+    long size;
+
+    file = fopen(filename, "rb");
+    if (!file)
+    {
+        roq_errno = ROQ_FILE_OPEN_FAILURE;
+        return NULL;
+    }
+
+    bytes = NULL;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0)
+    {
+        bytes = (unsigned char*)malloc(size);
+        if (bytes && fread(bytes, size, 1, file) != 1)
+        {
+            free(bytes);
+            bytes = NULL;
+        }
+        *length = size;
+    }
+    fclose(file);
+
+    if (!bytes)
+        roq_errno = ROQ_FILE_READ_FAILURE;
+
+    return bytes;
+}
+
+int roq_parallel_decode(const char* filename, int jobs, int scale, size_t max_buffered,
+    roq_video_decode_callback video_cb, roq_audio_decode_callback audio_cb, void* user_data)
+{
+    roq_parallel_t parallel;
+    roq_parallel_item_t* item;
+    pthread_t* threads;
+    int started = 0;
+    int i;
+
+    if (jobs < 1 || (!video_cb && !audio_cb))
+    {
+        roq_errno = ROQ_CLIENT_PROBLEM;
+        return 0;
+    }
+
+    memset(&parallel, 0, sizeof(parallel));
+    parallel.scale = scale;
+    parallel.decode_video = video_cb != NULL;
+    parallel.decode_audio = audio_cb != NULL;
+    parallel.window = jobs * 2;
+    parallel.segment_budget = (max_buffered ? max_buffered : ROQ_PARALLEL_DEFAULT_BUFFER) / parallel.window;
+
+    parallel.bytes = read_file(filename, &parallel.length);
+    if (!parallel.bytes)
+        return 0;
+
+    if (!find_segments(&parallel))
+    {
+        free(parallel.bytes);
+        return 0;
+    }
+
+    if (jobs > parallel.count)
+        jobs = parallel.count;
+    threads = (pthread_t*)malloc(jobs * sizeof(pthread_t));
+
+    pthread_mutex_init(&parallel.lock, NULL);
+    pthread_cond_init(&parallel.changed, NULL);
+    for (started = 0; threads && started < jobs; started++)
+    {
+        if (pthread_create(&threads[started], NULL, worker_thread, &parallel))
+            break;
+    }
+    if (!started)
+        parallel.error = ROQ_NO_MEMORY;
+
+    output_segments(&parallel, video_cb, audio_cb, user_data);
+
+    // After a failure the workers stop once they finish their segment
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (i = 0; i < parallel.count; i++)
+    {
+        while ((item = parallel.segments[i].head))
+        {
+            parallel.segments[i].head = item->next;
+            free(item);
+        }
+    }
+    pthread_cond_destroy(&parallel.changed);
+    pthread_mutex_destroy(&parallel.lock);
+    free(threads);
+    free(parallel.segments);
+    free(parallel.bytes);
+
+    if (parallel.error)
+    {
+        roq_errno = parallel.error;
+        return 0;
+    }
+
+    return parallel.count;
+}
@@ -0,0 +1,40 @@
+/*
+ * Dreamroq parallel decoding
+ *
+ * Decodes one file on several threads, for batch work like
+ * transcoding where total throughput matters more than latency. The
+ * file is split at the segments roq_find_segments() finds, a pool of
+ * threads decodes the segments with a decoder each, and the frames and
+ * audio chunks are handed to the callbacks in stream order, on the
+ * calling thread. Host builds only (pthreads).
+ */
+
+#ifndef ROQ_PARALLEL_H
+#define ROQ_PARALLEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "dreamroqlib.h"
+
+#define ROQ_PARALLEL_DEFAULT_BUFFER (1024 * 1024 * 256)
+
+// Decodes filename at the given decode scale on jobs threads. Either
+// callback may be NULL to leave that stream out. Decoding runs at most
+// twice as many segments as there are threads ahead of the one being
+// handed out. Their output waits in memory until its turn, at most
+// max_buffered bytes of it (0 for ROQ_PARALLEL_DEFAULT_BUFFER) split
+// evenly between them, give or take a frame each; a segment that has
+// used its share waits, so a small budget costs parallelism on long
+// segments. Returns the number of segments, or 0 and sets roq_errno on
+// a failure; the callbacks may have been called for part of the file by
+// then.
+int roq_parallel_decode(const char* filename, int jobs, int scale, size_t max_buffered,
+    roq_video_decode_callback video_cb, roq_audio_decode_callback audio_cb, void* user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * Roq-Player platform layer by Andress Barajas
+ *
+ * KallistiOS backend. Textures live in PVR memory, audio goes
+ * through the AICA sound stream and threads/mutexes are KOS ones.
+ */
+
+#include <kos/thread.h>
+#include <kos/mutex.h>
+#include <dc/sound/stream.h>
+#include <dc/pvr.h>
+#include <arch/timer.h>
+#include <arch/cache.h>
+
+#include <stdlib.h>
+
+#include "roq-platform.h"
+
+struct plat_texture_t {
+    pvr_ptr_t txr;
+    pvr_poly_hdr_t hdr;
+    int width;
+    int height;
+};
+
+struct plat_audio_t {
+    snd_stream_hnd_t shnd;
+    plat_audio_callback cb;
+    void* user_data;
+};
+
+struct plat_thread_t {
+    kthread_t* thd;
+};
+
+struct plat_mutex_t {
+    mutex_t mut;
+};
+
+static void* aica_callback(snd_stream_hnd_t hnd, int bytes_needed, int* bytes_returning);
+
+int plat_init(void) {
+    snd_stream_init();
+    pvr_init_defaults();
+
+    return 1;
+}
+
+unsigned int plat_time_ms(void) {
+    uint32_t s, ms;
+    uint64_t msec;
+
+    timer_ms_gettime(&s, &ms);
+    msec = (((uint64_t)s) * ((uint64_t)1000)) + ((uint64_t)ms);
+
+    return (unsigned int)msec;
+}
+
+void plat_sleep_ms(unsigned int ms) {
+    thd_sleep(ms);
+}
+
+void plat_yield(void) {
+    thd_pass();
+}
+
+plat_thread_t* plat_thread_create(void* (*routine)(void* arg), void* arg) {
+    plat_thread_t* thread = malloc(sizeof(plat_thread_t));
+    if(!thread)
+        return NULL;
+
+    thread->thd = thd_create(0, routine, arg);
+    if(!thread->thd) {
+        free(thread);
+        return NULL;
+    }
+
+    return thread;
+}
+
+void plat_thread_join(plat_thread_t* thread) {
+    if(!thread)
+        return;
+
+    thd_join(thread->thd, NULL);
+    free(thread);
+}
+
+plat_mutex_t* plat_mutex_create(void) {
+    plat_mutex_t* mutex = malloc(sizeof(plat_mutex_t));
+    if(!mutex)
+        return NULL;
+
+    mutex_init(&mutex->mut, MUTEX_TYPE_NORMAL);
+
+    return mutex;
+}
+
+void plat_mutex_lock(plat_mutex_t* mutex) {
+    mutex_lock(&mutex->mut);
+}
+
+void plat_mutex_unlock(plat_mutex_t* mutex) {
+    mutex_unlock(&mutex->mut);
+}
+
+void plat_mutex_destroy(plat_mutex_t* mutex) {
+    if(!mutex)
+        return;
+
+    mutex_destroy(&mutex->mut);
+    free(mutex);
+}
+
+plat_texture_t* plat_texture_create(int width, int height) {
+    pvr_poly_cxt_t cxt;
+    plat_texture_t* texture = malloc(sizeof(plat_texture_t));
+    if(!texture)
+        return NULL;
+
+    texture->txr = pvr_mem_malloc(width * height * 2);
+    if(!texture->txr) {
+        free(texture);
+        return NULL;
+    }
+    texture->width = width;
+    texture->height = height;
+
+    pvr_poly_cxt_txr(&cxt, PVR_LIST_OP_POLY, PVR_TXRFMT_RGB565 | PVR_TXRFMT_NONTWIDDLED, width, height, texture->txr, PVR_FILTER_NONE);// PVR_FILTER_BILINEAR); //PVR_FILTER_NONE
+    pvr_poly_compile(&texture->hdr, &cxt);
+
+    return texture;
+}
+
+void plat_texture_upload(plat_texture_t* texture, const unsigned short* data, int size) {
+    // DMA causes artifacts
+    // dcache_flush_range((uint32)data, size);   // dcache flush is needed when using DMA
+    // pvr_txr_load_dma(data, texture->txr, size, 1, NULL, 0);
+    pvr_txr_load((void*)data, texture->txr, size);
+}
+
+// Rows of at least 16 texels keep every store queue burst whole
+void plat_texture_upload_rows(plat_texture_t* texture, const unsigned short* data, int stride) {
+    uint16_t* txr = (uint16_t*)texture->txr;
+    int y;
+
+    if(stride == texture->width) {
+        pvr_txr_load((void*)data, texture->txr, texture->width * texture->height * 2);
+        return;
+    }
+
+    for(y = 0; y < texture->height; y++)
+        pvr_txr_load((void*)(data + y * stride), txr + y * texture->width, texture->width * 2);
+}
+
+void plat_texture_destroy(plat_texture_t* texture) {
+    if(!texture)
+        return;
+
+    pvr_mem_free(texture->txr);
+    free(texture);
+}
+
+void plat_scene_begin(void) {
+    pvr_wait_ready();
+    pvr_scene_begin();
+    pvr_list_begin(PVR_LIST_OP_POLY);
+}
+
+void plat_draw_texture(plat_texture_t* texture, float x0, float y0, float x1, float y1, float u1, float v1) {
+    pvr_vertex_t vert;
+
+    pvr_prim(&texture->hdr, sizeof(pvr_poly_hdr_t));
+
+    vert.z = 1.0f;
+    vert.argb = PVR_PACK_COLOR(1.0f, 1.0f, 1.0f, 1.0f);
+    vert.oargb = 0;
+    vert.flags = PVR_CMD_VERTEX;
+
+    vert.x = x0;
+    vert.y = y0;
+    vert.u = 0.0f;
+    vert.v = 0.0f;
+    pvr_prim(&vert, sizeof(pvr_vertex_t));
+
+    vert.x = x1;
+    vert.u = u1;
+    pvr_prim(&vert, sizeof(pvr_vertex_t));
+
+    vert.x = x0;
+    vert.y = y1;
+    vert.u = 0.0f;
+    vert.v = v1;
+    pvr_prim(&vert, sizeof(pvr_vertex_t));
+
+    vert.x = x1;
+    vert.u = u1;
+    vert.flags = PVR_CMD_VERTEX_EOL;
+    pvr_prim(&vert, sizeof(pvr_vertex_t));
+}
+
+void plat_scene_finish(void) {
+    pvr_list_finish();
+    pvr_scene_finish();
+}
+
+plat_audio_t* plat_audio_create(plat_audio_callback cb, void* user_data) {
+    plat_audio_t* audio = malloc(sizeof(plat_audio_t));
+    if(!audio)
+        return NULL;
+
+    audio->shnd = snd_stream_alloc(aica_callback, SND_STREAM_BUFFER_MAX/4);
+    if(audio->shnd == SND_STREAM_INVALID) {
+        free(audio);
+        return NULL;
+    }
+
+    audio->cb = cb;
+    audio->user_data = user_data;
+    snd_stream_set_userdata(audio->shnd, audio);
+
+    return audio;
+}
+
+void plat_audio_start(plat_audio_t* audio, unsigned int rate, int stereo) {
+    snd_stream_start(audio->shnd, rate, stereo);
+}
+
+void plat_audio_stop(plat_audio_t* audio) {
+    snd_stream_stop(audio->shnd);
+}
+
+void plat_audio_poll(plat_audio_t* audio) {
+    snd_stream_poll(audio->shnd);
+}
+
+void plat_audio_volume(plat_audio_t* audio, int vol) {
+    snd_stream_volume(audio->shnd, vol);
+}
+
+void plat_audio_destroy(plat_audio_t* audio) {
+    if(!audio)
+        return;
+
+    snd_stream_stop(audio->shnd);
+    snd_stream_destroy(audio->shnd);
+    free(audio);
+}
+
+static void* aica_callback(snd_stream_hnd_t hnd, int bytes_needed, int* bytes_returning) {
+    plat_audio_t* audio = (plat_audio_t*)snd_stream_get_userdata(hnd);
+
+    return audio->cb(audio->user_data, bytes_needed, bytes_returning);
+}
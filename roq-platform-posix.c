@@ -0,0 +1,318 @@
+/*
+ * Roq-Player platform layer by Andress Barajas
+ *
+ * Headless POSIX backend. Threads are pthreads, textures are plain
+ * memory, the screen is either discarded or composited into a
+ * 640x480 framebuffer that gets dumped as PNM files, and the sound
+ * device is simulated: it pulls PCM from the player at the real
+ * sample rate so buffering and pacing behave like on hardware.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "roq-platform.h"
+
+// Same request size the KOS backend hands to snd_stream_alloc()
+#define AUDIO_CHUNK_SIZE (65536/4)
+
+struct plat_texture_t {
+    int width;
+    int height;
+    unsigned short* pixels;
+};
+
+struct plat_audio_t {
+    plat_audio_callback cb;
+    void* user_data;
+    int running;
+    unsigned int rate;
+    int channels;
+    int vol;
+    unsigned int start_time;
+    unsigned long long pulled;
+};
+
+struct plat_thread_t {
+    pthread_t thd;
+};
+
+struct plat_mutex_t {
+    pthread_mutex_t mut;
+};
+
+static const char* framedump_dir;
+static unsigned short* framebuffer;
+static plat_posix_stats_t stats;
+static plat_posix_tap_t tap;
+
+static void write_framebuffer(void);
+
+int plat_init(void) {
+    return 1;
+}
+
+unsigned int plat_time_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned int)((unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+void plat_sleep_ms(unsigned int ms) {
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+void plat_yield(void) {
+    sched_yield();
+}
+
+plat_thread_t* plat_thread_create(void* (*routine)(void* arg), void* arg) {
+    plat_thread_t* thread = malloc(sizeof(plat_thread_t));
+    if(!thread)
+        return NULL;
+
+    if(pthread_create(&thread->thd, NULL, routine, arg) != 0) {
+        free(thread);
+        return NULL;
+    }
+
+    return thread;
+}
+
+void plat_thread_join(plat_thread_t* thread) {
+    if(!thread)
+        return;
+
+    pthread_join(thread->thd, NULL);
+    free(thread);
+}
+
+plat_mutex_t* plat_mutex_create(void) {
+    plat_mutex_t* mutex = malloc(sizeof(plat_mutex_t));
+    if(!mutex)
+        return NULL;
+
+    pthread_mutex_init(&mutex->mut, NULL);
+
+    return mutex;
+}
+
+void plat_mutex_lock(plat_mutex_t* mutex) {
+    pthread_mutex_lock(&mutex->mut);
+}
+
+void plat_mutex_unlock(plat_mutex_t* mutex) {
+    pthread_mutex_unlock(&mutex->mut);
+}
+
+void plat_mutex_destroy(plat_mutex_t* mutex) {
+    if(!mutex)
+        return;
+
+    pthread_mutex_destroy(&mutex->mut);
+    free(mutex);
+}
+
+plat_texture_t* plat_texture_create(int width, int height) {
+    plat_texture_t* texture = malloc(sizeof(plat_texture_t));
+    if(!texture)
+        return NULL;
+
+    texture->width = width;
+    texture->height = height;
+    texture->pixels = calloc(width * height, sizeof(unsigned short));
+    if(!texture->pixels) {
+        free(texture);
+        return NULL;
+    }
+
+    return texture;
+}
+
+void plat_texture_upload(plat_texture_t* texture, const unsigned short* data, int size) {
+    int capacity = texture->width * texture->height * 2;
+
+    if(size > capacity)
+        size = capacity;
+
+    memcpy(texture->pixels, data, size);
+
+    stats.uploads++;
+    stats.upload_bytes += size;
+}
+
+void plat_texture_upload_rows(plat_texture_t* texture, const unsigned short* data, int stride) {
+    int y;
+
+    for(y = 0; y < texture->height; y++)
+        memcpy(texture->pixels + y * texture->width, data + y * stride, texture->width * 2);
+
+    stats.uploads++;
+    stats.upload_bytes += texture->width * texture->height * 2;
+}
+
+void plat_texture_destroy(plat_texture_t* texture) {
+    if(!texture)
+        return;
+
+    free(texture->pixels);
+    free(texture);
+}
+
+void plat_scene_begin(void) {
+    if(!framedump_dir)
+        return;
+
+    if(!framebuffer)
+        framebuffer = malloc(PLAT_SCREEN_WIDTH * PLAT_SCREEN_HEIGHT * sizeof(unsigned short));
+
+    if(framebuffer)
+        memset(framebuffer, 0, PLAT_SCREEN_WIDTH * PLAT_SCREEN_HEIGHT * sizeof(unsigned short));
+}
+
+void plat_draw_texture(plat_texture_t* texture, float x0, float y0, float x1, float y1, float u1, float v1) {
+    int x, y, sx, sy;
+    int left, top, right, bottom;
+
+    if(tap.draw)
+        tap.draw(texture->pixels, (int)(u1 * texture->width + 0.5f), (int)(v1 * texture->height + 0.5f),
+                 texture->width, x0, y0, tap.user_data);
+
+    if(!framedump_dir || !framebuffer)
+        return;
+
+    left = x0 < 0 ? 0 : (int)x0;
+    top = y0 < 0 ? 0 : (int)y0;
+    right = x1 > PLAT_SCREEN_WIDTH ? PLAT_SCREEN_WIDTH : (int)x1;
+    bottom = y1 > PLAT_SCREEN_HEIGHT ? PLAT_SCREEN_HEIGHT : (int)y1;
+
+    // Point sampled, like PVR_FILTER_NONE
+    for(y = top; y < bottom; y++) {
+        sy = (int)((y - y0) / (y1 - y0) * v1 * texture->height);
+        for(x = left; x < right; x++) {
+            sx = (int)((x - x0) / (x1 - x0) * u1 * texture->width);
+            framebuffer[y * PLAT_SCREEN_WIDTH + x] = texture->pixels[sy * texture->width + sx];
+        }
+    }
+}
+
+void plat_scene_finish(void) {
+    if(framedump_dir && framebuffer)
+        write_framebuffer();
+
+    if(tap.scene)
+        tap.scene(tap.user_data);
+
+    stats.scenes++;
+}
+
+plat_audio_t* plat_audio_create(plat_audio_callback cb, void* user_data) {
+    plat_audio_t* audio = malloc(sizeof(plat_audio_t));
+    if(!audio)
+        return NULL;
+
+    memset(audio, 0, sizeof(plat_audio_t));
+    audio->cb = cb;
+    audio->user_data = user_data;
+    audio->vol = 240;
+
+    return audio;
+}
+
+void plat_audio_start(plat_audio_t* audio, unsigned int rate, int stereo) {
+    audio->rate = rate;
+    audio->channels = stereo ? 2 : 1;
+    audio->start_time = plat_time_ms();
+    audio->pulled = 0;
+    audio->running = 1;
+}
+
+void plat_audio_stop(plat_audio_t* audio) {
+    audio->running = 0;
+}
+
+void plat_audio_poll(plat_audio_t* audio) {
+    unsigned long long due;
+    int needed, returned;
+    void* pcm;
+
+    if(!audio->running)
+        return;
+
+    // The device keeps one request worth of data queued ahead of
+    // what has actually been played
+    due = (unsigned long long)(plat_time_ms() - audio->start_time) *
+          audio->rate * audio->channels * 2 / 1000 + AUDIO_CHUNK_SIZE;
+
+    while(audio->pulled < due) {
+        needed = due - audio->pulled;
+        if(needed > AUDIO_CHUNK_SIZE)
+            needed = AUDIO_CHUNK_SIZE;
+        needed &= ~3;
+        if(needed == 0)
+            break;
+
+        returned = 0;
+        pcm = audio->cb(audio->user_data, needed, &returned);
+        if(returned <= 0)
+            break;
+
+        if(tap.audio)
+            tap.audio(pcm, returned, tap.user_data);
+
+        audio->pulled += returned;
+        stats.audio_bytes += returned;
+    }
+}
+
+void plat_audio_volume(plat_audio_t* audio, int vol) {
+    audio->vol = vol;
+}
+
+void plat_audio_destroy(plat_audio_t* audio) {
+    free(audio);
+}
+
+void plat_posix_set_framedump(const char* dir) {
+    framedump_dir = dir;
+}
+
+void plat_posix_get_stats(plat_posix_stats_t* out) {
+    *out = stats;
+}
+
+void plat_posix_set_tap(const plat_posix_tap_t* hooks) {
+    tap = *hooks;
+}
+
+static void write_framebuffer(void) {
+    FILE *out;
+    char filename[1024];
+    unsigned int pixel;
+    int i;
+
+    snprintf(filename, sizeof(filename), "%s/%04d.pnm", framedump_dir, stats.scenes);
+    out = fopen(filename, "wb");
+    if (!out)
+        return;
+
+    fprintf(out, "P6\n%d %d\n255\n", PLAT_SCREEN_WIDTH, PLAT_SCREEN_HEIGHT);
+    for (i = 0; i < PLAT_SCREEN_WIDTH * PLAT_SCREEN_HEIGHT; i++) {
+        pixel = framebuffer[i];
+        fputc(((pixel >> 11) << 3) & 0xFF, out);  /* red */
+        fputc(((pixel >>  5) << 2) & 0xFF, out);  /* green */
+        fputc(((pixel >>  0) << 3) & 0xFF, out);  /* blue */
+    }
+    fclose(out);
+}
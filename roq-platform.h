@@ -0,0 +1,108 @@
+/*
+ * Roq-Player platform layer by Andress Barajas
+ *
+ * This is the interface between the playback engine and the
+ * system it runs on. The player only talks to textures, the
+ * screen, the sound stream, threads, mutexes and the clock
+ * through these functions. Exactly one backend is linked in:
+ * roq-platform-kos.c on the Dreamcast, roq-platform-posix.c
+ * (headless) everywhere else.
+ */
+
+#ifndef ROQPLATFORM_H
+#define ROQPLATFORM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PLAT_SCREEN_WIDTH   640
+#define PLAT_SCREEN_HEIGHT  480
+
+typedef struct plat_texture_t plat_texture_t;
+typedef struct plat_audio_t plat_audio_t;
+typedef struct plat_thread_t plat_thread_t;
+typedef struct plat_mutex_t plat_mutex_t;
+
+// Brings up the video and sound hardware. Returns 0 on failure.
+int plat_init(void);
+
+// Clock
+unsigned int plat_time_ms(void);
+void plat_sleep_ms(unsigned int ms);
+void plat_yield(void);
+
+// Threads & locks
+plat_thread_t* plat_thread_create(void* (*routine)(void* arg), void* arg);
+void plat_thread_join(plat_thread_t* thread);
+
+plat_mutex_t* plat_mutex_create(void);
+void plat_mutex_lock(plat_mutex_t* mutex);
+void plat_mutex_unlock(plat_mutex_t* mutex);
+void plat_mutex_destroy(plat_mutex_t* mutex);
+
+// Video. Textures are RGB565, non-twiddled, width x height texels
+// (both powers of two, at most PLAT_TEXTURE_MAX).
+#define PLAT_TEXTURE_MAX    1024
+
+plat_texture_t* plat_texture_create(int width, int height);
+void plat_texture_upload(plat_texture_t* texture, const unsigned short* data, int size);
+// Fills the whole texture from a larger picture whose rows are stride
+// texels apart, data pointing at the texel that goes top left.
+void plat_texture_upload_rows(plat_texture_t* texture, const unsigned short* data, int stride);
+void plat_texture_destroy(plat_texture_t* texture);
+
+// Drawing happens between plat_scene_begin() and plat_scene_finish().
+// (x0, y0)-(x1, y1) is the screen rectangle, u1/v1 the texture
+// coordinates of its bottom right corner.
+void plat_scene_begin(void);
+void plat_draw_texture(plat_texture_t* texture, float x0, float y0, float x1, float y1, float u1, float v1);
+void plat_scene_finish(void);
+
+// Audio. The backend calls back from plat_audio_poll() whenever the
+// device wants more 16-bit PCM. The callback returns a pointer to the
+// data and the amount it returns through bytes_returning.
+typedef void* (*plat_audio_callback)
+    (void* user_data, int bytes_needed, int* bytes_returning);
+
+plat_audio_t* plat_audio_create(plat_audio_callback cb, void* user_data);
+void plat_audio_start(plat_audio_t* audio, unsigned int rate, int stereo);
+void plat_audio_stop(plat_audio_t* audio);
+void plat_audio_poll(plat_audio_t* audio);
+void plat_audio_volume(plat_audio_t* audio, int vol);
+void plat_audio_destroy(plat_audio_t* audio);
+
+#ifndef _arch_dreamcast
+// Headless backend only. When set, every presented scene is written
+// as a PNM file into dir.
+void plat_posix_set_framedump(const char* dir);
+
+typedef struct {
+    unsigned int scenes;
+    unsigned int uploads;
+    unsigned long long upload_bytes;
+    unsigned long long audio_bytes;
+} plat_posix_stats_t;
+
+void plat_posix_get_stats(plat_posix_stats_t* stats);
+
+// Headless backend only. Lets a host check what it presents: draw sees
+// the visible texels of every texture drawn and where the quad starts,
+// scene the end of every scene and audio every piece of PCM the
+// device pulls.
+typedef struct {
+    void (*draw)(const unsigned short* pixels, int width, int height, int stride,
+                 float x0, float y0, void* user_data);
+    void (*scene)(void* user_data);
+    void (*audio)(const unsigned char* pcm, int size, void* user_data);
+    void* user_data;
+} plat_posix_tap_t;
+
+void plat_posix_set_tap(const plat_posix_tap_t* tap);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,40 +1,54 @@
 /*
  * Roq-Player by Andress Barajas
- * 
- * This is the playback engine. Handles displaying video 
+ *
+ * This is the playback engine. Handles displaying video
  * and playing audio that is decoded by the decoder engine.
+ *
+ * Any number of players can be alive at once. Each one owns its
+ * decoder, textures and PCM ring buffer; a single audio thread
+ * mixes every playing stream into one output stream.
+ *
+ * A player can also have a playlist. While one file plays, the next
+ * one is opened and its first frame and audio are decoded on a
+ * background thread, so the switch happens on the frame boundary.
+ *
+ * Frames larger than a texture can be are split into tiles of at most
+ * PLAT_TEXTURE_MAX texels a side, each drawn as its own quad. Then the
+ * decoder tracks which macroblocks change, and a tile whose texture
+ * already holds its picture from two frames back is not uploaded.
+ *
+ * With decode-ahead on, a thread of the player's own runs the decoder
+ * into a frame pool and queues the frames it decodes; the frame loop
+ * only takes the one that is due, uploads and draws it.
  */
 
-#include <kos/thread.h>
-#include <dc/sound/stream.h>
-#include <dc/pvr.h>
-#include <arch/timer.h>
-#include <arch/cache.h>
-
 #include <stdlib.h>
 #include <string.h>
+#ifdef _arch_dreamcast
+#include <malloc.h>
+#endif
 
 #include "dreamroqlib.h"
 #include "roq-player.h"
+#include "roq-platform.h"
 
-#define SND_STREAM_STATUS_NULL         0x00
-#define SND_STREAM_STATUS_READY        0x01
-#define SND_STREAM_STATUS_STREAMING    0x02
-#define SND_STREAM_STATUS_PAUSING      0x03
-#define SND_STREAM_STATUS_STOPPING     0x04
-#define SND_STREAM_STATUS_RESUMING     0x05
-#define SND_STREAM_STATUS_DONE         0x06
-#define SND_STREAM_STATUS_ERROR        0x07
+#define PLAYER_STATUS_READY        0x00
+#define PLAYER_STATUS_STREAMING    0x01
 
 #define ROQ_SAMPLE_RATE    22050
+#define DEFAULT_FRAMERATE  30
 
-int player_errno = 0;
+// If a ticked player falls this far behind it drops the backlog
+// instead of decoding as fast as it can to catch up
+#define TICK_RESYNC_MS     250
 
-struct roq_player_t {
-    roq_t* decoder;
-    int paused;
-    int initialized_format;
-};
+// Pool frames besides the queue. When a decode starts the queue holds
+// fewer than depth frames; the decoder may then still need its two
+// references, the frame it copies skipped blocks from and one to
+// decode into.
+#define DECODE_AHEAD_SPARE 3
+
+int player_errno = 0;
 
 typedef struct {
     unsigned char *buffer;
@@ -46,281 +60,493 @@ typedef struct {
 
 #define AUDIO_BUFFER_SIZE 1024*160
 #define AUDIO_DECODE_BUFFER_SIZE 1024*1024
-typedef int snd_stream_hnd_t;
 
+typedef struct playlist_entry {
+    char* filename;
+    struct playlist_entry* next;
+} playlist_entry;
+
+// A part of the frame drawn with a texture of its own, one for each of
+// the last two frames
+typedef struct {
+    int x, y;
+    int width, height;
+    plat_texture_t* textures[2];
+    float u1, v1;
+} video_tile;
+
+// The next file of a playlist, opened and decoded up to its first
+// frame by a background thread
+typedef struct {
+    char* filename;
+    roq_t* decoder;
+    plat_thread_t* thread;
+    unsigned short* frame;
+    int stride;
+    int texture_height;
+    int channels;
+    unsigned char* pcm;
+    int pcm_size;
+    int pcm_capacity;
+    // Pool the decoder decodes into with decode-ahead on
+    int ahead_depth;
+    unsigned short** frames;
+    int frame_count;
+} prefetch_t;
+
+// A frame the decode-ahead thread queued. changed is a copy of the
+// decoder's change flags for it, when the player tracks changes.
 typedef struct {
-    int initialized;
-    snd_stream_hnd_t shnd; 
+    unsigned short* data;
+    int stride;
+    unsigned int number;
+    int has_changed;
+    unsigned char* changed;
+} queued_frame;
+
+// Decode-ahead queue. While the thread runs only it calls into the
+// decoder, so the frames the render side is done with wait in done[]
+// for it to release. mut guards the queue, done[], ended and stats.
+typedef struct {
+    plat_thread_t* thread;
+    volatile int running;
+    int depth;
+    unsigned short** frames;
+    int frame_count;
+    unsigned char* changed;
+    int changed_size;
+
+    plat_mutex_t* mut;
+    queued_frame* queue;
+    int head;
+    int count;
+    unsigned short** done;
+    int done_count;
+    int ended;
+    unsigned int next_number;
+    player_queue_stats_t stats;
+    unsigned long long queued_total;
+} decode_ahead_t;
+
+struct roq_player_t {
+    roq_t* decoder;
+    int paused;
+    int initialized_format;
+    int playing_loop;
+
+    // Audio
     volatile int status;
     unsigned int vol;
-    unsigned int rate;
     unsigned int channels;
-    mutex_t decode_buffer_mut;
     ring_buffer decode_buffer;
-    unsigned char pcm_buffer[AUDIO_BUFFER_SIZE];
-} sound_hndlr;
 
-typedef struct {
+    // Video
     int framerate;
-    int initialized;
     int frame_index;
-    int texture_byte_length;
-    pvr_ptr_t textures[2];
-    pvr_poly_hdr_t hdr[2];
-    pvr_vertex_t vert[4];
-} video_hndlr;
+    int new_frame;
+    int has_frame;
+    int width, height;
+    video_tile* tiles;
+    int tile_count;
+    int upload_all;       // frames left to upload every tile of
+    float x0, y0, x1, y1;
+
+    // Pacing for player_play()
+    unsigned int last_frame_time;
+    unsigned int target_frame_time;
+
+    // Pacing for player_tick() and decode-ahead
+    unsigned int clock_start;
+    unsigned int clock_frames;
+
+    // Decode-ahead, NULL when off
+    decode_ahead_t* ahead;
+
+    // Playlist
+    char* filename;
+    playlist_entry* playlist;
+    prefetch_t* prefetch;
+    int playlist_loop;
+    unsigned int transition_latency;
+
+    roq_player_t* next;
+};
 
-static void* player_snd_thread();
-static void* aica_callback(snd_stream_hnd_t hnd, int req, int* done);
+typedef struct {
+    volatile int running;
+    plat_audio_t* shnd;
+    plat_thread_t* thread;
+    plat_mutex_t* mut;
+    roq_player_t* players;
+    short mix_buffer[AUDIO_BUFFER_SIZE/2];
+    int mix_accum[AUDIO_BUFFER_SIZE/2];
+} sound_mixer;
+
+static void* player_snd_thread(void* arg);
+static void* mixer_callback(void* user_data, int req, int* done);
 
 static void roq_loop_cb(void* user_data);
 static void roq_video_cb(unsigned short *buf, int width, int height, int stride, int texture_height, void* user_data);
 static void roq_audio_cb(unsigned char *buf, int size, int channels, void* user_data);
-
-static void initialize_defaults(roq_player_t* player, int index);
-static int initialize_graphics(int width, int height);
-static int initialize_audio(void);
-
+static unsigned char* roq_audio_buffer_cb(int size, int channels, int* granted, void* user_data);
+
+static roq_player_t* initialize_defaults(roq_t* decoder);
+static int initialize_graphics(roq_player_t* player, int width, int height);
+static void destroy_graphics(roq_player_t* player);
+static void track_changes(roq_player_t* player);
+static int tile_changed(roq_player_t* player, video_tile* tile, const unsigned char* changed);
+static void initialize_rect(roq_player_t* player, int width, int height);
+static int next_pow2(int value);
+static int initialize_audio(roq_player_t* player);
+static void upload_frame(roq_player_t* player, unsigned short* data, int stride, const unsigned char* changed);
+static void present_frame(roq_player_t* player);
+static void draw_scene(roq_player_t* player);
+static unsigned int frame_due_time(roq_player_t* player);
+static unsigned int frame_time(roq_player_t* player, unsigned int number);
+
+static void decode_frame(roq_player_t* player);
+static int playlist_append(roq_player_t* player, const char* filename);
+static void playlist_start_prefetch(roq_player_t* player);
+static void playlist_advance(roq_player_t* player);
+static void* prefetch_thread(void* arg);
+static void prefetch_video_cb(unsigned short *buf, int width, int height, int stride, int texture_height, void* user_data);
+static void prefetch_audio_cb(unsigned char *buf, int size, int channels, void* user_data);
+static void prefetch_destroy(prefetch_t* prefetch);
+static void playlist_restart_prefetch(roq_player_t* player);
+
+static unsigned short** attach_frames(roq_t* decoder, int depth, int* count);
+static void free_frames(unsigned short** frames, int count);
+static void decode_ahead_size_changed(roq_player_t* player);
+static void decode_ahead_start(roq_player_t* player);
+static void decode_ahead_stop(roq_player_t* player);
+static void decode_ahead_free(decode_ahead_t* ahead);
+static int decode_ahead_step(roq_player_t* player);
+static void* decode_ahead_thread(void* arg);
+static void ahead_video_cb(unsigned short *buf, int width, int height, int stride, int texture_height, void* user_data);
+static void decode_ahead_pop(decode_ahead_t* ahead);
+static void decode_ahead_wait(roq_player_t* player);
+static int decode_ahead_take(roq_player_t* player, unsigned int now);
+static int decode_ahead_end(roq_player_t* player);
+
+static void ring_buffer_reset(ring_buffer *rb);
 static int ring_buffer_write(ring_buffer *rb, const unsigned char *data, int data_length);
-static int ring_buffer_read(ring_buffer *rb, unsigned char *data, int data_length);
-static int ring_buffer_underflow(ring_buffer *rb, int data_length);
-
-static unsigned int get_current_time();
+static void mix_ring(ring_buffer *rb, int* accum, int frames, int channels, int vol);
 
-static video_hndlr vid_stream;
-static sound_hndlr snd_stream;
+static sound_mixer mixer;
 
-static kthread_t* audio_thread;
+int player_init(void) {
+    if(mixer.running)
+        return PLAYER_SUCCESS;
 
-static int playing_loop;
+    if(!plat_init())
+        return PLAYER_ERROR;
 
-// Used to keep video @ 30fps
-static unsigned int last_frame_time = 0;
-static unsigned int target_frame_time = 1000 / 30; // Target frame time in milliseconds
+    mixer.players = NULL;
+    mixer.mut = plat_mutex_create();
+    if(!mixer.mut)
+        return PLAYER_ERROR;
 
-int player_init(void) {
-    snd_stream_init();
-    pvr_init_defaults();
+    // The mixer always produces 16-bit stereo at the RoQ sample rate
+    mixer.shnd = plat_audio_create(mixer_callback, &mixer);
+    if(!mixer.shnd) {
+        plat_mutex_destroy(mixer.mut);
+        player_errno = PLAYER_SND_INIT_FAILURE;
+        return PLAYER_ERROR;
+    }
 
-    snd_stream.shnd = SND_STREAM_INVALID;
-    snd_stream.vol = 240;
-    snd_stream.rate = ROQ_SAMPLE_RATE;
-    snd_stream.status = SND_STREAM_STATUS_NULL;
+    plat_audio_volume(mixer.shnd, 255);
+    plat_audio_start(mixer.shnd, ROQ_SAMPLE_RATE, 1);
 
-    audio_thread = thd_create(0, player_snd_thread, NULL);
-    if(audio_thread != NULL) {
-		snd_stream.status = SND_STREAM_STATUS_READY;
-        return PLAYER_SUCCESS;
-	}
-    else {
-        snd_stream.status = SND_STREAM_STATUS_ERROR;
+    mixer.running = 1;
+    mixer.thread = plat_thread_create(player_snd_thread, NULL);
+    if(mixer.thread == NULL) {
+        mixer.running = 0;
+        plat_audio_destroy(mixer.shnd);
+        plat_mutex_destroy(mixer.mut);
         return PLAYER_ERROR;
     }
+
+    return PLAYER_SUCCESS;
 }
 
 void player_shutdown(roq_player_t* player) {
-    snd_stream.status = SND_STREAM_STATUS_DONE;
-    playing_loop = 0;
+    if(player != NULL)
+        player_destroy(player);
 
-    thd_join(audio_thread, NULL);
+    while(mixer.players != NULL)
+        player_destroy(mixer.players);
 
-    if(snd_stream.shnd != SND_STREAM_INVALID) {
-        snd_stream_stop(snd_stream.shnd);
-        snd_stream_destroy(snd_stream.shnd);
-        snd_stream.shnd = SND_STREAM_INVALID;
-        snd_stream.vol = 240;
-        snd_stream.status = SND_STREAM_STATUS_NULL;
-    }
+    if(!mixer.running)
+        return;
 
-    if(vid_stream.initialized) {
-        vid_stream.initialized = 0;
-        vid_stream.frame_index = 0;
-        vid_stream.texture_byte_length = 0;
-        pvr_mem_free(vid_stream.textures[0]);
-        pvr_mem_free(vid_stream.textures[1]);
-    }
+    mixer.running = 0;
+    plat_thread_join(mixer.thread);
+    mixer.thread = NULL;
 
-    if(snd_stream.initialized) {
-        snd_stream.initialized = 0;
-        free(snd_stream.decode_buffer.buffer);
-        mutex_destroy(&snd_stream.decode_buffer_mut); 
-    }
+    plat_audio_destroy(mixer.shnd);
+    mixer.shnd = NULL;
 
-    if(player != NULL && player->initialized_format) {
-        roq_destroy(player->decoder);
-        free(player);
-        player = NULL;
-    }
+    plat_mutex_destroy(mixer.mut);
+    mixer.mut = NULL;
 }
 
-roq_player_t* player_create(const char* filename) {
-    snd_stream_hnd_t index;
-    roq_player_t* player = NULL;
-    
-    if(filename == NULL) {
-        player_errno = PLAYER_SOURCE_ERROR;
-        return NULL;
-    }
+void player_destroy(roq_player_t* player) {
+    roq_player_t** link;
 
-    index = snd_stream_alloc(aica_callback, SND_STREAM_BUFFER_MAX/4);
+    if(player == NULL)
+        return;
 
-    if(index == SND_STREAM_INVALID) {
-        snd_stream_destroy(index);
-        player_errno = PLAYER_SND_INIT_FAILURE;
-        return NULL;
+    plat_mutex_lock(mixer.mut);
+    for(link = &mixer.players; *link != NULL; link = &(*link)->next) {
+        if(*link == player) {
+            *link = player->next;
+            break;
+        }
     }
+    plat_mutex_unlock(mixer.mut);
 
-    player = malloc(sizeof(roq_player_t));
-    if(!player) {
-        snd_stream_destroy(index);
-        player_errno = PLAYER_OUT_OF_MEMORY;
-        return NULL;
+    // Stops a player_play() loop that is running this player
+    player->status = PLAYER_STATUS_READY;
+    player->paused = 1;
+
+    if(player->ahead)
+        decode_ahead_stop(player);
+
+    if(player->prefetch) {
+        plat_thread_join(player->prefetch->thread);
+        prefetch_destroy(player->prefetch);
     }
 
-    player->decoder = roq_create_with_filename(filename);
-    if(!player->decoder) {
-        snd_stream_destroy(index);
-        player_errno = PLAYER_FORMAT_INIT_FAILURE;
-        return NULL;
+    while(player->playlist) {
+        playlist_entry* entry = player->playlist;
+        player->playlist = entry->next;
+        free(entry->filename);
+        free(entry);
     }
+    free(player->filename);
 
-    initialize_defaults(player, index);
+    destroy_graphics(player);
+    free(player->decode_buffer.buffer);
 
-    return player;
+    if(player->initialized_format)
+        roq_destroy(player->decoder);
+    decode_ahead_free(player->ahead);
+
+    free(player);
 }
 
-roq_player_t* player_create_file(FILE* file) {
-    snd_stream_hnd_t index;
-    roq_player_t* player = NULL;
+roq_player_t* player_create(const char* filename) {
+    roq_player_t* player;
 
-    if(file == NULL) {
+    if(filename == NULL) {
         player_errno = PLAYER_SOURCE_ERROR;
         return NULL;
     }
-    
-    index = snd_stream_alloc(aica_callback, SND_STREAM_BUFFER_MAX/4);
 
-    if(index == SND_STREAM_INVALID) {
-        snd_stream_destroy(index);
-        player_errno = PLAYER_SND_INIT_FAILURE;
-        return NULL;
-    }
+    player = initialize_defaults(roq_create_with_filename(filename));
+    if(player)
+        player->filename = strdup(filename);
 
-    player = malloc(sizeof(roq_player_t));
-    if(!player) {
-        snd_stream_destroy(index);
-        player_errno = PLAYER_OUT_OF_MEMORY;
-        return NULL;
-    }
+    return player;
+}
 
-    player->decoder = roq_create_with_file(file, 1);
-    if(!player->decoder) {
-        snd_stream_destroy(index);
-        player_errno = PLAYER_FORMAT_INIT_FAILURE;
+roq_player_t* player_create_file(FILE* file) {
+    if(file == NULL) {
+        player_errno = PLAYER_SOURCE_ERROR;
         return NULL;
     }
 
-    initialize_defaults(player, index);
-
-    return player;
+    return initialize_defaults(roq_create_with_file(file, 1));
 }
 
 roq_player_t* player_create_memory(unsigned char* memory, const unsigned int length) {
-    snd_stream_hnd_t index;
-    roq_player_t* player = NULL;
-
-    index = snd_stream_alloc(aica_callback, SND_STREAM_BUFFER_MAX/4);
-
     if(memory == NULL) {
         player_errno = PLAYER_SOURCE_ERROR;
         return NULL;
     }
 
-    if(index == SND_STREAM_INVALID) {
-        snd_stream_destroy(index);
-        player_errno = PLAYER_SND_INIT_FAILURE;
-        return NULL;
-    }
-
-    player = malloc(sizeof(roq_player_t));
-    if(!player) {
-        snd_stream_destroy(index);
-        player_errno = PLAYER_OUT_OF_MEMORY;
-        return NULL;
-    }
-
-    player->decoder = roq_create_with_memory(memory, length, 1);
-    if(!player->decoder) {
-        snd_stream_destroy(index);
-        player_errno = PLAYER_FORMAT_INIT_FAILURE;
-        return NULL;
-    }
+    return initialize_defaults(roq_create_with_memory(memory, length, 1));
+}
 
-    initialize_defaults(player, index);
+void player_start(roq_player_t* player) {
+    if(player->status == PLAYER_STATUS_STREAMING)
+        return;
 
-    return player;
+    player->paused = 0;
+    player->clock_start = plat_time_ms() - player->clock_frames * 1000 / player->framerate;
+    player->status = PLAYER_STATUS_STREAMING;
+    decode_ahead_start(player);
 }
 
 void player_play(roq_player_t* player, frame_callback frame_cb) {
-    if(snd_stream.status == SND_STREAM_STATUS_STREAMING)
+    if(player->status == PLAYER_STATUS_STREAMING)
        return;
 
-    player->paused = 0;
-    snd_stream.status = SND_STREAM_STATUS_RESUMING;
+    player_start(player);
 
     // Protect against recursion bc we can call player_play() in
     // frame_cb()
-    if(!playing_loop)
+    if(!player->playing_loop)
     {
-        playing_loop = 1;
+        player->playing_loop = 1;
 
         do {
             if(frame_cb)
                 frame_cb();
 
             // We shutdown the player, exit the loop
-            if(snd_stream.status == SND_STREAM_STATUS_NULL) {
-                break;
+            if(!mixer.running) {
+                return;
             }
 
-            if(!player->paused)
-                roq_decode(player->decoder);
-        } while (!roq_has_ended(player->decoder));
+            if(!player->paused && player->ahead) {
+                decode_ahead_wait(player);
+                if(decode_ahead_take(player, plat_time_ms()))
+                    draw_scene(player);
+            }
+            else if(!player->paused) {
+                decode_frame(player);
+                if(player->new_frame)
+                    present_frame(player);
+            }
+        } while (!player_has_ended(player));
+
+        player->playing_loop = 0;
+    }
+}
+
+int player_tick(roq_player_t* player) {
+    unsigned int now;
+    int late;
+
+    if(player->paused)
+        return 0;
+
+    now = plat_time_ms();
+    if(player->ahead) {
+        player->new_frame = decode_ahead_take(player, now);
+        return player->new_frame;
+    }
+
+    if(roq_has_ended(player->decoder))
+        return 0;
+
+    late = (int)(now - frame_due_time(player));
+    if(late < 0)
+        return 0;
+
+    if(late > TICK_RESYNC_MS)
+        player->clock_start += late;
+
+    decode_frame(player);
+    player->clock_frames++;
+
+    return player->new_frame;
+}
+
+void player_tick_all(void) {
+    roq_player_t* player;
+
+    for(player = mixer.players; player != NULL; player = player->next)
+        player_tick(player);
+}
+
+void player_draw(roq_player_t* player) {
+    float scale_x, scale_y;
+    video_tile* tile;
+    int i;
+
+    if(!player->has_frame)
+        return;
+
+    scale_x = (player->x1 - player->x0) / player->width;
+    scale_y = (player->y1 - player->y0) / player->height;
+
+    // frame_index points at the textures the next frame goes into
+    for(i = 0; i < player->tile_count; i++) {
+        tile = &player->tiles[i];
+        plat_draw_texture(tile->textures[!player->frame_index],
+                          player->x0 + tile->x * scale_x, player->y0 + tile->y * scale_y,
+                          player->x0 + (tile->x + tile->width) * scale_x,
+                          player->y0 + (tile->y + tile->height) * scale_y,
+                          tile->u1, tile->v1);
     }
 }
 
+void player_draw_all(void) {
+    roq_player_t* player;
+
+    for(player = mixer.players; player != NULL; player = player->next)
+        player_draw(player);
+}
+
+void player_set_rect(roq_player_t* player, float x, float y, float width, float height) {
+    player->x0 = x;
+    player->y0 = y;
+    player->x1 = x + width;
+    player->y1 = y + height;
+}
+
+int player_queue(roq_player_t* player, const char* filename) {
+    if(filename == NULL) {
+        player_errno = PLAYER_SOURCE_ERROR;
+        return PLAYER_ERROR;
+    }
+
+    if(!playlist_append(player, filename)) {
+        player_errno = PLAYER_OUT_OF_MEMORY;
+        return PLAYER_ERROR;
+    }
+
+    if(!player->prefetch)
+        playlist_start_prefetch(player);
+
+    return PLAYER_SUCCESS;
+}
+
+void player_set_playlist_loop(roq_player_t* player, int loop) {
+    player->playlist_loop = loop;
+}
+
+unsigned int player_get_transition_latency(roq_player_t* player) {
+    return player->transition_latency;
+}
+
 void player_pause(roq_player_t* player) {
     player->paused = 1;
-    if(snd_stream.status != SND_STREAM_STATUS_READY &&
-       snd_stream.status != SND_STREAM_STATUS_PAUSING)
-        snd_stream.status = SND_STREAM_STATUS_PAUSING;
+    player->status = PLAYER_STATUS_READY;
 }
 
 void player_stop(roq_player_t* player) {
     player->paused = 1;
+    player->status = PLAYER_STATUS_READY;
+    if(player->ahead)
+        decode_ahead_stop(player);
     roq_rewind(player->decoder);
 
-    if(snd_stream.status != SND_STREAM_STATUS_READY &&
-       snd_stream.status != SND_STREAM_STATUS_STOPPING)
-        snd_stream.status = SND_STREAM_STATUS_STOPPING;
+    plat_mutex_lock(mixer.mut);
+    ring_buffer_reset(&player->decode_buffer);
+    plat_mutex_unlock(mixer.mut);
+
+    player->clock_frames = 0;
+    if(player->ahead) {
+        player->ahead->ended = 0;
+        player->ahead->next_number = 0;
+    }
 }
 
 void player_volume(roq_player_t* player, int vol) {
-    if(snd_stream.shnd == SND_STREAM_INVALID)
-        return;
-
     if(vol > 255)
         vol = 255;
 
     if(vol < 0)
         vol = 0;
 
-    snd_stream.vol = vol;
-    snd_stream_volume(snd_stream.shnd, snd_stream.vol);
+    player->vol = vol;
 }
 
 int player_isplaying(roq_player_t* player) {
-    return snd_stream.status == SND_STREAM_STATUS_STREAMING;
+    return player->status == PLAYER_STATUS_STREAMING;
 }
 
 int player_get_loop(roq_player_t* player) {
@@ -331,234 +557,944 @@ void player_set_loop(roq_player_t* player, int loop) {
     roq_set_loop(player->decoder, loop, roq_loop_cb);
 }
 
+int player_set_loop_cache(roq_player_t* player, size_t budget) {
+    return roq_set_loop_cache(player->decoder, budget);
+}
+
 int player_has_ended(roq_player_t* player) {
-    return roq_has_ended(player->decoder);
+    decode_ahead_t* ahead = player->ahead;
+    int ended;
+
+    if(!ahead)
+        return roq_has_ended(player->decoder);
+
+    // Once the last queued frame is shown and no file follows
+    plat_mutex_lock(ahead->mut);
+    ended = ahead->ended && !ahead->count;
+    plat_mutex_unlock(ahead->mut);
+
+    return ended && !player->prefetch && !player->playlist;
+}
+
+int player_set_decode_ahead(roq_player_t* player, int depth) {
+    decode_ahead_t* ahead;
+
+    if(depth < 0 || player->status == PLAYER_STATUS_STREAMING)
+        return PLAYER_ERROR;
+
+    if(player->ahead) {
+        decode_ahead_stop(player);
+        roq_set_frame_pool(player->decoder, NULL, 0, 0);
+        roq_set_video_decode_callback(player->decoder, roq_video_cb);
+        decode_ahead_free(player->ahead);
+        player->ahead = NULL;
+    }
+
+    if(depth) {
+        ahead = calloc(1, sizeof(decode_ahead_t));
+        if(!ahead) {
+            player_errno = PLAYER_OUT_OF_MEMORY;
+            return PLAYER_ERROR;
+        }
+        player->ahead = ahead;
+        ahead->depth = depth;
+        ahead->next_number = player->clock_frames;
+        ahead->mut = plat_mutex_create();
+        ahead->queue = calloc(depth, sizeof(queued_frame));
+        ahead->frames = attach_frames(player->decoder, depth, &ahead->frame_count);
+        ahead->done = calloc(ahead->frame_count, sizeof(unsigned short*));
+        if(!ahead->mut || !ahead->queue || !ahead->frames || !ahead->done) {
+            // Back to the decoder's own frames
+            roq_set_frame_pool(player->decoder, NULL, 0, 0);
+            decode_ahead_free(ahead);
+            player->ahead = NULL;
+            player_errno = PLAYER_OUT_OF_MEMORY;
+            return PLAYER_ERROR;
+        }
+        decode_ahead_size_changed(player);
+        roq_set_video_decode_callback(player->decoder, ahead_video_cb);
+    }
+
+    // The next file must decode into a pool of its own as well, or not
+    if(player->prefetch)
+        playlist_restart_prefetch(player);
+
+    return PLAYER_SUCCESS;
+}
+
+void player_get_queue_stats(roq_player_t* player, player_queue_stats_t* stats) {
+    decode_ahead_t* ahead = player->ahead;
+
+    memset(stats, 0, sizeof(player_queue_stats_t));
+    if(!ahead)
+        return;
+
+    plat_mutex_lock(ahead->mut);
+    *stats = ahead->stats;
+    stats->depth = ahead->depth;
+    stats->queued = ahead->count;
+    if(stats->presented)
+        stats->average_queued = (float)ahead->queued_total / stats->presented;
+    plat_mutex_unlock(ahead->mut);
 }
 
 static void roq_loop_cb(void* user_data) {
 }
 
 static void roq_video_cb(unsigned short *texture_data, int width, int height, int stride, int texture_height, void* user_data) {
-    // DMA causes artifacts
-    // dcache_flush_range((uint32)texture_data, vid_stream.texture_byte_length);   // dcache flush is needed when using DMA
-    // pvr_txr_load_dma(texture_data, vid_stream.textures[vid_stream.frame_index], vid_stream.texture_byte_length, 1, NULL, 0);
-    pvr_txr_load(texture_data, vid_stream.textures[vid_stream.frame_index], stride * texture_height * 2);
+    roq_player_t* player = (roq_player_t*)user_data;
 
-    unsigned int elapsed_time = get_current_time() - last_frame_time; // Calculate elapsed time since last frame
-    //printf("%u\n", elapsed_time);
-    if (elapsed_time < target_frame_time) {
-        thd_sleep(target_frame_time - elapsed_time);
+    upload_frame(player, texture_data, stride, roq_get_changed_macroblocks(player->decoder));
+}
+
+// Uploads the tiles of a frame that changed, or all of them without
+// change flags, into the textures of frame_index
+static void upload_frame(roq_player_t* player, unsigned short* texture_data, int stride, const unsigned char* changed) {
+    video_tile* tile;
+    int i;
+
+    if(player->upload_all) {
+        changed = NULL;
+        player->upload_all--;
+    }
+
+    for(i = 0; i < player->tile_count; i++) {
+        tile = &player->tiles[i];
+        if(!changed || tile_changed(player, tile, changed))
+            plat_texture_upload_rows(tile->textures[player->frame_index],
+                                     texture_data + tile->y * stride + tile->x, stride);
     }
 
-    pvr_wait_ready();
-    pvr_scene_begin();
-    pvr_list_begin(PVR_LIST_OP_POLY);
+    player->frame_index = !player->frame_index;
+    player->new_frame = 1;
+    player->has_frame = 1;
+}
 
-    pvr_prim(&vid_stream.hdr[vid_stream.frame_index], sizeof(pvr_poly_hdr_t));
-    pvr_prim(&vid_stream.vert[0], sizeof(pvr_vertex_t));
-    pvr_prim(&vid_stream.vert[1], sizeof(pvr_vertex_t));
-    pvr_prim(&vid_stream.vert[2], sizeof(pvr_vertex_t));
-    pvr_prim(&vid_stream.vert[3], sizeof(pvr_vertex_t));
+// The decoder writes its pcm straight into the free space after the
+// ring's head; roq_audio_cb() then only has to publish it.
+static unsigned char* roq_audio_buffer_cb(int size, int channels, int* granted, void* user_data) {
+    roq_player_t* player = (roq_player_t*)user_data;
+    ring_buffer* rb = &player->decode_buffer;
+    int room;
 
-    pvr_list_finish();
-    pvr_scene_finish();
-    
-    // Update the last frame time
-    last_frame_time = get_current_time();
+    plat_mutex_lock(mixer.mut);
 
-    vid_stream.frame_index = !vid_stream.frame_index;
+    // Drop what is still queued in the other format
+    if(player->channels != channels) {
+        ring_buffer_reset(rb);
+        player->channels = channels;
+    }
+
+    room = rb->capacity - rb->size;
+    if(room > rb->capacity - rb->head)
+        room = rb->capacity - rb->head;
+    if(room > size)
+        room = size;
+
+    plat_mutex_unlock(mixer.mut);
+
+    // The mixer only reads up to size, so the region is ours until then
+    *granted = room;
+    return room ? rb->buffer + rb->head : NULL;
 }
 
 static void roq_audio_cb(unsigned char *audio_data, int data_length, int channels, void* user_data) {
-    snd_stream.channels = channels;
+    roq_player_t* player = (roq_player_t*)user_data;
+    ring_buffer* rb = &player->decode_buffer;
+
+    plat_mutex_lock(mixer.mut);
 
-    mutex_lock(&snd_stream.decode_buffer_mut);
+    if(player->channels != channels) {
+        ring_buffer_reset(rb);
+        player->channels = channels;
+    }
 
-    ring_buffer_write(&snd_stream.decode_buffer, audio_data, data_length);
+    if(audio_data == rb->buffer + rb->head) {
+        // Decoded in place by way of roq_audio_buffer_cb()
+        rb->head = (rb->head + data_length) % rb->capacity;
+        rb->size += data_length;
+    }
+    else {
+        // Prefetched audio, or the ring was full when it was decoded
+        ring_buffer_write(rb, audio_data, data_length);
+    }
 
-    mutex_unlock(&snd_stream.decode_buffer_mut);
+    plat_mutex_unlock(mixer.mut);
 }
 
-static void* aica_callback(snd_stream_hnd_t hnd, int bytes_needed, int* bytes_returning) {
+static void* mixer_callback(void* user_data, int bytes_needed, int* bytes_returning) {
+    roq_player_t* player;
+    int frames, available, i;
+    int sample;
+
+    if(bytes_needed > AUDIO_BUFFER_SIZE)
+        bytes_needed = AUDIO_BUFFER_SIZE;
+
+    frames = bytes_needed / 4;
+    memset(mixer.mix_accum, 0, frames * 2 * sizeof(int));
+
+    plat_mutex_lock(mixer.mut);
 
-    if(ring_buffer_underflow(&snd_stream.decode_buffer, bytes_needed))
-        thd_pass();
+    for(player = mixer.players; player != NULL; player = player->next) {
+        if(player->status != PLAYER_STATUS_STREAMING || player->channels == 0)
+            continue;
 
-    mutex_lock(&snd_stream.decode_buffer_mut);
+        // A stream that runs dry only contributes what it has
+        available = player->decode_buffer.size / (2 * player->channels);
+        if(available > frames)
+            available = frames;
 
-    ring_buffer_read(&snd_stream.decode_buffer, snd_stream.pcm_buffer, bytes_needed);
+        mix_ring(&player->decode_buffer, mixer.mix_accum, available, player->channels, player->vol);
+    }
+
+    plat_mutex_unlock(mixer.mut);
 
-    mutex_unlock(&snd_stream.decode_buffer_mut);
+    for(i = 0; i < frames * 2; i++) {
+        sample = mixer.mix_accum[i] / 255;
+        mixer.mix_buffer[i] = (sample < -32768) ? -32768 : ((sample > 32767) ? 32767 : sample);
+    }
 
-    *bytes_returning = bytes_needed;
+    *bytes_returning = frames * 4;
 
-    return snd_stream.pcm_buffer;
+    return mixer.mix_buffer;
 }
 
-static void initialize_defaults(roq_player_t* player, int index) {
+static roq_player_t* initialize_defaults(roq_t* decoder) {
+    roq_player_t* player;
+
+    if(!decoder) {
+        player_errno = PLAYER_FORMAT_INIT_FAILURE;
+        return NULL;
+    }
+
+    player = malloc(sizeof(roq_player_t));
+    if(!player) {
+        roq_destroy(decoder);
+        player_errno = PLAYER_OUT_OF_MEMORY;
+        return NULL;
+    }
+
+    memset(player, 0, sizeof(roq_player_t));
+    player->decoder = decoder;
+    player->initialized_format = 1;
+    player->paused = 1;
+    player->status = PLAYER_STATUS_READY;
+    player->vol = 240;
+
     roq_set_video_decode_callback(player->decoder, roq_video_cb);
     roq_set_audio_decode_callback(player->decoder, roq_audio_cb);
+    roq_set_audio_buffer_callback(player->decoder, roq_audio_buffer_cb);
+    roq_set_user_data(player->decoder, player);
+
+    player->framerate = roq_get_framerate(player->decoder);
+    if(player->framerate <= 0)
+        player->framerate = DEFAULT_FRAMERATE;
+    player->target_frame_time = 1000 / player->framerate;
+
+    if(initialize_graphics(player, roq_get_width(player->decoder), roq_get_height(player->decoder)) != PLAYER_SUCCESS) {
+        player_destroy(player);
+        player_errno = PLAYER_OUT_OF_VID_MEMORY;
+        return NULL;
+    }
+    initialize_rect(player, roq_get_width(player->decoder), roq_get_height(player->decoder));
+    track_changes(player);
 
-    vid_stream.framerate = roq_get_framerate(player->decoder);
+    if(initialize_audio(player) != PLAYER_SUCCESS) {
+        player_destroy(player);
+        player_errno = PLAYER_OUT_OF_MEMORY;
+        return NULL;
+    }
 
-    snd_stream.shnd = index;
-    snd_stream.status = SND_STREAM_STATUS_READY;
+    plat_mutex_lock(mixer.mut);
+    player->next = mixer.players;
+    mixer.players = player;
+    plat_mutex_unlock(mixer.mut);
 
-    player->initialized_format = 1;
+    return player;
+}
+
+// One tile per PLAT_TEXTURE_MAX square of the frame. The decoder pads
+// frames to power of two dimensions, so every tile's texture can be
+// filled straight from the frame, padding included.
+static int initialize_graphics(roq_player_t* player, int width, int height) {
+    int columns, rows, texture_width, texture_height, i;
+    video_tile* tile;
+
+    columns = (width + PLAT_TEXTURE_MAX - 1) / PLAT_TEXTURE_MAX;
+    rows = (height + PLAT_TEXTURE_MAX - 1) / PLAT_TEXTURE_MAX;
+
+    player->tiles = calloc(columns * rows, sizeof(video_tile));
+    if(!player->tiles)
+        return PLAYER_OUT_OF_MEMORY;
+    player->tile_count = columns * rows;
+    player->width = width;
+    player->height = height;
+
+    for(i = 0; i < player->tile_count; i++) {
+        tile = &player->tiles[i];
+        tile->x = (i % columns) * PLAT_TEXTURE_MAX;
+        tile->y = (i / columns) * PLAT_TEXTURE_MAX;
+        tile->width = width - tile->x < PLAT_TEXTURE_MAX ? width - tile->x : PLAT_TEXTURE_MAX;
+        tile->height = height - tile->y < PLAT_TEXTURE_MAX ? height - tile->y : PLAT_TEXTURE_MAX;
+
+        texture_width = next_pow2(tile->width);
+        texture_height = next_pow2(tile->height);
+        tile->textures[0] = plat_texture_create(texture_width, texture_height);
+        tile->textures[1] = plat_texture_create(texture_width, texture_height);
+        if (!tile->textures[0] || !tile->textures[1])
+            return PLAYER_OUT_OF_VID_MEMORY;
+
+        tile->u1 = (float)tile->width / texture_width;
+        tile->v1 = (float)tile->height / texture_height;
+    }
 
-    initialize_graphics(roq_get_width(player->decoder), roq_get_height(player->decoder));
-    initialize_audio();
+    return PLAYER_SUCCESS;
 }
 
-static int initialize_graphics(int width, int height) {
-    if(vid_stream.initialized)
-        return PLAYER_SUCCESS;
+static void destroy_graphics(roq_player_t* player) {
+    int i;
+
+    for(i = 0; i < player->tile_count; i++) {
+        plat_texture_destroy(player->tiles[i].textures[0]);
+        plat_texture_destroy(player->tiles[i].textures[1]);
+    }
+    free(player->tiles);
+    player->tiles = NULL;
+    player->tile_count = 0;
+}
 
-    vid_stream.texture_byte_length = width * height * 2;
-    vid_stream.textures[0] = pvr_mem_malloc(vid_stream.texture_byte_length);
-    vid_stream.textures[1] = pvr_mem_malloc(vid_stream.texture_byte_length);
-    if (!vid_stream.textures[0] || !vid_stream.textures[1])
-        return PLAYER_OUT_OF_VID_MEMORY;
-
-    pvr_poly_cxt_t cxt;
-
-    pvr_poly_cxt_txr(&cxt, PVR_LIST_OP_POLY, PVR_TXRFMT_RGB565 | PVR_TXRFMT_NONTWIDDLED, width, height, vid_stream.textures[0], PVR_FILTER_NONE);// PVR_FILTER_BILINEAR); //PVR_FILTER_NONE
-    pvr_poly_compile(&vid_stream.hdr[0], &cxt);
-    pvr_poly_cxt_txr(&cxt, PVR_LIST_OP_POLY, PVR_TXRFMT_RGB565 | PVR_TXRFMT_NONTWIDDLED, width, height, vid_stream.textures[1], PVR_FILTER_NONE); //PVR_FILTER_BILINEAR); //PVR_FILTER_NONE
-    pvr_poly_compile(&vid_stream.hdr[1], &cxt);
-    
-    vid_stream.vert[0].z     = vid_stream.vert[1].z     = vid_stream.vert[2].z     = vid_stream.vert[3].z     = 1.0f; 
-    vid_stream.vert[0].argb  = vid_stream.vert[1].argb  = vid_stream.vert[2].argb  = vid_stream.vert[3].argb  = PVR_PACK_COLOR(1.0f, 1.0f, 1.0f, 1.0f);    
-    vid_stream.vert[0].oargb = vid_stream.vert[1].oargb = vid_stream.vert[2].oargb = vid_stream.vert[3].oargb = 0;  
-    vid_stream.vert[0].flags = vid_stream.vert[1].flags = vid_stream.vert[2].flags = PVR_CMD_VERTEX;         
-    vid_stream.vert[3].flags = PVR_CMD_VERTEX_EOL;
+// With a single texture the check would cost more than it saves. Until
+// both textures hold frames of this decoder, everything is uploaded.
+static void track_changes(roq_player_t* player) {
+    roq_set_track_changes(player->decoder, player->tile_count > 1);
+    player->upload_all = 2;
+}
 
+static int tile_changed(roq_player_t* player, video_tile* tile, const unsigned char* changed) {
+    int mb_width = player->width / 16;
+    int x, y;
+
+    for(y = tile->y / 16; y < (tile->y + tile->height) / 16; y++)
+        for(x = tile->x / 16; x < (tile->x + tile->width) / 16; x++)
+            if(changed[y * mb_width + x])
+                return 1;
+
+    return 0;
+}
+
+// Full width, letterboxed
+static void initialize_rect(roq_player_t* player, int width, int height) {
     float ratio;
     int ul_x, ul_y, br_x, br_y;
 
-    ratio = 640.0 / width;
+    ratio = (float)PLAT_SCREEN_WIDTH / width;
     ul_x = 0;
     br_x = (ratio * width);
-    ul_y = ((480 - ratio * height) / 2);
+    ul_y = ((PLAT_SCREEN_HEIGHT - ratio * height) / 2);
     br_y = ul_y + ratio * height;
 
-    vid_stream.vert[0].x = ul_x;
-    vid_stream.vert[0].y = ul_y;
-    vid_stream.vert[0].u = 0.0;
-    vid_stream.vert[0].v = 0.0;
+    player_set_rect(player, ul_x, ul_y, br_x - ul_x, br_y - ul_y);
+}
 
-    vid_stream.vert[1].x = br_x;
-    vid_stream.vert[1].y = ul_y;
-    vid_stream.vert[1].u = 1.0;
-    vid_stream.vert[1].v = 0.0;
+static int next_pow2(int value) {
+    int pow2 = 8;
 
-    vid_stream.vert[2].x = ul_x;
-    vid_stream.vert[2].y = br_y;
-    vid_stream.vert[2].u = 0.0;
-    vid_stream.vert[2].v = 1.0;
+    while (pow2 < value)
+        pow2 <<= 1;
 
-    vid_stream.vert[3].x = br_x;
-    vid_stream.vert[3].y = br_y;
-    vid_stream.vert[3].u = 1.0;
-    vid_stream.vert[3].v = 1.0;
+    return pow2;
+}
 
-    vid_stream.initialized = 1;
+static int initialize_audio(roq_player_t* player) {
+    ring_buffer_reset(&player->decode_buffer);
+    player->decode_buffer.capacity = AUDIO_DECODE_BUFFER_SIZE;
+    player->decode_buffer.buffer = malloc(AUDIO_DECODE_BUFFER_SIZE);
+    if(player->decode_buffer.buffer == NULL)
+        return PLAYER_OUT_OF_MEMORY;
 
     return PLAYER_SUCCESS;
 }
 
-static int initialize_audio(void) {
-    if(snd_stream.initialized)
-        return PLAYER_SUCCESS;
+static void present_frame(roq_player_t* player) {
+    unsigned int elapsed_time = plat_time_ms() - player->last_frame_time; // Calculate elapsed time since last frame
+    //printf("%u\n", elapsed_time);
+    if (elapsed_time < player->target_frame_time) {
+        plat_sleep_ms(player->target_frame_time - elapsed_time);
+    }
 
-    snd_stream.decode_buffer.head = 0;
-    snd_stream.decode_buffer.tail = 0;
-    snd_stream.decode_buffer.size = 0;
-    snd_stream.decode_buffer.capacity = AUDIO_DECODE_BUFFER_SIZE;
-    snd_stream.decode_buffer.buffer = malloc(AUDIO_DECODE_BUFFER_SIZE);
-    if(snd_stream.decode_buffer.buffer == NULL)
-        return PLAYER_OUT_OF_MEMORY;
-    
-    mutex_init(&snd_stream.decode_buffer_mut, MUTEX_TYPE_NORMAL);
+    draw_scene(player);
 
-    snd_stream.initialized = 1;
-    
-    return PLAYER_SUCCESS;
+    // Update the last frame time
+    player->last_frame_time = plat_time_ms();
+}
+
+static void draw_scene(roq_player_t* player) {
+    plat_scene_begin();
+    player_draw(player);
+    plat_scene_finish();
+}
+
+static unsigned int frame_due_time(roq_player_t* player) {
+    return frame_time(player, player->clock_frames);
+}
+
+static unsigned int frame_time(roq_player_t* player, unsigned int number) {
+    return player->clock_start + number * 1000 / player->framerate;
+}
+
+static void decode_frame(roq_player_t* player) {
+    player->new_frame = 0;
+    roq_decode(player->decoder);
+
+    if(roq_has_ended(player->decoder) && (player->prefetch || player->playlist))
+        playlist_advance(player);
+}
+
+static int playlist_append(roq_player_t* player, const char* filename) {
+    playlist_entry** link;
+    playlist_entry* entry = malloc(sizeof(playlist_entry));
+    if(!entry)
+        return 0;
+
+    entry->filename = strdup(filename);
+    entry->next = NULL;
+    if(!entry->filename) {
+        free(entry);
+        return 0;
+    }
+
+    for(link = &player->playlist; *link != NULL; link = &(*link)->next)
+        ;
+    *link = entry;
+
+    return 1;
+}
+
+static void playlist_start_prefetch(roq_player_t* player) {
+    playlist_entry* entry = player->playlist;
+    prefetch_t* prefetch;
+
+    if(!entry)
+        return;
+
+    prefetch = malloc(sizeof(prefetch_t));
+    if(!prefetch)
+        return;
+
+    memset(prefetch, 0, sizeof(prefetch_t));
+    player->playlist = entry->next;
+    prefetch->filename = entry->filename;
+    prefetch->ahead_depth = player->ahead ? player->ahead->depth : 0;
+    free(entry);
+
+    prefetch->thread = plat_thread_create(prefetch_thread, prefetch);
+    if(!prefetch->thread) {
+        // Do the work right here, the switch just won't be gapless
+        prefetch_thread(prefetch);
+    }
+
+    player->prefetch = prefetch;
+}
+
+// Called on the frame boundary where the current file ended. Swaps in
+// the prefetched decoder and hands its first frame and audio to the
+// player so the next present already shows the new file.
+static void playlist_advance(roq_player_t* player) {
+    unsigned int ended_time = plat_time_ms();
+    prefetch_t* prefetch;
+    roq_t* finished;
+    unsigned short** old_frames = NULL;
+    int old_frame_count = 0;
+    int width, height;
+
+    for(;;) {
+        if(!player->prefetch)
+            playlist_start_prefetch(player);
+
+        prefetch = player->prefetch;
+        if(!prefetch)
+            return;
+
+        plat_thread_join(prefetch->thread);
+        prefetch->thread = NULL;
+        player->prefetch = NULL;
+
+        if(prefetch->decoder && prefetch->frame)
+            break;
+
+        // Could not open or decode it, move on to the next one
+        prefetch_destroy(prefetch);
+    }
+
+    finished = player->decoder;
+    width = roq_get_width(prefetch->decoder);
+    height = roq_get_height(prefetch->decoder);
+
+    if(width != roq_get_width(finished) || height != roq_get_height(finished)) {
+        destroy_graphics(player);
+
+        if(initialize_graphics(player, width, height) != PLAYER_SUCCESS) {
+            player_errno = PLAYER_OUT_OF_VID_MEMORY;
+            prefetch_destroy(prefetch);
+            player->has_frame = 0;
+            return;
+        }
+    }
+
+    player->decoder = prefetch->decoder;
+    prefetch->decoder = NULL;
+    roq_set_video_decode_callback(player->decoder, player->ahead ? ahead_video_cb : roq_video_cb);
+    roq_set_audio_decode_callback(player->decoder, roq_audio_cb);
+    roq_set_audio_buffer_callback(player->decoder, roq_audio_buffer_cb);
+    roq_set_user_data(player->decoder, player);
+    track_changes(player);
+
+    // The new decoder brought its pool; the old one goes with its decoder
+    if(player->ahead) {
+        old_frames = player->ahead->frames;
+        old_frame_count = player->ahead->frame_count;
+        player->ahead->frames = prefetch->frames;
+        player->ahead->frame_count = prefetch->frame_count;
+        prefetch->frames = NULL;
+        decode_ahead_size_changed(player);
+    }
+
+    player->framerate = roq_get_framerate(player->decoder);
+    if(player->framerate <= 0)
+        player->framerate = DEFAULT_FRAMERATE;
+    player->target_frame_time = 1000 / player->framerate;
+
+    if(prefetch->pcm_size)
+        roq_audio_cb(prefetch->pcm, prefetch->pcm_size, prefetch->channels, player);
+    roq_video_cb(prefetch->frame, width, height, prefetch->stride, prefetch->texture_height, player);
+
+    player->transition_latency = plat_time_ms() - ended_time;
+
+    if(player->playlist_loop && player->filename)
+        playlist_append(player, player->filename);
+
+    free(player->filename);
+    player->filename = prefetch->filename;
+    prefetch->filename = NULL;
+    prefetch_destroy(prefetch);
+
+    roq_destroy(finished);
+    free_frames(old_frames, old_frame_count);
+
+    playlist_start_prefetch(player);
+}
+
+// Opens the next file over again, for a prefetch started before
+// decode-ahead was turned on or off
+static void playlist_restart_prefetch(roq_player_t* player) {
+    prefetch_t* prefetch = player->prefetch;
+    playlist_entry* entry = malloc(sizeof(playlist_entry));
+
+    plat_thread_join(prefetch->thread);
+    prefetch->thread = NULL;
+    player->prefetch = NULL;
+
+    if(entry) {
+        entry->filename = prefetch->filename;
+        entry->next = player->playlist;
+        player->playlist = entry;
+        prefetch->filename = NULL;
+    }
+    prefetch_destroy(prefetch);
+
+    playlist_start_prefetch(player);
 }
 
-static void* player_snd_thread() {
-    while(snd_stream.status != SND_STREAM_STATUS_DONE && snd_stream.status != SND_STREAM_STATUS_ERROR) {
-        switch(snd_stream.status)
-        {
-            case SND_STREAM_STATUS_READY:
-                break;
-            case SND_STREAM_STATUS_RESUMING:
-                snd_stream_start(snd_stream.shnd, snd_stream.rate, snd_stream.channels-1);
-                snd_stream.status = SND_STREAM_STATUS_STREAMING;
-                break;
-            case SND_STREAM_STATUS_PAUSING:
-                snd_stream_stop(snd_stream.shnd);
-                snd_stream.status = SND_STREAM_STATUS_READY;
-                break;
-            case SND_STREAM_STATUS_STOPPING:
-                snd_stream_stop(snd_stream.shnd);
-                snd_stream.decode_buffer.head = 0;
-                snd_stream.decode_buffer.tail = 0;
-                snd_stream.decode_buffer.size = 0;
-                snd_stream.status = SND_STREAM_STATUS_READY;
-                break;
-            case SND_STREAM_STATUS_STREAMING:
-                snd_stream_poll(snd_stream.shnd);
-                thd_sleep(10);
-                break;
+static void* prefetch_thread(void* arg) {
+    prefetch_t* prefetch = (prefetch_t*)arg;
+
+    prefetch->decoder = roq_create_with_filename(prefetch->filename);
+    if(!prefetch->decoder)
+        return NULL;
+
+    roq_set_video_decode_callback(prefetch->decoder, prefetch_video_cb);
+    roq_set_audio_decode_callback(prefetch->decoder, prefetch_audio_cb);
+    roq_set_user_data(prefetch->decoder, prefetch);
+
+    // Frames from a pool, to go on decoding into for the queue
+    if(prefetch->ahead_depth) {
+        prefetch->frames = attach_frames(prefetch->decoder, prefetch->ahead_depth, &prefetch->frame_count);
+        if(!prefetch->frames) {
+            roq_destroy(prefetch->decoder);
+            prefetch->decoder = NULL;
+            return NULL;
         }
     }
 
+    roq_decode(prefetch->decoder);
+
     return NULL;
 }
 
-static int ring_buffer_write(ring_buffer *rb, const unsigned char *data, int data_length) {
-    if (data_length > rb->capacity - rb->size) {
-        return 0;
+static void prefetch_video_cb(unsigned short *frame_data, int width, int height, int stride, int texture_height, void* user_data) {
+    prefetch_t* prefetch = (prefetch_t*)user_data;
+
+    // Stays valid until the decoder runs again, which only happens
+    // after the switch
+    prefetch->frame = frame_data;
+    prefetch->stride = stride;
+    prefetch->texture_height = texture_height;
+}
+
+static void prefetch_audio_cb(unsigned char *audio_data, int data_length, int channels, void* user_data) {
+    prefetch_t* prefetch = (prefetch_t*)user_data;
+    unsigned char* pcm;
+
+    if(prefetch->pcm_size && prefetch->channels != channels)
+        return;
+
+    if(prefetch->pcm_size + data_length > prefetch->pcm_capacity) {
+        pcm = realloc(prefetch->pcm, prefetch->pcm_size + data_length);
+        if(!pcm)
+            return;
+        prefetch->pcm = pcm;
+        prefetch->pcm_capacity = prefetch->pcm_size + data_length;
     }
 
-    for (int i = 0; i < data_length; ++i) {
-        rb->buffer[rb->head] = data[i];
-        rb->head = (rb->head + 1) % rb->capacity;
+    memcpy(prefetch->pcm + prefetch->pcm_size, audio_data, data_length);
+    prefetch->pcm_size += data_length;
+    prefetch->channels = channels;
+}
+
+static void prefetch_destroy(prefetch_t* prefetch) {
+    if(prefetch->decoder)
+        roq_destroy(prefetch->decoder);
+
+    free_frames(prefetch->frames, prefetch->frame_count);
+    free(prefetch->filename);
+    free(prefetch->pcm);
+    free(prefetch);
+}
+
+// Gives decoder a pool of depth + DECODE_AHEAD_SPARE frames, before it
+// decodes anything
+static unsigned short** attach_frames(roq_t* decoder, int depth, int* count) {
+    size_t size = roq_get_frame_size(decoder);
+    unsigned short** frames;
+    int i;
+
+    *count = depth + DECODE_AHEAD_SPARE;
+    frames = calloc(*count, sizeof(unsigned short*));
+    if(!frames)
+        return NULL;
+
+    for(i = 0; i < *count; i++) {
+#ifdef _arch_dreamcast
+        frames[i] = memalign(32, size);
+#else
+        frames[i] = malloc(size);
+#endif
+        if(!frames[i])
+            break;
+    }
+
+    if(i < *count || !roq_set_frame_pool(decoder, frames, *count, size)) {
+        free_frames(frames, *count);
+        return NULL;
+    }
+
+    return frames;
+}
+
+static void free_frames(unsigned short** frames, int count) {
+    int i;
+
+    if(!frames)
+        return;
+
+    for(i = 0; i < count; i++)
+        free(frames[i]);
+    free(frames);
+}
+
+// Room for a copy of the change flags with every queued frame. Without
+// it every frame is uploaded whole.
+static void decode_ahead_size_changed(roq_player_t* player) {
+    decode_ahead_t* ahead = player->ahead;
+    int size = player->tile_count > 1 ? (player->width / 16) * (player->height / 16) : 0;
+    int i;
+
+    free(ahead->changed);
+    ahead->changed = size ? malloc(size * ahead->depth) : NULL;
+    ahead->changed_size = ahead->changed ? size : 0;
+    for(i = 0; i < ahead->depth; i++)
+        ahead->queue[i].changed = ahead->changed ? ahead->changed + i * size : NULL;
+}
+
+static void decode_ahead_start(roq_player_t* player) {
+    decode_ahead_t* ahead = player->ahead;
+
+    if(!ahead || ahead->thread || ahead->ended)
+        return;
+
+    // Without the thread, decode_ahead_take() decodes whenever the
+    // queue has room
+    ahead->running = 1;
+    ahead->thread = plat_thread_create(decode_ahead_thread, player);
+}
+
+// Stops the thread and empties the queue
+static void decode_ahead_stop(roq_player_t* player) {
+    decode_ahead_t* ahead = player->ahead;
+    int i;
+
+    if(ahead->thread) {
+        ahead->running = 0;
+        plat_thread_join(ahead->thread);
+        ahead->thread = NULL;
+    }
+
+    while(ahead->count)
+        decode_ahead_pop(ahead);
+    for(i = 0; i < ahead->done_count; i++)
+        roq_release_frame(player->decoder, ahead->done[i]);
+    ahead->done_count = 0;
+}
+
+static void decode_ahead_free(decode_ahead_t* ahead) {
+    if(!ahead)
+        return;
+
+    free_frames(ahead->frames, ahead->frame_count);
+    free(ahead->changed);
+    free(ahead->queue);
+    free(ahead->done);
+    if(ahead->mut)
+        plat_mutex_destroy(ahead->mut);
+    free(ahead);
+}
+
+// One round of the decode thread: hands back the frames the render
+// side is done with and decodes the next frame group if the queue has
+// room. Returns 0 when there was nothing to do.
+static int decode_ahead_step(roq_player_t* player) {
+    decode_ahead_t* ahead = player->ahead;
+    int room, result, i;
+
+    plat_mutex_lock(ahead->mut);
+    for(i = 0; i < ahead->done_count; i++)
+        roq_release_frame(player->decoder, ahead->done[i]);
+    ahead->done_count = 0;
+    room = !ahead->ended && ahead->count < ahead->depth;
+    plat_mutex_unlock(ahead->mut);
+
+    if(!room)
+        return 0;
+
+    result = roq_decode(player->decoder);
+    if(result == ROQ_NEED_FRAME)
+        return 0;
+
+    if(!result || roq_has_ended(player->decoder)) {
+        plat_mutex_lock(ahead->mut);
+        ahead->ended = 1;
+        plat_mutex_unlock(ahead->mut);
     }
 
-    rb->size += data_length;
     return 1;
 }
 
-static int ring_buffer_read(ring_buffer *rb, unsigned char *data, int data_length) {
-    if (data_length > rb->size) {
+static void* decode_ahead_thread(void* arg) {
+    roq_player_t* player = (roq_player_t*)arg;
+
+    while(player->ahead->running) {
+        if(!decode_ahead_step(player))
+            plat_sleep_ms(1);
+    }
+
+    return NULL;
+}
+
+// Runs on the decode thread. The frame stays held until the render
+// side is done with it.
+static void ahead_video_cb(unsigned short *frame_data, int width, int height, int stride, int texture_height, void* user_data) {
+    roq_player_t* player = (roq_player_t*)user_data;
+    decode_ahead_t* ahead = player->ahead;
+    const unsigned char* changed = roq_get_changed_macroblocks(player->decoder);
+    queued_frame* frame;
+
+    roq_acquire_frame(player->decoder, frame_data);
+
+    plat_mutex_lock(ahead->mut);
+    frame = &ahead->queue[(ahead->head + ahead->count) % ahead->depth];
+    frame->data = frame_data;
+    frame->stride = stride;
+    frame->number = ahead->next_number++;
+    frame->has_changed = changed && ahead->changed_size;
+    if(frame->has_changed)
+        memcpy(frame->changed, changed, ahead->changed_size);
+    ahead->count++;
+    plat_mutex_unlock(ahead->mut);
+}
+
+// Takes the frame at the head off the queue, with mut held
+static void decode_ahead_pop(decode_ahead_t* ahead) {
+    ahead->done[ahead->done_count++] = ahead->queue[ahead->head].data;
+    ahead->head = (ahead->head + 1) % ahead->depth;
+    ahead->count--;
+}
+
+// Sleeps until the next queued frame is due, or for a moment while the
+// queue is empty
+static void decode_ahead_wait(roq_player_t* player) {
+    decode_ahead_t* ahead = player->ahead;
+    int wait = 1;
+
+    plat_mutex_lock(ahead->mut);
+    if(ahead->count)
+        wait = (int)(frame_time(player, ahead->queue[ahead->head].number) - plat_time_ms());
+    else if(ahead->ended)
+        wait = 0;
+    plat_mutex_unlock(ahead->mut);
+
+    if(wait > 0)
+        plat_sleep_ms(wait);
+}
+
+// Uploads the last queued frame that is due by now; the ones before it
+// are dropped. Returns 1 when it uploaded one.
+static int decode_ahead_take(roq_player_t* player, unsigned int now) {
+    decode_ahead_t* ahead = player->ahead;
+    queued_frame* frame;
+    int late, ended;
+
+    if(!ahead->thread)
+        decode_ahead_step(player);
+
+    plat_mutex_lock(ahead->mut);
+    if(!ahead->count) {
+        ended = ahead->ended;
+        plat_mutex_unlock(ahead->mut);
+        return ended ? decode_ahead_end(player) : 0;
+    }
+
+    late = (int)(now - frame_time(player, ahead->queue[ahead->head].number));
+    if(late < 0) {
+        plat_mutex_unlock(ahead->mut);
         return 0;
     }
 
-    for (int i = 0; i < data_length; ++i) {
-        data[i] = rb->buffer[rb->tail];
-        rb->tail = (rb->tail + 1) % rb->capacity;
+    // Too far behind to catch up by dropping frames, start over from here
+    if(late > TICK_RESYNC_MS)
+        player->clock_start += late;
+
+    while(ahead->count > 1 &&
+          (int)(now - frame_time(player, ahead->queue[(ahead->head + 1) % ahead->depth].number)) >= 0) {
+        decode_ahead_pop(ahead);
+        ahead->stats.dropped++;
+        // The textures missed the frames the change flags build on
+        player->upload_all = 2;
     }
 
-    rb->size -= data_length;
+    frame = &ahead->queue[ahead->head];
+    if((int)(now - frame_time(player, frame->number)) >= 1000 / player->framerate || late > TICK_RESYNC_MS)
+        ahead->stats.late++;
+    ahead->queued_total += ahead->count;
+    plat_mutex_unlock(ahead->mut);
+
+    // Still counted in the queue, so the decoder leaves it alone
+    upload_frame(player, frame->data, frame->stride, frame->has_changed ? frame->changed : NULL);
+    player->clock_frames = frame->number + 1;
+
+    plat_mutex_lock(ahead->mut);
+    decode_ahead_pop(ahead);
+    ahead->stats.presented++;
+    plat_mutex_unlock(ahead->mut);
+
     return 1;
 }
 
-static int ring_buffer_underflow(ring_buffer *rb, int data_length) {
-    if (data_length > rb->size) {
-        return 1;
+// Everything up to the end of the file has been shown. Stops the
+// thread and moves on to the next file of the playlist, if there is
+// one, showing its first frame right away.
+static int decode_ahead_end(roq_player_t* player) {
+    decode_ahead_t* ahead = player->ahead;
+    roq_t* finished = player->decoder;
+
+    decode_ahead_stop(player);
+    if(!player->prefetch && !player->playlist)
+        return 0;
+
+    player->new_frame = 0;
+    playlist_advance(player);
+    if(player->decoder == finished)
+        return 0;
+
+    ahead->ended = 0;
+    ahead->next_number = 1;
+    player->clock_start = plat_time_ms();
+    player->clock_frames = 1;
+    decode_ahead_start(player);
+
+    return player->new_frame;
+}
+
+static void* player_snd_thread(void* arg) {
+    while(mixer.running) {
+        plat_audio_poll(mixer.shnd);
+        plat_sleep_ms(10);
     }
 
-    return 0;
+    return NULL;
 }
 
-static unsigned int get_current_time() {
-    uint32_t s, ms;
-    uint64_t msec;
+static void ring_buffer_reset(ring_buffer *rb) {
+    rb->head = 0;
+    rb->tail = 0;
+    rb->size = 0;
+}
 
-    timer_ms_gettime(&s, &ms);
-    msec = (((uint64_t)s) * ((uint64_t)1000)) + ((uint64_t)ms);
+static int ring_buffer_write(ring_buffer *rb, const unsigned char *data, int data_length) {
+    int span;
 
-    return (unsigned int)msec;
+    if (data_length > rb->capacity - rb->size) {
+        return 0;
+    }
+
+    span = rb->capacity - rb->head;
+    if (span > data_length)
+        span = data_length;
+    memcpy(rb->buffer + rb->head, data, span);
+    memcpy(rb->buffer, data + span, data_length - span);
+    rb->head = (rb->head + data_length) % rb->capacity;
+
+    rb->size += data_length;
+    return 1;
+}
+
+// Mixes frames sample frames from the tail of the ring into accum and
+// consumes them. Reads the ring in place, one contiguous span at a
+// time; every write to the ring is whole frames, so spans are too.
+static void mix_ring(ring_buffer *rb, int* accum, int frames, int channels, int vol) {
+    const short* src;
+    int span, sample, i;
+
+    while (frames > 0) {
+        span = (rb->capacity - rb->tail) / (2 * channels);
+        if (span > frames)
+            span = frames;
+        src = (const short*)(rb->buffer + rb->tail);
+
+        if (channels == 2) {
+            for (i = 0; i < span * 2; i++)
+                accum[i] += src[i] * vol;
+        }
+        else {
+            for (i = 0; i < span; i++) {
+                sample = src[i] * vol;
+                accum[i * 2] += sample;
+                accum[i * 2 + 1] += sample;
+            }
+        }
+
+        accum += span * 2;
+        frames -= span;
+        rb->tail = (rb->tail + span * 2 * channels) % rb->capacity;
+        rb->size -= span * 2 * channels;
+    }
 }
@@ -32,22 +32,82 @@ typedef void (*frame_callback)();
 
 typedef struct roq_player_t roq_player_t;
 
+// Starts the shared audio mixer. Call once before creating players.
 int player_init(void);
+
+// Destroys player, every other player still alive and stops the mixer.
 void player_shutdown(roq_player_t* player);
 
 roq_player_t* player_create(const char* filename);
 roq_player_t* player_create_file(FILE* f);
 roq_player_t* player_create_memory(unsigned char* memory, const unsigned int length);
 
+// Releases a single player. Do not call it from the frame_callback of
+// the player_play() loop that is running this player.
+void player_destroy(roq_player_t* player);
+
+// Blocking playback of a single player. Decodes, paces and presents
+// full screen until the video ends.
 void player_play(roq_player_t* player, frame_callback frame_cb);
+
+// Non-blocking playback for several players driven from one frame
+// loop: player_start() them, then call player_tick_all() once per
+// frame to decode whatever is due and player_draw_all() while a
+// scene is open to draw every player at its rectangle.
+void player_start(roq_player_t* player);
+int player_tick(roq_player_t* player);
+void player_tick_all(void);
+void player_draw(roq_player_t* player);
+void player_draw_all(void);
+void player_set_rect(roq_player_t* player, float x, float y, float width, float height);
+
+// Playlist. Queued files play one after another in this player. The
+// next file is opened and its first frame and audio decoded in the
+// background while the current one plays, textures are reused when
+// the dimensions match and the switch happens on the frame boundary
+// without an audio gap. With playlist loop on, every file that
+// finishes is queued again.
+int player_queue(roq_player_t* player, const char* filename);
+void player_set_playlist_loop(roq_player_t* player, int loop);
+
+// Milliseconds the last switch between two files took
+unsigned int player_get_transition_latency(roq_player_t* player);
+
 void player_pause(roq_player_t* player);
 void player_stop(roq_player_t* player);
+// Mixing volume of this player's audio, 0-255.
 void player_volume(roq_player_t* player, int vol);
 int player_isplaying(roq_player_t* player);
 int player_get_loop(roq_player_t* player);
 void player_set_loop(roq_player_t* player, int loop);
+// Loop cache of the file playing, see roq_set_loop_cache(). For short
+// looping backgrounds, where memory allows.
+int player_set_loop_cache(roq_player_t* player, size_t budget);
 int player_has_ended(roq_player_t* player);
 
+// Decode-ahead. With a depth above 0 the decoder runs on a thread of
+// its own while the player plays, and keeps up to depth decoded frames
+// queued. player_play() and player_tick() then only take the frame that
+// is due off the queue, upload and present it, so a frame that is slow
+// to decode does not hold up rendering and input for as long as the
+// queue lasts. Frames the render side falls behind on are dropped. It
+// takes depth + 3 frames of memory. Set it while the player is not
+// playing; a depth of 0 decodes on the calling thread again. Calls that
+// reach the decoder, like player_set_loop_cache(), also belong where
+// the player is not playing then.
+int player_set_decode_ahead(roq_player_t* player, int depth);
+
+typedef struct {
+    int depth;
+    int queued;               // frames waiting right now
+    float average_queued;     // frames waiting when one was taken
+    unsigned int presented;
+    unsigned int late;        // presented a frame or more after they were due
+    unsigned int dropped;     // skipped to catch up
+} player_queue_stats_t;
+
+void player_get_queue_stats(roq_player_t* player, player_queue_stats_t* stats);
+
 #ifdef __cplusplus
 }
 #endif
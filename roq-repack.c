@@ -0,0 +1,327 @@
+/*
+ * Dreamroq repacker
+ *
+ * Rewrites a RoQ file into the streaming layout described in
+ * dreamroqlib.h: every frame group (the chunks up to and including one
+ * video chunk) starts on a sector boundary, and an index chunk after
+ * RoQ_INFO lists the length of every group, so a disc reader can fetch
+ * whole groups with sector-aligned reads. The output is still a plain
+ * RoQ file that any decoder plays.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dreamroqlib.h"
+
+#define CHUNK_HEADER_SIZE 8
+
+// Keeps the index chunk under 64 KB, so repacked files stay readable by
+// older decoders that rejected larger chunks; groups past this are still
+// aligned, just read without the index
+#define MAX_INDEX_GROUPS ((1024 * 64 - ROQ_REPACK_INDEX_HEADER_SIZE) / 2)
+
+typedef struct
+{
+    unsigned short id;
+    unsigned int size;
+    unsigned short arg;
+    unsigned char *data;
+} chunk_t;
+
+typedef struct
+{
+    int first;      /* index of the first chunk of the group */
+    int count;      /* number of chunks in the group */
+    unsigned int sectors;
+} group_t;
+
+static chunk_t info;
+static chunk_t *chunks = NULL;
+static int chunk_count = 0;
+static group_t *groups = NULL;
+static int group_count = 0;
+static unsigned int sector_size = ROQ_REPACK_SECTOR_SIZE;
+
+static void put_le16(unsigned char *buf, unsigned int value)
+{
+    buf[0] = value & 0xFF;
+    buf[1] = (value >> 8) & 0xFF;
+}
+
+static void put_le32(unsigned char *buf, unsigned int value)
+{
+    put_le16(buf, value & 0xFFFF);
+    put_le16(buf + 2, value >> 16);
+}
+
+static int write_chunk_header(FILE *out, unsigned short id, unsigned int size, unsigned short arg)
+{
+    unsigned char header[CHUNK_HEADER_SIZE];
+
+    put_le16(&header[0], id);
+    put_le32(&header[2], size);
+    put_le16(&header[6], arg);
+
+    return fwrite(header, CHUNK_HEADER_SIZE, 1, out) == 1;
+}
+
+// Bytes of RoQ_INFO padding needed after 'length' bytes to reach the
+// next sector boundary. A padding chunk is at least a chunk header, so
+// a gap smaller than that spills into the following sector.
+static unsigned int padding_for(unsigned long length)
+{
+    unsigned int gap = (sector_size - length % sector_size) % sector_size;
+
+    if (gap > 0 && gap < CHUNK_HEADER_SIZE)
+        gap += sector_size;
+
+    return gap;
+}
+
+static int write_padding(FILE *out, unsigned int gap)
+{
+    static const unsigned char zeros[256];
+    unsigned int size;
+
+    if (gap == 0)
+        return 1;
+
+    if (!write_chunk_header(out, RoQ_INFO, gap - CHUNK_HEADER_SIZE, 0))
+        return 0;
+
+    for (gap -= CHUNK_HEADER_SIZE; gap > 0; gap -= size)
+    {
+        size = gap < sizeof(zeros) ? gap : sizeof(zeros);
+        if (fwrite(zeros, size, 1, out) != 1)
+            return 0;
+    }
+
+    return 1;
+}
+
+static int load_chunks(const char *filename, unsigned short *framerate)
+{
+    roq_packet_t packet;
+    roq_demux_t *demux;
+    chunk_t *chunk;
+    int capacity = 0;
+    int have_info = 0;
+
+    demux = roq_demux_create_with_filename(filename);
+    if (!demux)
+    {
+        printf("could not open %s (%d)\n", filename, roq_errno);
+        return 0;
+    }
+
+    if (!roq_demux_next(demux, &packet) || packet.chunk_id != RoQ_SIGNATURE)
+    {
+        printf("%s is not a RoQ file\n", filename);
+        roq_demux_destroy(demux);
+        return 0;
+    }
+    *framerate = packet.chunk_arg;
+
+    while (roq_demux_next(demux, &packet))
+    {
+        // Keep the first real RoQ_INFO, drop old indexes and padding
+        if (packet.chunk_id == RoQ_INFO)
+        {
+            if (have_info || packet.chunk_size < 4 || !memcmp(packet.data, ROQ_REPACK_MAGIC, 4))
+                continue;
+            have_info = 1;
+        }
+
+        chunk = packet.chunk_id == RoQ_INFO ? &info : &chunks[chunk_count];
+
+        if (chunk == &chunks[chunk_count] && chunk_count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 1024;
+            chunks = realloc(chunks, capacity * sizeof(chunk_t));
+            if (!chunks)
+            {
+                printf("out of memory\n");
+                roq_demux_destroy(demux);
+                return 0;
+            }
+            chunk = &chunks[chunk_count];
+        }
+
+        // The packet payload is only valid until the next call
+        chunk->id = packet.chunk_id;
+        chunk->size = packet.chunk_size;
+        chunk->arg = packet.chunk_arg;
+        chunk->data = malloc(packet.chunk_size ? packet.chunk_size : 1);
+        if (!chunk->data)
+        {
+            printf("out of memory\n");
+            roq_demux_destroy(demux);
+            return 0;
+        }
+        memcpy(chunk->data, packet.data, packet.chunk_size);
+        if (chunk != &info)
+            chunk_count++;
+    }
+
+    roq_demux_destroy(demux);
+
+    if (!have_info)
+    {
+        printf("%s has no RoQ_INFO chunk\n", filename);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Splits the chunks into groups ending with a video chunk
+static int build_groups(void)
+{
+    unsigned long length = 0;
+    group_t *group = NULL;
+    int i;
+
+    groups = malloc(chunk_count * sizeof(group_t));
+    if (!groups)
+        return 0;
+
+    for (i = 0; i < chunk_count; i++)
+    {
+        if (!group)
+        {
+            group = &groups[group_count++];
+            group->first = i;
+            group->count = 0;
+            length = 0;
+        }
+        group->count++;
+        length += CHUNK_HEADER_SIZE + chunks[i].size;
+
+        if (chunks[i].id == RoQ_QUAD_VQ || chunks[i].id == RoQ_JPEG || i == chunk_count - 1)
+        {
+            group->sectors = (length + padding_for(length)) / sector_size;
+            if (group->sectors > 0xFFFF)
+            {
+                printf("frame group %d is too large for the index\n", group_count - 1);
+                return 0;
+            }
+            group = NULL;
+        }
+    }
+
+    return 1;
+}
+
+static int write_file(const char *filename, unsigned short framerate)
+{
+    unsigned char *index;
+    unsigned int index_groups, index_size;
+    unsigned long header_length, first_group_offset;
+    FILE *out;
+    int i, j, ok = 1;
+
+    index_groups = group_count < MAX_INDEX_GROUPS ? group_count : MAX_INDEX_GROUPS;
+    index_size = ROQ_REPACK_INDEX_HEADER_SIZE + index_groups * 2;
+
+    header_length = CHUNK_HEADER_SIZE +
+                    CHUNK_HEADER_SIZE + info.size +
+                    CHUNK_HEADER_SIZE + index_size;
+    first_group_offset = header_length + padding_for(header_length);
+
+    index = malloc(index_size);
+    if (!index)
+        return 0;
+
+    memcpy(index, ROQ_REPACK_MAGIC, 4);
+    put_le16(&index[4], ROQ_REPACK_VERSION);
+    put_le16(&index[6], sector_size);
+    put_le32(&index[8], index_groups);
+    put_le32(&index[12], first_group_offset);
+    for (i = 0; i < (int)index_groups; i++)
+        put_le16(&index[ROQ_REPACK_INDEX_HEADER_SIZE + i * 2], groups[i].sectors);
+
+    out = fopen(filename, "wb");
+    if (!out)
+    {
+        printf("could not create %s\n", filename);
+        free(index);
+        return 0;
+    }
+
+    ok &= write_chunk_header(out, RoQ_SIGNATURE, 0xFFFFFFFF, framerate);
+    ok &= write_chunk_header(out, RoQ_INFO, info.size, info.arg);
+    ok &= fwrite(info.data, info.size, 1, out) == 1;
+    ok &= write_chunk_header(out, RoQ_INFO, index_size, 0);
+    ok &= fwrite(index, index_size, 1, out) == 1;
+    ok &= write_padding(out, padding_for(header_length));
+
+    for (i = 0; i < group_count && ok; i++)
+    {
+        unsigned long length = 0;
+
+        for (j = groups[i].first; j < groups[i].first + groups[i].count; j++)
+        {
+            ok &= write_chunk_header(out, chunks[j].id, chunks[j].size, chunks[j].arg);
+            if (chunks[j].size)
+                ok &= fwrite(chunks[j].data, chunks[j].size, 1, out) == 1;
+            length += CHUNK_HEADER_SIZE + chunks[j].size;
+        }
+        ok &= write_padding(out, padding_for(length));
+    }
+
+    if (fclose(out) != 0)
+        ok = 0;
+    free(index);
+
+    if (!ok)
+        printf("error writing %s\n", filename);
+
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *input = NULL, *output = NULL;
+    unsigned short framerate = 0;
+    unsigned long bytes;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--sector") && i + 1 < argc)
+            sector_size = atoi(argv[++i]);
+        else if (!input)
+            input = argv[i];
+        else
+            output = argv[i];
+    }
+
+    if (!input || !output || sector_size < 512 || sector_size > 0x8000 ||
+        (sector_size & (sector_size - 1)))
+    {
+        printf("USAGE: roq-repack [--sector <bytes>] <input.roq> <output.roq>\n");
+        printf("  sector size is a power of two from 512 to 32768 (default %d)\n", ROQ_REPACK_SECTOR_SIZE);
+        return 1;
+    }
+
+    if (!load_chunks(input, &framerate) || !build_groups() || !write_file(output, framerate))
+        return 1;
+
+    bytes = 0;
+    for (i = 0; i < group_count; i++)
+        bytes += groups[i].sectors * sector_size;
+    printf("%d chunks in %d frame groups, %lu bytes of groups, %d byte sectors\n",
+        chunk_count, group_count, bytes, sector_size);
+    if (group_count > MAX_INDEX_GROUPS)
+        printf("index covers the first %d groups\n", MAX_INDEX_GROUPS);
+
+    for (i = 0; i < chunk_count; i++)
+        free(chunks[i].data);
+    free(chunks);
+    free(groups);
+    free(info.data);
+
+    return 0;
+}
@@ -0,0 +1,263 @@
+/*
+ * Dreamroq frame server client
+ *
+ * Maps the shared memory of a roq-serve process read-only and reads
+ * its rings, see roq-serve.h. Nothing here writes to the shared
+ * memory, so any number of clients can attach without the server
+ * knowing about them.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "roq-serve.h"
+
+struct roq_client_t {
+    unsigned char* base;
+    size_t size;
+    const roq_serve_header_t* header;
+    const roq_serve_audio_t* audio;
+
+    unsigned int next_frame;
+    unsigned int next_chunk;
+    roq_client_stats_t stats;
+};
+
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+
+static int frame_intact(roq_client_t* client, unsigned int number);
+static int audio_intact(roq_client_t* client, unsigned int number);
+
+roq_client_t* roq_client_open(const char* name) {
+    roq_client_t* client;
+    struct stat st;
+    void* base;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(roq_serve_header_t)) {
+        close(fd);
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    client = (roq_client_t*)malloc(sizeof(roq_client_t));
+    if (!client) {
+        munmap(base, st.st_size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(client, 0, sizeof(roq_client_t));
+    client->base = (unsigned char*)base;
+    client->size = st.st_size;
+    client->header = (const roq_serve_header_t*)base;
+
+    if (LOAD(client->header->magic) != ROQ_SERVE_MAGIC ||
+        client->header->version != ROQ_SERVE_VERSION ||
+        client->header->frame_slots > ROQ_SERVE_MAX_FRAMES ||
+        client->header->pcm_offset + (size_t)client->header->pcm_size > client->size ||
+        client->header->frame_offset + (size_t)client->header->frame_slots * client->header->frame_size > client->size) {
+        roq_client_close(client);
+        errno = EAGAIN;
+        return NULL;
+    }
+    client->audio = (const roq_serve_audio_t*)(client->base + client->header->audio_offset);
+
+    // Start at the oldest entries still in the rings
+    client->next_frame = LOAD(client->header->frames);
+    client->next_frame -= client->next_frame < client->header->frame_slots ?
+        client->next_frame : client->header->frame_slots;
+    while (client->next_frame < LOAD(client->header->frames) && !frame_intact(client, client->next_frame))
+        client->next_frame++;
+
+    client->next_chunk = LOAD(client->header->chunks);
+    client->next_chunk -= client->next_chunk < client->header->audio_slots ?
+        client->next_chunk : client->header->audio_slots;
+    while (client->next_chunk < LOAD(client->header->chunks) && !audio_intact(client, client->next_chunk))
+        client->next_chunk++;
+
+    return client;
+}
+
+void roq_client_close(roq_client_t* client) {
+    munmap(client->base, client->size);
+    free(client);
+}
+
+const roq_serve_header_t* roq_client_get_header(roq_client_t* client) {
+    return client->header;
+}
+
+static const roq_serve_frame_t* frame_entry(roq_client_t* client, unsigned int number) {
+    unsigned int slot = LOAD(client->header->frame_index[number % client->header->frame_slots]);
+
+    if (slot >= client->header->frame_slots)
+        return NULL;
+
+    return &client->header->frame[slot];
+}
+
+// The acquire fence keeps the reads of the data the caller did before
+// from moving after the sequence number is read again
+static int frame_intact(roq_client_t* client, unsigned int number) {
+    const roq_serve_frame_t* entry = frame_entry(client, number);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return entry && __atomic_load_n(&entry->sequence, __ATOMIC_RELAXED) == number + 1;
+}
+
+static int audio_intact(roq_client_t* client, unsigned int number) {
+    const roq_serve_audio_t* entry = &client->audio[number % client->header->audio_slots];
+    uint64_t position = entry->position;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&entry->sequence, __ATOMIC_RELAXED) == number + 1 &&
+        __atomic_load_n(&client->header->pcm_reserved, __ATOMIC_RELAXED) - position <= client->header->pcm_size;
+}
+
+int roq_client_next_frame(roq_client_t* client, roq_client_frame_t* frame) {
+    const roq_serve_header_t* header = client->header;
+    const roq_serve_frame_t* entry;
+    unsigned int published;
+    unsigned int slot;
+
+    // A reader the server has lapped skips to the newest frame: the
+    // oldest ones left are the next to go
+    for (;;) {
+        published = LOAD(header->frames);
+        if (client->next_frame == published)
+            return 0;
+
+        entry = frame_entry(client, client->next_frame);
+        if (entry && LOAD(entry->sequence) == client->next_frame + 1)
+            break;
+
+        client->stats.frames_dropped += published - 1 - client->next_frame;
+        client->next_frame = published - 1;
+    }
+
+    slot = entry - header->frame;
+    frame->data = (const unsigned short*)(client->base + header->frame_offset + (size_t)slot * header->frame_size);
+    frame->width = header->width;
+    frame->height = header->height;
+    frame->stride = header->stride;
+    frame->number = client->next_frame++;
+    client->stats.frames++;
+
+    return 1;
+}
+
+int roq_client_next_audio(roq_client_t* client, roq_client_audio_t* audio) {
+    const roq_serve_header_t* header = client->header;
+    const roq_serve_audio_t* entry;
+
+    // Entries are small, so unlike frames they are read here, and one
+    // rewritten while it was being read is skipped too
+    for (;; client->next_chunk++, client->stats.chunks_dropped++) {
+        if (client->next_chunk == LOAD(header->chunks))
+            return 0;
+
+        entry = &client->audio[client->next_chunk % header->audio_slots];
+        if (LOAD(entry->sequence) != client->next_chunk + 1)
+            continue;
+
+        audio->data = client->base + header->pcm_offset + entry->position % header->pcm_size;
+        audio->size = entry->size;
+        audio->channels = entry->channels;
+        audio->frames = entry->frames;
+        audio->number = client->next_chunk;
+        if (audio_intact(client, audio->number))
+            break;
+    }
+    client->next_chunk++;
+    client->stats.chunks++;
+
+    return 1;
+}
+
+int roq_client_check_frame(roq_client_t* client, const roq_client_frame_t* frame) {
+    if (frame_intact(client, frame->number))
+        return 1;
+
+    client->stats.frames--;
+    client->stats.frames_dropped++;
+    return 0;
+}
+
+int roq_client_check_audio(roq_client_t* client, const roq_client_audio_t* audio) {
+    if (audio_intact(client, audio->number))
+        return 1;
+
+    client->stats.chunks--;
+    client->stats.chunks_dropped++;
+    return 0;
+}
+
+static int pending(roq_client_t* client) {
+    return client->next_frame != LOAD(client->header->frames) ||
+        client->next_chunk != LOAD(client->header->chunks) ||
+        LOAD(client->header->ended);
+}
+
+int roq_client_wait(roq_client_t* client, int timeout_ms) {
+    struct timespec timeout, now, deadline;
+    uint32_t generation;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    for (;;) {
+        // Read the generation first: anything published after this
+        // changes it and the futex does not sleep
+        generation = LOAD(client->header->generation);
+        if (pending(client))
+            return 1;
+
+        if (timeout_ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timeout.tv_sec = deadline.tv_sec - now.tv_sec;
+            timeout.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (timeout.tv_nsec < 0) {
+                timeout.tv_sec--;
+                timeout.tv_nsec += 1000000000L;
+            }
+            if (timeout.tv_sec < 0)
+                return 0;
+        }
+
+        syscall(SYS_futex, &client->header->generation, FUTEX_WAIT, generation,
+            timeout_ms >= 0 ? &timeout : NULL, NULL, 0);
+    }
+}
+
+int roq_client_has_ended(roq_client_t* client) {
+    return LOAD(client->header->ended) &&
+        client->next_frame == LOAD(client->header->frames) &&
+        client->next_chunk == LOAD(client->header->chunks);
+}
+
+void roq_client_get_stats(roq_client_t* client, roq_client_stats_t* stats) {
+    *stats = client->stats;
+}
@@ -0,0 +1,360 @@
+/*
+ * Dreamroq frame server
+ *
+ * Decodes a RoQ file once, in real time or as fast as it can, into a
+ * shared memory object that other processes read with the client
+ * functions of roq-serve.h. The frames of the ring are the frame pool
+ * of the decoder: a published frame is held until the decoder needs
+ * one back, then the oldest is marked free and released, so frames
+ * are decoded in place and stay untouched for as long as the ring
+ * allows. PCM is decoded straight into the audio ring through the
+ * audio buffer callback. Readers are never waited for.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dreamroqlib.h"
+#include "roq-serve.h"
+
+#define DEFAULT_FRAMES 8
+// The decoder's two references, the frame it replaces and one to
+// decode into
+#define MIN_FRAMES 4
+#define AUDIO_SLOTS 256
+// Encoders write at most 64 KiB of samples a chunk, each 2 bytes of
+// PCM; the ring holds at least two of those whole. Larger chunks, which
+// the decoder takes up to ROQ_MAX_CHUNK_SIZE, arrive in pieces.
+#define MAX_PCM_CHUNK (1024 * 64 * 2)
+#define DEFAULT_PCM_SIZE (1024 * 1024)
+
+#define ALIGN(x, a) (((x) + (a) - 1) & ~(size_t)((a) - 1))
+#define PAGE_SIZE 4096
+
+static const char* shm_name = ROQ_SERVE_DEFAULT_NAME;
+static unsigned char* base;
+static size_t base_size;
+static roq_serve_header_t* header;
+static roq_serve_audio_t* audio;
+static unsigned char* pcm;
+static unsigned short* frames[ROQ_SERVE_MAX_FRAMES];
+
+static roq_t* roq;
+static unsigned int oldest_held = 0;
+static unsigned int evictions = 0;
+static uint64_t pcm_write = 0;
+static uint64_t pcm_pending;
+static int published = 0;
+
+static volatile sig_atomic_t quit = 0;
+
+static void on_signal(int sig)
+{
+    quit = 1;
+}
+
+static int create_ring(int width, int height, int framerate, int frame_slots, size_t frame_size, size_t pcm_size)
+{
+    size_t audio_offset = ALIGN(sizeof(roq_serve_header_t), PAGE_SIZE);
+    size_t pcm_offset = ALIGN(audio_offset + AUDIO_SLOTS * sizeof(roq_serve_audio_t), PAGE_SIZE);
+    size_t frame_offset = ALIGN(pcm_offset + pcm_size, PAGE_SIZE);
+    void* mapping;
+    int fd;
+    int i;
+
+    frame_size = ALIGN(frame_size, 64);
+    base_size = frame_offset + frame_slots * frame_size;
+
+    // A server that did not get to clean up leaves its object behind
+    shm_unlink(shm_name);
+    fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+        return 0;
+    if (ftruncate(fd, base_size) < 0)
+    {
+        close(fd);
+        shm_unlink(shm_name);
+        return 0;
+    }
+    mapping = mmap(NULL, base_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        shm_unlink(shm_name);
+        return 0;
+    }
+
+    base = (unsigned char*)mapping;
+    header = (roq_serve_header_t*)base;
+    header->version = ROQ_SERVE_VERSION;
+    header->width = width;
+    header->height = height;
+    header->framerate = framerate;
+    header->frame_slots = frame_slots;
+    header->frame_size = frame_size;
+    header->frame_offset = frame_offset;
+    header->audio_slots = AUDIO_SLOTS;
+    header->audio_offset = audio_offset;
+    header->pcm_size = pcm_size;
+    header->pcm_offset = pcm_offset;
+    for (i = 0; i < ROQ_SERVE_MAX_FRAMES; i++)
+        header->frame_index[i] = ROQ_SERVE_MAX_FRAMES;
+
+    audio = (roq_serve_audio_t*)(base + audio_offset);
+    pcm = base + pcm_offset;
+    for (i = 0; i < frame_slots; i++)
+        frames[i] = (unsigned short*)(base + frame_offset + i * frame_size);
+
+    __atomic_store_n(&header->magic, ROQ_SERVE_MAGIC, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+static void destroy_ring(void)
+{
+    munmap(base, base_size);
+    shm_unlink(shm_name);
+}
+
+// Wakes every reader sleeping in roq_client_wait()
+static void publish(void)
+{
+    __atomic_add_fetch(&header->generation, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &header->generation, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    published = 0;
+}
+
+static void video_callback(unsigned short* frame_data, int width, int height, int stride, int texture_height, void* user_data)
+{
+    unsigned int number = header->frames;
+    unsigned int slot = ((unsigned char*)frame_data - (unsigned char*)frames[0]) / header->frame_size;
+
+    roq_acquire_frame(roq, frame_data);
+
+    // Published with the first frame, the layout is the decoder's
+    if (!number)
+    {
+        header->stride = stride;
+        header->texture_height = texture_height;
+    }
+
+    __atomic_store_n(&header->frame[slot].sequence, number + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->frame_index[number % header->frame_slots], slot, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->frames, number + 1, __ATOMIC_RELEASE);
+    published = 1;
+}
+
+// Marks the oldest frame free before the decoder can write to it, so
+// a reader still using it sees that it changed. Returns 0 when no
+// frame is held.
+static int evict_frame(void)
+{
+    unsigned int slot;
+
+    if (oldest_held == header->frames)
+        return 0;
+
+    slot = header->frame_index[oldest_held++ % header->frame_slots];
+    __atomic_store_n(&header->frame[slot].sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    roq_release_frame(roq, frames[slot]);
+    evictions++;
+
+    return 1;
+}
+
+// Every chunk gets contiguous room, at the start of the ring when it
+// does not fit at the end. One larger than the ring gets all of it and
+// the decoder asks again for the rest. pcm_reserved moves before
+// anything is written, so readers of the chunks in the way see them go.
+static unsigned char* audio_buffer_callback(int size, int channels, int* granted, void* user_data)
+{
+    size_t offset = pcm_write % header->pcm_size;
+
+    if (offset + size > header->pcm_size)
+    {
+        pcm_write += header->pcm_size - offset;
+        offset = 0;
+    }
+    if ((size_t)size > header->pcm_size - offset)
+        size = header->pcm_size - offset;
+
+    pcm_pending = pcm_write;
+    pcm_write += size;
+    __atomic_store_n(&header->pcm_reserved, pcm_write, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    *granted = size;
+    return pcm + pcm_pending % header->pcm_size;
+}
+
+static void audio_callback(unsigned char* buf, int size, int channels, void* user_data)
+{
+    unsigned int number = header->chunks;
+    roq_serve_audio_t* entry = &audio[number % AUDIO_SLOTS];
+
+    __atomic_store_n(&entry->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    entry->size = size;
+    entry->channels = channels;
+    entry->frames = header->frames;
+    entry->position = pcm_pending;
+    __atomic_store_n(&entry->sequence, number + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->chunks, number + 1, __ATOMIC_RELEASE);
+    published = 1;
+}
+
+// Sleeps until frame number is due at fps frames a second
+static void pace(const struct timespec* start, unsigned int number, int fps)
+{
+    unsigned long long due = number * 1000000000ULL / fps;
+    struct timespec until;
+
+    until.tv_sec = start->tv_sec + due / 1000000000ULL;
+    until.tv_nsec = start->tv_nsec + due % 1000000000ULL;
+    if (until.tv_nsec >= 1000000000L)
+    {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR && !quit)
+        ;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filename = NULL;
+    int frame_slots = DEFAULT_FRAMES;
+    size_t pcm_size = DEFAULT_PCM_SIZE;
+    int scale = ROQ_SCALE_FULL;
+    int fps = -1;
+    int loop = 0;
+    struct sigaction action;
+    struct timespec start;
+    int status = 1;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--name") && i + 1 < argc)
+            shm_name = argv[++i];
+        else if (!strcmp(argv[i], "--frames") && i + 1 < argc)
+            frame_slots = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--pcm") && i + 1 < argc)
+            pcm_size = atoi(argv[++i]) * 1024;
+        else if (!strcmp(argv[i], "--scale") && i + 1 < argc)
+            scale = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--fps") && i + 1 < argc)
+            fps = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--loop"))
+            loop = 1;
+        else
+            filename = argv[i];
+    }
+
+    if (!filename || frame_slots < MIN_FRAMES || frame_slots > ROQ_SERVE_MAX_FRAMES ||
+        pcm_size < 2 * MAX_PCM_CHUNK)
+    {
+        printf("USAGE: roq-serve [--name <shm name>] [--frames <count>] [--pcm <KiB>] [--scale 1|2|4] [--fps <rate>] [--loop] <file.roq>\n");
+        printf("  --frames between %d and %d (default %d), --pcm at least %d (default %d)\n",
+            MIN_FRAMES, ROQ_SERVE_MAX_FRAMES, DEFAULT_FRAMES, 2 * MAX_PCM_CHUNK / 1024, DEFAULT_PCM_SIZE / 1024);
+        printf("  --fps 0 decodes as fast as possible, the default is the rate of the video\n");
+        return 1;
+    }
+
+    roq = roq_create_with_filename(filename);
+    if (!roq)
+    {
+        printf("could not open %s (%d)\n", filename, roq_errno);
+        return 1;
+    }
+
+    if (!roq_set_decode_scale(roq, scale))
+    {
+        printf("unsupported scale %d\n", scale);
+        roq_destroy(roq);
+        return 1;
+    }
+
+    if (!create_ring(roq_get_width(roq), roq_get_height(roq), roq_get_framerate(roq),
+            frame_slots, roq_get_frame_size(roq), pcm_size))
+    {
+        printf("could not create shared memory %s: %s\n", shm_name, strerror(errno));
+        roq_destroy(roq);
+        return 1;
+    }
+
+    if (!roq_set_frame_pool(roq, frames, frame_slots, header->frame_size))
+    {
+        printf("could not set up the frame pool (%d)\n", roq_errno);
+        destroy_ring();
+        roq_destroy(roq);
+        return 1;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    roq_set_loop(roq, loop, NULL);
+    roq_set_video_decode_callback(roq, video_callback);
+    roq_set_audio_buffer_callback(roq, audio_buffer_callback);
+    roq_set_audio_decode_callback(roq, audio_callback);
+    if (fps < 0)
+        fps = roq_get_framerate(roq);
+
+    printf("serving %s as %s: %dx%d, %d frames of %d bytes, %d KiB of PCM\n", filename, shm_name,
+        (int)header->width, (int)header->height, frame_slots, (int)header->frame_size, (int)(pcm_size / 1024));
+    fflush(stdout);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!quit && !roq_has_ended(roq))
+    {
+        status = roq_decode(roq);
+        if (status == ROQ_NEED_FRAME)
+        {
+            if (!evict_frame())
+                break;
+            continue;
+        }
+        if (!status)
+            break;
+
+        if (published)
+        {
+            publish();
+            if (fps > 0)
+                pace(&start, header->frames, fps);
+        }
+    }
+
+    __atomic_store_n(&header->ended, 1, __ATOMIC_RELEASE);
+    publish();
+
+    if (status == ROQ_NEED_FRAME)
+        printf("decoder stalled with no frame held\n");
+    else if (!status && !roq_has_ended(roq))
+        printf("decoding failed (%d)\n", roq_errno);
+    printf("served %u frames and %u audio chunks, %u frames recycled\n",
+        header->frames, header->chunks, evictions);
+
+    status = quit || roq_has_ended(roq) ? 0 : 1;
+    roq_destroy(roq);
+    destroy_ring();
+
+    return status;
+}
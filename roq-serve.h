@@ -0,0 +1,154 @@
+/*
+ * Dreamroq frame server
+ *
+ * roq-serve decodes a stream once into a POSIX shared memory object
+ * that any number of processes on the same host map read-only: a ring
+ * of video frames and a ring of PCM, each entry tagged with a sequence
+ * number. The decoder decodes straight into the ring through a frame
+ * pool and its audio lands there through the audio buffer callback,
+ * so neither side copies. The server never waits for readers; a reader
+ * that falls more than a ring behind finds its next entries
+ * overwritten and skips ahead, and the client functions below count
+ * what it missed. Linux only (futex wake-ups).
+ */
+
+#ifndef ROQ_SERVE_H
+#define ROQ_SERVE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define ROQ_SERVE_MAGIC   0x56535152  // "RQSV"
+#define ROQ_SERVE_VERSION 1
+
+#define ROQ_SERVE_DEFAULT_NAME "/dreamroq"
+#define ROQ_SERVE_MAX_FRAMES   64
+
+// Layout of the shared memory object. The header, which holds the
+// frame entries, comes first, then the audio entries, the PCM ring and
+// the frames, each at the offset the header gives. Every field the server changes
+// while running is written with release ordering after the data it
+// describes.
+//
+// Entry sequence numbers are the number of the frame or audio chunk
+// plus one, and 0 while an entry is free or being rewritten. Frames
+// are not decoded in slot order, so frame_index[n % frame_slots] names
+// the slot of frame n. A reader that copies or uses an entry and then
+// finds its sequence number unchanged (and, for audio, its bytes not
+// yet reserved again, see pcm_reserved) knows the data was intact.
+typedef struct
+{
+    uint32_t sequence;
+    uint32_t pad;
+} roq_serve_frame_t;
+
+typedef struct
+{
+    uint32_t sequence;
+    uint32_t size;        // bytes of 16-bit PCM
+    uint32_t channels;
+    uint32_t frames;      // video frames published before this chunk
+    uint64_t position;    // where it starts, counting every byte ever reserved
+} roq_serve_audio_t;
+
+typedef struct
+{
+    uint32_t magic;       // written last, once everything else is set up
+    uint32_t version;
+
+    uint32_t width, height;
+    uint32_t stride, texture_height;  // set before the first frame is published
+    uint32_t framerate;
+
+    uint32_t frame_slots;
+    uint32_t frame_size;
+    uint32_t frame_offset;    // of slot 0, each slot frame_size further
+    uint32_t audio_slots;
+    uint32_t audio_offset;    // of the roq_serve_audio_t entries
+    uint32_t pcm_size;
+    uint32_t pcm_offset;
+
+    // Bumped whenever anything is published and when the stream ends;
+    // readers sleep on it with FUTEX_WAIT
+    uint32_t generation;
+    uint32_t ended;
+    uint32_t frames;          // video frames published
+    uint32_t chunks;          // audio chunks published
+    // End of the PCM bytes the server has reserved, counting from the
+    // start. Bytes before pcm_reserved - pcm_size may have been
+    // overwritten.
+    uint64_t pcm_reserved;
+
+    uint32_t frame_index[ROQ_SERVE_MAX_FRAMES];
+    roq_serve_frame_t frame[ROQ_SERVE_MAX_FRAMES];
+} roq_serve_header_t;
+
+// Client library. A client maps the object read-only and reads frames
+// and audio chunks in order, each at its own pace.
+
+typedef struct roq_client_t roq_client_t;
+
+typedef struct
+{
+    const unsigned short* data;
+    int width, height, stride;
+    unsigned int number;
+} roq_client_frame_t;
+
+typedef struct
+{
+    const unsigned char* data;
+    int size, channels;
+    unsigned int number;
+    unsigned int frames;      // video frames that come before it
+} roq_client_audio_t;
+
+typedef struct
+{
+    unsigned int frames;          // handed out
+    unsigned int frames_dropped;  // overwritten before they were read or while in use
+    unsigned int chunks;
+    unsigned int chunks_dropped;
+} roq_client_stats_t;
+
+// Maps the server's object. Returns NULL (errno tells why) when there
+// is no server by that name or it is not set up yet. A reader that
+// attaches late starts at the oldest frame and chunk still in the ring.
+roq_client_t* roq_client_open(const char* name);
+
+void roq_client_close(roq_client_t* client);
+
+const roq_serve_header_t* roq_client_get_header(roq_client_t* client);
+
+// Hand out the next frame or audio chunk without waiting. Returns 0
+// when there is nothing new. The data points into the ring and stays
+// intact until the server comes round to it again; call the matching
+// check function after using it to find out whether it did.
+int roq_client_next_frame(roq_client_t* client, roq_client_frame_t* frame);
+
+int roq_client_next_audio(roq_client_t* client, roq_client_audio_t* audio);
+
+// Returns 1 if the entry was not overwritten since it was handed out,
+// otherwise 0, and counts it as dropped.
+int roq_client_check_frame(roq_client_t* client, const roq_client_frame_t* frame);
+
+int roq_client_check_audio(roq_client_t* client, const roq_client_audio_t* audio);
+
+// Sleeps until there is a new frame or chunk or the stream has ended,
+// at most timeout_ms (-1 waits forever). Returns 0 on a timeout.
+int roq_client_wait(roq_client_t* client, int timeout_ms);
+
+// 1 once the server has published everything and no frame or chunk is
+// left to read.
+int roq_client_has_ended(roq_client_t* client);
+
+void roq_client_get_stats(roq_client_t* client, roq_client_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,647 @@
+/*
+ * Dreamroq synthetic stream generator
+ *
+ * Writes small deterministic RoQ files that exercise every part of the
+ * decoder: all block modes at both levels, full and partial codebooks,
+ * motion vectors with a global offset, mono and stereo audio,
+ * dimensions that are not powers of two, strides up to 2048, VQ chunks
+ * larger than 64 KB, audio chunks larger than roq-serve's PCM ring, JPEG
+ * keyframes, keyframes with a malformed Huffman table the decoder must
+ * reject, and self-contained VQ frames that start segments. The bitstreams are random but valid, so the pictures
+ * are noise; they exist for the golden checksum manifests, not for
+ * viewing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dreamroqlib.h"
+
+#define CHUNK_HEADER_SIZE 8
+#define MAX_CHUNK_SIZE (1024 * 1024)
+
+typedef struct
+{
+    const char *name;
+    int width;
+    int height;
+    int frames;
+    int channels;     /* 0 for a stream without audio */
+    int audio_bytes;  /* per audio chunk, 0 for one frame of samples */
+    int full_codebooks;
+    int keyframes;    /* JPEG keyframe interval, 0 for none */
+    int intra;        /* self-contained VQ frame interval, 0 for none */
+    int broken;       /* break every other keyframe's Huffman table */
+} synth_stream_t;
+
+static const synth_stream_t streams[] = {
+    /* name      width height frames channels audio bytes full codebooks keyframes intra broken */
+    { "small",     16,   16,    12,    0,       0,        0,            0,        0,    0 },
+    { "mono",      64,   48,    30,    1,       0,        0,            0,        0,    0 },
+    { "stereo",   256,  160,    24,    2,       0,        1,            0,        0,    0 },
+    { "jpeg",      80,   48,    18,    1,       0,        0,            6,        0,    0 },
+    { "wide",    1024,  512,    12,    0,       0,        0,            0,        0,    0 },
+    { "segments", 320,  240,    48,    1,       0,        0,            0,        8,    0 },
+    { "hd",      1920, 1088,     6,    1,       0,        0,            0,        0,    0 },
+    { "badjpeg",   80,   48,    30,    0,       0,        0,            6,        0,    1 },
+    { "bigaudio",  64,   48,     4,    2, 1000000,        0,            0,        0,    0 },
+};
+
+static unsigned int rng_state = 0x2545F491;
+
+static unsigned int rng(void)
+{
+    /* xorshift32, the same sequence on every host */
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+
+    return rng_state;
+}
+
+static void put_le16(unsigned char *buf, unsigned int value)
+{
+    buf[0] = value & 0xFF;
+    buf[1] = (value >> 8) & 0xFF;
+}
+
+static void put_le32(unsigned char *buf, unsigned int value)
+{
+    put_le16(buf, value & 0xFFFF);
+    put_le16(buf + 2, value >> 16);
+}
+
+static int write_chunk(FILE *out, unsigned short id, unsigned int size, unsigned short arg, const unsigned char *data)
+{
+    unsigned char header[CHUNK_HEADER_SIZE];
+
+    put_le16(&header[0], id);
+    put_le32(&header[2], size);
+    put_le16(&header[6], arg);
+
+    if (fwrite(header, CHUNK_HEADER_SIZE, 1, out) != 1)
+        return 0;
+
+    return size == 0 || size == 0xFFFFFFFF || fwrite(data, size, 1, out) == 1;
+}
+
+/*
+ * VQ bitstream writer. The decoder pulls a 16-bit mode word whenever it
+ * runs out of modes and reads argument bytes in between, so the writer
+ * reserves the word when the first of its eight modes is emitted and
+ * patches it as the rest arrive.
+ */
+typedef struct
+{
+    unsigned char *bytes;
+    int size;
+    int mode_pos;
+    int mode_count;
+    unsigned int mode_set;
+} vq_writer_t;
+
+static void vq_put_byte(vq_writer_t *vq, unsigned char value)
+{
+    vq->bytes[vq->size++] = value;
+}
+
+static void vq_put_mode(vq_writer_t *vq, int mode)
+{
+    if (!vq->mode_count)
+    {
+        vq->mode_pos = vq->size;
+        vq->size += 2;
+        vq->mode_count = 16;
+        vq->mode_set = 0;
+    }
+
+    vq->mode_count -= 2;
+    vq->mode_set |= mode << vq->mode_count;
+    put_le16(&vq->bytes[vq->mode_pos], vq->mode_set);
+}
+
+/* Picks a motion byte whose source block lies inside the frame, or
+ * returns -1 when there is none */
+static int motion_byte(int x, int y, int size, int mx, int my, int width, int height)
+{
+    int tries, byte, sx, sy;
+
+    for (tries = 0; tries < 64; tries++)
+    {
+        byte = rng() & 0xFF;
+        sx = x + 8 - (byte >> 4) - mx;
+        sy = y + 8 - (byte & 0xF) - my;
+        if (sx >= 0 && sy >= 0 && sx + size <= width && sy + size <= height)
+            return byte;
+    }
+
+    return -1;
+}
+
+/* Modes below first_mode are not used: 1 leaves out MOT, 2 MOT and FCC */
+static void vq_block(vq_writer_t *vq, int x, int y, int size, int mx, int my, int width, int height, int first_mode)
+{
+    int mode = first_mode + (rng() & 3) % (4 - first_mode);
+    int byte = 0, i;
+
+    if (mode == 1)
+    {
+        byte = motion_byte(x, y, size, mx, my, width, height);
+        if (byte < 0)
+            mode = 2;
+    }
+
+    vq_put_mode(vq, mode);
+    switch (mode)
+    {
+    case 1:
+        vq_put_byte(vq, byte);
+        break;
+
+    case 2:
+        vq_put_byte(vq, rng() & 0xFF);
+        break;
+
+    case 3:
+        if (size == 8)
+        {
+            for (i = 0; i < 4; i++)
+                vq_block(vq, x + (i % 2) * 4, y + (i / 2) * 4, 4, mx, my, width, height, first_mode);
+        }
+        else
+        {
+            /* a 4x4 block subdivides into four 2x2 vectors */
+            for (i = 0; i < 4; i++)
+                vq_put_byte(vq, rng() & 0xFF);
+        }
+        break;
+    }
+}
+
+/*
+ * Baseline JPEG writer for the keyframes. It uses its own Huffman
+ * tables rather than the usual ones: every DC category gets a 4 bit
+ * code and the AC symbols get 8 and 10 bit codes, so decoders take
+ * both their table lookup and their long code path.
+ */
+#define JPEG_AC_SHORT 100
+
+static const unsigned char zigzag_order[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/* round(4096 * C(u) / 2 * cos((2x + 1) * u * pi / 16)) */
+static const int dct_matrix[8][8] = {
+    { 1448,  1448,  1448,  1448,  1448,  1448,  1448,  1448 },
+    { 2009,  1703,  1138,   400,  -400, -1138, -1703, -2009 },
+    { 1892,   784,  -784, -1892, -1892,  -784,   784,  1892 },
+    { 1703,  -400, -2009, -1138,  1138,  2009,   400, -1703 },
+    { 1448, -1448, -1448,  1448,  1448, -1448, -1448,  1448 },
+    { 1138, -2009,   400,  1703, -1703,  -400,  2009, -1138 },
+    {  784, -1892,  1892,  -784,  -784,  1892, -1892,   784 },
+    {  400, -1138,  1703, -2009,  2009, -1703,  1138,  -400 },
+};
+
+typedef struct
+{
+    unsigned char *bytes;
+    int size;
+    unsigned int bits;
+    int count;
+    unsigned short dc_code[12];
+    unsigned short ac_code[256];
+    unsigned char ac_length[256];
+    unsigned char ac_symbols[162];
+    unsigned char quant[2][64];   /* natural order */
+    int dc_pred[3];
+} jpeg_writer_t;
+
+static void jpeg_put_bits(jpeg_writer_t *jpeg, unsigned int value, int count)
+{
+    jpeg->bits = (jpeg->bits << count) | (value & ((1 << count) - 1));
+    jpeg->count += count;
+
+    while (jpeg->count >= 8)
+    {
+        unsigned char byte = jpeg->bits >> (jpeg->count - 8);
+        jpeg->bytes[jpeg->size++] = byte;
+        if (byte == 0xFF)
+            jpeg->bytes[jpeg->size++] = 0x00;
+        jpeg->count -= 8;
+    }
+}
+
+/* pads the last byte with ones */
+static void jpeg_flush(jpeg_writer_t *jpeg)
+{
+    if (jpeg->count)
+        jpeg_put_bits(jpeg, 0x7F, 8 - jpeg->count);
+}
+
+static void jpeg_put_marker(jpeg_writer_t *jpeg, int marker, int length)
+{
+    jpeg->bytes[jpeg->size++] = 0xFF;
+    jpeg->bytes[jpeg->size++] = marker;
+    if (length)
+    {
+        jpeg->bytes[jpeg->size++] = length >> 8;
+        jpeg->bytes[jpeg->size++] = length & 0xFF;
+    }
+}
+
+static void jpeg_setup(jpeg_writer_t *jpeg)
+{
+    int r, s, i, n = 0;
+
+    for (i = 0; i < 12; i++)
+        jpeg->dc_code[i] = i;
+
+    jpeg->ac_symbols[n++] = 0x00;
+    jpeg->ac_symbols[n++] = 0xF0;
+    for (r = 0; r < 16; r++)
+        for (s = 1; s <= 10; s++)
+            jpeg->ac_symbols[n++] = (r << 4) | s;
+
+    for (i = 0; i < 162; i++)
+    {
+        r = jpeg->ac_symbols[i];
+        if (i < JPEG_AC_SHORT)
+        {
+            jpeg->ac_code[r] = i;
+            jpeg->ac_length[r] = 8;
+        }
+        else
+        {
+            jpeg->ac_code[r] = (JPEG_AC_SHORT << 2) + i - JPEG_AC_SHORT;
+            jpeg->ac_length[r] = 10;
+        }
+    }
+
+    for (i = 0; i < 64; i++)
+    {
+        jpeg->quant[0][i] = 2 + (i / 8 + i % 8) * 2;
+        jpeg->quant[1][i] = 4 + (i / 8 + i % 8) * 3;
+    }
+}
+
+static int magnitude_bits(int value)
+{
+    int count = 0;
+
+    if (value < 0)
+        value = -value;
+    while (value)
+    {
+        count++;
+        value >>= 1;
+    }
+
+    return count;
+}
+
+/* block holds level shifted samples in natural order */
+static void jpeg_put_block(jpeg_writer_t *jpeg, const int *block, int component)
+{
+    const unsigned char *quant = jpeg->quant[component ? 1 : 0];
+    long long row[8][8], sum;
+    int coef[64];
+    int u, v, x, y, k, run, count, value;
+
+    for (u = 0; u < 8; u++)
+        for (y = 0; y < 8; y++)
+        {
+            row[u][y] = 0;
+            for (x = 0; x < 8; x++)
+                row[u][y] += dct_matrix[u][x] * block[y * 8 + x];
+        }
+
+    for (v = 0; v < 8; v++)
+        for (u = 0; u < 8; u++)
+        {
+            sum = 0;
+            for (y = 0; y < 8; y++)
+                sum += dct_matrix[v][y] * row[u][y];
+            /* quantize, rounding half away from zero */
+            sum = sum / quant[v * 8 + u];
+            coef[v * 8 + u] = (int)((sum + (sum < 0 ? -(1 << 23) : (1 << 23))) / (1 << 24));
+        }
+
+    value = coef[0] - jpeg->dc_pred[component];
+    jpeg->dc_pred[component] = coef[0];
+    count = magnitude_bits(value);
+    jpeg_put_bits(jpeg, jpeg->dc_code[count], 4);
+    if (count)
+        jpeg_put_bits(jpeg, value < 0 ? value - 1 : value, count);
+
+    run = 0;
+    for (k = 1; k < 64; k++)
+    {
+        value = coef[zigzag_order[k]];
+        if (!value)
+        {
+            run++;
+            continue;
+        }
+        while (run > 15)
+        {
+            jpeg_put_bits(jpeg, jpeg->ac_code[0xF0], jpeg->ac_length[0xF0]);
+            run -= 16;
+        }
+        count = magnitude_bits(value);
+        if (count > 10)
+            count = 10, value = value < 0 ? -1023 : 1023;
+        jpeg_put_bits(jpeg, jpeg->ac_code[(run << 4) | count], jpeg->ac_length[(run << 4) | count]);
+        jpeg_put_bits(jpeg, value < 0 ? value - 1 : value, count);
+        run = 0;
+    }
+    if (run)
+        jpeg_put_bits(jpeg, jpeg->ac_code[0x00], jpeg->ac_length[0x00]);
+}
+
+/* RGB of keyframe 'key' at (x, y): smooth gradients plus some noise */
+static void keyframe_pixel(int key, int x, int y, int *r, int *g, int *b)
+{
+    *r = (x * 3 + key * 40) & 0xFF;
+    *g = (y * 5 + x + key * 16) & 0xFF;
+    *b = ((x ^ y) * 4 + (rng() & 15)) & 0xFF;
+}
+
+/*
+ * Writes keyframe number 'key' as a JPEG into buf and returns its size.
+ * Keyframes cycle through 4:2:0 with restart markers, 4:4:4 and
+ * grayscale. A broken keyframe also defines the last AC table with 12
+ * codes 1 bit long, more than fit, which the decoder has to reject
+ * before filling its lookup tables past the end of the table.
+ */
+static int write_jpeg(unsigned char *buf, int key, int width, int height, int broken)
+{
+    static int planes[3][256 * 256];
+    jpeg_writer_t jpeg;
+    int variant = key % 3;
+    int components = variant == 2 ? 1 : 3;
+    int sampling = variant == 0 ? 2 : 1;
+    int restart_interval = variant == 0 ? 2 : variant == 2 ? 3 : 0;
+    int mcu_size = 8 * sampling;
+    int mcus_x = (width + mcu_size - 1) / mcu_size;
+    int mcus_y = (height + mcu_size - 1) / mcu_size;
+    int block[64];
+    int x, y, c, i, n, mcu, bx, by, r, g, b, sx, sy;
+
+    memset(&jpeg, 0, sizeof(jpeg));
+    jpeg.bytes = buf;
+    jpeg_setup(&jpeg);
+
+    /* YCbCr planes, JFIF full range */
+    for (y = 0; y < height; y++)
+        for (x = 0; x < width; x++)
+        {
+            keyframe_pixel(key, x, y, &r, &g, &b);
+            planes[0][y * width + x] = (19595 * r + 38470 * g + 7471 * b + 32768) >> 16;
+            planes[1][y * width + x] = ((-11056 * r - 21712 * g + 32768 * b + 32768) >> 16) + 128;
+            planes[2][y * width + x] = ((32768 * r - 27440 * g - 5328 * b + 32768) >> 16) + 128;
+        }
+
+    jpeg_put_marker(&jpeg, 0xD8, 0);
+
+    jpeg_put_marker(&jpeg, 0xDB, 2 + 65 * 2);
+    for (n = 0; n < 2; n++)
+    {
+        buf[jpeg.size++] = n;
+        for (i = 0; i < 64; i++)
+            buf[jpeg.size++] = jpeg.quant[n][zigzag_order[i]];
+    }
+
+    /* one DC and one AC table, shared by all components */
+    jpeg_put_marker(&jpeg, 0xC4, 2 + 17 + 12 + 17 + 162);
+    buf[jpeg.size++] = 0x00;
+    for (i = 1; i <= 16; i++)
+        buf[jpeg.size++] = i == 4 ? 12 : 0;
+    for (i = 0; i < 12; i++)
+        buf[jpeg.size++] = i;
+    buf[jpeg.size++] = 0x10;
+    for (i = 1; i <= 16; i++)
+        buf[jpeg.size++] = i == 8 ? JPEG_AC_SHORT : i == 10 ? 162 - JPEG_AC_SHORT : 0;
+    memcpy(&buf[jpeg.size], jpeg.ac_symbols, 162);
+    jpeg.size += 162;
+
+    if (broken)
+    {
+        jpeg_put_marker(&jpeg, 0xC4, 2 + 17 + 12);
+        buf[jpeg.size++] = 0x13;
+        for (i = 1; i <= 16; i++)
+            buf[jpeg.size++] = i == 1 ? 12 : 0;
+        for (i = 0; i < 12; i++)
+            buf[jpeg.size++] = i;
+    }
+
+    if (restart_interval)
+    {
+        jpeg_put_marker(&jpeg, 0xDD, 4);
+        buf[jpeg.size++] = 0;
+        buf[jpeg.size++] = restart_interval;
+    }
+
+    jpeg_put_marker(&jpeg, 0xC0, 8 + components * 3);
+    buf[jpeg.size++] = 8;
+    buf[jpeg.size++] = height >> 8;
+    buf[jpeg.size++] = height & 0xFF;
+    buf[jpeg.size++] = width >> 8;
+    buf[jpeg.size++] = width & 0xFF;
+    buf[jpeg.size++] = components;
+    for (c = 0; c < components; c++)
+    {
+        buf[jpeg.size++] = c + 1;
+        buf[jpeg.size++] = c ? 0x11 : (sampling << 4) | sampling;
+        buf[jpeg.size++] = c ? 1 : 0;
+    }
+
+    jpeg_put_marker(&jpeg, 0xDA, 6 + components * 2);
+    buf[jpeg.size++] = components;
+    for (c = 0; c < components; c++)
+    {
+        buf[jpeg.size++] = c + 1;
+        buf[jpeg.size++] = 0x00;
+    }
+    buf[jpeg.size++] = 0;
+    buf[jpeg.size++] = 63;
+    buf[jpeg.size++] = 0;
+
+    for (mcu = 0; mcu < mcus_x * mcus_y; mcu++)
+    {
+        if (restart_interval && mcu && mcu % restart_interval == 0)
+        {
+            jpeg_flush(&jpeg);
+            jpeg_put_marker(&jpeg, 0xD0 + (mcu / restart_interval - 1) % 8, 0);
+            memset(jpeg.dc_pred, 0, sizeof(jpeg.dc_pred));
+        }
+
+        for (c = 0; c < components; c++)
+        {
+            n = c ? 1 : sampling;
+            for (by = 0; by < n; by++)
+                for (bx = 0; bx < n; bx++)
+                {
+                    /* chroma of a subsampled MCU averages 2x2 pixels */
+                    for (i = 0; i < 64; i++)
+                    {
+                        int step = c ? sampling : 1;
+                        int px = (mcu % mcus_x) * mcu_size + (bx * 8 + i % 8) * step;
+                        int py = (mcu / mcus_x) * mcu_size + (by * 8 + i / 8) * step;
+                        int sum = 0;
+                        for (sy = 0; sy < step; sy++)
+                            for (sx = 0; sx < step; sx++)
+                            {
+                                x = px + sx < width ? px + sx : width - 1;
+                                y = py + sy < height ? py + sy : height - 1;
+                                sum += planes[c][y * width + x];
+                            }
+                        block[i] = sum / (step * step) - 128;
+                    }
+                    jpeg_put_block(&jpeg, block, c);
+                }
+        }
+    }
+
+    jpeg_flush(&jpeg);
+    jpeg_put_marker(&jpeg, 0xD9, 0);
+
+    return jpeg.size;
+}
+
+static int write_stream(const synth_stream_t *stream, const char *filename)
+{
+    unsigned char *buf;
+    vq_writer_t vq;
+    unsigned int count2x2, count4x4, size, arg;
+    int frame, mb_x, mb_y, block, mx, my, first_mode, i;
+    FILE *out;
+    int ok = 1;
+
+    out = fopen(filename, "wb");
+    if (!out)
+    {
+        printf("could not create %s\n", filename);
+        return 0;
+    }
+
+    buf = malloc(MAX_CHUNK_SIZE);
+    if (!buf)
+    {
+        fclose(out);
+        return 0;
+    }
+
+    ok &= write_chunk(out, RoQ_SIGNATURE, 0xFFFFFFFF, 30, NULL);
+
+    put_le16(&buf[0], stream->width);
+    put_le16(&buf[2], stream->height);
+    put_le16(&buf[4], 8);
+    put_le16(&buf[6], 4);
+    ok &= write_chunk(out, RoQ_INFO, 8, 0, buf);
+
+    for (frame = 0; frame < stream->frames && ok; frame++)
+    {
+        /* audio: one frame worth of 22050 Hz samples */
+        if (stream->channels)
+        {
+            size = stream->audio_bytes ? stream->audio_bytes : 735 * stream->channels;
+            for (i = 0; i < (int)size; i++)
+                buf[i] = rng() & 0xFF;
+            arg = rng() & 0xFFFF;
+            ok &= write_chunk(out, stream->channels == 2 ? RoQ_SOUND_STEREO : RoQ_SOUND_MONO,
+                size, arg, buf);
+        }
+
+        /* keyframes replace the codebook and the video chunk */
+        if (stream->keyframes && frame % stream->keyframes == 0)
+        {
+            size = write_jpeg(buf, frame / stream->keyframes, stream->width, stream->height,
+                stream->broken && frame / stream->keyframes % 2);
+            ok &= write_chunk(out, RoQ_JPEG, size, 0, buf);
+            continue;
+        }
+
+        /* a self-contained frame has only SLD and CCC blocks after a
+         * full codebook, and the frame after it no MOT blocks, which
+         * would show the picture from before it */
+        first_mode = 0;
+        if (stream->intra && frame % stream->intra < 2)
+            first_mode = frame % stream->intra ? 1 : 2;
+
+        /* codebook every few frames and after a keyframe; a count of 0
+         * means 256 */
+        if (frame % 4 == 0 || (stream->keyframes && frame % stream->keyframes == 1) || first_mode == 2)
+        {
+            /* a full codebook after a keyframe makes it a clean restart
+             * point for seeking */
+            if (stream->full_codebooks || (stream->keyframes && frame % stream->keyframes == 1) || first_mode == 2)
+            {
+                count2x2 = 256;
+                count4x4 = 256;
+            }
+            else
+            {
+                count2x2 = 1 + rng() % 255;
+                count4x4 = 1 + rng() % 255;
+            }
+            size = count2x2 * 6 + count4x4 * 4;
+            for (i = 0; i < (int)size; i++)
+                buf[i] = rng() & 0xFF;
+            /* 4x4 vectors may only reference 2x2 vectors that exist */
+            for (i = 0; i < (int)count4x4 * 4; i++)
+                buf[count2x2 * 6 + i] %= count2x2;
+            arg = ((count2x2 & 0xFF) << 8) | (count4x4 & 0xFF);
+            ok &= write_chunk(out, RoQ_QUAD_CODEBOOK, size, arg, buf);
+        }
+
+        /* video */
+        mx = (int)(rng() % 9) - 4;
+        my = (int)(rng() % 9) - 4;
+        memset(&vq, 0, sizeof(vq));
+        vq.bytes = buf;
+        for (mb_y = 0; mb_y < stream->height; mb_y += 16)
+            for (mb_x = 0; mb_x < stream->width; mb_x += 16)
+                for (block = 0; block < 4; block++)
+                    vq_block(&vq, mb_x + (block % 2) * 8, mb_y + (block / 2) * 8, 8,
+                        mx, my, stream->width, stream->height, first_mode);
+        arg = ((mx & 0xFF) << 8) | (my & 0xFF);
+        ok &= write_chunk(out, RoQ_QUAD_VQ, vq.size, arg, buf);
+    }
+
+    free(buf);
+    if (fclose(out) != 0)
+        ok = 0;
+
+    if (!ok)
+        printf("error writing %s\n", filename);
+
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int i;
+
+    if (argc == 3)
+    {
+        for (i = 0; i < sizeof(streams) / sizeof(streams[0]); i++)
+            if (!strcmp(argv[1], streams[i].name))
+                return write_stream(&streams[i], argv[2]) ? 0 : 1;
+    }
+
+    printf("USAGE: roq-synth <stream> <output.roq>\n");
+    printf("  streams:");
+    for (i = 0; i < sizeof(streams) / sizeof(streams[0]); i++)
+        printf(" %s", streams[i].name);
+    printf("\n");
+
+    return 1;
+}
@@ -0,0 +1,142 @@
+/*
+ * Dreamroq timeline tracing
+ *
+ * One ring per thread, allocated on its first event and linked into a
+ * global list with a compare-and-swap, so recording never takes a lock.
+ * Only the owning thread writes a ring; it publishes each event by
+ * advancing the ring's count with a release store.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "roq-trace.h"
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#ifdef ROQ_TRACE
+
+#ifdef _arch_dreamcast
+#include <arch/timer.h>
+#else
+#include <time.h>
+#endif
+
+typedef struct {
+    const char* name;
+    unsigned long long time_ns;
+    char phase;           // 'B'egin or 'E'nd
+} roq_trace_event_t;
+
+typedef struct roq_trace_ring_t {
+    roq_trace_event_t events[ROQ_TRACE_RING_SIZE];
+    unsigned int count;   // events ever recorded
+    int thread;
+    struct roq_trace_ring_t* next;
+} roq_trace_ring_t;
+
+static roq_trace_ring_t* rings = NULL;
+static int thread_count = 0;
+static __thread roq_trace_ring_t* thread_ring = NULL;
+
+static unsigned long long roq_trace_now(void) {
+#ifdef _arch_dreamcast
+    return timer_us_gettime64() * 1000;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static roq_trace_ring_t* roq_trace_ring(void) {
+    roq_trace_ring_t* ring = calloc(1, sizeof(roq_trace_ring_t));
+
+    if(!ring)
+        return NULL;
+
+    ring->thread = __atomic_add_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&rings, &ring->next, ring, TRUE,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    return ring;
+}
+
+static void roq_trace_record(const char* name, char phase) {
+    roq_trace_ring_t* ring = thread_ring;
+    roq_trace_event_t* event;
+
+    if(!ring) {
+        ring = thread_ring = roq_trace_ring();
+        if(!ring)
+            return;
+    }
+
+    event = &ring->events[ring->count & (ROQ_TRACE_RING_SIZE - 1)];
+    event->name = name;
+    event->time_ns = roq_trace_now();
+    event->phase = phase;
+    __atomic_store_n(&ring->count, ring->count + 1, __ATOMIC_RELEASE);
+}
+
+void roq_trace_begin(const char* name) {
+    roq_trace_record(name, 'B');
+}
+
+void roq_trace_end(const char* name) {
+    roq_trace_record(name, 'E');
+}
+
+int roq_trace_dump(const char* filename) {
+    roq_trace_ring_t* ring;
+    roq_trace_event_t* event;
+    unsigned long long start = ~0ULL;
+    unsigned int i, count, first;
+    int separator = FALSE;
+    FILE* out;
+
+    out = fopen(filename, "w");
+    if(!out)
+        return FALSE;
+
+    // Timestamps are relative to the oldest event still in a ring
+    for(ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+        first = count > ROQ_TRACE_RING_SIZE ? count - ROQ_TRACE_RING_SIZE : 0;
+        if(count && ring->events[first & (ROQ_TRACE_RING_SIZE - 1)].time_ns < start)
+            start = ring->events[first & (ROQ_TRACE_RING_SIZE - 1)].time_ns;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for(ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+            separator ? ",\n" : "", ring->thread, ring->thread);
+        separator = TRUE;
+
+        count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+        first = count > ROQ_TRACE_RING_SIZE ? count - ROQ_TRACE_RING_SIZE : 0;
+        for(i = first; i != count; i++) {
+            event = &ring->events[i & (ROQ_TRACE_RING_SIZE - 1)];
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+                event->name, event->phase, ring->thread, (event->time_ns - start) / 1000.0);
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    return fclose(out) == 0;
+}
+
+#else
+
+int roq_trace_dump(const char* filename) {
+    return FALSE;
+}
+
+#endif
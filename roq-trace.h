@@ -0,0 +1,47 @@
+/*
+ * Dreamroq timeline tracing
+ *
+ * Build with ROQ_TRACE defined (make -f Makefile.PC TRACE=1) to record
+ * begin/end events around reads, codebook, VQ, JPEG and audio decoding
+ * and the client callbacks. Every thread records into its own ring of
+ * the last ROQ_TRACE_RING_SIZE events without locking, timestamped with
+ * a monotonic clock. roq_trace_dump() writes them as Chrome trace JSON
+ * for chrome://tracing or Perfetto.
+ *
+ * Without ROQ_TRACE the trace points expand to nothing.
+ */
+
+#ifndef ROQ_TRACE_H
+#define ROQ_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Events kept per thread, a power of two
+#ifndef ROQ_TRACE_RING_SIZE
+#define ROQ_TRACE_RING_SIZE (1 << 14)
+#endif
+
+#ifdef ROQ_TRACE
+// name must be a string that outlives the trace, normally a literal
+void roq_trace_begin(const char* name);
+void roq_trace_end(const char* name);
+
+#define ROQ_TRACE_BEGIN(name) roq_trace_begin(name)
+#define ROQ_TRACE_END(name)   roq_trace_end(name)
+#else
+#define ROQ_TRACE_BEGIN(name) ((void)0)
+#define ROQ_TRACE_END(name)   ((void)0)
+#endif
+
+// Writes the events of every thread to filename. Call it while no
+// thread is recording, e.g. after the decoders are done. Returns 0 if
+// tracing is compiled out or the file could not be written.
+int roq_trace_dump(const char* filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
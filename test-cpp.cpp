@@ -0,0 +1,287 @@
+/*
+ * Dreamroq C++ layer test
+ *
+ * Plays a file through dreamroq.hpp and checks every frame and audio
+ * chunk against a test-dreamroq manifest, four times over:
+ *
+ *  - frames<argb8888>() with an audio sink, converting every frame and
+ *    checking the conversion against the RGB565 it came from;
+ *  - decode() on a decoder that is move constructed and then move
+ *    assigned partway through;
+ *  - set_loop(), until loop_count() shows two wraps, each pass checked
+ *    from the top of the manifest;
+ *  - frames() with a pool of 3 frames that are all held, so it stops
+ *    with need_frame and is called again once they are released.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "dreamroq.hpp"
+
+namespace {
+
+constexpr unsigned long long fnv_offset_basis = 0xcbf29ce484222325ULL;
+constexpr unsigned long long fnv_prime = 0x100000001b3ULL;
+
+constexpr int pool_size = 3;
+constexpr unsigned loop_wraps = 2;
+
+unsigned long long fnv1a(unsigned long long hash, const void* bytes, std::size_t size) {
+    auto* p = static_cast<const unsigned char*>(bytes);
+    for (std::size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= fnv_prime;
+    }
+    return hash;
+}
+
+// The manifest entries in order, compared one by one with what a pass
+// hands out
+class manifest {
+public:
+    bool load(const char* filename) {
+        std::FILE* in = std::fopen(filename, "r");
+        char line[128];
+
+        if (!in)
+            return false;
+        while (std::fgets(line, sizeof(line), in)) {
+            line[std::strcspn(line, "\n")] = 0;
+            if (line[0] && line[0] != '#')
+                entries_.push_back(line);
+        }
+        std::fclose(in);
+        return !entries_.empty();
+    }
+
+    void rewind() { next_ = frames_ = chunks_ = 0; }
+
+    template <class Format>
+    void video(const roq::basic_frame<Format>& frame) {
+        unsigned long long hash = fnv_offset_basis;
+        char line[128];
+
+        for (int y = 0; y < frame.height(); y++) {
+            auto row = frame.row(y);
+            hash = fnv1a(hash, row.data(), row.size_bytes());
+        }
+        std::snprintf(line, sizeof(line), "video %d %dx%d %016llx", frames_++, frame.width(),
+                      frame.height(), hash);
+        expect(line);
+    }
+
+    void audio(const roq::audio& chunk) {
+        char line[128];
+
+        std::snprintf(line, sizeof(line), "audio %d %d %d %016llx", chunks_++, chunk.channels(),
+                      int(chunk.bytes().size()),
+                      fnv1a(fnv_offset_basis, chunk.bytes().data(), chunk.bytes().size()));
+        expect(line);
+    }
+
+    // Reports the entries a pass did not get to
+    void finish(const char* pass) {
+        if (next_ < entries_.size())
+            mismatch(pass, "expected '" + entries_[next_] + "', stream ended");
+    }
+
+    void mismatch(const char* pass, const std::string& what) {
+        if (mismatches_ < 10)
+            std::printf("MISMATCH (%s): %s\n", pass, what.c_str());
+        mismatches_++;
+    }
+
+    int mismatches() const { return mismatches_; }
+
+private:
+    void expect(const char* line) {
+        if (next_ >= entries_.size())
+            mismatch("decode", std::string("got '") + line + "' past the end");
+        else if (entries_[next_] != line)
+            mismatch("decode", "expected '" + entries_[next_] + "', got '" + line + "'");
+        next_++;
+    }
+
+    std::vector<std::string> entries_;
+    std::size_t next_ = 0;
+    int frames_ = 0;
+    int chunks_ = 0;
+    int mismatches_ = 0;
+};
+
+manifest expected;
+int total_frames = 0;
+
+void check_pixels(const roq::basic_frame<roq::argb8888>& frame) {
+    std::vector<std::uint32_t> converted(std::size_t(frame.width()) * frame.height());
+
+    frame.convert(converted);
+    for (int y = 0; y < frame.height(); y++) {
+        auto row = frame.as<roq::rgb565>().row(y);
+        for (int x = 0; x < frame.width(); x++) {
+            std::uint32_t argb = converted[std::size_t(y) * frame.width() + x];
+            std::uint16_t back = std::uint16_t(((argb >> 8) & 0xF800) | ((argb >> 5) & 0x07E0) |
+                                               ((argb >> 3) & 0x001F));
+            if ((argb >> 24) != 0xFF || back != row[x] || frame.pixel(x, y) != argb) {
+                expected.mismatch("argb8888", "pixel " + std::to_string(x) + "," + std::to_string(y) +
+                                  " does not convert back");
+                return;
+            }
+        }
+    }
+}
+
+void converted_pass(const char* filename) {
+    roq::decoder video(filename);
+
+    expected.rewind();
+    for (const auto& frame : video.frames<roq::argb8888>([](const roq::audio& pcm) { expected.audio(pcm); })) {
+        expected.video(frame);
+        check_pixels(frame);
+        total_frames++;
+    }
+    expected.finish("frames<argb8888>");
+}
+
+auto video_sink = [](const roq::frame& frame) { expected.video(frame); total_frames++; };
+auto audio_sink = [](const roq::audio& pcm) { expected.audio(pcm); };
+
+// Decodes up to count frame groups, all of them with a count below 0
+void decode_some(roq::decoder& video, int count) {
+    while (count-- != 0 && !video.ended())
+        video.decode(video_sink, audio_sink);
+}
+
+void moved_pass(const char* filename) {
+    roq::decoder first(filename);
+    int groups;
+
+    expected.rewind();
+    decode_some(first, 20);
+
+    roq::decoder second(std::move(first));
+    if (first.native_handle())
+        expected.mismatch("move", "the moved from decoder kept its handle");
+    decode_some(second, 20);
+
+    // The decoder it replaces is destroyed, whatever it was playing
+    roq::decoder third(filename);
+    for (groups = 0; groups < 5; groups++)
+        third.decode([](const roq::frame&) {}, [](const roq::audio&) {});
+    third = std::move(second);
+    if (second.native_handle())
+        expected.mismatch("move", "the moved from decoder kept its handle");
+    for (groups = 0; !third.ended(); groups++)
+        third.decode(video_sink, audio_sink);
+    if (!groups)
+        expected.mismatch("move", "nothing left after the move assignment");
+    expected.finish("move");
+}
+
+void looped_pass(const char* filename) {
+    roq::decoder video(filename);
+    unsigned wraps = 0;
+
+    expected.rewind();
+    video.set_loop(true);
+    if (!video.loop())
+        expected.mismatch("loop", "set_loop(true) did not stick");
+
+    while (!video.ended()) {
+        video.decode(video_sink, audio_sink);
+        if (video.loop_count() != wraps) {
+            expected.finish("loop");
+            expected.rewind();
+            if (++wraps == loop_wraps)
+                video.set_loop(false);
+        }
+    }
+    expected.finish("loop");
+
+    if (video.loop_count() != loop_wraps)
+        expected.mismatch("loop", "loop_count() is " + std::to_string(video.loop_count()) +
+                          ", not " + std::to_string(loop_wraps));
+}
+
+void pooled_pass(const char* filename) {
+    roq::decoder video(filename);
+    roq_t* roq = video.native_handle();
+    std::size_t size = roq_get_frame_size(roq);
+    std::vector<std::vector<unsigned short>> storage(pool_size, std::vector<unsigned short>(size / 2));
+    unsigned short* pool[pool_size];
+    std::vector<unsigned short*> held;
+    int stops = 0;
+
+    for (int i = 0; i < pool_size; i++)
+        pool[i] = storage[i].data();
+    if (!roq_set_frame_pool(roq, pool, pool_size, size)) {
+        expected.mismatch("pool", "could not set up the frame pool");
+        return;
+    }
+
+    expected.rewind();
+    while (!video.ended()) {
+        for (const auto& frame : video.frames([](const roq::audio& pcm) { expected.audio(pcm); })) {
+            expected.video(frame);
+            total_frames++;
+            held.push_back(const_cast<unsigned short*>(frame.native().data()));
+            roq_acquire_frame(roq, held.back());
+        }
+        if (video.ended())
+            break;
+
+        // Stopped for a frame: nothing is decoded until one is back
+        if (held.empty() || video.decode(video_sink, audio_sink) != roq::status::need_frame) {
+            expected.mismatch("pool", "frames() stopped without waiting for a frame");
+            break;
+        }
+        for (unsigned short* frame : held)
+            roq_release_frame(roq, frame);
+        held.clear();
+        stops++;
+    }
+    expected.finish("pool");
+
+    if (!stops)
+        expected.mismatch("pool", "frames() never stopped for a frame");
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        std::printf("USAGE: test-cpp <manifest> <file.roq>\n");
+        return 1;
+    }
+    if (!expected.load(argv[1])) {
+        std::printf("could not read %s\n", argv[1]);
+        return 1;
+    }
+
+    try {
+        roq::decoder missing("missing.roq");
+        expected.mismatch("open", "opening a missing file did not throw");
+    }
+    catch (const roq::error&) {
+    }
+
+    try {
+        converted_pass(argv[2]);
+        moved_pass(argv[2]);
+        looped_pass(argv[2]);
+        pooled_pass(argv[2]);
+    }
+    catch (const roq::error& e) {
+        std::printf("%s\n", e.what());
+        return 1;
+    }
+
+    std::printf("%s: %d frames in %d passes, %d mismatches\n", expected.mismatches() ? "FAIL" : "OK",
+                total_frames, 4 + int(loop_wraps), expected.mismatches());
+
+    return expected.mismatches() ? 1 : 0;
+}
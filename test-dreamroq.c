@@ -5,7 +5,11 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "dreamroqlib.h"
+#include "roq-parallel.h"
+#include "roq-trace.h"
 
 int quit_cb()
 {
@@ -128,33 +132,642 @@ int finish_cb()
     return ROQ_SUCCESS;
 }
 
+/*
+ * Checksum mode: instead of writing files, every decoded frame and
+ * audio chunk is reduced to a 64-bit FNV-1a hash. --hash writes them as
+ * a manifest, --check compares them against one, so any change to the
+ * decoded output shows up as the first frame or chunk that differs.
+ */
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+#define MANIFEST_LINE    128
+
+static FILE *manifest;
+static int check_mode = 0;
+static int hash_frames = 0;
+static int hash_chunks = 0;
+static int mismatches = 0;
+
+static unsigned long long fnv1a(unsigned long long hash, const unsigned char *bytes, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static void manifest_entry(const char *line)
+{
+    char expected[MANIFEST_LINE];
+
+    if (!check_mode)
+    {
+        fprintf(manifest, "%s\n", line);
+        return;
+    }
+
+    /* skip comments */
+    do {
+        if (!fgets(expected, sizeof(expected), manifest))
+            expected[0] = 0;
+    } while (expected[0] == '#');
+    expected[strcspn(expected, "\n")] = 0;
+
+    if (strcmp(expected, line))
+    {
+        if (mismatches < 10)
+            printf("MISMATCH: expected '%s', got '%s'\n", expected, line);
+        mismatches++;
+    }
+}
+
+static unsigned long long frame_hash(unsigned short *buf, int width, int height, int stride)
+{
+    unsigned long long hash = FNV_OFFSET_BASIS;
+    int y;
+
+    /* only the visible pixels, not the stride or texture padding */
+    for (y = 0; y < height; y++)
+        hash = fnv1a(hash, (const unsigned char *)(buf + y * stride), width * 2);
+
+    return hash;
+}
+
+/*
+ * Pool mode: frames are decoded into pool_count frames of our own and
+ * every one is held, like a queue of frames waiting to be sent, until
+ * the decoder runs out and asks for one back. A frame is hashed again
+ * when it is released, so a held frame the decoder wrote to shows up as
+ * a mismatch.
+ */
+typedef struct
+{
+    unsigned short *frame;
+    int number;
+    unsigned long long hash;
+} held_frame_t;
+
+static unsigned short **pool_frames;
+static int pool_count = 0;
+static held_frame_t *held;
+static int held_head = 0;
+static int held_count = 0;
+static int held_width, held_height, held_stride;
+
+static void hold_frame(roq_t *roq, unsigned short *buf, int number, unsigned long long hash)
+{
+    held_frame_t *entry = &held[(held_head + held_count++) % pool_count];
+
+    entry->frame = buf;
+    entry->number = number;
+    entry->hash = hash;
+    roq_acquire_frame(roq, buf);
+}
+
+static int release_frame(roq_t *roq)
+{
+    held_frame_t *entry = &held[held_head];
+
+    if (!held_count)
+        return 0;
+
+    if (frame_hash(entry->frame, held_width, held_height, held_stride) != entry->hash)
+    {
+        if (mismatches < 10)
+            printf("MISMATCH: frame %d changed while it was held\n", entry->number);
+        mismatches++;
+    }
+
+    roq_release_frame(roq, entry->frame);
+    held_head = (held_head + 1) % pool_count;
+    held_count--;
+
+    return 1;
+}
+
+static void hash_video_callback(unsigned short *buf, int width, int height, int stride, int texture_height, void *user_data)
+{
+    unsigned long long hash = frame_hash(buf, width, height, stride);
+    char line[MANIFEST_LINE];
+
+    if (pool_count)
+    {
+        held_width = width;
+        held_height = height;
+        held_stride = stride;
+        hold_frame((roq_t *)user_data, buf, hash_frames, hash);
+    }
+
+    snprintf(line, sizeof(line), "video %d %dx%d %016llx", hash_frames++, width, height, hash);
+    manifest_entry(line);
+}
+
+static void hash_audio_callback(unsigned char *buf, int size, int channels, void *user_data)
+{
+    char line[MANIFEST_LINE];
+
+    snprintf(line, sizeof(line), "audio %d %d %d %016llx", hash_chunks++, channels, size,
+        fnv1a(FNV_OFFSET_BASIS, buf, size));
+    manifest_entry(line);
+}
+
+static int finish_manifest(void)
+{
+    char extra[MANIFEST_LINE];
+
+    if (check_mode)
+    {
+        /* the manifest must not have entries left over */
+        while (fgets(extra, sizeof(extra), manifest))
+        {
+            if (extra[0] != '#')
+            {
+                extra[strcspn(extra, "\n")] = 0;
+                printf("MISMATCH: expected '%s', stream ended\n", extra);
+                mismatches++;
+                break;
+            }
+        }
+
+        printf("%s: %d frames, %d audio chunks, %d mismatches\n",
+            mismatches ? "FAIL" : "OK", hash_frames, hash_chunks, mismatches);
+    }
+
+    fclose(manifest);
+
+    return mismatches ? 1 : 0;
+}
+
+/*
+ * Loop mode: a snapshot is taken before frame loop_in and the frames up
+ * to loop_out, or to the end with a loop_out of -1, are played
+ * LOOP_PASSES more times through loop points, before decoding goes on to
+ * the end. Each pass goes back to the same
+ * place in the manifest, so every looped frame is checked again.
+ */
+#define LOOP_PASSES 2
+
+static int loop_in = -1;
+static int loop_out = -1;
+static int loop_passes = 0;
+static roq_snapshot_t *loop_snapshot;
+static long loop_manifest_offset;
+static int loop_frames, loop_chunks;
+
+static void loop_callback(void *user_data)
+{
+    fseek(manifest, loop_manifest_offset, SEEK_SET);
+    hash_frames = loop_frames;
+    hash_chunks = loop_chunks;
+
+    if (++loop_passes == LOOP_PASSES)
+        roq_set_loop_points((roq_t *)user_data, NULL, -1);
+}
+
+static int loop_points(roq_t *roq)
+{
+    if (!loop_snapshot && hash_frames == loop_in)
+    {
+        loop_snapshot = roq_snapshot(roq);
+        if (!loop_snapshot)
+            return 0;
+        loop_manifest_offset = ftell(manifest);
+        loop_frames = hash_frames;
+        loop_chunks = hash_chunks;
+        if (loop_out == -1)
+            return roq_set_loop_points(roq, loop_snapshot, -1);
+    }
+
+    if (loop_snapshot && !loop_passes && hash_frames == loop_out &&
+        roq_get_position(roq) != -1)
+        return roq_set_loop_points(roq, loop_snapshot, roq_get_position(roq));
+
+    return 1;
+}
+
+/*
+ * Passes mode: the whole file is played passes times through
+ * roq_set_loop(), each pass checked against the manifest from the top,
+ * optionally with a loop cache of cache_budget bytes replaying the
+ * passes after the first.
+ */
+static int passes = 0;
+static int passes_done = 0;
+static size_t cache_budget = 0;
+
+static void passes_callback(void *user_data)
+{
+    fseek(manifest, 0, SEEK_SET);
+    hash_frames = 0;
+    hash_chunks = 0;
+
+    if (++passes_done == passes - 1)
+        roq_set_loop((roq_t *)user_data, 0, NULL);
+}
+
+/*
+ * Push mode: the file is handed to the decoder in pieces of push_size
+ * bytes, only when it asks for more, the way a network or disc reader
+ * would feed it.
+ */
+static FILE *push_input;
+static unsigned char *push_bytes;
+static size_t push_size = 0;
+static size_t push_pending = 0;
+
+static int push_more(roq_t *roq)
+{
+    size_t taken;
+
+    if (!push_pending)
+    {
+        push_pending = fread(push_bytes, 1, push_size, push_input);
+        if (!push_pending)
+        {
+            roq_push_end(roq);
+            return 1;
+        }
+    }
+
+    /* whatever did not fit is offered again next time */
+    taken = roq_push_data(roq, push_bytes, push_pending);
+    memmove(push_bytes, push_bytes + taken, push_pending - taken);
+    push_pending -= taken;
+
+    return taken > 0;
+}
+
+/*
+ * Region mode: the file is decoded with a decode region and, frame by
+ * frame alongside it, by a second decoder without one. Every macroblock
+ * the first does not flag as stale must come out the same; the stale
+ * ones within the region itself, which a viewer would show, are
+ * counted.
+ */
+static int region_x, region_y, region_width = 0, region_height, region_margin;
+static roq_t *region_reference;
+static unsigned short *reference_frame;
+static int region_frames = 0;
+static int region_stale = 0;
+
+static void reference_video_callback(unsigned short *buf, int width, int height, int stride, int texture_height, void *user_data)
+{
+    reference_frame = buf;
+}
+
+static void region_video_callback(unsigned short *buf, int width, int height, int stride, int texture_height, void *user_data)
+{
+    const unsigned char *stale = roq_get_stale_macroblocks((roq_t *)user_data);
+    int mb_size = 16 / roq_get_decode_scale((roq_t *)user_data);
+    int mb_x, mb_y, y, offset, differs;
+
+    reference_frame = NULL;
+    while (!reference_frame && !roq_has_ended(region_reference))
+        roq_decode(region_reference);
+    if (!reference_frame)
+    {
+        printf("MISMATCH: frame %d, the reference decoder ended\n", region_frames);
+        mismatches++;
+        return;
+    }
+
+    for (mb_y = 0; mb_y < height / mb_size; mb_y++)
+    {
+        for (mb_x = 0; mb_x < width / mb_size; mb_x++)
+        {
+            offset = mb_y * mb_size * stride + mb_x * mb_size;
+            for (y = 0, differs = 0; y < mb_size && !differs; y++, offset += stride)
+                differs = memcmp(buf + offset, reference_frame + offset, mb_size * sizeof(unsigned short));
+
+            if (*stale++)
+            {
+                if (mb_x * 16 < region_x + region_width && (mb_x + 1) * 16 > region_x &&
+                    mb_y * 16 < region_y + region_height && (mb_y + 1) * 16 > region_y)
+                    region_stale++;
+            }
+            else if (differs)
+            {
+                if (mismatches < 10)
+                    printf("MISMATCH: frame %d, macroblock %d,%d is not flagged stale\n", region_frames, mb_x, mb_y);
+                mismatches++;
+            }
+        }
+    }
+    region_frames++;
+}
+
+/*
+ * Memory mode: the whole file is read into memory first, which is how
+ * a roq-pack file gets played.
+ */
+static roq_t *create_with_memory(const char *filename)
+{
+    unsigned char *bytes = NULL;
+    FILE *file;
+    long size = 0;
+
+    file = fopen(filename, "rb");
+    if (!file)
+        return NULL;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0)
+    {
+        bytes = malloc(size);
+        if (bytes && fread(bytes, size, 1, file) != 1)
+        {
+            free(bytes);
+            bytes = NULL;
+        }
+    }
+    fclose(file);
+
+    return bytes ? roq_create_with_memory(bytes, size, 1) : NULL;
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc < 2)
+    const char *filename = NULL;
+    const char *manifest_name = NULL;
+    const char *trace_name = NULL;
+    int scale = ROQ_SCALE_FULL;
+    int tiled = 0;
+    int memory = 0;
+    int jobs = 0;
+    size_t max_buffered = 0;
+    int status;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--scale") && i + 1 < argc)
+            scale = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+            trace_name = argv[++i];
+        else if (!strcmp(argv[i], "--tiled"))
+            tiled = 1;
+        else if (!strcmp(argv[i], "--memory"))
+            memory = 1;
+        else if (!strcmp(argv[i], "--push") && i + 1 < argc)
+            push_size = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--pool") && i + 1 < argc)
+            pool_count = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--jobs") && i + 1 < argc)
+            jobs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--buffer") && i + 1 < argc)
+            max_buffered = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--passes") && i + 1 < argc)
+            passes = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--cache") && i + 1 < argc)
+            cache_budget = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--region") && i + 5 < argc)
+        {
+            region_x = atoi(argv[++i]);
+            region_y = atoi(argv[++i]);
+            region_width = atoi(argv[++i]);
+            region_height = atoi(argv[++i]);
+            region_margin = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--loop") && i + 2 < argc)
+        {
+            loop_in = atoi(argv[++i]);
+            loop_out = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--hash") && i + 1 < argc)
+            manifest_name = argv[++i];
+        else if (!strcmp(argv[i], "--check") && i + 1 < argc)
+        {
+            manifest_name = argv[++i];
+            check_mode = 1;
+        }
+        else
+            filename = argv[i];
+    }
+
+    if (!filename || (pool_count && (pool_count < 3 || !manifest_name)) ||
+        (loop_in >= 0 && ((loop_out <= loop_in && loop_out != -1) || !check_mode)) ||
+        (jobs && (jobs < 1 || !manifest_name || tiled || push_size || pool_count || loop_in >= 0)) ||
+        (max_buffered && !jobs) ||
+        (memory && (push_size || jobs)) ||
+        (passes && (passes < 2 || !check_mode || loop_in >= 0 || push_size || jobs)) ||
+        (cache_budget && !passes) ||
+        (region_width && (region_height <= 0 || manifest_name || push_size || pool_count || jobs || loop_in >= 0 || passes)))
+    {
+        printf("USAGE: test-dreamroq [--scale 1|2|4] [--tiled] [--memory | --push <bytes>] [--pool <frames>] [--loop <in> <out> | --passes <n> [--cache <bytes>]] [--jobs <threads> [--buffer <bytes>]] [--region <x> <y> <w> <h> <margin>] [--trace <file.json>] [--hash <manifest> | --check <manifest>] <file.roq>\n");
+        printf("  --memory reads the whole file first and also plays roq-pack files\n");
+        printf("  --pool needs at least 3 frames and --hash or --check\n");
+        printf("  --loop needs frame numbers in < out, or an out of -1 for the end, and --check\n");
+        printf("  --passes plays the file n times (at least 2) and needs --check, --cache keeps a loop cache of that many bytes\n");
+        printf("  --jobs needs --hash or --check and goes with --scale only, --buffer caps the output held for later segments\n");
+        printf("  --region checks against a decoder without one and goes with --scale, --tiled and --memory only\n");
+        return 1;
+    }
+
+    if (manifest_name)
+    {
+        manifest = fopen(manifest_name, check_mode ? "r" : "w");
+        if (!manifest)
+        {
+            printf("could not open %s\n", manifest_name);
+            return 1;
+        }
+        if (!check_mode)
+            fprintf(manifest, "# %s, scale %d\n", filename, scale);
+    }
+
+    // Parallel mode: segments decoded on a thread pool, the output in order
+    if (jobs)
+    {
+        status = roq_parallel_decode(filename, jobs, scale, max_buffered, hash_video_callback, hash_audio_callback, NULL);
+        if (!status)
+            printf("parallel decoding failed (%d)\n", roq_errno);
+        else
+            printf("decoded %d segments on up to %d threads\n", status, jobs);
+        return finish_manifest() || !status;
+    }
+
+    roq_t *roq;
+    if (push_size)
+    {
+        push_input = fopen(filename, "rb");
+        push_bytes = malloc(push_size);
+        roq = push_input && push_bytes ? roq_create_with_push(0) : NULL;
+    }
+    else if (memory)
+        roq = create_with_memory(filename);
+    else
+        roq = roq_create_with_filename(filename);
+    if (!roq)
+    {
+        printf("could not open %s (%d)\n", filename, roq_errno);
+        return 1;
+    }
+
+    if (!roq_set_decode_scale(roq, scale))
+    {
+        printf("unsupported scale %d\n", scale);
+        roq_destroy(roq);
+        return 1;
+    }
+
+    if (!roq_set_decode_tiled(roq, tiled))
     {
-        printf("USAGE: test-dreamroq <file.roq>\n");
+        printf("could not decode tiled (%d)\n", roq_errno);
+        roq_destroy(roq);
         return 1;
     }
 
-    roq_t *roq = roq_create_with_filename(argv[1]);
+    if (pool_count)
+    {
+        /* a push source has no header yet, so take the largest frame */
+        size_t frame_size = roq_get_frame_size(roq);
+        if (!frame_size)
+            frame_size = (size_t)ROQ_MAX_DIMENSION * ROQ_MAX_DIMENSION * sizeof(unsigned short);
+
+        pool_frames = malloc(pool_count * sizeof(unsigned short *));
+        held = malloc(pool_count * sizeof(held_frame_t));
+        for (i = 0; pool_frames && i < pool_count; i++)
+            pool_frames[i] = malloc(frame_size);
+        if (!pool_frames || !held || !roq_set_frame_pool(roq, pool_frames, pool_count, frame_size))
+        {
+            printf("could not set up a pool of %d frames (%d)\n", pool_count, roq_errno);
+            roq_destroy(roq);
+            return 1;
+        }
+        roq_set_user_data(roq, roq);
+    }
+
+    if (loop_in >= 0)
+    {
+        roq_set_user_data(roq, roq);
+        roq_set_loop(roq, 0, loop_callback);
+    }
+
+    if (passes)
+    {
+        roq_set_user_data(roq, roq);
+        roq_set_loop(roq, 1, passes_callback);
+        if (cache_budget && !roq_set_loop_cache(roq, cache_budget))
+        {
+            printf("could not set up a loop cache (%d)\n", roq_errno);
+            roq_destroy(roq);
+            return 1;
+        }
+    }
+
+    if (region_width)
+    {
+        region_reference = memory ? create_with_memory(filename) : roq_create_with_filename(filename);
+        if (!region_reference || !roq_set_decode_scale(region_reference, scale) ||
+            !roq_set_decode_region(roq, region_x, region_y, region_width, region_height, region_margin))
+        {
+            printf("could not set up a decode region (%d)\n", roq_errno);
+            roq_destroy(roq);
+            return 1;
+        }
+        roq_set_video_decode_callback(region_reference, reference_video_callback);
+        roq_set_user_data(roq, roq);
+    }
 
     // Install the video & audio decode callbacks
-    roq_set_video_decode_callback(roq, video_callback);
-    roq_set_audio_decode_callback(roq, audio_callback);
+    if (region_width)
+        roq_set_video_decode_callback(roq, region_video_callback);
+    else if (manifest)
+    {
+        roq_set_video_decode_callback(roq, hash_video_callback);
+        roq_set_audio_decode_callback(roq, hash_audio_callback);
+    }
+    else
+    {
+        roq_set_video_decode_callback(roq, video_callback);
+        roq_set_audio_decode_callback(roq, audio_callback);
+    }
 
     // Decode
     do {
         if(quit_cb())
             break;
+
+        if (loop_in >= 0 && !loop_points(roq))
+        {
+            printf("could not set loop points (%d)\n", roq_errno);
+            break;
+        }
 	
         // Decode
-        roq_decode(roq);
+        status = roq_decode(roq);
+        if (status == ROQ_NEED_DATA && !push_more(roq))
+        {
+            printf("decoder stalled with %d bytes pending\n", (int)push_pending);
+            break;
+        }
+        if (status == ROQ_NEED_FRAME && !release_frame(roq))
+        {
+            printf("decoder stalled with no frame held\n");
+            break;
+        }
     } while (!roq_has_ended(roq));
 
-    printf("DONE");
-
     // All done
+    while (release_frame(roq))
+        ;
+    if (cache_budget)
+    {
+        roq_loop_cache_stats_t stats;
+
+        roq_get_loop_cache_stats(roq, &stats);
+        printf("loop cache: %u frames in %lu bytes%s, %u passes and %u frames replayed, "
+            "decoding %llu us, replaying %llu us, %lld us saved\n",
+            stats.frames, (unsigned long)stats.bytes,
+            stats.overflowed ? " (over budget)" : stats.unsupported ? " (passes decode differently)" : "",
+            stats.passes, stats.frames_replayed, stats.decode_us, stats.replay_us, stats.saved_us);
+    }
     roq_destroy(roq);
+    if (region_reference)
+    {
+        roq_destroy(region_reference);
+        printf("%s: %d frames, %d stale macroblocks shown, %d mismatches\n",
+            mismatches ? "FAIL" : "OK", region_frames, region_stale, mismatches);
+        return mismatches ? 1 : 0;
+    }
+    if (loop_snapshot)
+    {
+        if (loop_out == -1)
+            printf("looped frames %d to the end %d times, snapshot of %d bytes\n", loop_in,
+                loop_passes, (int)roq_snapshot_get_size(loop_snapshot));
+        else
+            printf("looped frames %d to %d %d times, snapshot of %d bytes\n", loop_in, loop_out - 1,
+                loop_passes, (int)roq_snapshot_get_size(loop_snapshot));
+        if (loop_passes != LOOP_PASSES)
+        {
+            printf("MISMATCH: looped %d times, not %d\n", loop_passes, LOOP_PASSES);
+            mismatches++;
+        }
+        roq_snapshot_destroy(loop_snapshot);
+    }
+    if (pool_frames)
+    {
+        for (i = 0; i < pool_count; i++)
+            free(pool_frames[i]);
+        free(pool_frames);
+        free(held);
+    }
+    if (push_input)
+    {
+        fclose(push_input);
+        free(push_bytes);
+    }
+
+    if (trace_name && !roq_trace_dump(trace_name))
+        printf("could not write %s (tracing needs a TRACE=1 build)\n", trace_name);
+
+    if (manifest)
+        return finish_manifest();
+
+    printf("DONE");
 
     return 0;
 }
@@ -0,0 +1,667 @@
+/*
+ * Roq-Player by Andress Barajas
+ *
+ * Headless host program that runs the player on the POSIX platform
+ * backend. Useful to profile pacing, buffering, mixing and threading
+ * without a Dreamcast.
+ *
+ * With one file it runs the blocking player_play() path. With
+ * several files every video gets its own panel on screen and all of
+ * them are ticked from a single frame loop, or with --playlist they
+ * play one after another in a single player. --ahead decodes on a
+ * thread per player, that many frames ahead of the one on screen.
+ *
+ * --check decodes every file up front and then checks each scene:
+ * every player on screen has to show, tile by tile, a frame that can
+ * follow the one it showed last and has to end on its last one. The
+ * audio the sound device pulls, mixed at full volume, has to be the
+ * decoded PCM with nothing but silence added, up to its end. That
+ * last check needs at most one player with audio at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dreamroqlib.h"
+#include "roq-player.h"
+#include "roq-platform.h"
+
+#define MAX_FILES 16
+#define MAX_TILES 16
+#define FRAME_LOOP_MS 16
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+/* A file as the decoder sees it: per frame the hash of every tile the
+ * player splits it into, and its PCM as the mixer outputs it */
+typedef struct
+{
+    const char *filename;
+    int frames;
+    int tiles;
+    int capacity;
+    int channels;
+    int failed;
+    unsigned long long *hashes;
+    unsigned char *pcm;
+    size_t pcm_size;
+    size_t pcm_capacity;
+} reference_t;
+
+/* A player on screen: the references it plays in order and, as
+ * frames can look alike, every one of their frames it may be showing,
+ * both as it may drop frames and as it shows them all */
+typedef struct
+{
+    int first;
+    int last;
+    int frames;
+    unsigned char *showing;
+    unsigned char *in_order;
+    int started;
+    int skipped;
+    int failed;
+    int drawn;
+    unsigned long long drawn_hashes[MAX_TILES];
+} panel_t;
+
+static unsigned int frames = 0;
+static int ahead_depth = 0;
+
+static int check = 0;
+static reference_t references[MAX_FILES];
+static int reference_count = 0;
+static panel_t panels[MAX_FILES];
+static int panel_count = 0;
+static int panel_columns = 1;
+static float panel_width = PLAT_SCREEN_WIDTH;
+static float panel_height = PLAT_SCREEN_HEIGHT;
+static unsigned int check_scenes = 0;
+static int mismatches = 0;
+
+static const unsigned char silence[4];
+static int audio_references[MAX_FILES];
+static int audio_count = 0;
+static int audio_at = 0;
+static size_t audio_offset = 0;
+static size_t audio_matched = 0;
+static size_t audio_expected = 0;
+static int audio_checked = 0;
+static int audio_mismatch = 0;
+
+static unsigned long long fnv1a(unsigned long long hash, const unsigned char *bytes, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static unsigned long long hash_rect(const unsigned short *pixels, int width, int height, int stride)
+{
+    unsigned long long hash = FNV_OFFSET_BASIS;
+    int y;
+
+    for (y = 0; y < height; y++)
+        hash = fnv1a(hash, (const unsigned char *)(pixels + y * stride), width * 2);
+
+    return hash;
+}
+
+static void mismatch(const char *message)
+{
+    if (mismatches < 10)
+        printf("MISMATCH: %s\n", message);
+    mismatches++;
+}
+
+/* Same tiles as the player: one per PLAT_TEXTURE_MAX square, in rows */
+static void reference_video_cb(unsigned short *buf, int width, int height, int stride, int texture_height, void *user_data)
+{
+    reference_t *reference = user_data;
+    int columns, rows, i, x, y;
+    unsigned long long *hashes;
+
+    columns = (width + PLAT_TEXTURE_MAX - 1) / PLAT_TEXTURE_MAX;
+    rows = (height + PLAT_TEXTURE_MAX - 1) / PLAT_TEXTURE_MAX;
+    if (!reference->frames)
+        reference->tiles = columns * rows;
+    if (reference->tiles > MAX_TILES)
+    {
+        reference->failed = 1;
+        return;
+    }
+
+    if (reference->frames == reference->capacity)
+    {
+        reference->capacity = reference->capacity ? reference->capacity * 2 : 64;
+        hashes = realloc(reference->hashes, reference->capacity * reference->tiles * sizeof(*hashes));
+        if (!hashes)
+        {
+            reference->failed = 1;
+            return;
+        }
+        reference->hashes = hashes;
+    }
+
+    hashes = reference->hashes + reference->frames * reference->tiles;
+    for (i = 0; i < reference->tiles; i++)
+    {
+        x = (i % columns) * PLAT_TEXTURE_MAX;
+        y = (i / columns) * PLAT_TEXTURE_MAX;
+        hashes[i] = hash_rect(buf + y * stride + x,
+            width - x < PLAT_TEXTURE_MAX ? width - x : PLAT_TEXTURE_MAX,
+            height - y < PLAT_TEXTURE_MAX ? height - y : PLAT_TEXTURE_MAX, stride);
+    }
+    reference->frames++;
+}
+
+static void reference_audio_cb(unsigned char *buf, int size, int channels, void *user_data)
+{
+    reference_t *reference = user_data;
+    size_t needed = reference->pcm_size + (channels == 2 ? size : size * 2);
+    unsigned char *pcm;
+    int i;
+
+    if (needed > reference->pcm_capacity)
+    {
+        reference->pcm_capacity = needed * 2;
+        pcm = realloc(reference->pcm, reference->pcm_capacity);
+        if (!pcm)
+        {
+            reference->failed = 1;
+            return;
+        }
+        reference->pcm = pcm;
+    }
+
+    /* The mixer always plays stereo */
+    pcm = reference->pcm + reference->pcm_size;
+    if (channels == 2)
+        memcpy(pcm, buf, size);
+    else
+        for (i = 0; i < size; i += 2)
+        {
+            memcpy(pcm + i * 2, buf + i, 2);
+            memcpy(pcm + i * 2 + 2, buf + i, 2);
+        }
+    reference->pcm_size = needed;
+    reference->channels = channels;
+}
+
+static int load_reference(reference_t *reference, const char *filename)
+{
+    roq_t *roq = roq_create_with_filename(filename);
+    int ended;
+
+    if (!roq)
+    {
+        printf("could not open %s (%d)\n", filename, roq_errno);
+        return 0;
+    }
+
+    reference->filename = filename;
+    roq_set_user_data(roq, reference);
+    roq_set_video_decode_callback(roq, reference_video_cb);
+    roq_set_audio_decode_callback(roq, reference_audio_cb);
+    while (!roq_has_ended(roq) && roq_decode(roq))
+        ;
+    ended = roq_has_ended(roq);
+    roq_destroy(roq);
+
+    if (!ended || reference->failed || !reference->frames)
+    {
+        printf("could not decode %s (%d)\n", filename, roq_errno);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int frame_matches(const panel_t *panel, const reference_t *reference, int frame)
+{
+    return panel->drawn == reference->tiles &&
+        !memcmp(panel->drawn_hashes, reference->hashes + frame * reference->tiles,
+            reference->tiles * sizeof(unsigned long long));
+}
+
+/* Moves a set of frames a panel may be showing on to the scene just
+ * drawn: to those that look like it and follow one in the set, any
+ * later one when frames can be dropped and otherwise the same one or
+ * the next. A playlist goes on with the first frame of its next file.
+ * Returns whether any is left. */
+static int follow(const panel_t *panel, unsigned char *showing, int drops)
+{
+    int reference = panel->first, frame = 0;
+    int i, before = 0, seen = 0, was, possible, found = 0;
+
+    for (i = 0; i < panel->frames; i++, frame++)
+    {
+        if (frame == references[reference].frames)
+        {
+            reference++;
+            frame = 0;
+        }
+
+        was = showing[i];
+        seen |= was;
+        if (!panel->started)
+            possible = drops || i == 0;
+        else
+            possible = drops ? seen : was || before;
+        showing[i] = possible && frame_matches(panel, &references[reference], frame);
+        found |= showing[i];
+        before = was;
+    }
+
+    return found;
+}
+
+/* Only decode ahead drops frames */
+static void check_panel(panel_t *panel, int number)
+{
+    char message[256];
+
+    if (!panel->skipped && !follow(panel, panel->in_order, 0))
+        panel->skipped = 1;
+    if (ahead_depth ? !follow(panel, panel->showing, 1) : panel->skipped)
+    {
+        snprintf(message, sizeof(message), "scene %u, player %d: not a frame that can follow the last one",
+            check_scenes, number);
+        mismatch(message);
+        panel->failed = 1;
+    }
+    panel->started = 1;
+}
+
+static void tap_draw(const unsigned short *pixels, int width, int height, int stride, float x0, float y0, void *user_data)
+{
+    int number = (int)((x0 + 0.5f) / panel_width) + (int)((y0 + 0.5f) / panel_height) * panel_columns;
+    panel_t *panel;
+
+    (void)user_data;
+    if (number < 0 || number >= panel_count)
+    {
+        mismatch("a quad outside every player");
+        return;
+    }
+
+    panel = &panels[number];
+    if (panel->drawn < MAX_TILES)
+        panel->drawn_hashes[panel->drawn] = hash_rect(pixels, width, height, stride);
+    panel->drawn++;
+}
+
+static void tap_scene(void *user_data)
+{
+    int i;
+
+    (void)user_data;
+    for (i = 0; i < panel_count; i++)
+    {
+        if (panels[i].drawn && !panels[i].failed)
+            check_panel(&panels[i], i);
+        panels[i].drawn = 0;
+    }
+    check_scenes++;
+}
+
+/* What the player still holds of a file's audio when it moves on: the
+ * frame group on screen and one for each frame decoded ahead */
+static size_t audio_tail(const reference_t *reference)
+{
+    return reference->pcm_size / reference->frames * (ahead_depth + 2);
+}
+
+/* When the channel count changes the player drops what it still has
+ * queued of the last file, so the next one may start early: at its
+ * first sample that is not silence */
+static int audio_skip(const unsigned char *frame)
+{
+    const reference_t *current = &references[audio_references[audio_at]];
+    const reference_t *next;
+    size_t start = 0;
+
+    if (audio_at + 1 >= audio_count)
+        return 0;
+    next = &references[audio_references[audio_at + 1]];
+    if (next->channels == current->channels || current->pcm_size - audio_offset > audio_tail(current))
+        return 0;
+
+    while (start + 4 <= next->pcm_size && !memcmp(next->pcm + start, silence, 4))
+        start += 4;
+    if (start + 4 > next->pcm_size || memcmp(frame, next->pcm + start, 4))
+        return 0;
+
+    audio_at++;
+    audio_offset = start + 4;
+    audio_matched += audio_offset;
+
+    return 1;
+}
+
+/* Stereo frames of 4 bytes: each is either the next one expected or,
+ * when the players ran dry, silence */
+static void tap_audio(const unsigned char *pcm, int size, void *user_data)
+{
+    const reference_t *current;
+    int i;
+
+    (void)user_data;
+    for (i = 0; i + 4 <= size && audio_count && !audio_mismatch; i += 4)
+    {
+        current = &references[audio_references[audio_at]];
+        while (audio_offset == current->pcm_size && audio_at + 1 < audio_count)
+        {
+            current = &references[audio_references[++audio_at]];
+            audio_offset = 0;
+        }
+
+        if (audio_offset < current->pcm_size && !memcmp(pcm + i, current->pcm + audio_offset, 4))
+        {
+            audio_offset += 4;
+            audio_matched += 4;
+        }
+        else if (memcmp(pcm + i, silence, 4) && !audio_skip(pcm + i))
+            audio_mismatch = 1;
+    }
+}
+
+static int setup_check(const char **filenames, int count, int playlist)
+{
+    plat_posix_tap_t tap = { tap_draw, tap_scene, tap_audio, NULL };
+    int i, j;
+
+    for (i = 0; i < count; i++)
+    {
+        if (!load_reference(&references[i], filenames[i]))
+            return 0;
+        reference_count++;
+        if (references[i].pcm_size)
+        {
+            audio_references[audio_count++] = i;
+            audio_expected += references[i].pcm_size;
+        }
+    }
+
+    /* A playlist plays its files one after another; players side by
+     * side can only be told apart when one of them has audio */
+    audio_checked = playlist || audio_count <= 1;
+
+    panel_count = playlist ? 1 : count;
+    for (i = 0; i < panel_count; i++)
+    {
+        panels[i].first = i;
+        panels[i].last = playlist ? count - 1 : i;
+        for (j = panels[i].first; j <= panels[i].last; j++)
+            panels[i].frames += references[j].frames;
+        panels[i].showing = calloc(panels[i].frames, 1);
+        panels[i].in_order = calloc(panels[i].frames, 1);
+        if (!panels[i].showing || !panels[i].in_order)
+            return 0;
+    }
+    if (!playlist && count > 1)
+    {
+        while (panel_columns * panel_columns < count)
+            panel_columns++;
+        panel_width = (float)PLAT_SCREEN_WIDTH / panel_columns;
+        panel_height = (float)PLAT_SCREEN_HEIGHT / ((count + panel_columns - 1) / panel_columns);
+    }
+
+    plat_posix_set_tap(&tap);
+
+    return 1;
+}
+
+/* Every player ended on (a frame that looks like) its last one, and
+ * the audio was all there but for the tail the player drops when it
+ * stops with the video */
+static int finish_check(void)
+{
+    char message[256];
+    int i, total = 0;
+
+    for (i = 0; i < panel_count; i++)
+    {
+        if (!panels[i].failed && !(ahead_depth ? panels[i].showing : panels[i].in_order)[panels[i].frames - 1])
+        {
+            snprintf(message, sizeof(message), "player %d did not end on the last frame of %s",
+                i, references[panels[i].last].filename);
+            mismatch(message);
+        }
+        total += panels[i].frames;
+    }
+
+    if (audio_checked && audio_mismatch)
+    {
+        snprintf(message, sizeof(message), "the audio is not the decoded PCM after %lu bytes",
+            (unsigned long)audio_matched);
+        mismatch(message);
+    }
+    else if (audio_checked && audio_count && (audio_at != audio_count - 1 ||
+        audio_offset + audio_tail(&references[audio_references[audio_at]]) < references[audio_references[audio_at]].pcm_size))
+    {
+        snprintf(message, sizeof(message), "%lu of %lu bytes of audio played",
+            (unsigned long)audio_matched, (unsigned long)audio_expected);
+        mismatch(message);
+    }
+
+    if (audio_checked)
+        printf("%s: %u scenes of %d frames, %lu of %lu audio bytes, %d mismatches\n",
+            mismatches ? "FAIL" : "OK", check_scenes, total,
+            (unsigned long)audio_matched, (unsigned long)audio_expected, mismatches);
+    else
+        printf("%s: %u scenes of %d frames, audio of several players not checked, %d mismatches\n",
+            mismatches ? "FAIL" : "OK", check_scenes, total, mismatches);
+
+    return !mismatches;
+}
+
+static void frame_cb()
+{
+    frames++;
+}
+
+static roq_player_t *create_player(const char *filename)
+{
+    roq_player_t *player = player_create(filename);
+
+    if (!player)
+        printf("player_create(%s) failed (%d)\n", filename, player_errno);
+    else if (ahead_depth && player_set_decode_ahead(player, ahead_depth) != PLAYER_SUCCESS)
+        printf("player_set_decode_ahead(%d) failed (%d)\n", ahead_depth, player_errno);
+
+    /* At full volume the mixer passes a lone stream through unchanged */
+    if (player && check)
+        player_volume(player, 255);
+
+    return player;
+}
+
+static void print_queue_stats(roq_player_t *player, int number)
+{
+    player_queue_stats_t stats;
+    char message[256];
+
+    if (!ahead_depth)
+        return;
+
+    player_get_queue_stats(player, &stats);
+    printf("decode-ahead %d: %u frames presented, %u late, %u dropped, %.2f queued on average\n",
+        stats.depth, stats.presented, stats.late, stats.dropped, stats.average_queued);
+
+    /* The first frame of each next file in a playlist comes with the
+     * switch, not off the queue */
+    if (check && stats.presented + stats.dropped + panels[number].last - panels[number].first != (unsigned)panels[number].frames)
+    {
+        snprintf(message, sizeof(message), "player %d: %u presented and %u dropped of %d frames",
+            number, stats.presented, stats.dropped, panels[number].frames);
+        mismatch(message);
+    }
+    else if (check && !stats.dropped && panels[number].skipped)
+    {
+        snprintf(message, sizeof(message), "player %d dropped no frames, but did not show them all", number);
+        mismatch(message);
+    }
+}
+
+static int play_single(const char *filename, int loop)
+{
+    roq_player_t *player = create_player(filename);
+    if (!player)
+        return 0;
+
+    player_set_loop(player, loop);
+    player_play(player, frame_cb);
+    print_queue_stats(player, 0);
+
+    return 1;
+}
+
+static int play_playlist(const char **filenames, int count, int loop)
+{
+    roq_player_t *player = create_player(filenames[0]);
+    int i;
+
+    if (!player)
+        return 0;
+
+    for (i = 1; i < count; i++)
+        player_queue(player, filenames[i]);
+    player_set_playlist_loop(player, loop);
+
+    player_play(player, frame_cb);
+
+    printf("last transition took %u ms\n", player_get_transition_latency(player));
+    print_queue_stats(player, 0);
+
+    return 1;
+}
+
+static int play_multiple(const char **filenames, int count, int loop)
+{
+    roq_player_t *players[MAX_FILES];
+    int columns, rows, i, playing;
+    float width, height;
+
+    columns = 1;
+    while (columns * columns < count)
+        columns++;
+    rows = (count + columns - 1) / columns;
+    width = (float)PLAT_SCREEN_WIDTH / columns;
+    height = (float)PLAT_SCREEN_HEIGHT / rows;
+
+    for (i = 0; i < count; i++)
+    {
+        players[i] = create_player(filenames[i]);
+        if (!players[i])
+            return 0;
+
+        player_set_loop(players[i], loop);
+        player_set_rect(players[i], (i % columns) * width, (i / columns) * height, width, height);
+        player_start(players[i]);
+    }
+
+    do {
+        player_tick_all();
+
+        plat_scene_begin();
+        player_draw_all();
+        plat_scene_finish();
+        frames++;
+
+        playing = 0;
+        for (i = 0; i < count; i++)
+            if (!player_has_ended(players[i]))
+                playing = 1;
+
+        plat_sleep_ms(FRAME_LOOP_MS);
+    } while (playing);
+
+    for (i = 0; i < count; i++)
+        print_queue_stats(players[i], i);
+
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    plat_posix_stats_t stats;
+    const char *filenames[MAX_FILES];
+    int count = 0;
+    int loop = 0;
+    int playlist = 0;
+    int ok;
+    unsigned int start, elapsed;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--dump") && i + 1 < argc)
+            plat_posix_set_framedump(argv[++i]);
+        else if (!strcmp(argv[i], "--loop"))
+            loop = 1;
+        else if (!strcmp(argv[i], "--playlist"))
+            playlist = 1;
+        else if (!strcmp(argv[i], "--ahead") && i + 1 < argc)
+            ahead_depth = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--check"))
+            check = 1;
+        else if (count < MAX_FILES)
+            filenames[count++] = argv[i];
+    }
+
+    if (!count)
+    {
+        printf("USAGE: test-player [--dump <dir>] [--loop] [--playlist] [--ahead <depth>] [--check] <file.roq> [<file.roq> ...]\n");
+        return 1;
+    }
+
+    if (check && loop)
+    {
+        printf("--check plays every file once, it does not go with --loop\n");
+        return 1;
+    }
+
+    if (check && !setup_check(filenames, count, playlist))
+        return 1;
+
+    if (player_init() != PLAYER_SUCCESS)
+    {
+        printf("player_init failed\n");
+        return 1;
+    }
+
+    start = plat_time_ms();
+    if (count == 1)
+        ok = play_single(filenames[0], loop);
+    else if (playlist)
+        ok = play_playlist(filenames, count, loop);
+    else
+        ok = play_multiple(filenames, count, loop);
+    elapsed = plat_time_ms() - start;
+
+    player_shutdown(NULL);
+
+    if (!ok)
+        return 1;
+
+    plat_posix_get_stats(&stats);
+    printf("%u loop iterations, %u scenes in %u ms (%.2f fps)\n",
+        frames, stats.scenes, elapsed,
+        elapsed ? stats.scenes * 1000.0 / elapsed : 0.0);
+    printf("%u texture uploads, %llu bytes\n", stats.uploads, stats.upload_bytes);
+    printf("%llu audio bytes pulled\n", stats.audio_bytes);
+
+    if (check && !finish_check())
+        return 1;
+
+    return 0;
+}
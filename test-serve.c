@@ -0,0 +1,202 @@
+/*
+ * Dreamroq frame server client
+ *
+ * Attaches to a running roq-serve and reads every frame and audio
+ * chunk it can keep up with. With --check each one is hashed and
+ * compared with the entry of the same number in a test-dreamroq
+ * manifest; entries the server overwrote before or while they were
+ * read are counted as dropped, not as mismatches. --delay makes it a
+ * slow reader that holds every frame for that long.
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "roq-serve.h"
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+#define MANIFEST_LINE    128
+// How long the server may stay silent before we give up on it
+#define IDLE_TIMEOUT_MS  5000
+
+typedef struct
+{
+    unsigned long long *hash;
+    int count;
+    int capacity;
+} hashes_t;
+
+static hashes_t video_hashes;
+static hashes_t audio_hashes;
+static int mismatches = 0;
+
+static unsigned long long fnv1a(unsigned long long hash, const unsigned char *bytes, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static int add_hash(hashes_t *hashes, int number, unsigned long long hash)
+{
+    if (number != hashes->count)
+        return 0;
+
+    if (hashes->count == hashes->capacity)
+    {
+        hashes->capacity = hashes->capacity ? hashes->capacity * 2 : 1024;
+        hashes->hash = realloc(hashes->hash, hashes->capacity * sizeof(unsigned long long));
+        if (!hashes->hash)
+            return 0;
+    }
+    hashes->hash[hashes->count++] = hash;
+
+    return 1;
+}
+
+static int load_manifest(const char *filename)
+{
+    char line[MANIFEST_LINE];
+    unsigned long long hash;
+    int number, a, b;
+    FILE *manifest;
+    int ok = 1;
+
+    manifest = fopen(filename, "r");
+    if (!manifest)
+        return 0;
+
+    while (ok && fgets(line, sizeof(line), manifest))
+    {
+        if (sscanf(line, "video %d %dx%d %llx", &number, &a, &b, &hash) == 4)
+            ok = add_hash(&video_hashes, number, hash);
+        else if (sscanf(line, "audio %d %d %d %llx", &number, &a, &b, &hash) == 4)
+            ok = add_hash(&audio_hashes, number, hash);
+    }
+    fclose(manifest);
+
+    return ok;
+}
+
+static void compare(const char *kind, const hashes_t *hashes, unsigned int number, unsigned long long hash)
+{
+    if (!hashes->count)
+        return;
+
+    if (number >= (unsigned int)hashes->count || hashes->hash[number] != hash)
+    {
+        if (mismatches < 10)
+            printf("MISMATCH: %s %u\n", kind, number);
+        mismatches++;
+    }
+}
+
+static void sleep_ms(int ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *name = ROQ_SERVE_DEFAULT_NAME;
+    const char *manifest_name = NULL;
+    int wait_ms = 0;
+    int delay_ms = 0;
+    roq_client_t *client;
+    roq_client_frame_t frame;
+    roq_client_audio_t chunk;
+    roq_client_stats_t stats;
+    unsigned long long hash;
+    int y;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--name") && i + 1 < argc)
+            name = argv[++i];
+        else if (!strcmp(argv[i], "--wait") && i + 1 < argc)
+            wait_ms = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--delay") && i + 1 < argc)
+            delay_ms = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--check") && i + 1 < argc)
+            manifest_name = argv[++i];
+        else
+        {
+            printf("USAGE: test-serve [--name <shm name>] [--wait <ms>] [--delay <ms>] [--check <manifest>]\n");
+            printf("  --wait keeps trying to attach until a server is up, --delay holds every frame that long\n");
+            return 1;
+        }
+    }
+
+    if (manifest_name && !load_manifest(manifest_name))
+    {
+        printf("could not read %s\n", manifest_name);
+        return 1;
+    }
+
+    // The server may not be up yet
+    while (!(client = roq_client_open(name)) && wait_ms > 0)
+    {
+        sleep_ms(10);
+        wait_ms -= 10;
+    }
+    if (!client)
+    {
+        printf("could not attach to %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+
+    while (!roq_client_has_ended(client))
+    {
+        if (!roq_client_wait(client, IDLE_TIMEOUT_MS))
+        {
+            printf("%s went quiet\n", name);
+            mismatches++;
+            break;
+        }
+
+        while (roq_client_next_frame(client, &frame))
+        {
+            hash = FNV_OFFSET_BASIS;
+            for (y = 0; y < frame.height; y++)
+                hash = fnv1a(hash, (const unsigned char *)(frame.data + y * frame.stride), frame.width * 2);
+            if (delay_ms)
+                sleep_ms(delay_ms);
+
+            if (roq_client_check_frame(client, &frame))
+                compare("video", &video_hashes, frame.number, hash);
+        }
+
+        while (roq_client_next_audio(client, &chunk))
+        {
+            hash = fnv1a(FNV_OFFSET_BASIS, chunk.data, chunk.size);
+            if (roq_client_check_audio(client, &chunk))
+                compare("audio", &audio_hashes, chunk.number, hash);
+        }
+    }
+
+    roq_client_get_stats(client, &stats);
+    roq_client_close(client);
+
+    printf("%s: %u frames, %u audio chunks, %u frames and %u chunks dropped, %d mismatches\n",
+        mismatches || !stats.frames ? "FAIL" : "OK", stats.frames, stats.chunks,
+        stats.frames_dropped, stats.chunks_dropped, mismatches);
+
+    return mismatches || !stats.frames ? 1 : 0;
+}